@@ -39,6 +39,7 @@
 #include <sys/param.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <netinet/in.h>
 
@@ -46,24 +47,32 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(XBF_TEST_PROG) && defined(XBF_ZLIB)
+#include <zlib.h>
+#endif
+
 #include "xbf.h"
 
 #define ASSERT		assert
 #define ARRAY_SIZE(x)	((int)(sizeof(x)/sizeof(x[0])))
-static int		xbf_debug = 1;
+static const int	xbf_debug = 1;
+
+#define WHDR "Wrong header format! "
 
 /*
  * Try to setup correct values for the library further usage.
  */
-static int
+enum xbf_error
 _xbf_setup(struct xbf *xbf)
 {
 	uint32_t u32;
@@ -90,17 +99,19 @@ _xbf_setup(struct xbf *xbf)
 #define LEFT()				\
 	 ((unsigned)((void *)endptr - (void *)ptr))
 
-#define WHDR "Wrong header format! "
+#define HERR(code, field, val)		\
+	(xbf_errc(xbf, (code), (field), (val), ptr - (char *)xbf->_xbf_mem))
 
 	/*
 	 * Field 1:
 	 * 2 bytes          length 0x0009           (big endian) 
 	 * 9 bytes          some sort of header
 	 */
+	if (LEFT() < 2 + 9 + 2 + 1)
+		return (HERR(XBF_E_TRUNC, 1, 0));
 	u16 = U16(ptr);
 	if (u16 != 9)
-		return (xbf_erri(xbf, WHDR "Field1's length should be 9, "
-		    "but is %d", u16));
+		return (HERR(XBF_E_FIELDLEN, 1, u16));
 	ptr += 2;
 	ptr += u16;
 
@@ -111,12 +122,11 @@ _xbf_setup(struct xbf *xbf)
 	 */
 	u16 = U16(ptr);
 	if (u16 != 1)
-		return (xbf_erri(xbf, WHDR "Field2's length should be 1, "
-		    "but is %d", u16));
+		return (HERR(XBF_E_FIELDLEN, 2, u16));
 	ptr += 2;
 	u8 = U8(ptr);
 	if (u8 != 'a')
-		return (xbf_erri(xbf, WHDR "Magic 'a' missing (%#hhx)", u8));
+		return (HERR(XBF_E_MAGIC, 2, (uint8_t)u8));
 	ptr += 1;
 
 	/*
@@ -124,13 +134,14 @@ _xbf_setup(struct xbf *xbf)
 	 * 2 bytes          length 0x000a           (value depends on file name length) 
 	 * 10 bytes         string design name "xform.ncd" (including a trailing 0x00) 
 	 */
+	if (LEFT() < 2)
+		return (HERR(XBF_E_TRUNC, 3, 0));
 	u16 = U16(ptr);
-	if (u16 >= LEFT())
-		return (xbf_erri(xbf, WHDR "NCD filename seems to be to long"
-		    " (%d)", u16));
+	if (u16 == 0 || u16 > LEFT() - 2)
+		return (HERR(XBF_E_STRLEN, 3, u16));
 	ptr += 2;
 	if (ptr[u16 - 1] != '\0')
-		return (xbf_erri(xbf, WHDR "NCF filename isn't terminated with 0"));
+		return (HERR(XBF_E_STRTERM, 3, 0));
 	xbf->xbf_ncdname = ptr;
 	ptr += u16;
 
@@ -140,17 +151,19 @@ _xbf_setup(struct xbf *xbf)
 	 * 2 bytes          length 0x000c           (value depends on part name length) 
 	 * 12 bytes         string part name "v1000efg860" (including a  trailing 0x00)
 	 */
+	if (LEFT() < 3)
+		return (HERR(XBF_E_TRUNC, 4, 0));
 	u8 = U8(ptr);
 	if (u8 != 'b')
-		return (xbf_erri(xbf, WHDR "Magic 'b' missing (%#hhx)", u8));
+		return (HERR(XBF_E_MAGIC, 4, (uint8_t)u8));
 	ptr += 1;
 
 	u16 = U16(ptr);
-	if (u16 >= LEFT())
-		return (xbf_erri(xbf, WHDR "Part name to long (%d)", u16));
+	if (u16 == 0 || u16 > LEFT() - 2)
+		return (HERR(XBF_E_STRLEN, 4, u16));
 	ptr += 2;
 	if (ptr[u16 - 1] != '\0')
-		return (xbf_erri(xbf, WHDR, "Part name isn't terminated with 0"));
+		return (HERR(XBF_E_STRTERM, 4, 0));
 	xbf->xbf_partname = ptr;
 	ptr += u16;
 
@@ -160,17 +173,18 @@ _xbf_setup(struct xbf *xbf)
 	 * 2 bytes          length 0x000b 
 	 * 11 bytes         string date "2001/08/10"  (including a trailing 0x00)
 	 */
+	if (LEFT() < 3 + 11)
+		return (HERR(XBF_E_TRUNC, 5, 0));
 	u8 = U8(ptr);
 	if (u8 != 'c')
-		return (xbf_erri(xbf, WHDR "Magic 'c' missing (%#hhx)", u8));
+		return (HERR(XBF_E_MAGIC, 5, (uint8_t)u8));
 	ptr += 1;
 	u16 = U16(ptr);
 	if (u16 != 11)
-		return (xbf_erri(xbf, WHDR "Field5's length should be 11, "
-		    "but is %d", u16));
+		return (HERR(XBF_E_FIELDLEN, 5, u16));
 	ptr += 2;
 	if (ptr[u16 - 1] != '\0')
-		return (xbf_erri(xbf, WHDR, "Date isn't terminated with 0"));
+		return (HERR(XBF_E_STRTERM, 5, 0));
 	xbf->xbf_date = ptr;
 	ptr += u16;
 
@@ -180,18 +194,19 @@ _xbf_setup(struct xbf *xbf)
 	 * 2 bytes          length 0x0009 
 	 * 9 bytes          string time "06:55:04"    (including a trailing 0x00)
 	 */
+	if (LEFT() < 3 + 9)
+		return (HERR(XBF_E_TRUNC, 6, 0));
 	u8 = U8(ptr);
 	if (u8 != 'd')
-		return (xbf_erri(xbf, WHDR "Magic 'd' missing (%hhx)", u8));
+		return (HERR(XBF_E_MAGIC, 6, (uint8_t)u8));
 	ptr += 1;
 
 	u16 = U16(ptr);
 	if (u16 != 9)
-		return (xbf_erri(xbf, WHDR "6th field length should be 9, "
-		    "but is %d", u16));
+		return (HERR(XBF_E_FIELDLEN, 6, u16));
 	ptr += 2;
 	if (ptr[u16 - 1] != '\0')
-		return (xbf_erri(xbf, WHDR, "Time isn't terminated with 0"));
+		return (HERR(XBF_E_STRTERM, 6, 0));
 	xbf->xbf_time = ptr;
 	ptr += u16;
 
@@ -200,27 +215,35 @@ _xbf_setup(struct xbf *xbf)
 	 * 1 byte           key 0x65                 (The letter "e") 
 	 * 4 bytes          length 0x000c9090        (value depends on device type,
 	 * and maybe design details) 
+	 *
+	 * The length is checked against the whole file, since with
+	 * xbf_probe() only the header is in memory.
 	 */
+	if (LEFT() < 1 + 4)
+		return (HERR(XBF_E_TRUNC, 7, 0));
 	u8 = U8(ptr);
 	if (u8 != 'e')
-		return (xbf_erri(xbf, WHDR "Magic 'e' missing (%#hhx)", u8));
+		return (HERR(XBF_E_MAGIC, 7, (uint8_t)u8));
 	ptr += 1;
 	u32 = U32(ptr);
-	if (u32 >= LEFT())
-		return (xbf_erri(xbf, WHDR "Part name filename seems to be to long")); 
+	if (u32 > xbf->_xbf_filesize - (ptr + 4 - (char *)xbf->_xbf_mem))
+		return (HERR(XBF_E_PAYLOAD, 7, u32));
 	ptr += 4;
 	xbf->xbf_len = u32;
-	xbf->xbf_data = ptr;
-#undef WHDR
+	xbf->xbf_offset = ptr - (char *)xbf->_xbf_mem;
+	if ((xbf->_xbf_flags & XBF_FLAG_HDRONLY) == 0)
+		xbf->xbf_data = ptr;
+	xbf->_xbf_flags |= XBF_FLAG_OPENED;
+#undef HERR
 #undef U32
 #undef U16
 #undef U8
 #undef LEFT
-	return (0);
+	return (XBF_OK);
 }
 
 /*
- * Put error message in internal library's buffer.
+ * Record an error whose message is formatted right away.
  */
 static void
 xbf_err_fmt(const char *func, int lineno, struct xbf *xbf, const char *fmt, va_list va)
@@ -231,11 +254,14 @@ xbf_err_fmt(const char *func, int lineno, struct xbf *xbf, const char *fmt, va_l
 	ASSERT(fmt != NULL);
 
 	e = &xbf->_xbf_err;
-	memset(e, 0, sizeof(*e));
-
+	e->_xbf_code = XBF_E_OTHER;
+	e->_xbf_field = 0;
+	e->_xbf_val = 0;
+	e->_xbf_off = 0;
+	e->_xbf_func = func;
+	e->_xbf_line = lineno;
 	(void)vsnprintf(e->_xbf_errmsg, sizeof(e->_xbf_errmsg), fmt, va);
-	(void)snprintf(e->_xbf_errsrc, sizeof(e->_xbf_errsrc), " [%s(%d)]",
-	    func, lineno);
+	e->_xbf_fmted = 1;
 }
 
 /*
@@ -270,48 +296,233 @@ _xbf_erri(const char *func, int lineno, struct xbf *xbf, const char *fmt, ...)
 }
 
 /*
- * Fetch the error message.
+ * Record error ``code'' without formatting anything: this is what bulk
+ * scans hit on every file that isn't a bit stream.  ``field'' is the
+ * header field (errno for system calls), ``val'' what was found in it
+ * and ``off'' where.
+ */
+enum xbf_error
+_xbf_errc(const char *func, int lineno, struct xbf *xbf, enum xbf_error code,
+    int field, uint32_t val, size_t off)
+{
+	struct _xbf_err *e;
+
+	ASSERT(code > XBF_OK && code < XBF_E_MAX);
+	e = &xbf->_xbf_err;
+	e->_xbf_code = code;
+	e->_xbf_field = field;
+	e->_xbf_val = val;
+	e->_xbf_off = off;
+	e->_xbf_func = func;
+	e->_xbf_line = lineno;
+	e->_xbf_fmted = 0;
+	return (code);
+}
+
+static const char *xbf_errstr[XBF_E_MAX] = {
+	[XBF_OK] =		"No error",
+	[XBF_E_OTHER] =		"Error",
+	[XBF_E_INIT] =		"Call xbf_init() first",
+	[XBF_E_OPEN] =		"Couldn't open file",
+	[XBF_E_STAT] =		"Couldn't check file information",
+	[XBF_E_SHORT] =		"File doesn't contain valid data",
+	[XBF_E_MAP] =		"Couldn't map file to memory",
+	[XBF_E_NOMEM] =		"Couldn't allocate header buffer",
+	[XBF_E_READ] =		"Couldn't read header",
+	[XBF_E_TRUNC] =		"Header truncated",
+	[XBF_E_FIELDLEN] =	"Header field has the wrong length",
+	[XBF_E_MAGIC] =		"Header field key missing",
+	[XBF_E_STRLEN] =	"Header string too long",
+	[XBF_E_STRTERM] =	"Header string isn't terminated with 0",
+	[XBF_E_PAYLOAD] =	"Payload past the end of file",
+};
+
+/*
+ * Short description of ``code''.
+ */
+const char *
+xbf_strerror(enum xbf_error code)
+{
+
+	if (code < XBF_OK || code >= XBF_E_MAX)
+		return ("Unknown error");
+	return (xbf_errstr[code]);
+}
+
+/*
+ * Error code of the last failure.  The header field (or errno) and the
+ * file offset it was found at are stored in ``field'' and ``off'' if
+ * they aren't NULL.
+ */
+enum xbf_error
+xbf_errcode(struct xbf *xbf, int *field, size_t *off)
+{
+
+	xbf_assert(xbf);
+	if (field != NULL)
+		*field = xbf->_xbf_err._xbf_field;
+	if (off != NULL)
+		*off = xbf->_xbf_err._xbf_off;
+	return (xbf->_xbf_err._xbf_code);
+}
+
+/*
+ * Turn the error recorded in ``xbf'' into a message in ``buf''.
+ * Nothing in ``xbf'' is changed.
+ */
+static void
+xbf_errmsg_fmt(const struct xbf *xbf, char *buf, size_t size)
+{
+	/* Per header field: its name, its fixed length and its key */
+	static const char *names[] = {
+		NULL, "Field1", "Field2", "NCD filename", "Part name",
+		"Date", "Time", "Length"
+	};
+	static const int lens[] = { 0, 9, 1, 0, 0, 11, 9, 0 };
+	static const char keys[] = { 0, 0, 'a', 0, 'b', 'c', 'd', 'e' };
+	static const char *files[XBF_E_MAX] = {
+		[XBF_E_OPEN] =	"Couldn't open file '%s'",
+		[XBF_E_STAT] =	"Couldn't check file '%s' information",
+		[XBF_E_SHORT] =	"File '%s' doesn't contain valid data",
+		[XBF_E_MAP] =	"Couldn't map file '%s' to memory",
+		[XBF_E_READ] =	"Couldn't read header of '%s'",
+	};
+	const struct _xbf_err *e = &xbf->_xbf_err;
+	const char *fname;
+	int f;
+
+	fname = (xbf->xbf_fname != NULL) ? xbf->xbf_fname : "";
+	f = e->_xbf_field;
+	if (e->_xbf_code >= XBF_E_TRUNC && (f < 1 || f > 7))
+		f = 0;
+	switch (e->_xbf_code) {
+	case XBF_E_OTHER:
+		/* Formatted when it happened */
+		if (buf != e->_xbf_errmsg)
+			(void)snprintf(buf, size, "%s", e->_xbf_errmsg);
+		return;
+	case XBF_E_OPEN:
+	case XBF_E_STAT:
+	case XBF_E_SHORT:
+	case XBF_E_MAP:
+	case XBF_E_READ:
+		(void)snprintf(buf, size, files[e->_xbf_code], fname);
+		if (e->_xbf_field != 0)
+			(void)snprintf(buf + strlen(buf), size - strlen(buf),
+			    ": %s", strerror(e->_xbf_field));
+		return;
+	case XBF_E_TRUNC:
+		(void)snprintf(buf, size, WHDR "Header truncated before "
+		    "%s", f ? names[f] : "?");
+		break;
+	case XBF_E_FIELDLEN:
+		(void)snprintf(buf, size, WHDR "%s's length should be %d, "
+		    "but is %u", f ? names[f] : "?", lens[f], e->_xbf_val);
+		break;
+	case XBF_E_MAGIC:
+		(void)snprintf(buf, size, WHDR "Magic '%c' missing (%#x)",
+		    keys[f] ? keys[f] : '?', e->_xbf_val);
+		break;
+	case XBF_E_STRLEN:
+		(void)snprintf(buf, size, WHDR "%s seems to be too long "
+		    "(%u)", f ? names[f] : "?", e->_xbf_val);
+		break;
+	case XBF_E_STRTERM:
+		(void)snprintf(buf, size, WHDR "%s isn't terminated with 0",
+		    f ? names[f] : "?");
+		break;
+	case XBF_E_PAYLOAD:
+		(void)snprintf(buf, size, WHDR "Payload length %u goes past "
+		    "the end of file", e->_xbf_val);
+		break;
+	default:
+		(void)snprintf(buf, size, "%s", xbf_strerror(e->_xbf_code));
+		return;
+	}
+	(void)snprintf(buf + strlen(buf), size - strlen(buf),
+	    " at offset %zu", e->_xbf_off);
+}
+
+/*
+ * Fetch the error message.  It's put together only now, and only once,
+ * in the context.
  */
 const char *
 xbf_errmsg(struct xbf *xbf)
 {
 	struct _xbf_err *e;
+	size_t n;
 
 	xbf_assert(xbf);
 	e = &xbf->_xbf_err;
-	if (xbf_debug)
-		strlcat(e->_xbf_errmsg, e->_xbf_errsrc, sizeof(e->_xbf_errmsg));
+	if (e->_xbf_code == XBF_OK)
+		return ("");
+	if (e->_xbf_fmted == 0) {
+		xbf_errmsg_fmt(xbf, e->_xbf_errmsg, sizeof(e->_xbf_errmsg));
+		e->_xbf_fmted = 1;
+	}
+	if (xbf_debug && e->_xbf_fmted == 1) {
+		n = strlen(e->_xbf_errmsg);
+		(void)snprintf(e->_xbf_errmsg + n, sizeof(e->_xbf_errmsg) - n,
+		    " [%s(%d)]", e->_xbf_func, e->_xbf_line);
+		e->_xbf_fmted = 2;
+	}
 	return (e->_xbf_errmsg);
 }
 
 /*
- * Was the library initialized correctly?
+ * Same as xbf_errmsg(), but the message goes to ``buf'' and ``xbf''
+ * isn't touched, so any number of threads can call it.
+ */
+const char *
+xbf_errmsg_r(const struct xbf *xbf, char *buf, size_t size)
+{
+	const struct _xbf_err *e;
+	size_t n;
+
+	ASSERT(xbf != NULL && buf != NULL && size > 0);
+	e = &xbf->_xbf_err;
+	buf[0] = '\0';
+	if (e->_xbf_code == XBF_OK)
+		return (buf);
+	if (e->_xbf_fmted == 0)
+		xbf_errmsg_fmt(xbf, buf, size);
+	else
+		(void)snprintf(buf, size, "%s", e->_xbf_errmsg);
+	if (xbf_debug && e->_xbf_fmted != 2) {
+		n = strlen(buf);
+		(void)snprintf(buf + n, size - n, " [%s(%d)]", e->_xbf_func,
+		    e->_xbf_line);
+	}
+	return (buf);
+}
+
+/*
+ * Was the header parsed successfully?
  */
 int
 xbf_opened(struct xbf *xbf)
 {
-	const char *estr;
 
 	xbf_assert(xbf);
-	estr = xbf_errmsg(xbf);
-	return (estr[0] == '\0');
+	return ((xbf->_xbf_flags & XBF_FLAG_OPENED) != 0);
 }
 
 /*
  * Load a bit stream from a memory ``mem'' of length ``mem_size''
  * and try to setup a library context based on a memory contents.
  */
-int
+enum xbf_error
 xbf_open_mem(struct xbf *xbf, void *mem, size_t mem_size)
 {
 
 	xbf_assert(xbf);
 	if (!xbf_initialized(xbf))
-		return (xbf_erri(xbf, "Call xbf_init() before "
-		    "xbf_open_mem()!"));
+		return (xbf_errc(xbf, XBF_E_INIT, 0, 0, 0));
 	xbf->_xbf_mem = mem;
 	xbf->_xbf_memsize = mem_size;
-	if (xbf->xbf_fname != NULL)
+	xbf->_xbf_filesize = mem_size;
+	if (xbf->xbf_fname == NULL)
 		xbf->xbf_fname = "(memory)";
 	return (_xbf_setup(xbf));
 }
@@ -319,7 +530,7 @@ xbf_open_mem(struct xbf *xbf, void *mem, size_t mem_size)
 /*
  * Open a bit stream file and initialize a library context.
  */
-int
+enum xbf_error
 xbf_open(struct xbf *xbf, const char *fname)
 {
 	struct stat st;
@@ -329,25 +540,113 @@ xbf_open(struct xbf *xbf, const char *fname)
 
 	xbf_assert(xbf);
 	if (!xbf_initialized(xbf))
-		return (xbf_erri(xbf, "Call xbf_init() before xbf_open()!"));
+		return (xbf_errc(xbf, XBF_E_INIT, 0, 0, 0));
+	xbf->xbf_fname = fname;
 	fd = open(fname, O_RDONLY);
 	if (fd == -1)
-		return (xbf_erri(xbf, "Couldn't open file '%s'", fname));
-	memset(&st, 0, sizeof(st));
+		return (xbf_errc(xbf, XBF_E_OPEN, errno, 0, 0));
 	error = fstat(fd, &st);
-	if (error == -1)
-		return (xbf_erri(xbf, "Couldn't check file '%s' information",
-		    fname));
-	if (st.st_size < XBF_HDR_SIZE)
-		return (xbf_erri(xbf, "File '%s' doesn't contain valid data",
-		    fname));
-	mem = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
-	    MAP_PRIVATE, fd, 0);
-	if (xbf->_xbf_mem == MAP_FAILED)
-		return (xbf_erri(xbf, "Couldn't map file '%s' to memory", fname));
-	xbf->xbf_fname = fname;
+	if (error == -1) {
+		error = errno;
+		(void)close(fd);
+		return (xbf_errc(xbf, XBF_E_STAT, error, 0, 0));
+	}
+	if (st.st_size < XBF_HDR_SIZE) {
+		(void)close(fd);
+		return (xbf_errc(xbf, XBF_E_SHORT, 0, 0, st.st_size));
+	}
+	/* Read only, so the pages stay shared between threads and processes */
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	error = errno;
+	(void)close(fd);
+	if (mem == MAP_FAILED)
+		return (xbf_errc(xbf, XBF_E_MAP, error, 0, 0));
+	if (_xbf_xbz_is(mem, st.st_size))
+		return (_xbf_xbz_open(xbf, fname, mem, st.st_size) == 0 ?
+		    XBF_OK : xbf_errcode(xbf, NULL, NULL));
+	if (_xbf_zin_is(mem, st.st_size))
+		return (_xbf_zin_open(xbf, fname, mem, st.st_size) == 0 ?
+		    XBF_OK : xbf_errcode(xbf, NULL, NULL));
 	xbf->_xbf_flags |= XBF_FLAG_MMAPED;
-	error = xbf_open_mem(xbf, mem, st.st_size);
+	return (xbf_open_mem(xbf, mem, st.st_size));
+}
+
+/*
+ * Read only the beginning of a bit stream file and initialize a library
+ * context with its header.  The payload is never read nor mapped, so
+ * xbf_get_data() returns NULL, but xbf_get_len() and xbf_get_offset()
+ * tell where it is in the file.
+ */
+enum xbf_error
+xbf_probe(struct xbf *xbf, const char *fname)
+{
+	struct stat st;
+	ssize_t rsize;
+	void *mem;
+	int fd;
+	int error;
+
+	xbf_assert(xbf);
+	if (!xbf_initialized(xbf))
+		return (xbf_errc(xbf, XBF_E_INIT, 0, 0, 0));
+	xbf->xbf_fname = fname;
+	fd = open(fname, O_RDONLY);
+	if (fd == -1)
+		return (xbf_errc(xbf, XBF_E_OPEN, errno, 0, 0));
+	error = fstat(fd, &st);
+	if (error == -1) {
+		error = errno;
+		(void)close(fd);
+		return (xbf_errc(xbf, XBF_E_STAT, error, 0, 0));
+	}
+	if (st.st_size < XBF_HDR_SIZE) {
+		(void)close(fd);
+		return (xbf_errc(xbf, XBF_E_SHORT, 0, 0, st.st_size));
+	}
+	mem = malloc(XBF_PROBE_SIZE);
+	if (mem == NULL) {
+		(void)close(fd);
+		return (xbf_errc(xbf, XBF_E_NOMEM, ENOMEM, 0, 0));
+	}
+	rsize = pread(fd, mem, XBF_PROBE_SIZE, 0);
+	error = (rsize == -1) ? errno : 0;
+	(void)close(fd);
+	if (rsize < XBF_HDR_SIZE) {
+		free(mem);
+		return (xbf_errc(xbf, XBF_E_READ, error, 0, 0));
+	}
+	if (_xbf_xbz_is(mem, rsize))
+		return (_xbf_xbz_probe(xbf, fname, mem, rsize,
+		    st.st_size) == 0 ? XBF_OK : xbf_errcode(xbf, NULL, NULL));
+	if (_xbf_zin_is(mem, rsize))
+		return (_xbf_zin_probe(xbf, fname, mem, rsize,
+		    st.st_size) == 0 ? XBF_OK : xbf_errcode(xbf, NULL, NULL));
+	return (_xbf_open_hdr(xbf, fname, mem, rsize, st.st_size));
+}
+
+/*
+ * Set up a context from the first ``mem_size'' bytes of a ``file_size''
+ * long file.  ``mem'' comes from malloc() and is owned by the context
+ * from now on, even if the header turns out to be broken.
+ */
+enum xbf_error
+_xbf_open_hdr(struct xbf *xbf, const char *fname, void *mem, size_t mem_size,
+    size_t file_size)
+{
+	enum xbf_error error;
+
+	xbf_assert(xbf);
+	xbf->xbf_fname = fname;
+	xbf->_xbf_flags |= XBF_FLAG_ALLOCED | XBF_FLAG_HDRONLY;
+	xbf->_xbf_mem = mem;
+	xbf->_xbf_memsize = mem_size;
+	xbf->_xbf_filesize = file_size;
+	error = _xbf_setup(xbf);
+	if (error != XBF_OK) {
+		free(mem);
+		xbf->_xbf_mem = NULL;
+		xbf->_xbf_flags &= ~(XBF_FLAG_ALLOCED | XBF_FLAG_HDRONLY);
+	}
 	return (error);
 }
 
@@ -361,8 +660,19 @@ xbf_close(struct xbf *xbf)
 
 	xbf_assert(xbf);
 	ASSERT(xbf->_xbf_mem != NULL);
+	if (xbf->_xbf_shared != NULL) {
+		/* A view: everything belongs to the shared handle */
+		xbf_shared_put(xbf->_xbf_shared);
+		xbf_init(xbf);
+		xbf->_xbf_flags = 0;
+		return (0);
+	}
 	if (xbf->_xbf_flags & XBF_FLAG_MMAPED)
 		error = munmap(xbf->_xbf_mem, xbf->_xbf_memsize);
+	if (xbf->_xbf_flags & XBF_FLAG_ALLOCED)
+		free(xbf->_xbf_mem);
+	_xbf_far_index_free(xbf);
+	_xbf_xbz_free(xbf);
 	ASSERT(error == 0);
 	/*
 	 * Initialize a state but clear all possible flags
@@ -372,6 +682,77 @@ xbf_close(struct xbf *xbf)
 	return (error);
 }
 
+/*
+ * Turn the opened ``xbf'' into a handle many threads can use at once.
+ * The mapping and everything else moves to the handle and ``xbf'' is
+ * left empty.  The caller holds the first reference.
+ */
+struct xbf_shared *
+xbf_share(struct xbf *xbf)
+{
+	struct xbf_shared *xs;
+
+	xbf_assert(xbf);
+	if (!xbf_opened(xbf) || xbf->_xbf_shared != NULL) {
+		xbf_erri(xbf, "Only an opened bit stream can be shared");
+		return (NULL);
+	}
+	xs = malloc(sizeof(*xs));
+	if (xs == NULL) {
+		xbf_erri(xbf, "Couldn't allocate shared handle");
+		return (NULL);
+	}
+	memcpy(&xs->xs_xbf, xbf, sizeof(*xbf));
+	xs->xs_refs = 1;
+	xs->xs_fname = NULL;
+	xbf_init(xbf);
+	return (xs);
+}
+
+/*
+ * Take a reference to ``xs'' and set up ``view'' as this thread's
+ * context for it.  The view reads the shared mapping and keeps its own
+ * errors; xbf_close() on it drops the reference.  No locks are taken.
+ */
+void
+xbf_shared_get(struct xbf_shared *xs, struct xbf *view)
+{
+	const struct xbf *xbf = &xs->xs_xbf;
+
+	ASSERT(__atomic_load_n(&xs->xs_refs, __ATOMIC_RELAXED) > 0);
+	(void)__atomic_add_fetch(&xs->xs_refs, 1, __ATOMIC_RELAXED);
+	xbf_init(view);
+	view->_xbf_mem = xbf->_xbf_mem;
+	view->_xbf_memsize = xbf->_xbf_memsize;
+	view->_xbf_filesize = xbf->_xbf_filesize;
+	view->_xbf_flags |= xbf->_xbf_flags &
+	    (XBF_FLAG_HDRONLY | XBF_FLAG_OPENED | XBF_FLAG_ZIN);
+	view->xbf_fname = xbf->xbf_fname;
+	view->xbf_ncdname = xbf->xbf_ncdname;
+	view->xbf_partname = xbf->xbf_partname;
+	view->xbf_time = xbf->xbf_time;
+	view->xbf_date = xbf->xbf_date;
+	view->xbf_len = xbf->xbf_len;
+	view->xbf_data = xbf->xbf_data;
+	view->xbf_offset = xbf->xbf_offset;
+	view->_xbf_xbz = xbf->_xbf_xbz;
+	view->_xbf_shared = xs;
+}
+
+/*
+ * Drop a reference to ``xs''; the last one closes the bit stream.
+ */
+void
+xbf_shared_put(struct xbf_shared *xs)
+{
+
+	if (__atomic_sub_fetch(&xs->xs_refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	(void)xbf_close(&xs->xs_xbf);
+	free(xs->xs_fname);
+	free(xs);
+}
+
 /*
  * Self-explanatory accessor functions below
  */
@@ -431,6 +812,62 @@ xbf_get_data(struct xbf *xbf)
 	return (xbf->xbf_data);
 }
 
+/*
+ * Offset of the payload from the beginning of the file
+ */
+size_t
+xbf_get_offset(struct xbf *xbf)
+{
+
+	xbf_assert(xbf);
+	return (xbf->xbf_offset);
+}
+
+/*
+ * Copy ``len'' bytes of the payload at ``off'' to ``buf''.  Without the
+ * payload in memory (xbf_probe()) only what's needed is read from the
+ * file, and from a container only the blocks the range falls into are
+ * decompressed.  Returns the number of bytes copied, which is less than
+ * ``len'' at the end of the payload, or -1.
+ */
+ssize_t
+xbf_pread(struct xbf *xbf, void *buf, size_t len, size_t off)
+{
+	ssize_t r;
+	int fd;
+
+	xbf_assert(xbf);
+	if (off >= xbf->xbf_len)
+		return (0);
+	len = MIN(len, xbf->xbf_len - off);
+	if (xbf->xbf_data != NULL) {
+		memcpy(buf, xbf->xbf_data + off, len);
+		return ((ssize_t)len);
+	}
+	if (xbf->xbf_fname == NULL)
+		return (xbf_erri(xbf, "Payload isn't available"));
+	if (xbf->_xbf_flags & XBF_FLAG_ZIN)
+		return (xbf_erri(xbf, "'%s' is compressed, only xbf_open() "
+		    "can read its payload", xbf->xbf_fname));
+	/* The file may have been replaced since it was probed */
+	if (xbf->_xbf_xbz != NULL)
+		fd = _xbf_xbz_source(xbf);
+	else
+		fd = _xbf_open_source(xbf);
+	if (fd == -1)
+		return (xbf_erri(xbf, "'%s' isn't the file that was opened",
+		    xbf->xbf_fname));
+	if (xbf->_xbf_xbz != NULL)
+		r = _xbf_xbz_pread(xbf, fd, buf, len, off);
+	else {
+		r = pread(fd, buf, len, xbf->xbf_offset + off);
+		if (r == -1)
+			xbf_erri(xbf, "Couldn't read '%s'", xbf->xbf_fname);
+	}
+	(void)close(fd);
+	return (r);
+}
+
 /*
  * Print information about bit stream file to the descriptor ``fp''
  */
@@ -460,10 +897,142 @@ xbf_print(struct xbf *xbf)
 	xbf_print_fp(stdout, xbf);
 }
 
+/*
+ * write(2) all of ``buf'' to ``fd''.
+ */
+int
+_xbf_write(struct xbf *xbf, int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t w;
+
+	while (len > 0) {
+		w = write(fd, p, len);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return (xbf_erri(xbf, "Couldn't write: %s", (w == 0) ?
+			    "short write" : strerror(errno)));
+		p += w;
+		len -= w;
+	}
+	return (0);
+}
+
+/*
+ * Open the file ``xbf'' came from, if its payload is still there at
+ * xbf_offset: the file has the same size and starts with the same
+ * header.  Returns the descriptor, or -1.
+ */
+int
+_xbf_open_source(struct xbf *xbf)
+{
+	struct xbf *own;
+	struct stat st;
+	char hdr[XBF_PROBE_SIZE];
+	int fd;
+
+	own = _xbf_owner(xbf);
+	if (own->_xbf_xbz != NULL || (own->_xbf_flags & XBF_FLAG_ZIN) ||
+	    own->_xbf_mem == NULL || xbf->xbf_fname == NULL ||
+	    xbf->xbf_offset > sizeof(hdr) ||
+	    xbf->xbf_offset > own->_xbf_memsize)
+		return (-1);
+	fd = open(xbf->xbf_fname, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size != own->_xbf_filesize ||
+	    pread(fd, hdr, xbf->xbf_offset, 0) != (ssize_t)xbf->xbf_offset ||
+	    memcmp(hdr, own->_xbf_mem, xbf->xbf_offset) != 0) {
+		(void)close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Build the 7 header fields for a ``len'' byte payload in ``buf'', with
+ * the names, date and time taken from ``xbf''.  Returns the header
+ * length, or -1 if it doesn't fit in ``size'' bytes.
+ */
+ssize_t
+_xbf_hdr_build(struct xbf *xbf, uint32_t len, char *buf, size_t size)
+{
+	static const char hdr1[] = {
+		0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x00
+	};
+	const char *strs[4];
+	uint16_t u16;
+	uint32_t u32;
+	size_t off, n;
+	int i;
+
+	xbf_assert(xbf);
+	strs[0] = xbf->xbf_ncdname;
+	strs[1] = xbf->xbf_partname;
+	strs[2] = xbf->xbf_date;
+	strs[3] = xbf->xbf_time;
+	for (i = 0, n = 2 + 9 + 2 + 1 + 1 + 4; i < 4; i++) {
+		if (strs[i] == NULL)
+			strs[i] = "";
+		n += 2 + strlen(strs[i]) + 1 + (i > 0);
+	}
+	if (n > size)
+		return (xbf_erri(xbf, "Header doesn't fit in %d bytes",
+		    (int)size));
+
+	u16 = htons(sizeof(hdr1));
+	memcpy(buf, &u16, 2);
+	memcpy(buf + 2, hdr1, sizeof(hdr1));
+	u16 = htons(1);
+	memcpy(buf + 11, &u16, 2);
+	buf[13] = 'a';
+	for (i = 0, off = 14; i < 4; i++) {
+		/* Field 3 has no key, 'a' above stands for it */
+		if (i > 0)
+			buf[off++] = 'a' + i;
+		n = strlen(strs[i]) + 1;
+		u16 = htons(n);
+		memcpy(buf + off, &u16, 2);
+		memcpy(buf + off + 2, strs[i], n);
+		off += 2 + n;
+	}
+	buf[off++] = 'e';
+	u32 = htonl(len);
+	memcpy(buf + off, &u32, 4);
+	return (off + 4);
+}
+
 #ifdef XBF_TEST_PROG
 static int flag_v = 0;
 static int flag_r = 0;
+static int flag_p = 0;
+static int flag_J = 0;
+static int flag_s = 0;
+static int flag_P = 0;
+static int flag_S = 0;
+static int flag_j = 0;
+static int flag_M = 0;
+static int flag_H = 0;
+static int flag_C = 0;
 const char *test_dir = NULL;
+const char *scan_dir = NULL;
+const char *bench_name = NULL;
+const char *export_mode = NULL;
+const char *export_out = NULL;
+uint32_t export_addr = 0;
+const char *flash_out = NULL;
+const char *diff_old = NULL;
+const char *far_query = NULL;
+const char *verify_rb = NULL;
+const char *verify_msk = NULL;
+const char *compress_out = NULL;
+const char *xbz_out = NULL;
+const char *hcache_path = NULL;
+const char *program_out = NULL;
+const char *stamp_out = NULL;
+uint32_t flash_size = 0;
+size_t mcache_budget = 0;
 
 struct bf {
 	/* Field 1 */
@@ -502,13 +1071,20 @@ struct bf {
 
 typedef enum {
 	TEST_OK,
-	TEST_ER
+	TEST_ER,
+	TEST_DIFF	/* Not the error expected, or probe and open differ */
 } test_exerr_t;
 
 struct test {
 	struct bf	 *t_bf;
+	const char	*(*t_fn)(const char *dir);	/* Not about headers */
 	test_exerr_t	  t_experr;
 	const char	 *t_desc;
+	int		  t_code;	/* enum xbf_error, -1 if not checked */
+	int		  t_field;
+	size_t		  t_len;	/* Bytes written, 0 for the whole bf */
+	int		  t_mem;	/* Opened with xbf_open_mem() */
+	int		  t_feed;	/* And compared with xbf_feed() */
 	int		 _t_num;
 	const char	*_t_name;
 };
@@ -518,17 +1094,65 @@ struct test {
 		.t_bf = &(bf),			\
 		.t_experr = (errcode),		\
 		.t_desc = (desc),		\
+		.t_code = -1,			\
 		._t_num = __LINE__,		\
 		._t_name = #bf,			\
 	};
 
+/*
+ * Expect xbf_errcode() to give ``code'' in ``field'' for the first
+ * ``len'' bytes of ``bf'', from a file or from memory.
+ */
+#define _TEST_DECL_CODE(bf, code, field, len, mem, feed, desc)		\
+	static struct test test_##bf = {				\
+		.t_bf = &(bf),						\
+		.t_experr = ((code) == XBF_OK) ? TEST_OK : TEST_ER,	\
+		.t_desc = (desc),					\
+		.t_code = (code),					\
+		.t_field = (field),					\
+		.t_len = (len),						\
+		.t_mem = (mem),						\
+		.t_feed = (feed),					\
+		._t_num = __LINE__,					\
+		._t_name = #bf,						\
+	};
+#define TEST_DECL_ERR(bf, code, field, len, desc)			\
+	_TEST_DECL_CODE(bf, code, field, len, 0, 0, desc)
+#define TEST_DECL_MEM(bf, code, field, len, desc)			\
+	_TEST_DECL_CODE(bf, code, field, len, 1, 0, desc)
+/* Feed it at every split point, expecting what xbf_open_mem() gets */
+#define TEST_DECL_FEED(bf, len, desc)					\
+	_TEST_DECL_CODE(bf, XBF_OK, 0, len, 1, 1, desc)
+
+/*
+ * A unit of its own: ``fn'' makes its files in the test directory and
+ * returns what went wrong, or NULL.
+ */
+#define TEST_DECL_FN(fn, desc)						\
+	static struct test test_##fn = {				\
+		.t_fn = (fn),						\
+		.t_experr = TEST_OK,					\
+		.t_desc = (desc),					\
+		.t_code = -1,						\
+		._t_num = __LINE__,					\
+		._t_name = #fn,						\
+	};
+
+/* Fields of a valid header */
+#define BF_F1	.len1 = 9, .hdr = "__--__--|"
+#define BF_F2	.len2 = 1, .a = 'a'
+#define BF_F3	.len3 = 10, .ncdname = "top.ncd"
+#define BF_F4	.b = 'b', .len4 = 12, .partname = "7a35tcpg236"
+#define BF_F5	.c = 'c', .len5 = 11, .date = "2016/01/02"
+#define BF_F6	.d = 'd', .len6 = 9, .time = "12:34:56"
+
 struct bf f1_nob = {
 	.len1 = 9,
 	.hdr = "__--__--|",
 	.a = 'a',
 	.len2 = 1,
 };
-TEST_DECL(f1_nob, TEST_ER, "Correct 1st field");
+TEST_DECL_ERR(f1_nob, XBF_E_STRLEN, 3, 0, "Correct 1st field");
 
 struct bf f1_ncdnonull = {
 	.len1 = 9,
@@ -545,7 +1169,8 @@ struct bf f1_ncdnonull = {
 	.c = 'c',
 	.d = 'd',
 };
-TEST_DECL(f1_ncdnonull, TEST_ER, "No null termination of the header");
+TEST_DECL_ERR(f1_ncdnonull, XBF_E_STRTERM, 3, 0,
+    "No null termination of the header");
 
 struct bf f1_ncdnull = {
 	.len1 = 9,
@@ -562,19 +1187,126 @@ struct bf f1_ncdnull = {
 	.c = 'c',
 	.d = 'd',
 };
-TEST_DECL(f1_ncdnull, TEST_ER, "Is null, but ...");
+TEST_DECL_ERR(f1_ncdnull, XBF_E_STRLEN, 4, 0, "Is null, but ...");
 
 struct bf f1_neglen = {
 	.len1 = -1,
 	.hdr = "12345678\0",
 };
-TEST_DECL(f1_neglen, TEST_ER, "Negative length in the header");
+TEST_DECL_ERR(f1_neglen, XBF_E_FIELDLEN, 1, 0,
+    "Negative length in the header");
 
 struct bf f1_lentoobig = {
 	.len1 = 1000,
 	.hdr = "12345678\0",
 };
-TEST_DECL(f1_lentoobig, TEST_ER, "Too long length in the header");
+TEST_DECL_ERR(f1_lentoobig, XBF_E_FIELDLEN, 1, 0,
+    "Too long length in the header");
+
+struct bf hdr_ok = {
+	BF_F1, BF_F2, BF_F3, BF_F4, BF_F5, BF_F6,
+	.e = 'e',
+	.len7 = 0,
+};
+TEST_DECL_ERR(hdr_ok, XBF_OK, 0, 0, "Valid header, empty payload");
+
+struct bf hdr_payload = {
+	BF_F1, BF_F2, BF_F3, BF_F4, BF_F5, BF_F6,
+	.e = 'e',
+	.len7 = 4,
+};
+TEST_DECL_ERR(hdr_payload, XBF_OK, 0, sizeof(struct bf) + 4,
+    "Payload up to the end of file");
+
+struct bf hdr_short = {
+	BF_F1, BF_F2, BF_F3,
+};
+TEST_DECL_ERR(hdr_short, XBF_E_SHORT, 0, 40, "File shorter than a header");
+
+struct bf f1_trunc = {
+	BF_F1,
+};
+TEST_DECL_MEM(f1_trunc, XBF_E_TRUNC, 1, 13, "Header ends in field 1");
+
+struct bf f2_noa = {
+	BF_F1,
+	.len2 = 1,
+	.a = 'x',
+};
+TEST_DECL_ERR(f2_noa, XBF_E_MAGIC, 2, 0, "No 'a' key");
+
+struct bf f3_trunc = {
+	BF_F1, BF_F2,
+};
+TEST_DECL_MEM(f3_trunc, XBF_E_TRUNC, 3, 15, "Header ends in field 3");
+
+/* The design name runs up to the last byte of the file */
+struct bf f3_pastend = {
+	BF_F1, BF_F2,
+	.len3 = 57,
+	.ncdname = "top.ncd",
+};
+TEST_DECL_ERR(f3_pastend, XBF_E_STRLEN, 3, 0, "Design name past the end");
+
+struct bf f4_trunc = {
+	BF_F1, BF_F2,
+	.len3 = 56,
+	.ncdname = "top.ncd",
+};
+TEST_DECL_ERR(f4_trunc, XBF_E_TRUNC, 4, 0, "Header ends before field 4");
+
+struct bf f4_pastend = {
+	BF_F1, BF_F2, BF_F3,
+	.b = 'b',
+	.len4 = 44,
+	.partname = "7a35tcpg236",
+};
+TEST_DECL_ERR(f4_pastend, XBF_E_STRLEN, 4, 0, "Part name past the end");
+
+struct bf f5_len = {
+	BF_F1, BF_F2, BF_F3, BF_F4,
+	.c = 'c',
+	.len5 = 10,
+	.date = "2016/01/02",
+};
+TEST_DECL_ERR(f5_len, XBF_E_FIELDLEN, 5, 0, "Date of the wrong length");
+
+struct bf f6_nonull = {
+	BF_F1, BF_F2, BF_F3, BF_F4, BF_F5,
+	.d = 'd',
+	.len6 = 9,
+	.time = "12:34:567",
+};
+TEST_DECL_ERR(f6_nonull, XBF_E_STRTERM, 6, 0, "Time isn't terminated");
+
+struct bf f7_noe = {
+	BF_F1, BF_F2, BF_F3, BF_F4, BF_F5, BF_F6,
+	.e = 'x',
+};
+TEST_DECL_ERR(f7_noe, XBF_E_MAGIC, 7, 0, "No 'e' key");
+
+struct bf f7_pastend = {
+	BF_F1, BF_F2, BF_F3, BF_F4, BF_F5, BF_F6,
+	.e = 'e',
+	.len7 = 5,
+};
+TEST_DECL_ERR(f7_pastend, XBF_E_PAYLOAD, 7, sizeof(struct bf) + 4,
+    "Payload length past the end of file");
+
+struct bf f7_huge = {
+	BF_F1, BF_F2, BF_F3, BF_F4, BF_F5, BF_F6,
+	.e = 'e',
+	.len7 = -1,
+};
+TEST_DECL_ERR(f7_huge, XBF_E_PAYLOAD, 7, 0, "Payload length wraps around");
+
+struct bf hdr_feed = {
+	BF_F1, BF_F2, BF_F3, BF_F4, BF_F5, BF_F6,
+	.e = 'e',
+	.len7 = 64,
+};
+TEST_DECL_FEED(hdr_feed, sizeof(struct bf) + 64 + 3,
+    "Header and payload fed in pieces");
 
 static void
 bf_serialize(struct bf *raw, struct bf *b)
@@ -609,68 +1341,3051 @@ bf_serialize(struct bf *raw, struct bf *b)
 
 	/* Field 7 */
 	raw->e = b->e;
-	raw->len7 = ntohs(b->len7);
+	raw->len7 = ntohl(b->len7);
 }
 
-static test_exerr_t
-bf_test(const char *dir_test, struct test *t, char **e)
+/*
+ * Did ``a'' and ``b'' read the same header?
+ */
+static int
+bf_hdr_same(struct xbf *a, struct xbf *b)
 {
-	struct xbf xbf;
-	char path[512];
-	struct bf raw;
-	int error;
-	int fd;
-	int l;
-
-	ASSERT(dir_test != NULL);
-	ASSERT(t != NULL);
-	ASSERT(e != NULL);
-	ASSERT(*e == NULL);
 
-	error = mkdir(dir_test, 0700);
-	ASSERT((error == 0 || errno == EEXIST) && "couldn't create directory");
-	(void)snprintf(path, sizeof(path), "%s/%s.out", dir_test, t->_t_name);
-	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
-	ASSERT(fd != -1 && "couldn't create file? maybe it exists?");
+	return (strcmp(a->xbf_ncdname, b->xbf_ncdname) == 0 &&
+	    strcmp(a->xbf_partname, b->xbf_partname) == 0 &&
+	    strcmp(a->xbf_date, b->xbf_date) == 0 &&
+	    strcmp(a->xbf_time, b->xbf_time) == 0 &&
+	    a->xbf_len == b->xbf_len && a->xbf_offset == b->xbf_offset);
+}
 
-	bf_serialize(&raw, t->t_bf);
-	l = write(fd, &raw, sizeof(raw));
-	ASSERT(l == sizeof(raw) && "didn't write whole structure");
-	error = close(fd);
-	ASSERT(error != -1 && "couldn't close a file");
+/*
+ * Did xbf_probe() end up where xbf_open() did?  Returns a description
+ * of the difference, or NULL.
+ */
+static const char *
+bf_probe_diff(struct xbf *o, enum xbf_error ocode, struct xbf *p,
+    enum xbf_error pcode)
+{
+	int ofield, pfield;
 
-	xbf_init(&xbf);
-	error = xbf_open(&xbf, path);
-	if (error != 0) {
-		*e = strdup(xbf_errmsg(&xbf));
-		ASSERT(*e != NULL);
-		return (TEST_ER);
+	if (pcode != ocode)
+		return ("xbf_probe() and xbf_open() return different errors");
+	if (ocode != XBF_OK) {
+		(void)xbf_errcode(o, &ofield, NULL);
+		(void)xbf_errcode(p, &pfield, NULL);
+		return ((ofield != pfield) ? "xbf_probe() and xbf_open() "
+		    "fail in different fields" : NULL);
 	}
-	error = xbf_close(&xbf);
-	ASSERT(error == 0 && "couldn't close xbf file");
-	return (TEST_OK);
+	if (!bf_hdr_same(o, p))
+		return ("xbf_probe() and xbf_open() read different headers");
+	return (NULL);
 }
 
-struct test *tests[] = {
-#define	TEST_UNIT(bf)	&test_##bf,
-#include "xbf_tests.h"
-#undef TEST_UNIT
+struct bf_feed {
+	char	*bff_data;
+	size_t	 bff_len;
+	int	 bff_nhdr;
 };
 
-static void
-usage(const char *prog)
+static int
+bf_feed_hdr(void *arg, struct xbf *xbf)
 {
+	struct bf_feed *bff = arg;
 
-	printf("%s [-vh] <filename>\n", prog);
-	printf("%s -d <directory> -r all | <number>\n", prog);
-	exit(EXIT_SUCCESS);
+	(void)xbf;
+	bff->bff_nhdr++;
+	return (0);
 }
 
 static int
-regression_test(int argc, char **argv)
+bf_feed_data(void *arg, const void *buf, size_t len)
 {
-	struct test *t;
-	int tnum;
+	struct bf_feed *bff = arg;
+
+	memcpy(bff->bff_data + bff->bff_len, buf, len);
+	bff->bff_len += len;
+	return (0);
+}
+
+/*
+ * Feed the ``len'' bytes at ``buf'' one at a time if ``split'' is 0,
+ * in two pieces split there otherwise.  The payload goes to ``data''.
+ * Returns how the outcome differs from ``ref'', or NULL.
+ */
+static const char *
+bf_feed_split(const char *buf, size_t len, size_t split, struct xbf *ref,
+    char *data)
+{
+	struct xbf_feed xf;
+	struct bf_feed bff;
+	size_t i;
+	int error = 0;
+
+	bff.bff_data = data;
+	bff.bff_len = 0;
+	bff.bff_nhdr = 0;
+	xbf_feed_init(&xf, bf_feed_hdr, bf_feed_data, &bff);
+	if (split == 0) {
+		for (i = 0; i < len && error == 0; i++)
+			error = xbf_feed(&xf, buf + i, 1);
+	} else {
+		error = xbf_feed(&xf, buf, split);
+		if (error == 0)
+			error = xbf_feed(&xf, buf + split, len - split);
+	}
+	if (error != 0 || xbf_feed_end(&xf) != 0)
+		return ("xbf_feed() failed");
+	if (bff.bff_nhdr != 1)
+		return ("header callback didn't run exactly once");
+	if (!bf_hdr_same(&xf.xf_xbf, ref))
+		return ("xbf_feed() and xbf_open_mem() read different headers");
+	if (bff.bff_len != ref->xbf_len ||
+	    memcmp(data, ref->xbf_data, bff.bff_len) != 0)
+		return ("xbf_feed() and xbf_open_mem() give different "
+		    "payloads");
+	return (NULL);
+}
+
+/*
+ * Feed the ``len'' bytes at ``buf'' a byte at a time, then split in two
+ * at every point, and compare with ``ref'', which xbf_open_mem() opened
+ * from them.  Returns a description of the first difference, or NULL.
+ */
+static const char *
+bf_feed_diff(const char *buf, size_t len, struct xbf *ref)
+{
+	static char msg[128];
+	const char *diff;
+	char *data;
+	size_t split;
+
+	data = malloc(ref->xbf_len + 1);
+	ASSERT(data != NULL && "couldn't allocate the payload");
+	diff = NULL;
+	for (split = 0; split <= len && diff == NULL; split++)
+		diff = bf_feed_split(buf, len, split, ref, data);
+	free(data);
+	if (diff == NULL)
+		return (NULL);
+	if (split == 1)
+		(void)snprintf(msg, sizeof(msg), "%s, a byte at a time", diff);
+	else
+		(void)snprintf(msg, sizeof(msg), "%s, split at %zu", diff,
+		    split - 1);
+	return (msg);
+}
+
+/*
+ * Failure message of a unit, formatted.
+ */
+static const char *
+bf_fail(const char *fmt, ...)
+{
+	static char msg[512];
+	va_list va;
+
+	va_start(va, fmt);
+	(void)vsnprintf(msg, sizeof(msg), fmt, va);
+	va_end(va);
+	return (msg);
+}
+
+static void
+bf_mkdir(const char *dir)
+{
+	int error;
+
+	error = mkdir(dir, 0700);
+	ASSERT((error == 0 || errno == EEXIST) &&
+	    "couldn't create directory");
+}
+
+static void
+bf_write_file(const char *path, const void *buf, size_t len)
+{
+	ssize_t l;
+	int error;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1 && "couldn't create file? maybe it exists?");
+	l = write(fd, buf, len);
+	ASSERT(l == (ssize_t)len && "didn't write whole file");
+	error = close(fd);
+	ASSERT(error != -1 && "couldn't close a file");
+}
+
+/*
+ * Write ``name'' in ``dir'': the header xbf_build_write() makes for a
+ * 7 series part and the ``len'' bytes at ``data'' as the payload.  Its
+ * path goes to ``path''.
+ */
+static void
+bf_write_bit(const char *dir, const char *name, const void *data,
+    size_t len, char *path, size_t size)
+{
+	struct xbf_build xb;
+	int error;
+	int fd;
+
+	(void)snprintf(path, size, "%s/%s", dir, name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1 && "couldn't create file? maybe it exists?");
+	xbf_build_init(&xb, "top.ncd", "7a35tcpg236");
+	xb.xb_date = "2016/01/02";
+	xb.xb_time = "12:34:56";
+	xbf_build_data(&xb, data, len);
+	error = xbf_build_write(&xb, fd);
+	ASSERT(error == 0 && "couldn't write the bit stream");
+	xbf_build_free(&xb);
+	error = close(fd);
+	ASSERT(error != -1 && "couldn't close a file");
+}
+
+/*
+ * Synthetic 7 series payloads for the units about frames: the dummy pad
+ * and the sync word, register writes followed by the configuration CRC
+ * they add up to, and DESYNC.  Words are kept big endian, as in a file.
+ */
+#define BS_FLEN		101	/* Words per 7 series frame */
+#define BS_NOOP		0x20000000
+
+struct bf_stream {
+	uint32_t	*bs_w;
+	size_t		 bs_n;
+	size_t		 bs_cap;
+	uint32_t	 bs_crc;
+};
+
+static void
+bs_word(struct bf_stream *bs, uint32_t w)
+{
+
+	if (bs->bs_n == bs->bs_cap) {
+		bs->bs_cap = (bs->bs_cap == 0) ? 1024 : bs->bs_cap * 2;
+		bs->bs_w = realloc(bs->bs_w, bs->bs_cap * sizeof(uint32_t));
+		ASSERT(bs->bs_w != NULL && "couldn't allocate the stream");
+	}
+	bs->bs_w[bs->bs_n++] = htonl(w);
+}
+
+/*
+ * Write ``n'' words to ``reg'', with a type 2 packet if they don't fit
+ * in a type 1.  ``v'' NULL writes frame ``id'' words, see bs_frame().
+ */
+static void
+bs_reg(struct bf_stream *bs, unsigned reg, const uint32_t *v, size_t n)
+{
+	size_t i, start;
+
+	if (n < 2048)
+		bs_word(bs, 0x30000000 | (reg << 13) | n);
+	else {
+		bs_word(bs, 0x30000000 | (reg << 13));
+		bs_word(bs, 0x50000000 | n);
+	}
+	start = bs->bs_n;
+	for (i = 0; i < n; i++)
+		bs_word(bs, v[i]);
+	if (reg == XBF_REG_CMD && n == 1 && v[0] == XBF_CMD_RCRC)
+		bs->bs_crc = 0;
+	else
+		bs->bs_crc = _xbf_crc_update(XBF_FAM_7, bs->bs_crc, reg,
+		    bs->bs_w + start, n);
+}
+
+static void
+bs_reg1(struct bf_stream *bs, unsigned reg, uint32_t v)
+{
+
+	bs_reg(bs, reg, &v, 1);
+}
+
+static void
+bs_begin(struct bf_stream *bs)
+{
+	int i;
+
+	memset(bs, 0, sizeof(*bs));
+	for (i = 0; i < 8; i++)
+		bs_word(bs, XBF_DUMMY_WORD);
+	bs_word(bs, XBF_BUSWIDTH_WORD0);
+	bs_word(bs, XBF_BUSWIDTH_WORD1);
+	bs_word(bs, XBF_DUMMY_WORD);
+	bs_word(bs, XBF_DUMMY_WORD);
+	bs_word(bs, XBF_SYNC_WORD);
+	bs_word(bs, BS_NOOP);
+	bs_reg1(bs, XBF_REG_CMD, XBF_CMD_RCRC);
+	bs_word(bs, BS_NOOP);
+	bs_word(bs, BS_NOOP);
+	bs_reg1(bs, XBF_REG_IDCODE, 0x0362d093);
+	bs_reg1(bs, XBF_REG_CMD, XBF_CMD_WCFG);
+}
+
+/*
+ * Word ``i'' of the frame called ``id''.  Frame 0 is all zeros, like
+ * most of a real bit stream.
+ */
+static uint32_t
+bs_frame_word(unsigned id, unsigned i)
+{
+
+	return ((id == 0) ? 0 : id * 0x01000193 ^ (i + 1) * 0x9e3779b9);
+}
+
+/*
+ * An FDRI burst of the ``n'' frames ``ids'', after a write of ``far''
+ * to FAR unless it's -1.
+ */
+static void
+bs_frames(struct bf_stream *bs, int64_t far, const unsigned *ids, size_t n)
+{
+	uint32_t *v;
+	size_t i, j;
+
+	if (far != -1)
+		bs_reg1(bs, XBF_REG_FAR, (uint32_t)far);
+	v = malloc(n * BS_FLEN * sizeof(uint32_t));
+	ASSERT(v != NULL);
+	for (i = 0; i < n; i++)
+		for (j = 0; j < BS_FLEN; j++)
+			v[i * BS_FLEN + j] = bs_frame_word(ids[i], j);
+	bs_reg(bs, XBF_REG_FDRI, v, n * BS_FLEN);
+	free(v);
+}
+
+/*
+ * The CRC check and DESYNC.
+ */
+static void
+bs_end(struct bf_stream *bs)
+{
+
+	bs_word(bs, 0x30000000 | (XBF_REG_CRC << 13) | 1);
+	bs_word(bs, bs->bs_crc);
+	bs->bs_crc = 0;
+	bs_reg1(bs, XBF_REG_CMD, XBF_CMD_DESYNC);
+	bs_word(bs, BS_NOOP);
+	bs_word(bs, BS_NOOP);
+}
+
+/*
+ * Write the stream as ``name'' in ``dir'' and open it into ``xbf''.
+ */
+static const char *
+bs_open(struct bf_stream *bs, const char *dir, const char *name,
+    struct xbf *xbf, char *path, size_t size)
+{
+
+	bf_write_bit(dir, name, bs->bs_w, bs->bs_n * 4, path, size);
+	free(bs->bs_w);
+	memset(bs, 0, sizeof(*bs));
+	xbf_init(xbf);
+	if (xbf_open(xbf, path) != XBF_OK)
+		return (bf_fail("%s: %s", path, xbf_errmsg(xbf)));
+	return (NULL);
+}
+
+/*
+ * Probe ``path'' through ``hc'' twice; both must read the header of
+ * ``ref'', and the payload must be readable after the second.
+ */
+static const char *
+u_hcache_twice(struct xbf_hcache *hc, const char *path, struct xbf *ref,
+    int zin)
+{
+	struct xbf xbf;
+	char *buf;
+	int i, bad;
+
+	for (i = 0; i < 2; i++) {
+		xbf_init(&xbf);
+		if (xbf_hcache_probe(hc, &xbf, path) != 0)
+			return (bf_fail("%s, probe %d: %s", path, i + 1,
+			    xbf_errmsg(&xbf)));
+		bad = (strcmp(xbf.xbf_ncdname, ref->xbf_ncdname) != 0 ||
+		    xbf.xbf_len != ref->xbf_len);
+		if (!bad && i == 1 && !zin) {
+			buf = malloc(ref->xbf_len);
+			ASSERT(buf != NULL);
+			bad = (xbf_pread(&xbf, buf, ref->xbf_len, 0) !=
+			    (ssize_t)ref->xbf_len ||
+			    memcmp(buf, ref->xbf_data, ref->xbf_len) != 0);
+			free(buf);
+		}
+		(void)xbf_close(&xbf);
+		if (bad)
+			return (bf_fail("%s, probe %d: wrong header or payload",
+			    path, i + 1));
+	}
+	return (NULL);
+}
+
+/*
+ * Only the plain file may be a hit the second time round: containers
+ * and compressed files are probed again.
+ */
+static const char *
+u_hcache(const char *dir)
+{
+	struct xbf_hcache hc;
+	struct xbf ref;
+	char path[512], xpath[512], hpath[512];
+	const char *diff;
+	uint8_t *data;
+	size_t len, i;
+	int fd, nprobes;
+#ifdef XBF_ZLIB
+	char gpath[512];
+	gzFile gz;
+#endif
+
+	len = 16468;
+	data = malloc(len);
+	ASSERT(data != NULL);
+	for (i = 0; i < len; i++)
+		data[i] = (i % 64 < 32) ? 0 : (uint8_t)(i * 13);
+	bf_write_bit(dir, "hcache.bit", data, len, path, sizeof(path));
+	free(data);
+	xbf_init(&ref);
+	if (xbf_open(&ref, path) != XBF_OK)
+		return (bf_fail("%s: %s", path, xbf_errmsg(&ref)));
+
+	(void)snprintf(xpath, sizeof(xpath), "%s/hcache.xbz", dir);
+	fd = open(xpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1);
+	if (xbf_xbz_write(&ref, fd, 4096) != 0)
+		return (bf_fail("%s: %s", xpath, xbf_errmsg(&ref)));
+	(void)close(fd);
+#ifdef XBF_ZLIB
+	(void)snprintf(gpath, sizeof(gpath), "%s/hcache.bit.gz", dir);
+	gz = gzopen(gpath, "wb");
+	ASSERT(gz != NULL);
+	ASSERT(gzwrite(gz, ref._xbf_mem, ref._xbf_filesize) ==
+	    (int)ref._xbf_filesize);
+	ASSERT(gzclose(gz) == Z_OK);
+#endif
+
+	(void)snprintf(hpath, sizeof(hpath), "%s/hcache.db", dir);
+	(void)unlink(hpath);
+	if (xbf_hcache_open(&hc, hpath, 16, XBF_HCACHE_WRITE) != 0)
+		return (bf_fail("%s", xbf_errmsg(&hc.hc_xbf)));
+	diff = u_hcache_twice(&hc, path, &ref, 0);
+	if (diff == NULL)
+		diff = u_hcache_twice(&hc, xpath, &ref, 0);
+	nprobes = 4;
+#ifdef XBF_ZLIB
+	if (diff == NULL)
+		diff = u_hcache_twice(&hc, gpath, &ref, 1);
+	nprobes += 2;
+#endif
+	if (diff == NULL && (hc.hc_hits != 1 ||
+	    hc.hc_misses != (size_t)nprobes - 1))
+		diff = bf_fail("%d hits and %d misses", (int)hc.hc_hits,
+		    (int)hc.hc_misses);
+	xbf_hcache_close(&hc);
+	(void)xbf_close(&ref);
+	return (diff);
+}
+TEST_DECL_FN(u_hcache, "Header cache hits only plain .bit files");
+
+/*
+ * Frame ``idx'' after ``far'' the slow way: the last burst holding it.
+ */
+static ssize_t
+u_far_scan(struct xbf_bursts *xb, uint32_t far, uint32_t idx)
+{
+	const struct xbf_burst *b;
+	ssize_t off;
+	size_t i;
+
+	off = -1;
+	for (i = 0; i < xb->xb_nbursts; i++) {
+		b = &xb->xb_bursts[i];
+		if (b->xb_farok && b->xb_far == far && idx >= b->xb_first &&
+		    idx - b->xb_first < b->xb_nframes)
+			off = b->xb_off + (idx - b->xb_first) * xb->xb_flen * 4;
+	}
+	return (off);
+}
+
+/*
+ * FAR X with 5 frames, 2 more without a FAR write, then X rewritten
+ * with 10: frames 0 to 9 all come from the rewrite.
+ */
+static const char *
+u_far(const char *dir)
+{
+	static const unsigned ids[] = {
+		1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17
+	};
+	struct bf_stream bs;
+	struct xbf_pkts pk;
+	struct xbf_bursts xb;
+	struct xbf xbf;
+	char path[512];
+	const char *diff;
+	uint32_t far, idx;
+	ssize_t off, exp;
+
+	bs_begin(&bs);
+	bs_frames(&bs, 0x00020000, ids, 3);
+	bs_frames(&bs, 0x00420000, ids, 5);
+	bs_frames(&bs, -1, ids + 5, 2);
+	bs_frames(&bs, 0x00420000, ids + 7, 10);
+	bs_frames(&bs, 0x00420100, ids, 1);
+	bs_end(&bs);
+	if ((diff = bs_open(&bs, dir, "far.bit", &xbf, path,
+	    sizeof(path))) != NULL)
+		return (diff);
+	if (xbf_pkt_decode(&xbf, &pk) != 0 ||
+	    _xbf_frame_bursts(&xbf, &pk, &xb) != 0)
+		return (bf_fail("%s", xbf_errmsg(&xbf)));
+	xbf_pkt_free(&pk);
+	diff = NULL;
+	for (far = 0x00020000; far <= 0x00420100 && diff == NULL;
+	    far += 0x100)
+		for (idx = 0; idx < 12 && diff == NULL; idx++) {
+			off = xbf_far_lookup(&xbf, far, idx);
+			exp = u_far_scan(&xb, far, idx);
+			if (off != exp)
+				diff = bf_fail("%08x:%u found at %d, not %d",
+				    far, idx, (int)off, (int)exp);
+		}
+	if (diff == NULL && (xbf_far_lookup(&xbf, 0x00420000, 9) == -1 ||
+	    xbf_far_lookup(&xbf, 0x00420000, 10) != -1))
+		diff = "frames 0 to 9 of the rewrite aren't all found";
+	_xbf_frame_bursts_free(&xb);
+	(void)xbf_close(&xbf);
+	return (diff);
+}
+TEST_DECL_FN(u_far, "Frame lookup finds the last write of a frame");
+
+/*
+ * The configuration CRC of a known stream, worked out a bit at a time
+ * from the 37 bit words: IDCODE, WCFG, FAR 0x00400000 and frames 1, 2,
+ * 0 and 3 after RCRC.
+ */
+#define U_CRC_KAT	0xc986a58f
+
+static const char *
+u_crc_check(const char *path, int kern, int good)
+{
+	struct xbf xbf;
+	const char *diff;
+	size_t n;
+	int error;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, path) != XBF_OK)
+		return (bf_fail("%s: %s", path, xbf_errmsg(&xbf)));
+	error = _xbf_crc_verify_kern(kern, &xbf, &n);
+	diff = NULL;
+	if (good && (error != 0 || n != 1))
+		diff = bf_fail("%s, kernel %d: %s", path, kern,
+		    (error != 0) ? xbf_errmsg(&xbf) : "no CRC checked");
+	else if (!good && error == 0)
+		diff = bf_fail("%s, kernel %d: corrupted frame accepted",
+		    path, kern);
+	(void)xbf_close(&xbf);
+	return (diff);
+}
+
+static const char *
+u_crc(const char *dir)
+{
+	static const unsigned ids[] = { 1, 2, 0, 3 };
+	static const int kerns[] = { XBF_KERN_SCALAR, XBF_KERN_SSE42 };
+	struct bf_stream bs;
+	struct xbf xbf;
+	char path[512], bpath[512];
+	const char *diff;
+	char *bad;
+	ssize_t off;
+	int i;
+
+	bs_begin(&bs);
+	bs_frames(&bs, 0x00400000, ids, ARRAY_SIZE(ids));
+	if (bs.bs_crc != U_CRC_KAT)
+		return (bf_fail("CRC is 0x%08x, not 0x%08x", bs.bs_crc,
+		    U_CRC_KAT));
+	bs_end(&bs);
+	if ((diff = bs_open(&bs, dir, "crc.bit", &xbf, path,
+	    sizeof(path))) != NULL)
+		return (diff);
+	/* One bit of frame 1 flipped */
+	off = xbf_far_lookup(&xbf, 0x00400000, 1);
+	ASSERT(off != -1);
+	bad = malloc(xbf.xbf_len);
+	ASSERT(bad != NULL);
+	memcpy(bad, xbf.xbf_data, xbf.xbf_len);
+	bad[off + 41] ^= 0x10;
+	bf_write_bit(dir, "crc_bad.bit", bad, xbf.xbf_len, bpath,
+	    sizeof(bpath));
+	free(bad);
+	(void)xbf_close(&xbf);
+
+	for (i = 0; i < ARRAY_SIZE(kerns) && diff == NULL; i++) {
+		if (!_xbf_cpu_has(kerns[i]))
+			continue;
+		diff = u_crc_check(path, kerns[i], 1);
+		if (diff == NULL)
+			diff = u_crc_check(bpath, kerns[i], 0);
+	}
+	return (diff);
+}
+TEST_DECL_FN(u_crc, "Configuration CRC of a known 7 series stream");
+
+/*
+ * Open ``path'' and check its configuration CRC.
+ */
+static const char *
+u_open_crc(const char *path, struct xbf *xbf)
+{
+	size_t n;
+
+	xbf_init(xbf);
+	if (xbf_open(xbf, path) != XBF_OK)
+		return (bf_fail("%s: %s", path, xbf_errmsg(xbf)));
+	if (xbf_crc_verify(xbf, &n) != 0 || n == 0) {
+		(void)xbf_close(xbf);
+		return (bf_fail("%s: %s", path, (n == 0) ? "no CRC checked" :
+		    xbf_errmsg(xbf)));
+	}
+	return (NULL);
+}
+
+/*
+ * Six frames written on their own, each a FAR write and the frame with
+ * its pad frame; frames 0, 2, 3 and 5 are the same, and 1 and 4.
+ */
+static const char *
+u_compress(const char *dir)
+{
+	static const unsigned ids[] = { 1, 2, 1, 1, 2, 1 };
+	/* FAR and MFWR writes of the result; MFWR is -1 */
+	static const int64_t seq[] = {
+		0x100, 0x100, -1, 0x102, -1, 0x103, -1, 0x105, -1,
+		0x101, 0x101, -1, 0x104, -1,
+	};
+	struct xbf_compress xc;
+	struct bf_stream bs;
+	struct xbf_pkts pk;
+	struct xbf xbf, out;
+	const struct xbf_pkt *p;
+	char path[512], opath[512];
+	const char *diff;
+	unsigned fr[2];
+	size_t i, n;
+	int fd, error;
+
+	bs_begin(&bs);
+	fr[1] = 0;
+	for (i = 0; i < ARRAY_SIZE(ids); i++) {
+		fr[0] = ids[i];
+		bs_frames(&bs, 0x100 + i, fr, 2);
+	}
+	bs_end(&bs);
+	if ((diff = bs_open(&bs, dir, "compress.bit", &xbf, path,
+	    sizeof(path))) != NULL)
+		return (diff);
+	(void)snprintf(opath, sizeof(opath), "%s/compress.out.bit", dir);
+	fd = open(opath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1);
+	error = xbf_compress(&xbf, fd, &xc);
+	(void)close(fd);
+	if (error != 0)
+		diff = bf_fail("%s", xbf_errmsg(&xbf));
+	else if (xc.xc_nframes != 6 || xc.xc_nunique != 2 ||
+	    xc.xc_ncopied != 6 || xc.xc_oldlen != xbf.xbf_len ||
+	    xc.xc_newlen >= xc.xc_oldlen)
+		diff = bf_fail("%d frames, %d distinct, %d copied, %d -> %d "
+		    "bytes", (int)xc.xc_nframes, (int)xc.xc_nunique,
+		    (int)xc.xc_ncopied, (int)xc.xc_oldlen, (int)xc.xc_newlen);
+	(void)xbf_close(&xbf);
+	if (diff != NULL || (diff = u_open_crc(opath, &out)) != NULL)
+		return (diff);
+
+	memset(&pk, 0, sizeof(pk));
+	if (out.xbf_len != xc.xc_newlen)
+		diff = "length isn't the one reported";
+	else if (xbf_pkt_decode(&out, &pk) != 0)
+		diff = bf_fail("%s", xbf_errmsg(&out));
+	for (i = 0, n = 0; diff == NULL && i < pk.xp_npkts; i++) {
+		p = &pk.xp_pkts[i];
+		if (p->xp_type == XBF_PKT_SYNC ||
+		    p->xp_op != XBF_PKT_OP_WRITE ||
+		    (p->xp_reg != XBF_REG_FAR && p->xp_reg != XBF_REG_MFWR))
+			continue;
+		if (n == ARRAY_SIZE(seq) || (p->xp_reg == XBF_REG_MFWR) !=
+		    (seq[n] == -1) || (seq[n] != -1 &&
+		    xbf_pkt_word(&out, p, 0) != seq[n]))
+			diff = bf_fail("write %d of FAR or MFWR isn't the one "
+			    "expected", (int)n);
+		n++;
+	}
+	if (diff == NULL && n != ARRAY_SIZE(seq))
+		diff = bf_fail("%d writes of FAR or MFWR, not %d", (int)n,
+		    ARRAY_SIZE(seq));
+	xbf_pkt_free(&pk);
+	(void)xbf_close(&out);
+	return (diff);
+}
+TEST_DECL_FN(u_compress, "Compression copies repeated frames with MFWR");
+
+/*
+ * Two bursts, 8 frames after FAR 0x100 and 6 after 0x200, with frame 3
+ * of the first and frame 4 of the second different in the new stream.
+ */
+static const char *
+u_diff_stream(const char *dir, const char *name, int changed,
+    struct xbf *xbf, char *path, size_t size)
+{
+	unsigned ids[8];
+	struct bf_stream bs;
+	int i;
+
+	bs_begin(&bs);
+	for (i = 0; i < 8; i++)
+		ids[i] = 1 + i;
+	if (changed)
+		ids[3] = 21;
+	bs_frames(&bs, 0x100, ids, 8);
+	for (i = 0; i < 6; i++)
+		ids[i] = 11 + i;
+	if (changed)
+		ids[4] = 22;
+	bs_frames(&bs, 0x200, ids, 6);
+	bs_end(&bs);
+	return (bs_open(&bs, dir, name, xbf, path, size));
+}
+
+static const char *
+u_diff(const char *dir)
+{
+	static const struct {
+		uint32_t	far;
+		uint32_t	first;
+	} exp[] = {
+		{ 0x100, 3 },
+		{ 0x200, 4 },
+	};
+	const struct xbf_diff_range *r;
+	struct xbf_diff xd;
+	struct xbf old, new, part;
+	char path[512], ppath[512];
+	const char *diff;
+	ssize_t off, poff;
+	int i, fd, error;
+
+	if ((diff = u_diff_stream(dir, "diff_old.bit", 0, &old, path,
+	    sizeof(path))) != NULL)
+		return (diff);
+	if ((diff = u_diff_stream(dir, "diff_new.bit", 1, &new, path,
+	    sizeof(path))) != NULL) {
+		(void)xbf_close(&old);
+		return (diff);
+	}
+	if (xbf_diff(&old, &new, &xd) != 0) {
+		diff = bf_fail("%s", xbf_errmsg(&new));
+		goto out;
+	}
+	if (xd.xd_nframes != 14 || xd.xd_nchanged != 2 ||
+	    xd.xd_nranges != ARRAY_SIZE(exp))
+		diff = bf_fail("%d of %d frames changed, in %d ranges",
+		    (int)xd.xd_nchanged, (int)xd.xd_nframes,
+		    (int)xd.xd_nranges);
+	for (i = 0; i < ARRAY_SIZE(exp) && diff == NULL; i++) {
+		r = &xd.xd_ranges[i];
+		if (!r->xdr_farok || r->xdr_far != exp[i].far ||
+		    r->xdr_first != exp[i].first || r->xdr_nframes != 1 ||
+		    (ssize_t)r->xdr_off != xbf_far_lookup(&new, r->xdr_far,
+		    r->xdr_first))
+			diff = bf_fail("range %d is %08x:%u, %u frames", i,
+			    r->xdr_far, r->xdr_first, r->xdr_nframes);
+	}
+	if (diff != NULL)
+		goto free;
+
+	(void)snprintf(ppath, sizeof(ppath), "%s/diff_part.bit", dir);
+	fd = open(ppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1);
+	error = xbf_diff_write(&new, &xd, fd);
+	(void)close(fd);
+	if (error != 0) {
+		diff = bf_fail("%s", xbf_errmsg(&new));
+		goto free;
+	}
+	if ((diff = u_open_crc(ppath, &part)) != NULL)
+		goto free;
+	/* The changed frames are in it, where they belong */
+	for (i = 0; i < ARRAY_SIZE(exp) && diff == NULL; i++) {
+		off = xbf_far_lookup(&new, exp[i].far, exp[i].first);
+		poff = xbf_far_lookup(&part, exp[i].far, exp[i].first);
+		if (poff == -1 || memcmp(part.xbf_data + poff,
+		    new.xbf_data + off, BS_FLEN * 4) != 0)
+			diff = bf_fail("frame %08x:%u isn't in the partial "
+			    "bit stream", exp[i].far, exp[i].first);
+	}
+	(void)xbf_close(&part);
+free:
+	xbf_diff_free(&xd);
+out:
+	(void)xbf_close(&old);
+	(void)xbf_close(&new);
+	return (diff);
+}
+TEST_DECL_FN(u_diff, "Partial bit stream of two changed frames");
+
+#define U_XBZ_BLOCK	4096
+#define U_XBZ_LEN	(5 * U_XBZ_BLOCK + 523)
+
+/*
+ * Write ``ref'' as a container, then read it back whole with xbf_open()
+ * and in pieces across block boundaries after xbf_probe().
+ */
+static const char *
+u_xbz_one(const char *dir, const char *name, struct xbf *ref, size_t *size)
+{
+	static const struct {
+		size_t	off;
+		size_t	len;
+	} rd[] = {
+		{ 0,				U_XBZ_LEN },
+		{ U_XBZ_BLOCK - 1,		2 },
+		{ U_XBZ_BLOCK - 96,		2 * U_XBZ_BLOCK + 200 },
+		{ 3 * U_XBZ_BLOCK,		U_XBZ_BLOCK },
+		{ U_XBZ_LEN - 5,		100 },
+		{ U_XBZ_LEN,			10 },
+	};
+	struct xbf xbf;
+	struct stat st;
+	char path[512];
+	const char *diff;
+	char *buf;
+	ssize_t n;
+	size_t exp;
+	int i, fd;
+
+	(void)snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1);
+	if (xbf_xbz_write(ref, fd, U_XBZ_BLOCK) != 0 || fstat(fd, &st) != 0) {
+		(void)close(fd);
+		return (bf_fail("%s: %s", path, xbf_errmsg(ref)));
+	}
+	(void)close(fd);
+	*size = st.st_size;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, path) != XBF_OK)
+		return (bf_fail("%s: %s", path, xbf_errmsg(&xbf)));
+	diff = NULL;
+	if (strcmp(xbf.xbf_ncdname, ref->xbf_ncdname) != 0 ||
+	    xbf.xbf_len != ref->xbf_len ||
+	    memcmp(xbf.xbf_data, ref->xbf_data, ref->xbf_len) != 0)
+		diff = bf_fail("%s: xbf_open() reads something else", path);
+	(void)xbf_close(&xbf);
+	if (diff != NULL)
+		return (diff);
+
+	xbf_init(&xbf);
+	if (xbf_probe(&xbf, path) != XBF_OK)
+		return (bf_fail("%s: %s", path, xbf_errmsg(&xbf)));
+	buf = malloc(U_XBZ_LEN);
+	ASSERT(buf != NULL);
+	for (i = 0; i < ARRAY_SIZE(rd) && diff == NULL; i++) {
+		exp = MIN(rd[i].len, U_XBZ_LEN - rd[i].off);
+		n = xbf_pread(&xbf, buf, rd[i].len, rd[i].off);
+		if (n == -1)
+			diff = bf_fail("%s: %s", path, xbf_errmsg(&xbf));
+		else if (n != (ssize_t)exp ||
+		    memcmp(buf, ref->xbf_data + rd[i].off, exp) != 0)
+			diff = bf_fail("%s: xbf_pread() of %d bytes at %d "
+			    "isn't the payload", path, (int)rd[i].len,
+			    (int)rd[i].off);
+	}
+	free(buf);
+	(void)xbf_close(&xbf);
+	return (diff);
+}
+
+/*
+ * A payload that compresses well and one that doesn't, so its blocks
+ * are stored as they are.
+ */
+static const char *
+u_xbz(const char *dir)
+{
+	struct xbf ref;
+	char path[512];
+	const char *diff;
+	uint8_t *data;
+	uint32_t x;
+	size_t i, size;
+	int rnd;
+
+	data = malloc(U_XBZ_LEN);
+	ASSERT(data != NULL);
+	diff = NULL;
+	for (rnd = 0; rnd < 2 && diff == NULL; rnd++) {
+		for (i = 0, x = 2463534242U; i < U_XBZ_LEN; i++) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			data[i] = rnd ? (uint8_t)x :
+			    (i % 404 < 300) ? 0 : (uint8_t)(i / 404);
+		}
+		bf_write_bit(dir, "xbz.bit", data, U_XBZ_LEN, path,
+		    sizeof(path));
+		xbf_init(&ref);
+		if (xbf_open(&ref, path) != XBF_OK) {
+			diff = bf_fail("%s: %s", path, xbf_errmsg(&ref));
+			break;
+		}
+		diff = u_xbz_one(dir, rnd ? "xbz_rnd.xbz" : "xbz_zero.xbz",
+		    &ref, &size);
+		if (diff == NULL && !rnd && size > U_XBZ_LEN / 2)
+			diff = bf_fail("%d bytes compressed to %d", U_XBZ_LEN,
+			    (int)size);
+		else if (diff == NULL && rnd && size < U_XBZ_LEN)
+			diff = bf_fail("%d random bytes compressed to %d",
+			    U_XBZ_LEN, (int)size);
+		(void)xbf_close(&ref);
+	}
+	free(data);
+	return (diff);
+}
+TEST_DECL_FN(u_xbz, "Containers read back whole and across blocks");
+
+/*
+ * Re-stamp ``path'', opened or probed, with ``date'' and ``time'' into
+ * ``out''.
+ */
+static const char *
+u_build_one(const char *path, int probe, const char *date, const char *time,
+    const char *out)
+{
+	struct xbf_build xb;
+	struct xbf xbf;
+	const char *diff;
+	int fd;
+
+	xbf_init(&xbf);
+	if ((probe ? xbf_probe(&xbf, path) : xbf_open(&xbf, path)) != XBF_OK)
+		return (bf_fail("%s: %s", path, xbf_errmsg(&xbf)));
+	xbf_build_init(&xb, NULL, NULL);
+	diff = NULL;
+	fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1);
+	if (xbf_build_from(&xb, &xbf) == 0) {
+		xb.xb_date = date;
+		xb.xb_time = time;
+		if (xbf_build_write(&xb, fd) != 0)
+			diff = xbf_errmsg(&xb.xb_xbf);
+	} else
+		diff = xbf_errmsg(&xb.xb_xbf);
+	if (diff != NULL)
+		diff = bf_fail("%s, %s: %s", path, probe ? "probed" : "opened",
+		    diff);
+	(void)close(fd);
+	xbf_build_free(&xb);
+	(void)xbf_close(&xbf);
+	return (diff);
+}
+
+/*
+ * A .bit file and a container of it, opened and probed, re-stamped with
+ * the date and time they have give back the .bit file byte for byte.
+ * Another date only changes the header.
+ */
+static const char *
+u_build(const char *dir)
+{
+	unsigned ids[200];
+	struct bf_stream bs;
+	struct xbf ref, xbf;
+	char path[512], xpath[512], out[512];
+	const char *diff, *src;
+	int i, probe, fd;
+
+	for (i = 0; i < ARRAY_SIZE(ids); i++)
+		ids[i] = i % 5;
+	bs_begin(&bs);
+	bs_frames(&bs, 0, ids, ARRAY_SIZE(ids));
+	bs_end(&bs);
+	if ((diff = bs_open(&bs, dir, "build.bit", &ref, path,
+	    sizeof(path))) != NULL)
+		return (diff);
+	(void)snprintf(xpath, sizeof(xpath), "%s/build.xbz", dir);
+	fd = open(xpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ASSERT(fd != -1);
+	if (xbf_xbz_write(&ref, fd, 4096) != 0)
+		diff = bf_fail("%s: %s", xpath, xbf_errmsg(&ref));
+	(void)close(fd);
+	(void)snprintf(out, sizeof(out), "%s/build.out.bit", dir);
+
+	for (i = 0; i < 4 && diff == NULL; i++) {
+		src = (i < 2) ? path : xpath;
+		probe = i % 2;
+		diff = u_build_one(src, probe, ref.xbf_date, ref.xbf_time,
+		    out);
+		if (diff != NULL)
+			break;
+		xbf_init(&xbf);
+		if (xbf_open(&xbf, out) != XBF_OK)
+			diff = bf_fail("%s: %s", out, xbf_errmsg(&xbf));
+		else if (xbf._xbf_filesize != ref._xbf_filesize ||
+		    memcmp(xbf._xbf_mem, ref._xbf_mem, ref._xbf_filesize) != 0)
+			diff = bf_fail("%s, %s: not the same file again", src,
+			    probe ? "probed" : "opened");
+		(void)xbf_close(&xbf);
+	}
+	if (diff == NULL)
+		diff = u_build_one(xpath, 1, "2024/12/31", "23:59:59", out);
+	if (diff == NULL) {
+		xbf_init(&xbf);
+		if (xbf_open(&xbf, out) != XBF_OK)
+			diff = bf_fail("%s: %s", out, xbf_errmsg(&xbf));
+		else if (strcmp(xbf.xbf_date, "2024/12/31") != 0 ||
+		    strcmp(xbf.xbf_time, "23:59:59") != 0 ||
+		    strcmp(xbf.xbf_ncdname, ref.xbf_ncdname) != 0 ||
+		    xbf.xbf_len != ref.xbf_len ||
+		    memcmp(xbf.xbf_data, ref.xbf_data, ref.xbf_len) != 0)
+			diff = bf_fail("%s: not re-stamped", out);
+		(void)xbf_close(&xbf);
+	}
+	(void)xbf_close(&ref);
+	return (diff);
+}
+TEST_DECL_FN(u_build, "Re-stamping with the same date gives the same file");
+
+struct u_pipe {
+	int	 up_fd;
+	char	*up_buf;
+	size_t	 up_len;
+	size_t	 up_cap;
+};
+
+static void *
+u_pipe_read(void *arg)
+{
+	struct u_pipe *up = arg;
+	ssize_t l;
+
+	for (;;) {
+		if (up->up_len == up->up_cap) {
+			up->up_cap = (up->up_cap == 0) ? 4096 : up->up_cap * 2;
+			up->up_buf = realloc(up->up_buf, up->up_cap);
+			ASSERT(up->up_buf != NULL);
+		}
+		l = read(up->up_fd, up->up_buf + up->up_len,
+		    up->up_cap - up->up_len);
+		if (l <= 0)
+			break;
+		up->up_len += l;
+	}
+	return (NULL);
+}
+
+/*
+ * Program ``xbf'' (``how'' it was opened) into a pipe or a file in
+ * ``dir'' and compare what arrived with the ``len'' bytes at ``exp''.
+ */
+static const char *
+u_program_one(struct xbf *xbf, const char *how, const char *dir, int topipe,
+    int mode, int flags, const char *exp, size_t len)
+{
+	struct xbf_program_opts xp;
+	struct u_pipe up;
+	pthread_t td;
+	char path[512];
+	const char *diff;
+	int fds[2], error;
+
+	memset(&xp, 0, sizeof(xp));
+	xp.xp_mode = mode;
+	xp.xp_flags = flags;
+	xp.xp_chunk = 4096;
+	memset(&up, 0, sizeof(up));
+	if (topipe) {
+		error = pipe(fds);
+		ASSERT(error == 0 && "couldn't make a pipe");
+		up.up_fd = fds[0];
+		error = pthread_create(&td, NULL, u_pipe_read, &up);
+		ASSERT(error == 0);
+	} else {
+		(void)snprintf(path, sizeof(path), "%s/program.out", dir);
+		fds[1] = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		ASSERT(fds[1] != -1);
+	}
+	error = xbf_program_fd(xbf, fds[1], &xp);
+	if (topipe) {
+		(void)close(fds[1]);
+		(void)pthread_join(td, NULL);
+		(void)close(fds[0]);
+	} else {
+		up.up_buf = malloc(len + 1);
+		ASSERT(up.up_buf != NULL);
+		up.up_len = pread(fds[1], up.up_buf, len + 1, 0);
+		(void)close(fds[1]);
+	}
+	diff = NULL;
+	if (error != 0)
+		diff = xbf_errmsg(xbf);
+	else if (xp.xp_bytes != len || up.up_len != len ||
+	    memcmp(up.up_buf, exp, len) != 0)
+		diff = "the payload didn't arrive as it should";
+	if (diff != NULL)
+		diff = bf_fail("%s, %s, mode %d, flags %#x: %s", how,
+		    topipe ? "pipe" : "file", mode, flags, diff);
+	free(up.up_buf);
+	return (diff);
+}
+
+/*
+ * Opened and probed, every way the payload can go out, into a file and
+ * into a pipe.
+ */
+static const char *
+u_program(const char *dir)
+{
+	static const struct {
+		int	probe;
+		int	mode;
+		int	flags;
+	} cases[] = {
+		{ 0, XBF_EXPORT_ASIS,	0 },
+		{ 0, XBF_EXPORT_ASIS,	XBF_PROG_NOZEROCOPY },
+		{ 0, XBF_EXPORT_ASIS,	XBF_PROG_DONTNEED },
+		{ 0, XBF_EXPORT_SWAP32,	0 },
+		{ 0, XBF_EXPORT_SWAP32,	XBF_PROG_DONTNEED },
+		{ 1, XBF_EXPORT_ASIS,	0 },
+		{ 1, XBF_EXPORT_ASIS,	XBF_PROG_NOZEROCOPY },
+		{ 1, XBF_EXPORT_ASIS,	XBF_PROG_DONTNEED },
+		{ 1, XBF_EXPORT_SWAP32,	0 },
+	};
+	unsigned ids[200];
+	struct bf_stream bs;
+	struct xbf ref, xbf;
+	char path[512];
+	const char *diff;
+	char *swapped;
+	size_t len;
+	int i, topipe;
+
+	for (i = 0; i < ARRAY_SIZE(ids); i++)
+		ids[i] = i % 7;
+	bs_begin(&bs);
+	bs_frames(&bs, 0, ids, ARRAY_SIZE(ids));
+	bs_end(&bs);
+	if ((diff = bs_open(&bs, dir, "program.bit", &ref, path,
+	    sizeof(path))) != NULL)
+		return (diff);
+	len = ref.xbf_len;
+	swapped = malloc(len);
+	ASSERT(swapped != NULL);
+	xbf_export_conv(XBF_EXPORT_SWAP32, swapped, ref.xbf_data, len);
+
+	for (i = 0; i < ARRAY_SIZE(cases) && diff == NULL; i++)
+		for (topipe = 0; topipe < 2 && diff == NULL; topipe++) {
+			xbf_init(&xbf);
+			if ((cases[i].probe ? xbf_probe(&xbf, path) :
+			    xbf_open(&xbf, path)) != XBF_OK) {
+				diff = bf_fail("%s: %s", path,
+				    xbf_errmsg(&xbf));
+				break;
+			}
+			diff = u_program_one(&xbf, cases[i].probe ? "probed" :
+			    "opened", dir, topipe, cases[i].mode,
+			    cases[i].flags, (cases[i].mode == XBF_EXPORT_ASIS) ?
+			    ref.xbf_data : swapped, len);
+			(void)xbf_close(&xbf);
+		}
+	free(swapped);
+	(void)xbf_close(&ref);
+	return (diff);
+}
+TEST_DECL_FN(u_program, "Programming sends the payload into files and pipes");
+
+/* The byte at ``p'' in hex, or -1 */
+static int
+u_mcs_byte(const char *p)
+{
+	unsigned v;
+	int i;
+
+	v = 0;
+	for (i = 0; i < 2; i++) {
+		v <<= 4;
+		if (p[i] >= '0' && p[i] <= '9')
+			v |= p[i] - '0';
+		else if (p[i] >= 'A' && p[i] <= 'F')
+			v |= p[i] - 'A' + 10;
+		else
+			return (-1);
+	}
+	return (v);
+}
+
+/*
+ * Check the ``len'' bytes of .mcs output at ``mcs'': every record sums
+ * to zero, none crosses a 64kB boundary, an extended address record
+ * comes first and at every boundary, and the data is the ``n'' bytes
+ * at ``exp'' placed at ``addr''.
+ */
+static const char *
+u_mcs_check(const char *mcs, size_t len, uint32_t addr, const uint8_t *exp,
+    size_t n)
+{
+	uint8_t rec[4 + 255 + 1], sum;
+	const char *p, *end;
+	size_t off, nela;
+	uint32_t base, a;
+	int b, i, l, eof;
+
+	base = UINT32_MAX;
+	off = nela = 0;
+	eof = 0;
+	for (p = mcs, end = mcs + len; p < end; p += 2 * l + 1) {
+		if (eof)
+			return (bf_fail("record after the end of file at %zu",
+			    (size_t)(p - mcs)));
+		if (*p++ != ':' || end - p < 2 || (l = u_mcs_byte(p)) == -1)
+			return (bf_fail("bad record at %zu",
+			    (size_t)(p - mcs)));
+		l += 5;
+		if (end - p < 2 * l + 1 || p[2 * l] != '\n')
+			return (bf_fail("short record at %zu",
+			    (size_t)(p - mcs)));
+		sum = 0;
+		for (i = 0; i < l; i++) {
+			if ((b = u_mcs_byte(p + 2 * i)) == -1)
+				return (bf_fail("bad hex at %zu",
+				    (size_t)(p - mcs)));
+			rec[i] = b;
+			sum += b;
+		}
+		if (sum != 0)
+			return (bf_fail("bad checksum at %zu",
+			    (size_t)(p - mcs)));
+		a = rec[1] << 8 | rec[2];
+		switch (rec[3]) {
+		case 0x00:
+			if (base == UINT32_MAX)
+				return (bf_fail("data before an address"));
+			if ((base << 16 | a) != addr + off)
+				return (bf_fail("data at %#x, not at %#zx",
+				    base << 16 | a, addr + off));
+			if (a + rec[0] > 0x10000)
+				return (bf_fail("record at %#x crosses 64kB",
+				    base << 16 | a));
+			if (rec[0] > n - off ||
+			    memcmp(rec + 4, exp + off, rec[0]) != 0)
+				return (bf_fail("wrong data at %#x",
+				    base << 16 | a));
+			off += rec[0];
+			break;
+		case 0x01:
+			eof = 1;
+			break;
+		case 0x04:
+			if (rec[0] != 2 || a != 0)
+				return (bf_fail("bad extended address"));
+			base = rec[4] << 8 | rec[5];
+			if (base != (addr + off) >> 16)
+				return (bf_fail("extended address %#x at %#zx",
+				    base, addr + off));
+			nela++;
+			break;
+		default:
+			return (bf_fail("record type %#x", rec[3]));
+		}
+	}
+	if (!eof)
+		return (bf_fail("no end of file record"));
+	if (off != n)
+		return (bf_fail("%zu bytes of %zu", off, n));
+	if (nela != ((addr + n - 1) >> 16) - (addr >> 16) + 1)
+		return (bf_fail("%zu extended addresses", nela));
+	return (NULL);
+}
+
+/*
+ * The .mcs writer, placed just below a 64kB boundary so its first
+ * record ends on it, or crosses it and gets split.
+ */
+static const char *
+u_mcs(const char *dir)
+{
+	static const struct {
+		uint32_t	addr;
+		int		mode;
+	} cases[] = {
+		{ 0,		XBF_EXPORT_ASIS },
+		{ 0x1fff0,	XBF_EXPORT_ASIS },
+		{ 0x1fff5,	XBF_EXPORT_BITREV },
+		{ 0x2fffb,	XBF_EXPORT_SWAP32 },
+	};
+	unsigned ids[200];
+	struct bf_stream bs;
+	struct xbf xbf;
+	struct stat st;
+	char path[512], out[512], why[256];
+	const char *diff;
+	uint8_t *exp;
+	char *mcs;
+	size_t len;
+	ssize_t l;
+	int i, fd, error;
+
+	for (i = 0; i < ARRAY_SIZE(ids); i++)
+		ids[i] = i % 3;
+	bs_begin(&bs);
+	bs_frames(&bs, 0, ids, ARRAY_SIZE(ids));
+	bs_end(&bs);
+	if ((diff = bs_open(&bs, dir, "mcs.bit", &xbf, path,
+	    sizeof(path))) != NULL)
+		return (diff);
+	len = xbf.xbf_len;
+	exp = malloc(len);
+	ASSERT(exp != NULL);
+	(void)snprintf(out, sizeof(out), "%s/mcs.out.mcs", dir);
+
+	for (i = 0; i < ARRAY_SIZE(cases) && diff == NULL; i++) {
+		xbf_export_conv(cases[i].mode, exp, xbf.xbf_data, len);
+		fd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		ASSERT(fd != -1);
+		if (xbf_export_mcs(&xbf, fd, cases[i].addr,
+		    cases[i].mode) != 0) {
+			diff = bf_fail("%s: %s", out, xbf_errmsg(&xbf));
+			(void)close(fd);
+			break;
+		}
+		error = fstat(fd, &st);
+		ASSERT(error == 0);
+		mcs = malloc(st.st_size);
+		ASSERT(mcs != NULL);
+		l = pread(fd, mcs, st.st_size, 0);
+		ASSERT(l == st.st_size);
+		(void)close(fd);
+		diff = u_mcs_check(mcs, l, cases[i].addr, exp, len);
+		if (diff != NULL) {
+			(void)snprintf(why, sizeof(why), "%s", diff);
+			diff = bf_fail("at %#x, mode %d: %s", cases[i].addr,
+			    cases[i].mode, why);
+		}
+		free(mcs);
+	}
+	free(exp);
+	(void)xbf_close(&xbf);
+	return (diff);
+}
+TEST_DECL_FN(u_mcs, "PROM files check and cross 64kB boundaries");
+
+static test_exerr_t
+bf_test(const char *dir_test, struct test *t, char **e)
+{
+	struct xbf xbf, pxbf;
+	enum xbf_error code, pcode;
+	const char *diff;
+	char path[512];
+	char msg[512];
+	struct bf raw;
+	size_t len;
+	char *buf;
+	int error;
+	int field;
+	int l;
+
+	ASSERT(dir_test != NULL);
+	ASSERT(t != NULL);
+	ASSERT(e != NULL);
+	ASSERT(*e == NULL);
+
+	if (t->t_fn != NULL) {
+		bf_mkdir(dir_test);
+		diff = t->t_fn(dir_test);
+		if (diff == NULL)
+			return (TEST_OK);
+		*e = strdup(diff);
+		return (TEST_DIFF);
+	}
+	bf_serialize(&raw, t->t_bf);
+	len = (t->t_len != 0) ? t->t_len : sizeof(raw);
+	buf = calloc(1, MAX(len, sizeof(raw)));
+	ASSERT(buf != NULL && "couldn't allocate the header");
+	memcpy(buf, &raw, sizeof(raw));
+	/* Something to tell payload bytes apart */
+	for (l = sizeof(raw); l < (int)len; l++)
+		buf[l] = (char)(l * 7 + 1);
+
+	xbf_init(&xbf);
+	if (t->t_mem) {
+		code = xbf_open_mem(&xbf, buf, len);
+	} else {
+		bf_mkdir(dir_test);
+		(void)snprintf(path, sizeof(path), "%s/%s.out", dir_test,
+		    t->_t_name);
+		bf_write_file(path, buf, len);
+		code = xbf_open(&xbf, path);
+	}
+
+	diff = NULL;
+	if (t->t_code != -1) {
+		(void)xbf_errcode(&xbf, &field, NULL);
+		if (code != (enum xbf_error)t->t_code ||
+		    (code != XBF_OK && field != t->t_field))
+			diff = "not the error expected";
+	}
+	if (diff == NULL && t->t_feed && code == XBF_OK)
+		diff = bf_feed_diff(buf, len, &xbf);
+	if (diff == NULL && !t->t_mem) {
+		xbf_init(&pxbf);
+		pcode = xbf_probe(&pxbf, path);
+		diff = bf_probe_diff(&xbf, code, &pxbf, pcode);
+		if (pcode == XBF_OK)
+			(void)xbf_close(&pxbf);
+	}
+	if (diff != NULL && code == XBF_OK)
+		*e = strdup(diff);
+	else if (diff != NULL) {
+		(void)snprintf(msg, sizeof(msg), "%s: %s", diff,
+		    xbf_errmsg(&xbf));
+		*e = strdup(msg);
+	} else if (code != XBF_OK)
+		*e = strdup(xbf_errmsg(&xbf));
+	if (code == XBF_OK) {
+		error = xbf_close(&xbf);
+		ASSERT(error == 0 && "couldn't close xbf file");
+	}
+	free(buf);
+	if (diff != NULL)
+		return (TEST_DIFF);
+	if (code != XBF_OK) {
+		ASSERT(*e != NULL);
+		return (TEST_ER);
+	}
+	return (TEST_OK);
+}
+
+struct test *tests[] = {
+#define	TEST_UNIT(bf)	&test_##bf,
+#include "xbf_tests.h"
+#undef TEST_UNIT
+};
+
+/*
+ * Print a string that is going to be a TSV field or a JSON string.
+ */
+static void
+scan_str(FILE *fp, const char *str)
+{
+	const unsigned char *p;
+
+	if (str == NULL)
+		str = "";
+	for (p = (const unsigned char *)str; *p != '\0'; p++) {
+		if (flag_J && (*p == '"' || *p == '\\'))
+			fprintf(fp, "\\%c", *p);
+		else if (flag_J && *p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else if (!flag_J && (*p == '\t' || *p == '\n'))
+			putc(' ', fp);
+		else
+			putc(*p, fp);
+	}
+}
+
+/*
+ * One record per scanned file.  Called from many threads at once.
+ */
+static void
+scan_record(void *arg, const char *path, struct xbf *xbf, int error)
+{
+	FILE *fp = arg;
+	const char *f[6];
+	const char *fn[6] = {
+		"path", "ncdname", "partname", "date", "time", "error"
+	};
+	int i;
+
+	memset(f, 0, sizeof(f));
+	f[0] = path;
+	if (error == 0) {
+		f[1] = xbf_get_ncdname(xbf);
+		f[2] = xbf_get_partname(xbf);
+		f[3] = xbf_get_date(xbf);
+		f[4] = xbf_get_time(xbf);
+	} else
+		f[5] = xbf_errmsg(xbf);
+
+	flockfile(fp);
+	if (flag_J)
+		putc('{', fp);
+	for (i = 0; i < ARRAY_SIZE(f); i++) {
+		if (i == 5) {
+			if (flag_J)
+				fprintf(fp, ",\"length\":%d",
+				    (int)xbf_get_len(xbf));
+			else
+				fprintf(fp, "%d\t", (int)xbf_get_len(xbf));
+		}
+		if (flag_J) {
+			fprintf(fp, "%s\"%s\":", (i == 0) ? "" : ",", fn[i]);
+			if (f[i] == NULL) {
+				fprintf(fp, "null");
+				continue;
+			}
+			putc('"', fp);
+		}
+		scan_str(fp, f[i]);
+		if (flag_J)
+			putc('"', fp);
+		else
+			putc((i == ARRAY_SIZE(f) - 1) ? '\n' : '\t', fp);
+	}
+	if (flag_J)
+		fprintf(fp, "}\n");
+	funlockfile(fp);
+}
+
+/*
+ * Streaming mode: header is printed as soon as it's parsed, the
+ * payload is only counted.
+ */
+static int
+stream_hdr(void *arg, struct xbf *xbf)
+{
+
+	(void)arg;
+	xbf_print(xbf);
+	(void)fflush(stdout);
+	return (0);
+}
+
+static int
+stream_data(void *arg, const void *buf, size_t len)
+{
+	size_t *total = arg;
+
+	(void)buf;
+	*total += len;
+	return (0);
+}
+
+static void
+stream_test(int fd)
+{
+	struct xbf_feed xf;
+	char buf[64 * 1024];
+	size_t total = 0;
+	ssize_t l;
+
+	xbf_feed_init(&xf, stream_hdr, stream_data, &total);
+	while ((l = read(fd, buf, sizeof(buf))) > 0)
+		if (xbf_feed(&xf, buf, l) != 0)
+			break;
+	if (l == -1)
+		err(EXIT_FAILURE, "Couldn't read the stream");
+	if (xbf_feed_end(&xf) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xf.xf_xbf));
+}
+
+/*
+ * Same, with the file (compressed or not) pushed by the library.
+ */
+static void
+stream_test_file(const char *fname)
+{
+	struct xbf_feed xf;
+	size_t total = 0;
+
+	xbf_feed_init(&xf, stream_hdr, stream_data, &total);
+	if (xbf_feed_file(&xf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xf.xf_xbf));
+}
+
+static void
+sync_print(struct xbf *xbf)
+{
+	size_t *offs;
+	size_t i, n;
+
+	printf("  Bus detect: ");
+	if (xbf_get_buswidth_off(xbf) == -1)
+		printf("none\n");
+	else
+		printf("%d\n", (int)xbf_get_buswidth_off(xbf));
+	n = xbf_get_syncs(xbf, NULL, 0);
+	offs = calloc(n + 1, sizeof(*offs));
+	ASSERT(offs != NULL);
+	n = xbf_get_syncs(xbf, offs, n);
+	for (i = 0; i < n; i++)
+		printf("        Sync: %d\n", (int)offs[i]);
+	free(offs);
+}
+
+static const struct {
+	int		 mode;
+	int		 mcs;
+	const char	*name;
+} export_modes[] = {
+	{ XBF_EXPORT_ASIS,	0,	"asis" },
+	{ XBF_EXPORT_SWAP32,	0,	"swap32" },
+	{ XBF_EXPORT_BITREV,	0,	"bitrev" },
+	{ XBF_EXPORT_ASIS,	1,	"mcs" },
+	{ XBF_EXPORT_SWAP32,	1,	"mcs-swap32" },
+	{ XBF_EXPORT_BITREV,	1,	"mcs-bitrev" },
+};
+
+static void
+export_bin(struct xbf *xbf, const char *mode, const char *out)
+{
+	int fd, i;
+
+	for (i = 0; i < ARRAY_SIZE(export_modes); i++)
+		if (strcmp(mode, export_modes[i].name) == 0)
+			break;
+	if (i == ARRAY_SIZE(export_modes))
+		errx(EXIT_FAILURE, "Unknown export mode '%s'", mode);
+	if (out == NULL || strcmp(out, "-") == 0)
+		fd = STDOUT_FILENO;
+	else {
+		fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			err(EXIT_FAILURE, "Couldn't create '%s'", out);
+	}
+	if ((export_modes[i].mcs ?
+	    xbf_export_mcs(xbf, fd, export_addr, export_modes[i].mode) :
+	    xbf_export_bin(xbf, fd, export_modes[i].mode)) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(xbf));
+	if (fd != STDOUT_FILENO && close(fd) != 0)
+		err(EXIT_FAILURE, "Couldn't write '%s'", out);
+}
+
+static const char *program_methods[] = {
+	[XBF_PROG_M_SENDFILE] =	"sendfile",
+	[XBF_PROG_M_SPLICE] =	"splice",
+	[XBF_PROG_M_WRITE] =	"write",
+	[XBF_PROG_M_CONV] =	"write-behind",
+};
+
+/*
+ * -W <device>: send the payload to a configuration device, or to a file
+ * or a pipe ("-" is stdout) standing in for one.  -x picks the format
+ * the device wants, -p sends it without mapping the file.
+ */
+static void
+program_test(const char *fname, const char *out)
+{
+	struct xbf_program_opts xp;
+	struct xbf xbf;
+	int fd, i;
+
+	memset(&xp, 0, sizeof(xp));
+	if (export_mode != NULL) {
+		for (i = 0; i < ARRAY_SIZE(export_modes); i++)
+			if (!export_modes[i].mcs &&
+			    strcmp(export_mode, export_modes[i].name) == 0)
+				break;
+		if (i == ARRAY_SIZE(export_modes))
+			errx(EXIT_FAILURE, "Unknown export mode '%s'",
+			    export_mode);
+		xp.xp_mode = export_modes[i].mode;
+	}
+	xbf_init(&xbf);
+	if ((flag_p ? xbf_probe(&xbf, fname) : xbf_open(&xbf, fname)) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	if (strcmp(out, "-") == 0)
+		fd = STDOUT_FILENO;
+	else {
+		fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			err(EXIT_FAILURE, "Couldn't open '%s'", out);
+	}
+	if (xbf_program_fd(&xbf, fd, &xp) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	if (fd != STDOUT_FILENO && close(fd) != 0)
+		err(EXIT_FAILURE, "Couldn't write '%s'", out);
+	fprintf(stderr, "%ju bytes in %.3f ms (%.1f MB/s) with %s\n",
+	    (uintmax_t)xp.xp_bytes, xp.xp_secs * 1e3,
+	    xp.xp_bytes / xp.xp_secs / 1e6, program_methods[xp.xp_method]);
+	xbf_close(&xbf);
+}
+
+/*
+ * -T <output>: write a copy of the bit stream stamped with the current
+ * date and time.  With -p the file isn't mapped at all.
+ */
+static void
+stamp_test(const char *fname, const char *out)
+{
+	struct xbf_build xb;
+	struct xbf xbf;
+	int fd;
+
+	xbf_init(&xbf);
+	if ((flag_p ? xbf_probe(&xbf, fname) : xbf_open(&xbf, fname)) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	xbf_build_init(&xb, NULL, NULL);
+	if (xbf_build_from(&xb, &xbf) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xb.xb_xbf));
+	fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Couldn't create '%s'", out);
+	if (xbf_build_write(&xb, fd) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xb.xb_xbf));
+	if (close(fd) != 0)
+		err(EXIT_FAILURE, "Couldn't write '%s'", out);
+	xbf_build_free(&xb);
+	xbf_close(&xbf);
+}
+
+/*
+ * Build a flash image out of ``file[@offset]'' arguments.  Images without
+ * an offset go to the next 64kB boundary.  With -M the last one is the
+ * MultiBoot update image.
+ */
+#define FLASH_ALIGN	0x10000
+
+static void
+flash_build(int argc, char **argv)
+{
+	struct xbf_flash xfl;
+	struct xbf *arr;
+	uint64_t pos;
+	uint32_t off;
+	char *at;
+	int fd, i;
+
+	arr = calloc(argc, sizeof(*arr));
+	ASSERT(arr != NULL);
+	xbf_flash_init(&xfl, flash_size, flag_M ? XBF_FLASH_MULTIBOOT : 0);
+	pos = flag_M ? FLASH_ALIGN : 0;
+	for (i = 0; i < argc; i++) {
+		off = roundup(pos, FLASH_ALIGN);
+		at = strrchr(argv[i], '@');
+		if (at != NULL) {
+			*at++ = '\0';
+			off = strtoul(at, NULL, 0);
+		}
+		xbf_init(&arr[i]);
+		if (xbf_probe(&arr[i], argv[i]) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&arr[i]));
+		if (xbf_flash_add(&xfl, &arr[i], off, (flag_M &&
+		    i == argc - 1) ? XBF_FLASH_UPDATE : 0) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xfl.xfl_xbf));
+		pos = (uint64_t)off + xbf_get_len(&arr[i]);
+	}
+	if (strcmp(flash_out, "-") == 0)
+		fd = STDOUT_FILENO;
+	else {
+		fd = open(flash_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			err(EXIT_FAILURE, "Couldn't create '%s'", flash_out);
+	}
+	if (xbf_flash_write(&xfl, fd) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xfl.xfl_xbf));
+	if (fd != STDOUT_FILENO && close(fd) != 0)
+		err(EXIT_FAILURE, "Couldn't write '%s'", flash_out);
+	xbf_flash_print_fp((fd == STDOUT_FILENO) ? stderr : stdout, &xfl);
+	xbf_flash_free(&xfl);
+	for (i = 0; i < argc; i++)
+		xbf_close(&arr[i]);
+	free(arr);
+}
+
+/*
+ * Compare ``oname'' with ``nname'' and, with -o, write the partial bit
+ * stream.
+ */
+static void
+diff_test(const char *oname, const char *nname, const char *out)
+{
+	struct xbf old, new;
+	struct xbf_diff xd;
+	int fd;
+
+	xbf_init(&old);
+	xbf_init(&new);
+	if (xbf_open(&old, oname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&old));
+	if (xbf_open(&new, nname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&new));
+	if (xbf_diff(&old, &new, &xd) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&new));
+	xbf_diff_print_fp(stdout, &xd);
+	if (out != NULL) {
+		fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+			err(EXIT_FAILURE, "Couldn't create '%s'", out);
+		if (xbf_diff_write(&new, &xd, fd) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&new));
+		if (close(fd) != 0)
+			err(EXIT_FAILURE, "Couldn't write '%s'", out);
+	}
+	xbf_diff_free(&xd);
+	xbf_close(&new);
+	xbf_close(&old);
+}
+
+/*
+ * Look up ``far[:idx]'' in the frame address index.
+ */
+static void
+far_print(struct xbf *xbf, const char *query)
+{
+	uint32_t far, idx = 0;
+	ssize_t off;
+	char *p;
+
+	far = strtoul(query, &p, 0);
+	if (*p == ':')
+		idx = strtoul(p + 1, NULL, 0);
+	off = xbf_far_lookup(xbf, far, idx);
+	if (off == -1 && xbf->_xbf_faridx == NULL)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(xbf));
+	printf("         FAR: 0x%08x +%u ", far, idx);
+	if (off == -1)
+		printf("not found\n");
+	else
+		printf("at offset %d\n", (int)off);
+}
+
+/*
+ * Write ``xbf'' compressed with multiple frame writes to ``out''.
+ */
+static void
+compress_test(struct xbf *xbf, const char *out)
+{
+	struct xbf_compress xc;
+	int fd;
+
+	fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Couldn't create '%s'", out);
+	if (xbf_compress(xbf, fd, &xc) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(xbf));
+	if (close(fd) != 0)
+		err(EXIT_FAILURE, "Couldn't write '%s'", out);
+	xbf_compress_print_fp(stdout, &xc);
+}
+
+/*
+ * Write ``xbf'' as a seekable compressed container to ``out''.
+ */
+static void
+xbz_test(struct xbf *xbf, const char *out)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Couldn't create '%s'", out);
+	if (xbf_xbz_write(xbf, fd, 0) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(xbf));
+	if (fstat(fd, &st) != 0 || close(fd) != 0)
+		err(EXIT_FAILURE, "Couldn't write '%s'", out);
+	printf("%d -> %d bytes\n", (int)(xbf_get_offset(xbf) +
+	    xbf_get_len(xbf)), (int)st.st_size);
+}
+
+/*
+ * Compare the readback in ``rbname'' with ``xbf'', under the mask in
+ * ``mskname'' if there's one.
+ */
+static void
+verify_test(struct xbf *xbf, const char *rbname, const char *mskname)
+{
+	struct xbf_verify xv;
+	struct xbf msk;
+	char buf[64 * 1024];
+	ssize_t l;
+	int fd;
+
+	xbf_init(&msk);
+	if (mskname != NULL && xbf_open(&msk, mskname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&msk));
+	if (xbf_verify_init(&xv, xbf, (mskname != NULL) ? &msk : NULL,
+	    0) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(xbf));
+	fd = open(rbname, O_RDONLY);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Couldn't open '%s'", rbname);
+	while ((l = read(fd, buf, sizeof(buf))) > 0)
+		if (xbf_verify_update(&xv, buf, l) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(xbf));
+	if (l == -1)
+		err(EXIT_FAILURE, "Couldn't read '%s'", rbname);
+	(void)close(fd);
+	if (xbf_verify_end(&xv) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(xbf));
+	printf("    Readback: ");
+	xbf_verify_print_fp(stdout, &xv);
+	l = xv.xv_nbad;
+	xbf_verify_free(&xv);
+	if (mskname != NULL)
+		xbf_close(&msk);
+	if (l != 0)
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * Benchmarks.  Each one gets the file names from the command line and
+ * reports the time of every variant it compares.
+ */
+#define BENCH_ROUNDS	5
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+bench_report(const char *what, double secs, size_t nops)
+{
+
+	printf("%-24s %10.3f ms %10.3f us/op\n", what, secs * 1e3,
+	    secs * 1e6 / nops);
+}
+
+static void
+bench_close_all(struct xbf *arr, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (xbf_opened(&arr[i]) && arr[i]._xbf_mem != NULL)
+			(void)xbf_close(&arr[i]);
+}
+
+static void
+bench_open(int argc, char **argv)
+{
+	struct xbf_hcache hc;
+	struct xbf *arr;
+	double t, t_open, t_probe, t_uring, t_pool, t_hcache;
+	int i, r;
+
+	arr = calloc(argc, sizeof(*arr));
+	ASSERT(arr != NULL);
+	t_open = t_probe = t_uring = t_pool = t_hcache = 0;
+	if (hcache_path != NULL && xbf_hcache_open(&hc, hcache_path, 0,
+	    XBF_HCACHE_WRITE) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&hc.hc_xbf));
+	/* Warm the cache up, so the rounds measure hits */
+	for (i = 0; hcache_path != NULL && i < argc; i++) {
+		xbf_init(&arr[i]);
+		if (xbf_hcache_probe(&hc, &arr[i], argv[i]) == 0)
+			(void)xbf_close(&arr[i]);
+	}
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		t = bench_now();
+		for (i = 0; i < argc; i++) {
+			xbf_init(&arr[i]);
+			if (xbf_open(&arr[i], argv[i]) == 0)
+				(void)xbf_close(&arr[i]);
+		}
+		t_open += bench_now() - t;
+
+		t = bench_now();
+		for (i = 0; i < argc; i++) {
+			xbf_init(&arr[i]);
+			if (xbf_probe(&arr[i], argv[i]) == 0)
+				(void)xbf_close(&arr[i]);
+		}
+		t_probe += bench_now() - t;
+
+		t = bench_now();
+		(void)xbf_open_batch(arr, (const char **)argv, argc, 0);
+		bench_close_all(arr, argc);
+		t_uring += bench_now() - t;
+
+		t = bench_now();
+		(void)xbf_open_batch(arr, (const char **)argv, argc,
+		    XBF_BATCH_NOURING);
+		bench_close_all(arr, argc);
+		t_pool += bench_now() - t;
+
+		if (hcache_path == NULL)
+			continue;
+		t = bench_now();
+		for (i = 0; i < argc; i++) {
+			xbf_init(&arr[i]);
+			if (xbf_hcache_probe(&hc, &arr[i], argv[i]) == 0)
+				(void)xbf_close(&arr[i]);
+		}
+		t_hcache += bench_now() - t;
+	}
+	printf("%d files, %d rounds\n", argc, BENCH_ROUNDS);
+	bench_report("xbf_open() loop", t_open, argc * BENCH_ROUNDS);
+	bench_report("xbf_probe() loop", t_probe, argc * BENCH_ROUNDS);
+	bench_report("xbf_open_batch()", t_uring, argc * BENCH_ROUNDS);
+	bench_report("xbf_open_batch(NOURING)", t_pool, argc * BENCH_ROUNDS);
+	if (hcache_path != NULL) {
+		bench_report("xbf_hcache_probe() loop", t_hcache,
+		    argc * BENCH_ROUNDS);
+		printf("cache: %zu hits, %zu misses\n", hc.hc_hits,
+		    hc.hc_misses);
+		xbf_hcache_close(&hc);
+	}
+	free(arr);
+}
+
+/*
+ * What the sync word search would look like without any tricks.
+ */
+static size_t
+bench_sync_naive(const uint8_t *p, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i + 4 <= len; i++)
+		if (p[i] == 0xaa && p[i + 1] == 0x99 && p[i + 2] == 0x55 &&
+		    p[i + 3] == 0x66)
+			n++;
+	return (n);
+}
+
+static size_t
+bench_dummy_naive(const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= len && p[i] == 0xff && p[i + 1] == 0xff &&
+	    p[i + 2] == 0xff && p[i + 3] == 0xff; i += 4)
+		;
+	return (i);
+}
+
+static void
+bench_sync(const char *fname)
+{
+	static const struct {
+		int		 kern;
+		const char	*name;
+	} kerns[] = {
+		{ XBF_KERN_SCALAR,	"scalar kernel" },
+		{ XBF_KERN_SSE2,	"SSE2 kernel" },
+		{ XBF_KERN_AVX2,	"AVX2 kernel" },
+	};
+	struct xbf xbf;
+	size_t offs[64];
+	uint8_t *pad;
+	size_t len, n, n0;
+	double t;
+	int i, r;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	len = xbf_get_len(&xbf);
+
+	t = bench_now();
+	for (r = 0, n0 = 0; r < BENCH_ROUNDS; r++)
+		n0 = bench_sync_naive(xbf_get_data(&xbf), len);
+	t = bench_now() - t;
+	printf("%d bytes, %d sync words, %d rounds\n", (int)len, (int)n0,
+	    BENCH_ROUNDS);
+	printf("%-24s %10.3f ms %10.3f GB/s\n", "naive byte loop",
+	    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+	for (i = 0; i < ARRAY_SIZE(kerns); i++) {
+		if (!_xbf_cpu_has(kerns[i].kern))
+			continue;
+		t = bench_now();
+		for (r = 0, n = 0; r < BENCH_ROUNDS; r++)
+			n = _xbf_sync_find_kern(kerns[i].kern,
+			    xbf_get_data(&xbf), len, XBF_SYNC_WORD, offs,
+			    ARRAY_SIZE(offs));
+		t = bench_now() - t;
+		printf("%-24s %10.3f ms %10.3f GB/s%s\n", kerns[i].name,
+		    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9,
+		    (n == MIN(n0, ARRAY_SIZE(offs))) ? "" : " MISMATCH");
+	}
+
+	/* The dummy pad is short; time skipping a payload's worth of it */
+	pad = malloc(len);
+	ASSERT(pad != NULL);
+	memset(pad, 0xff, len);
+	t = bench_now();
+	for (r = 0, n0 = 0; r < BENCH_ROUNDS; r++)
+		n0 = bench_dummy_naive(pad, len);
+	t = bench_now() - t;
+	printf("%d bytes of dummy pad, %d rounds\n", (int)len, BENCH_ROUNDS);
+	printf("%-24s %10.3f ms %10.3f GB/s\n", "naive word loop",
+	    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+	for (i = 0; i < ARRAY_SIZE(kerns); i++) {
+		if (!_xbf_cpu_has(kerns[i].kern))
+			continue;
+		t = bench_now();
+		for (r = 0, n = 0; r < BENCH_ROUNDS; r++)
+			n = _xbf_dummy_skip_kern(kerns[i].kern, pad, len);
+		t = bench_now() - t;
+		printf("%-24s %10.3f ms %10.3f GB/s%s\n", kerns[i].name,
+		    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9,
+		    (n == n0) ? "" : " MISMATCH");
+	}
+	free(pad);
+	xbf_close(&xbf);
+}
+
+static void
+bench_export(const char *fname)
+{
+	static const struct {
+		int		 kern;
+		const char	*name;
+	} kerns[] = {
+		{ XBF_KERN_SCALAR,	"scalar" },
+		{ XBF_KERN_SSSE3,	"SSSE3" },
+		{ XBF_KERN_AVX2,	"AVX2" },
+	};
+	struct xbf xbf;
+	char what[32];
+	uint8_t *buf, *ref;
+	size_t len;
+	double t;
+	int fd, i, m, r;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	len = xbf_get_len(&xbf);
+	if (posix_memalign((void **)&buf, 64, len + 1) != 0 ||
+	    (ref = malloc(len + 1)) == NULL)
+		err(EXIT_FAILURE, "Couldn't allocate buffers");
+	printf("%d bytes, %d rounds\n", (int)len, BENCH_ROUNDS);
+	for (m = 1; m < ARRAY_SIZE(export_modes) && !export_modes[m].mcs; m++) {
+		_xbf_export_conv_kern(XBF_KERN_SCALAR, export_modes[m].mode,
+		    ref, xbf_get_data(&xbf), len);
+		for (i = 0; i < ARRAY_SIZE(kerns); i++) {
+			if (!_xbf_cpu_has(kerns[i].kern))
+				continue;
+			t = bench_now();
+			for (r = 0; r < BENCH_ROUNDS; r++)
+				_xbf_export_conv_kern(kerns[i].kern,
+				    export_modes[m].mode, buf,
+				    xbf_get_data(&xbf), len);
+			t = bench_now() - t;
+			snprintf(what, sizeof(what), "%s %s",
+			    export_modes[m].name, kerns[i].name);
+			printf("%-24s %10.3f ms %10.3f GB/s%s\n", what,
+			    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9,
+			    (memcmp(buf, ref, len) == 0) ? "" : " MISMATCH");
+		}
+	}
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Couldn't open /dev/null");
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		if (xbf_export_mcs(&xbf, fd, 0, XBF_EXPORT_BITREV) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	t = bench_now() - t;
+	printf("%-24s %10.3f ms %10.3f GB/s\n", "mcs-bitrev",
+	    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+	(void)close(fd);
+	free(ref);
+	free(buf);
+	xbf_close(&xbf);
+}
+
+static void
+bench_hash(const char *fname)
+{
+	struct xbf xbf;
+	uint32_t crc, ref;
+	size_t len;
+	double t;
+	int nthr, r;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	len = xbf_get_len(&xbf);
+	printf("%d bytes, %d rounds\n", (int)len, BENCH_ROUNDS);
+	ref = _xbf_crc32c_kern(XBF_KERN_SCALAR, 0, xbf_get_data(&xbf), len);
+
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		crc = _xbf_crc32c_kern(XBF_KERN_SCALAR, 0, xbf_get_data(&xbf),
+		    len);
+	t = bench_now() - t;
+	printf("%-24s %10.3f ms %10.3f GB/s\n", "slice-by-8 table",
+	    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+	if (_xbf_cpu_has(XBF_KERN_SSE42)) {
+		t = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			crc = _xbf_crc32c_kern(XBF_KERN_SSE42, 0,
+			    xbf_get_data(&xbf), len);
+		t = bench_now() - t;
+		printf("%-24s %10.3f ms %10.3f GB/s%s\n", "SSE4.2 crc32",
+		    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9,
+		    (crc == ref) ? "" : " MISMATCH");
+	}
+	nthr = (flag_j > 0) ? flag_j : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		if (xbf_hash(&xbf, nthr, &crc) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	t = bench_now() - t;
+	printf("xbf_hash(), %2d threads  %10.3f ms %10.3f GB/s%s\n", nthr,
+	    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9,
+	    (crc == ref) ? "" : " MISMATCH");
+	xbf_close(&xbf);
+}
+
+static void
+bench_crc(const char *fname)
+{
+	struct xbf xbf;
+	size_t len, n;
+	uint32_t crc;
+	double t;
+	int r;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	len = xbf_get_len(&xbf);
+	printf("%d bytes, %d rounds\n", (int)len, BENCH_ROUNDS);
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		crc = xbf_crc32c(0, xbf_get_data(&xbf), len);
+	t = bench_now() - t;
+	printf("%-24s %10.3f ms %10.3f GB/s\n", "xbf_crc32c() pass",
+	    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+	(void)crc;
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		if (_xbf_crc_verify_kern(XBF_KERN_SCALAR, &xbf, &n) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	t = bench_now() - t;
+	printf("%-24s %10.3f ms %10.3f GB/s\n", "verify, table",
+	    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+	if (_xbf_cpu_has(XBF_KERN_SSE42)) {
+		t = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+			if (_xbf_crc_verify_kern(XBF_KERN_SSE42, &xbf, &n) != 0)
+				errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		t = bench_now() - t;
+		printf("%-24s %10.3f ms %10.3f GB/s\n", "verify, SSE4.2",
+		    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+	}
+	xbf_close(&xbf);
+}
+
+static void
+bench_diff(const char *oname, const char *nname)
+{
+	struct xbf old, new;
+	struct xbf_diff xd;
+	size_t nchanged;
+	double t;
+	int r;
+
+	xbf_init(&old);
+	xbf_init(&new);
+	if (xbf_open(&old, oname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&old));
+	if (xbf_open(&new, nname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&new));
+	printf("%d bytes, %d rounds\n", (int)xbf_get_len(&new), BENCH_ROUNDS);
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		if (_xbf_diff_kern(XBF_KERN_SCALAR, &old, &new, &xd) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&new));
+		nchanged = xd.xd_nchanged;
+		xbf_diff_free(&xd);
+	}
+	t = bench_now() - t;
+	printf("%-24s %10.3f ms %10.3f GB/s\n", "memcmp() per frame",
+	    t * 1e3 / BENCH_ROUNDS,
+	    xbf_get_len(&new) * 2.0 * BENCH_ROUNDS / t / 1e9);
+	if (_xbf_cpu_has(XBF_KERN_AVX2)) {
+		t = bench_now();
+		for (r = 0; r < BENCH_ROUNDS; r++) {
+			if (_xbf_diff_kern(XBF_KERN_AVX2, &old, &new, &xd) != 0)
+				errx(EXIT_FAILURE, "%s:", xbf_errmsg(&new));
+			if (xd.xd_nchanged != nchanged)
+				printf("MISMATCH\n");
+			xbf_diff_free(&xd);
+		}
+		t = bench_now() - t;
+		printf("%-24s %10.3f ms %10.3f GB/s\n", "AVX2 kernel",
+		    t * 1e3 / BENCH_ROUNDS,
+		    xbf_get_len(&new) * 2.0 * BENCH_ROUNDS / t / 1e9);
+	}
+	xbf_close(&new);
+	xbf_close(&old);
+}
+
+/*
+ * Frame lookups: rescanning the packets for every query, against the
+ * index.  Queries are every burst's FAR and a frame within it.
+ */
+static void
+bench_far(const char *fname)
+{
+	struct xbf xbf;
+	struct xbf_pkts pk;
+	struct xbf_bursts xb;
+	struct xbf_faridx *fi;
+	uint32_t *qfar, *qidx;
+	size_t i, j, nq, nfound;
+	double t;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	t = bench_now();
+	if (xbf_far_index(&xbf) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	t = bench_now() - t;
+	fi = xbf._xbf_faridx;
+	nq = fi->fi_n;
+	if (nq == 0)
+		errx(EXIT_FAILURE, "No FAR writes in '%s'", fname);
+	printf("%d bursts, %d directory buckets\n", (int)nq, (int)fi->fi_ndir);
+	bench_report("building the index", t, 1);
+	qfar = calloc(nq, sizeof(*qfar));
+	qidx = calloc(nq, sizeof(*qidx));
+	ASSERT(qfar != NULL && qidx != NULL);
+	for (i = 0; i < nq; i++) {
+		qfar[i] = fi->fi_far[(i * 7919) % nq];
+		qidx[i] = fi->fi_first[(i * 7919) % nq] +
+		    fi->fi_nframes[(i * 7919) % nq] / 2;
+	}
+
+	t = bench_now();
+	for (i = 0, nfound = 0; i < MIN(nq, 100); i++) {
+		if (xbf_pkt_decode(&xbf, &pk) != 0 ||
+		    _xbf_frame_bursts(&xbf, &pk, &xb) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		for (j = 0; j < xb.xb_nbursts; j++)
+			if (xb.xb_bursts[j].xb_farok &&
+			    xb.xb_bursts[j].xb_far == qfar[i]) {
+				nfound++;
+				break;
+			}
+		_xbf_frame_bursts_free(&xb);
+		xbf_pkt_free(&pk);
+	}
+	t = bench_now() - t;
+	bench_report("rescan per query", t, MIN(nq, 100));
+
+	t = bench_now();
+	for (i = 0, nfound = 0; i < nq; i++)
+		if (xbf_far_lookup(&xbf, qfar[i], qidx[i]) != -1)
+			nfound++;
+	t = bench_now() - t;
+	bench_report("xbf_far_lookup()", t, nq);
+	if (nfound != nq)
+		printf("MISMATCH: %d of %d found\n", (int)nfound, (int)nq);
+	free(qfar);
+	free(qidx);
+	xbf_close(&xbf);
+}
+
+/*
+ * Readback verification kernels.  The readback is made of the frames of
+ * the bit stream with a bit flipped in every 64th frame, and it's fed
+ * in 64 kB pieces, with and without a mask (the bit stream itself).
+ */
+static void
+bench_verify(const char *fname)
+{
+	static const struct {
+		int		 kern;
+		const char	*name;
+	} kerns[] = {
+		{ XBF_KERN_SCALAR,	"scalar" },
+		{ XBF_KERN_SSE2,	"SSE2" },
+		{ XBF_KERN_AVX2,	"AVX2" },
+	};
+	struct xbf xbf;
+	struct xbf_verify xv;
+	char what[32];
+	uint8_t *rb;
+	size_t i, len, off, nbad[2];
+	double t;
+	int k, m, r;
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	if (xbf_verify_init(&xv, &xbf, NULL, 0) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	len = xv.xv_total * xv.xv_exp.xb_flen * 4;
+	rb = malloc(len + 1);
+	ASSERT(rb != NULL);
+	for (i = 0, off = 0; i < xv.xv_exp.xb_nbursts; i++) {
+		memcpy(rb + off, (const char *)xbf.xbf_data +
+		    xv.xv_exp.xb_bursts[i].xb_off,
+		    xv.xv_exp.xb_bursts[i].xb_nframes * xv.xv_exp.xb_flen * 4);
+		off += xv.xv_exp.xb_bursts[i].xb_nframes *
+		    xv.xv_exp.xb_flen * 4;
+	}
+	for (off = 5; off < len; off += 64 * xv.xv_exp.xb_flen * 4)
+		rb[off] ^= 0x10;
+	printf("%d frames, %d rounds\n", (int)xv.xv_total, BENCH_ROUNDS);
+	xbf_verify_free(&xv);
+
+	for (m = 0; m < 2; m++)
+		for (k = 0; k < ARRAY_SIZE(kerns); k++) {
+			if (!_xbf_cpu_has(kerns[k].kern))
+				continue;
+			t = bench_now();
+			for (r = 0; r < BENCH_ROUNDS; r++) {
+				if (_xbf_verify_init_kern(kerns[k].kern, &xv,
+				    &xbf, m ? &xbf : NULL, 0) != 0)
+					errx(EXIT_FAILURE, "%s:",
+					    xbf_errmsg(&xbf));
+				for (off = 0; off < len; off += 64 * 1024)
+					(void)xbf_verify_update(&xv, rb + off,
+					    MIN(len - off, 64 * 1024));
+				if (xbf_verify_end(&xv) != 0)
+					errx(EXIT_FAILURE, "%s:",
+					    xbf_errmsg(&xbf));
+				if (k == 0)
+					nbad[m] = xv.xv_nbad;
+				else if (xv.xv_nbad != nbad[m])
+					printf("MISMATCH\n");
+				xbf_verify_free(&xv);
+			}
+			t = bench_now() - t;
+			snprintf(what, sizeof(what), "%s%s", kerns[k].name,
+			    m ? ", masked" : "");
+			printf("%-24s %10.3f ms %10.3f GB/s\n", what,
+			    t * 1e3 / BENCH_ROUNDS, len * BENCH_ROUNDS / t / 1e9);
+		}
+	printf("%d frames differ, %d under the mask\n", (int)nbad[0],
+	    (int)nbad[1]);
+	free(rb);
+	xbf_close(&xbf);
+}
+
+/*
+ * Containers: getting the header and 4 kB of payload with xbf_probe()
+ * and xbf_pread(), against decompressing everything with xbf_open().
+ */
+static void
+bench_xbz(const char *fname)
+{
+	struct xbf xbf, full;
+	char buf[4096];
+	size_t off, len;
+	double t;
+	int r;
+
+	xbf_init(&full);
+	if (xbf_open(&full, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&full));
+	len = xbf_get_len(&full);
+	off = len / 2;
+	printf("%d bytes of payload, %d rounds\n", (int)len, BENCH_ROUNDS);
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		xbf_init(&xbf);
+		if (xbf_open(&xbf, fname) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		xbf_close(&xbf);
+	}
+	bench_report("xbf_open()", bench_now() - t, BENCH_ROUNDS);
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		xbf_init(&xbf);
+		if (xbf_probe(&xbf, fname) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		xbf_close(&xbf);
+	}
+	bench_report("xbf_probe()", bench_now() - t, BENCH_ROUNDS);
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		xbf_init(&xbf);
+		if (xbf_probe(&xbf, fname) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		if (xbf_pread(&xbf, buf, sizeof(buf), off) !=
+		    (ssize_t)MIN(sizeof(buf), len - off))
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		if (memcmp(buf, (const char *)xbf_get_data(&full) + off,
+		    MIN(sizeof(buf), len - off)) != 0)
+			printf("MISMATCH\n");
+		xbf_close(&xbf);
+	}
+	bench_report("xbf_probe(), 4k pread", bench_now() - t, BENCH_ROUNDS);
+	xbf_close(&full);
+}
+
+/*
+ * Stress test of a shared bit stream: every thread takes a view, parses
+ * the packets, hashes the payload, checks the CRCs and looks a frame up,
+ * and compares the results with the ones from a private open.
+ */
+#define SHARED_ROUNDS	200
+
+struct shared_job {
+	struct xbf_shared	*sj_xs;
+	size_t			 sj_npkts;
+	size_t			 sj_ncrc;
+	uint32_t		 sj_digest;
+	uint32_t		 sj_far;
+	uint32_t		 sj_first;
+	ssize_t			 sj_off;	/* -1: no FAR writes */
+	int			 sj_bad;
+};
+
+static void *
+shared_worker(void *arg)
+{
+	struct shared_job *sj = arg;
+	struct xbf_pkts pk;
+	struct xbf view;
+	uint32_t digest;
+	size_t ncrc;
+	char msg[128];
+	int r, bad;
+
+	for (r = 0; r < SHARED_ROUNDS; r++) {
+		xbf_shared_get(sj->sj_xs, &view);
+		bad = 0;
+		if (xbf_pkt_decode(&view, &pk) != 0)
+			bad++;
+		else {
+			bad += (pk.xp_npkts != sj->sj_npkts);
+			xbf_pkt_free(&pk);
+		}
+		bad += (xbf_hash(&view, 1, &digest) != 0 ||
+		    digest != sj->sj_digest);
+		bad += (xbf_crc_verify(&view, &ncrc) != 0 ||
+		    ncrc != sj->sj_ncrc);
+		if (sj->sj_off != -1)
+			bad += (xbf_far_lookup(&view, sj->sj_far,
+			    sj->sj_first) != sj->sj_off);
+		if (bad != 0) {
+			fprintf(stderr, "%s\n", xbf_errmsg_r(&view, msg,
+			    sizeof(msg)));
+			__atomic_add_fetch(&sj->sj_bad, bad, __ATOMIC_RELAXED);
+		}
+		(void)xbf_close(&view);
+	}
+	return (NULL);
+}
+
+static void
+bench_shared(const char *fname)
+{
+	struct shared_job sj;
+	struct xbf_pkts pk;
+	struct xbf xbf, ref;
+	struct xbf_faridx *fi;
+	pthread_t *thr;
+	double t;
+	int i, nthr;
+
+	memset(&sj, 0, sizeof(sj));
+	xbf_init(&ref);
+	if (xbf_open(&ref, fname) != 0 || xbf_pkt_decode(&ref, &pk) != 0 ||
+	    xbf_hash(&ref, 1, &sj.sj_digest) != 0 ||
+	    xbf_crc_verify(&ref, &sj.sj_ncrc) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&ref));
+	sj.sj_npkts = pk.xp_npkts;
+	xbf_pkt_free(&pk);
+	sj.sj_off = -1;
+	if (xbf_far_index(&ref) == 0 && (fi = ref._xbf_faridx)->fi_n > 0) {
+		sj.sj_far = fi->fi_far[fi->fi_n / 2];
+		sj.sj_first = fi->fi_first[fi->fi_n / 2];
+		sj.sj_off = xbf_far_lookup(&ref, sj.sj_far, sj.sj_first);
+	}
+	xbf_close(&ref);
+
+	xbf_init(&xbf);
+	if (xbf_open(&xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	sj.sj_xs = xbf_share(&xbf);
+	if (sj.sj_xs == NULL)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	nthr = (flag_j > 0) ? flag_j : 8;
+	thr = calloc(nthr, sizeof(*thr));
+	ASSERT(thr != NULL);
+	t = bench_now();
+	for (i = 0; i < nthr; i++)
+		if (pthread_create(&thr[i], NULL, shared_worker, &sj) != 0)
+			err(EXIT_FAILURE, "Couldn't start thread");
+	for (i = 0; i < nthr; i++)
+		(void)pthread_join(thr[i], NULL);
+	t = bench_now() - t;
+	xbf_shared_put(sj.sj_xs);
+	free(thr);
+	printf("%d threads, %d rounds each, %d mismatches\n", nthr,
+	    SHARED_ROUNDS, sj.sj_bad);
+	bench_report("parse+hash+crc+lookup", t, nthr * SHARED_ROUNDS);
+	if (sj.sj_bad != 0)
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * One programming cycle's worth of reading: every page of the payload.
+ */
+static unsigned
+bench_touch(struct xbf *xbf)
+{
+	const volatile char *p;
+	unsigned sum = 0;
+	size_t i;
+
+	p = xbf_get_data(xbf);
+	for (i = 0; p != NULL && i < xbf_get_len(xbf); i += 4096)
+		sum += p[i];
+	return (sum);
+}
+
+/*
+ * Open, read and close the same files over and over, directly and
+ * through the mapping cache.  -B sets the cache budget.
+ */
+static void
+bench_mcache(int argc, char **argv)
+{
+	struct xbf_mcache mc;
+	struct xbf xbf;
+	double t;
+	unsigned sum = 0;
+	int i, r;
+
+	if (xbf_mcache_init(&mc, (mcache_budget != 0) ? mcache_budget :
+	    SIZE_MAX) != 0)
+		errx(EXIT_FAILURE, "Couldn't set up the mapping cache");
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < argc; i++) {
+			xbf_init(&xbf);
+			if (xbf_open(&xbf, argv[i]) != 0)
+				errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+			sum += bench_touch(&xbf);
+			xbf_close(&xbf);
+		}
+	bench_report("xbf_open() cycle", bench_now() - t, argc * BENCH_ROUNDS);
+	t = bench_now();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+		for (i = 0; i < argc; i++) {
+			xbf_init(&xbf);
+			if (xbf_mcache_open(&mc, &xbf, argv[i]) != 0)
+				errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+			sum += bench_touch(&xbf);
+			xbf_close(&xbf);
+		}
+	bench_report("xbf_mcache_open() cycle", bench_now() - t,
+	    argc * BENCH_ROUNDS);
+	xbf_mcache_print_fp(stdout, &mc);
+	xbf_mcache_free(&mc);
+	if (sum == 0)
+		printf("(all zero)\n");
+}
+
+/*
+ * Resident set size in bytes, or 0 if the system won't tell.
+ */
+static size_t
+bench_rss(void)
+{
+	unsigned long size, rss;
+	FILE *fp;
+	int n;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL)
+		return (0);
+	n = fscanf(fp, "%lu %lu", &size, &rss);
+	(void)fclose(fp);
+	return (n == 2 ? rss * sysconf(_SC_PAGESIZE) : 0);
+}
+
+/*
+ * Get ``fname'' out of the page cache, so the next open reads the disk.
+ */
+static void
+bench_evict(const char *fname)
+{
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Couldn't open '%s'", fname);
+	(void)fdatasync(fd);
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	(void)close(fd);
+}
+
+/*
+ * Open and read ``fname'' BENCH_ROUNDS times with ``xo''.  Reports the
+ * time to open and touch every page, and how much the resident set
+ * grew.
+ */
+static void
+bench_io_one(const char *fname, const char *name, struct xbf_open_opts *xo,
+    int warm)
+{
+	struct xbf xbf;
+	double t, secs;
+	size_t rss0, rss1, rss;
+	unsigned sum = 0;
+	int r;
+
+	secs = 0;
+	rss = 0;
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		if (!warm)
+			bench_evict(fname);
+		rss0 = bench_rss();
+		t = bench_now();
+		xbf_init(&xbf);
+		if (xbf_open_opts(&xbf, fname, xo) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		sum += bench_touch(&xbf);
+		secs += bench_now() - t;
+		rss1 = bench_rss();
+		if (rss1 > rss0)
+			rss = MAX(rss, rss1 - rss0);
+		xbf_close(&xbf);
+	}
+	printf("  %-10s %-5s %12.3f us/op %10zu kB RSS%s\n", name,
+	    warm ? "warm" : "cold", secs * 1e6 / BENCH_ROUNDS, rss / 1024,
+	    sum == 0 ? " (all zero)" : "");
+}
+
+/*
+ * Each of the xbf_open_opts() strategies on every file, from a cold
+ * page cache and from a warm one.
+ */
+static void
+bench_io(int argc, char **argv)
+{
+	static const struct {
+		const char	*name;
+		int		 io;
+		int		 buf;
+	} strats[] = {
+		{ "mmap",	XBF_IO_MMAP,		0 },
+		{ "populate",	XBF_IO_POPULATE,	0 },
+		{ "pread",	XBF_IO_PREAD,		0 },
+		{ "pread-buf",	XBF_IO_PREAD,		1 },
+		{ "direct",	XBF_IO_DIRECT,		0 },
+	};
+	struct xbf_open_opts xo;
+	struct stat st;
+	int i, s;
+
+	for (i = 0; i < argc; i++) {
+		if (stat(argv[i], &st) == -1)
+			err(EXIT_FAILURE, "Couldn't check '%s'", argv[i]);
+		printf("%s: %jd bytes\n", argv[i], (intmax_t)st.st_size);
+		for (s = 0; s < (int)ARRAY_SIZE(strats); s++) {
+			memset(&xo, 0, sizeof(xo));
+			xo.xo_io = strats[s].io;
+			if (strats[s].buf) {
+				/* One buffer for all the rounds */
+				xo.xo_bufsize = st.st_size;
+				xo.xo_buf = malloc(xo.xo_bufsize);
+				ASSERT(xo.xo_buf != NULL);
+			}
+			bench_io_one(argv[i], strats[s].name, &xo, 0);
+			bench_io_one(argv[i], strats[s].name, &xo, 1);
+			free(xo.xo_buf);
+		}
+	}
+}
+
+static void *
+bench_drain(void *arg)
+{
+	char buf[64 * 1024];
+	int fd = *(int *)arg;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		continue;
+	return (NULL);
+}
+
+static const struct bench_prog {
+	const char	*bp_name;
+	int		 bp_mode;
+	int		 bp_probe;
+	int		 bp_flags;
+} bench_progs[] = {
+	{ "asis",		XBF_EXPORT_ASIS, 0, 0 },
+	{ "asis nozerocopy",	XBF_EXPORT_ASIS, 0, XBF_PROG_NOZEROCOPY },
+	{ "asis probed",	XBF_EXPORT_ASIS, 1, XBF_PROG_NOZEROCOPY },
+	{ "asis dontneed",	XBF_EXPORT_ASIS, 0, XBF_PROG_DONTNEED },
+	{ "swap32",		XBF_EXPORT_SWAP32, 0, 0 },
+	{ "bitrev",		XBF_EXPORT_BITREV, 0, 0 },
+};
+
+/*
+ * Send the payload of ``fname'' BENCH_ROUNDS times the way ``bp'' says,
+ * to a pipe another thread drains or to the regular file ``tmp''.
+ */
+static void
+bench_program_one(const char *fname, const char *tmp, int to_pipe,
+    const struct bench_prog *bp)
+{
+	struct xbf_program_opts xp;
+	struct xbf xbf;
+	pthread_t td;
+	double secs = 0;
+	uint64_t bytes = 0;
+	int r, fds[2], fd;
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		xbf_init(&xbf);
+		if ((bp->bp_probe ? xbf_probe(&xbf, fname) :
+		    xbf_open(&xbf, fname)) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		if (to_pipe) {
+			if (pipe(fds) != 0)
+				err(EXIT_FAILURE, "Couldn't make a pipe");
+			if (pthread_create(&td, NULL, bench_drain,
+			    &fds[0]) != 0)
+				errx(EXIT_FAILURE, "Couldn't start a thread");
+			fd = fds[1];
+		} else {
+			fd = open(tmp, O_WRONLY | O_TRUNC);
+			if (fd == -1)
+				err(EXIT_FAILURE, "Couldn't open '%s'", tmp);
+		}
+		memset(&xp, 0, sizeof(xp));
+		xp.xp_mode = bp->bp_mode;
+		xp.xp_flags = bp->bp_flags;
+		if (xbf_program_fd(&xbf, fd, &xp) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		(void)close(fd);
+		if (to_pipe) {
+			pthread_join(td, NULL);
+			(void)close(fds[0]);
+		}
+		secs += xp.xp_secs;
+		bytes += xp.xp_bytes;
+		xbf_close(&xbf);
+	}
+	printf("%-4s %-16s %-12s %10.3f ms %8.1f MB/s\n",
+	    to_pipe ? "pipe" : "file", bp->bp_name,
+	    program_methods[xp.xp_method], secs * 1e3 / BENCH_ROUNDS,
+	    bytes / secs / 1e6);
+}
+
+/*
+ * xbf_program_fd() every way a device may want the payload, to a pipe
+ * and to a regular file standing in for the device.
+ */
+static void
+bench_program(const char *fname)
+{
+	char tmp[] = "/tmp/xbf_program.XXXXXX";
+	int i, fd;
+
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		err(EXIT_FAILURE, "Couldn't create '%s'", tmp);
+	(void)close(fd);
+	for (i = 0; i < ARRAY_SIZE(bench_progs); i++)
+		bench_program_one(fname, tmp, 1, &bench_progs[i]);
+	for (i = 0; i < ARRAY_SIZE(bench_progs); i++)
+		bench_program_one(fname, tmp, 0, &bench_progs[i]);
+	(void)unlink(tmp);
+}
+
+struct bench_cat {
+	struct xbf_catalog	 bc_cat;
+	pthread_mutex_t		 bc_lock;
+	size_t			 bc_nerr;
+};
+
+static void
+bench_catalog_add(void *arg, const char *path, struct xbf *xbf, int error)
+{
+	struct bench_cat *bc = arg;
+
+	(void)path;
+	pthread_mutex_lock(&bc->bc_lock);
+	if (error != 0 || xbf_catalog_add(&bc->bc_cat, xbf) == -1)
+		bc->bc_nerr++;
+	pthread_mutex_unlock(&bc->bc_lock);
+}
+
+/*
+ * Catalog everything under ``dir'', then filter on the part of the
+ * first header and sort by time.
+ */
+static void
+bench_catalog(const char *dir)
+{
+	struct bench_cat bc;
+	struct xbf_catalog *cat = &bc.bc_cat;
+	uint32_t *idx;
+	size_t n, i;
+	double t;
+	int r;
+
+	(void)xbf_catalog_init(cat);
+	pthread_mutex_init(&bc.bc_lock, NULL);
+	bc.bc_nerr = 0;
+	t = bench_now();
+	if (xbf_scan(dir, ".bit", flag_j, bench_catalog_add, &bc) != 0)
+		err(EXIT_FAILURE, "Couldn't scan '%s'", dir);
+	t = bench_now() - t;
+	if (cat->xct_n == 0)
+		errx(EXIT_FAILURE, "No bit streams in '%s'", dir);
+	printf("%zu headers, %zu unreadable, %zu distinct names\n",
+	    cat->xct_n, bc.bc_nerr, cat->xct_nstr);
+	printf("catalog: %zu bytes, %.1f bytes/header (struct xbf: %zu)\n",
+	    xbf_catalog_memsize(cat),
+	    (double)xbf_catalog_memsize(cat) / cat->xct_n,
+	    sizeof(struct xbf));
+	bench_report("scan", t, cat->xct_n);
+
+	idx = calloc(cat->xct_n, sizeof(*idx));
+	ASSERT(idx != NULL);
+	t = bench_now();
+	for (r = 0, n = 0; r < BENCH_ROUNDS; r++)
+		n = xbf_catalog_filter(cat, cat->xct_partname[0], INT64_MIN,
+		    INT64_MAX, idx);
+	bench_report("filter on part", bench_now() - t,
+	    cat->xct_n * BENCH_ROUNDS);
+	printf("%zu headers for %s\n", n,
+	    xbf_catalog_str(cat, cat->xct_partname[0]));
+	n = xbf_catalog_filter(cat, XBF_CATALOG_ANY, INT64_MIN, INT64_MAX,
+	    idx);
+	t = bench_now();
+	if (xbf_catalog_sort_time(cat, idx, n) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&cat->xct_xbf));
+	bench_report("sort by time", bench_now() - t, n);
+	for (i = 1; i < n; i++)
+		if (cat->xct_time[idx[i - 1]] > cat->xct_time[idx[i]])
+			errx(EXIT_FAILURE, "Catalog isn't sorted at %zu", i);
+	printf("oldest: %s\nnewest: %s\n",
+	    xbf_catalog_str(cat, cat->xct_path[idx[0]]),
+	    xbf_catalog_str(cat, cat->xct_path[idx[n - 1]]));
+	free(idx);
+	pthread_mutex_destroy(&bc.bc_lock);
+	xbf_catalog_free(cat);
+}
+
+static int
+bench(const char *name, int argc, char **argv)
+{
+
+	if (argc < 1)
+		return (-1);
+	if (strcmp(name, "open") == 0)
+		bench_open(argc, argv);
+	else if (strcmp(name, "sync") == 0)
+		bench_sync(argv[0]);
+	else if (strcmp(name, "export") == 0)
+		bench_export(argv[0]);
+	else if (strcmp(name, "hash") == 0)
+		bench_hash(argv[0]);
+	else if (strcmp(name, "crc") == 0)
+		bench_crc(argv[0]);
+	else if (strcmp(name, "far") == 0)
+		bench_far(argv[0]);
+	else if (strcmp(name, "verify") == 0)
+		bench_verify(argv[0]);
+	else if (strcmp(name, "xbz") == 0)
+		bench_xbz(argv[0]);
+	else if (strcmp(name, "catalog") == 0)
+		bench_catalog(argv[0]);
+	else if (strcmp(name, "shared") == 0)
+		bench_shared(argv[0]);
+	else if (strcmp(name, "mcache") == 0)
+		bench_mcache(argc, argv);
+	else if (strcmp(name, "io") == 0)
+		bench_io(argc, argv);
+	else if (strcmp(name, "program") == 0)
+		bench_program(argv[0]);
+	else if (strcmp(name, "diff") == 0 && argc >= 2)
+		bench_diff(argv[0], argv[1]);
+	else
+		return (-1);
+	return (0);
+}
+
+/*
+ * -K <cache> -p: probe through the header cache, filling it.
+ */
+static void
+hcache_test(const char *path, const char *fname)
+{
+	struct xbf_hcache hc;
+	struct xbf xbf;
+
+	if (xbf_hcache_open(&hc, path, 0, XBF_HCACHE_WRITE) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&hc.hc_xbf));
+	xbf_init(&xbf);
+	if (xbf_hcache_probe(&hc, &xbf, fname) != 0)
+		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	xbf_print(&xbf);
+	printf(" Data offset: %d\n", (int)xbf_get_offset(&xbf));
+	printf("       Cache: %s\n", hc.hc_hits ? "hit" : "miss");
+	xbf_close(&xbf);
+	xbf_hcache_close(&hc);
+}
+
+static void
+usage(const char *prog)
+{
+
+	printf("%s [-vh] <filename>\n", prog);
+	printf("%s [-K <cache>] -p <filename>\n", prog);
+	printf("%s -s < <filename>\n", prog);
+	printf("%s -s <filename>\n", prog);
+	printf("%s -P <filename>\n", prog);
+	printf("%s [-J] [-j <threads>] -R <directory>\n", prog);
+	printf("%s [-j <threads>] -b catalog <directory>\n", prog);
+	printf("%s [-j <threads>] -b shared <filename>\n", prog);
+	printf("%s [-B <budget>] -b mcache <filename> ...\n", prog);
+	printf("%s -b io <filename> ...\n", prog);
+	printf("%s -W <device> [-x asis | swap32 | bitrev] [-p] <filename>\n",
+	    prog);
+	printf("%s -b program <filename>\n", prog);
+	printf("%s -T <output> [-p] <filename>\n", prog);
+	printf("%s [-K <cache>] -b open <filename> ...\n", prog);
+	printf("%s -b sync <filename>\n", prog);
+	printf("%s -b export <filename>\n", prog);
+	printf("%s [-j <threads>] -b hash <filename>\n", prog);
+	printf("%s [-j <threads>] -H <filename>\n", prog);
+	printf("%s -C <filename>\n", prog);
+	printf("%s -b crc <filename>\n", prog);
+	printf("%s -D <old> [-o <partial>] <filename>\n", prog);
+	printf("%s -b diff <old> <filename>\n", prog);
+	printf("%s -L <far>[:<frame>] <filename>\n", prog);
+	printf("%s -b far <filename>\n", prog);
+	printf("%s -V <readback> [-m <mask>] <filename>\n", prog);
+	printf("%s -b verify <filename>\n", prog);
+	printf("%s -x asis | swap32 | bitrev [-o <output>] <filename>\n", prog);
+	printf("%s -x mcs | mcs-swap32 | mcs-bitrev [-a <address>] "
+	    "[-o <output>] <filename>\n", prog);
+	printf("%s -c <output> <filename>\n", prog);
+	printf("%s -Z <output> <filename>\n", prog);
+	printf("%s -b xbz <container>\n", prog);
+	printf("%s -S <filename>\n", prog);
+	printf("%s -F <output> [-M] [-z <size>] <filename>[@<offset>] ...\n",
+	    prog);
+	printf("%s -d <directory> -r all | <number>\n", prog);
+	exit(EXIT_SUCCESS);
+}
+
+static int
+regression_test(int argc, char **argv)
+{
+	struct test *t;
+	int tnum;
 	int i;
 	test_exerr_t experr;
 	const char *neg;
@@ -723,23 +4438,104 @@ regression_test(int argc, char **argv)
 int
 main(int argc, char **argv)
 {
+	struct xbf_pkts pkts;
 	struct xbf xbf;
+	uint32_t crc;
+	size_t ncrc;
 	char *fname = NULL;
 	int o = -1;
 	char *prog = NULL;
 
 	prog = argv[0];
-	while ((o = getopt(argc, argv, "d:rv")) != -1)
+	while ((o = getopt(argc, argv, "a:B:b:Cc:D:d:F:HJj:K:L:Mm:o:PpR:rSsT:V:vW:x:Z:z:")) != -1)
 		switch (o) {
+		case 'a':
+			export_addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			mcache_budget = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bench_name = optarg;
+			break;
+		case 'C':
+			flag_C++;
+			break;
+		case 'c':
+			compress_out = optarg;
+			break;
+		case 'D':
+			diff_old = optarg;
+			break;
 		case 'd':
 			test_dir = optarg;
 			break;
+		case 'F':
+			flash_out = optarg;
+			break;
+		case 'H':
+			flag_H++;
+			break;
+		case 'J':
+			flag_J++;
+			break;
+		case 'j':
+			flag_j = atoi(optarg);
+			break;
+		case 'K':
+			hcache_path = optarg;
+			break;
+		case 'L':
+			far_query = optarg;
+			break;
+		case 'M':
+			flag_M++;
+			break;
+		case 'm':
+			verify_msk = optarg;
+			break;
+		case 'o':
+			export_out = optarg;
+			break;
+		case 'P':
+			flag_P++;
+			break;
+		case 'p':
+			flag_p++;
+			break;
+		case 'R':
+			scan_dir = optarg;
+			break;
+		case 'S':
+			flag_S++;
+			break;
+		case 's':
+			flag_s++;
+			break;
+		case 'T':
+			stamp_out = optarg;
+			break;
+		case 'V':
+			verify_rb = optarg;
+			break;
 		case 'v':
 			flag_v++;
 			break;
+		case 'W':
+			program_out = optarg;
+			break;
 		case 'r':
 			flag_r++;
 			break;
+		case 'x':
+			export_mode = optarg;
+			break;
+		case 'Z':
+			xbz_out = optarg;
+			break;
+		case 'z':
+			flash_size = strtoul(optarg, NULL, 0);
+			break;
 		case 'h':
 			usage(prog);
 			break;
@@ -759,15 +4555,102 @@ main(int argc, char **argv)
 		}
 		regression_test(argc, argv);
 	}
+	if (flag_s) {
+		if (argc > 0)
+			stream_test_file(argv[0]);
+		else
+			stream_test(STDIN_FILENO);
+		exit(EXIT_SUCCESS);
+	}
+	if (bench_name != NULL) {
+		if (bench(bench_name, argc, argv) != 0)
+			usage(prog);
+		exit(EXIT_SUCCESS);
+	}
+	if (flash_out != NULL) {
+		if (argc == 0)
+			usage(prog);
+		flash_build(argc, argv);
+		exit(EXIT_SUCCESS);
+	}
+	if (scan_dir != NULL) {
+		if (xbf_scan(scan_dir, ".bit", flag_j, scan_record,
+		    stdout) != 0)
+			err(EXIT_FAILURE, "Couldn't scan '%s'", scan_dir);
+		exit(EXIT_SUCCESS);
+	}
 
 	if (argc == 0)
 		usage(prog);
 	fname = argv[0];
 
+	if (diff_old != NULL) {
+		diff_test(diff_old, fname, export_out);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (program_out != NULL) {
+		program_test(fname, program_out);
+		exit(EXIT_SUCCESS);
+	}
+	if (stamp_out != NULL) {
+		stamp_test(fname, stamp_out);
+		exit(EXIT_SUCCESS);
+	}
+
 	xbf_init(&xbf);
+	if (flag_p && hcache_path != NULL) {
+		hcache_test(hcache_path, fname);
+		exit(EXIT_SUCCESS);
+	}
+	if (flag_p) {
+		if (xbf_probe(&xbf, fname) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		xbf_print(&xbf);
+		printf(" Data offset: %d\n", (int)xbf_get_offset(&xbf));
+		xbf_close(&xbf);
+		exit(EXIT_SUCCESS);
+	}
 	if (xbf_open(&xbf, fname) != 0)
 		errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+	if (xbz_out != NULL) {
+		xbz_test(&xbf, xbz_out);
+		xbf_close(&xbf);
+		exit(EXIT_SUCCESS);
+	}
+	if (compress_out != NULL) {
+		compress_test(&xbf, compress_out);
+		xbf_close(&xbf);
+		exit(EXIT_SUCCESS);
+	}
+	if (export_mode != NULL) {
+		export_bin(&xbf, export_mode, export_out);
+		xbf_close(&xbf);
+		exit(EXIT_SUCCESS);
+	}
 	xbf_print(&xbf);
+	if (flag_H) {
+		if (xbf_hash(&xbf, flag_j, &crc) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		printf("      CRC32C: 0x%08x\n", crc);
+	}
+	if (flag_C) {
+		if (xbf_crc_verify(&xbf, &ncrc) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		printf("  Config CRC: ok, %d checked\n", (int)ncrc);
+	}
+	if (far_query != NULL)
+		far_print(&xbf, far_query);
+	if (verify_rb != NULL)
+		verify_test(&xbf, verify_rb, verify_msk);
+	if (flag_S)
+		sync_print(&xbf);
+	if (flag_P) {
+		if (xbf_pkt_decode(&xbf, &pkts) != 0)
+			errx(EXIT_FAILURE, "%s:", xbf_errmsg(&xbf));
+		xbf_pkt_print_fp(stdout, &xbf, &pkts);
+		xbf_pkt_free(&pkts);
+	}
 	xbf_close(&xbf);
 
 	exit(EXIT_SUCCESS);
@@ -34,18 +34,54 @@
 /* Debugging */
 #define ASSERT	assert
 
+/*
+ * Why opening a bit stream failed.  The values are stable.
+ */
+enum xbf_error {
+	XBF_OK = 0,
+	XBF_E_OTHER = 1,	/* See xbf_errmsg() */
+	XBF_E_INIT = 2,		/* xbf_init() wasn't called */
+	XBF_E_OPEN = 3,		/* Couldn't open the file */
+	XBF_E_STAT = 4,
+	XBF_E_SHORT = 5,	/* File too short to be a bit stream */
+	XBF_E_MAP = 6,
+	XBF_E_NOMEM = 7,
+	XBF_E_READ = 8,
+	XBF_E_TRUNC = 9,	/* Header ends before the field */
+	XBF_E_FIELDLEN = 10,	/* Fixed size field has the wrong length */
+	XBF_E_MAGIC = 11,	/* Field key missing */
+	XBF_E_STRLEN = 12,	/* String field longer than the header */
+	XBF_E_STRTERM = 13,	/* String field isn't terminated with 0 */
+	XBF_E_PAYLOAD = 14,	/* Payload length past the end of file */
+	XBF_E_MAX
+};
+
+/*
+ * The message is only formatted by xbf_errmsg(), from the numbers.
+ */
 #define _XBF_ERRMSG_LEN	1024
 struct _xbf_err {
-	char	 _xbf_errmsg[_XBF_ERRMSG_LEN];
-	char	 _xbf_errsrc[_XBF_ERRMSG_LEN / 8];
+	int		 _xbf_code;	/* enum xbf_error */
+	int		 _xbf_field;	/* Header field 1-7, or errno */
+	uint32_t	 _xbf_val;	/* What was found there */
+	size_t		 _xbf_off;	/* Where, from the start of file */
+	const char	*_xbf_func;
+	int		 _xbf_line;
+	int		 _xbf_fmted;	/* _xbf_errmsg holds: 1 message, 2 +src */
+	char		 _xbf_errmsg[_XBF_ERRMSG_LEN];
 };
 
+struct xbf_faridx;
+struct xbf_xbz;
+struct xbf_shared;
+
 /*
  * Structure for representing Xilinx Bitstream File Header
  */
 struct xbf {
 	void		*_xbf_mem;
 	size_t		 _xbf_memsize;
+	size_t		 _xbf_filesize;
 	struct _xbf_err	 _xbf_err;
 	unsigned	 _xbf_flags;
 	const char	*xbf_fname;
@@ -55,13 +91,24 @@ struct xbf {
 	const char	*xbf_date;
 	uint32_t	 xbf_len;
 	const char	*xbf_data;
+	size_t		 xbf_offset;
+	struct xbf_faridx *_xbf_faridx;	/* Built on first use */
+	struct xbf_xbz	*_xbf_xbz;	/* Opened from a container */
+	struct xbf_shared *_xbf_shared;	/* This is a view of a shared one */
 };
 #define XBF_FLAG_INITIALIZED	(1 << 0)
 #define XBF_FLAG_MMAPED		(1 << 1)
+#define XBF_FLAG_ALLOCED	(1 << 2)	/* _xbf_mem came from malloc() */
+#define XBF_FLAG_HDRONLY	(1 << 3)	/* Only the header is in memory */
+#define XBF_FLAG_OPENED		(1 << 4)	/* The header was parsed */
+#define XBF_FLAG_ZIN		(1 << 5)	/* Probed from a .gz or .zst */
 
 /* Typical size of a header */
 #define XBF_HDR_SIZE 72
 
+/* How much of the file xbf_probe() reads to find the header */
+#define XBF_PROBE_SIZE 1024
+
 /*
  * Keep this function in here and don't forget to modify it
  * if 'struct xbf' gets modified.
@@ -72,7 +119,10 @@ xbf_init(struct xbf *xbf)
 
 	xbf->_xbf_mem = NULL;
 	xbf->_xbf_memsize = 0;
-	memset(&xbf->_xbf_err, 0, sizeof(xbf->_xbf_err));
+	xbf->_xbf_filesize = 0;
+	xbf->_xbf_err._xbf_code = XBF_OK;
+	xbf->_xbf_err._xbf_fmted = 0;
+	xbf->_xbf_err._xbf_errmsg[0] = '\0';
 	xbf->_xbf_flags = XBF_FLAG_INITIALIZED;
 
 	xbf->xbf_fname = NULL;
@@ -82,6 +132,10 @@ xbf_init(struct xbf *xbf)
 	xbf->xbf_date = NULL;
 	xbf->xbf_len = 0;
 	xbf->xbf_data = NULL;
+	xbf->xbf_offset = 0;
+	xbf->_xbf_faridx = NULL;
+	xbf->_xbf_xbz = NULL;
+	xbf->_xbf_shared = NULL;
 }
 
 /*
@@ -94,35 +148,565 @@ xbf_initialized(struct xbf *xbf)
 	return ((xbf->_xbf_flags & XBF_FLAG_INITIALIZED) != 0);
 }
 
+/*
+ * A bit stream shared by many threads, see xbf_share().  The views
+ * handed out by xbf_shared_get() point back here.
+ */
+struct xbf_shared {
+	struct xbf	 xs_xbf;	/* Owns the mapping and the indexes */
+	unsigned	 xs_refs;
+	char		*xs_fname;	/* Freed with the handle, if set */
+};
+
+/*
+ * Context that holds state built on first use: the shared one for
+ * views.
+ */
+static inline struct xbf *
+_xbf_owner(struct xbf *xbf)
+{
+
+	return ((xbf->_xbf_shared != NULL) ? &xbf->_xbf_shared->xs_xbf : xbf);
+}
+
 #define xbf_assert(xbf) do {						\
 	ASSERT(xbf != NULL && "xbf can't be NULL here");		\
 	ASSERT(xbf_initialized(xbf) != 0 &&				\
 	    "xbf_initialized() must be called");			\
 } while (0)
 
-int xbf_open_mem(struct xbf *xbf, void *mem, size_t mem_size);
-int xbf_open(struct xbf *xbf, const char *fname);
+enum xbf_error _xbf_setup(struct xbf *xbf);
+int _xbf_write(struct xbf *xbf, int fd, const void *buf, size_t len);
+int _xbf_open_source(struct xbf *xbf);
+ssize_t _xbf_hdr_build(struct xbf *xbf, uint32_t len, char *buf,
+    size_t size);
+enum xbf_error xbf_open_mem(struct xbf *xbf, void *mem, size_t mem_size);
+enum xbf_error xbf_open(struct xbf *xbf, const char *fname);
+enum xbf_error xbf_probe(struct xbf *xbf, const char *fname);
+enum xbf_error _xbf_open_hdr(struct xbf *xbf, const char *fname, void *mem,
+    size_t mem_size, size_t file_size);
+int xbf_open_batch(struct xbf *arr, const char **paths, size_t n, int flags);
+#define XBF_BATCH_NOURING	(1 << 0)	/* Use the thread pool */
+
+/*
+ * How xbf_open_opts() brings the file into memory, see xbf_io.c
+ */
+struct xbf_open_opts {
+	int		 xo_io;		/* XBF_IO_* */
+	void		*xo_buf;	/* Caller's buffer for the reads */
+	size_t		 xo_bufsize;
+};
+#define XBF_IO_MMAP	0	/* Mapped, faulted in on use, as xbf_open() */
+#define XBF_IO_POPULATE	1	/* Mapped and faulted in up front */
+#define XBF_IO_PREAD	2	/* Read into xo_buf or a malloc()ed buffer */
+#define XBF_IO_DIRECT	3	/* Read with O_DIRECT, past the page cache */
+#define XBF_IO_MAX	4
+enum xbf_error xbf_open_opts(struct xbf *xbf, const char *fname,
+    const struct xbf_open_opts *xo);
 int xbf_close(struct xbf *xbf);
+struct xbf_shared *xbf_share(struct xbf *xbf);
+void xbf_shared_get(struct xbf_shared *xs, struct xbf *view);
+void xbf_shared_put(struct xbf_shared *xs);
 const char *xbf_errmsg(struct xbf *xbf);
+const char *xbf_errmsg_r(const struct xbf *xbf, char *buf, size_t size);
+enum xbf_error xbf_errcode(struct xbf *xbf, int *field, size_t *off);
+const char *xbf_strerror(enum xbf_error code);
 struct xbf *_xbf_err(const char *func, int lineno, struct xbf *xbf,
     const char *fmt, ...);
 int _xbf_erri(const char *func, int lineno, struct xbf *xbf,
     const char *fmt, ...);
+enum xbf_error _xbf_errc(const char *func, int lineno, struct xbf *xbf,
+    enum xbf_error code, int field, uint32_t val, size_t off);
 size_t xbf_get_len(struct xbf *xbf);
 const void *xbf_get_data(struct xbf *xbf);
+size_t xbf_get_offset(struct xbf *xbf);
 const char *xbf_get_partname(struct xbf *xbf);
 const char *xbf_get_date(struct xbf *xbf);
 const char *xbf_get_time(struct xbf *xbf);
 const char *xbf_get_ncdname(struct xbf *xbf);
 const char *xbf_get_fname(struct xbf *xbf);
+ssize_t xbf_pread(struct xbf *xbf, void *buf, size_t len, size_t off);
 void xbf_print_fp(FILE *fp, struct xbf *xp);
 void xbf_print(struct xbf *xbf);
 int xbf_opened(struct xbf *xbf);
 
+/*
+ * Push parser for streamed bit streams, see xbf_feed.c
+ */
+typedef int xbf_feed_hdr_cb_t(void *arg, struct xbf *xbf);
+typedef int xbf_feed_data_cb_t(void *arg, const void *buf, size_t len);
+
+struct xbf_feed {
+	struct xbf	 xf_xbf;
+	xbf_feed_hdr_cb_t *xf_hdr_cb;
+	xbf_feed_data_cb_t *xf_data_cb;
+	void		*xf_arg;
+	int		 xf_state;
+	size_t		 xf_need;	/* Bytes missing from current field */
+	size_t		 xf_fstart;	/* Where current field starts */
+	size_t		 xf_hdrlen;
+	uint32_t	 xf_left;	/* Payload bytes still to come */
+	size_t		 xf_trailer;	/* Bytes seen after the payload */
+	char		 xf_hdr[XBF_PROBE_SIZE];
+};
+
+void xbf_feed_init(struct xbf_feed *xf, xbf_feed_hdr_cb_t *hdr_cb,
+    xbf_feed_data_cb_t *data_cb, void *arg);
+int xbf_feed(struct xbf_feed *xf, const void *buf, size_t len);
+int xbf_feed_end(struct xbf_feed *xf);
+
+/*
+ * Cache of opened bit streams, see xbf_mcache.c
+ */
+struct xbf_mcache_stats {
+	size_t		 ms_budget;	/* Bytes that may stay mapped */
+	size_t		 ms_bytes;
+	size_t		 ms_nentries;
+	size_t		 ms_hits;
+	size_t		 ms_misses;
+	size_t		 ms_evictions;
+	size_t		 ms_stale;	/* Dropped since the file changed */
+};
+
+struct xbf_mcache_priv;
+struct xbf_mcache {
+	struct xbf_mcache_stats mc_stats;
+	struct xbf_mcache_priv	*_mc_priv;
+};
+
+int xbf_mcache_init(struct xbf_mcache *mc, size_t budget);
+enum xbf_error xbf_mcache_open(struct xbf_mcache *mc, struct xbf *view,
+    const char *fname);
+void xbf_mcache_stats(struct xbf_mcache *mc, struct xbf_mcache_stats *ms);
+void xbf_mcache_print_fp(FILE *fp, struct xbf_mcache *mc);
+void xbf_mcache_free(struct xbf_mcache *mc);
+
+/*
+ * Persistent header cache shared between processes, see xbf_hcache.c
+ */
+struct xbf_hcache {
+	struct xbf	 hc_xbf;	/* Errors about the cache itself */
+	int		 hc_fd;
+	void		*hc_map;	/* NULL while the cache is empty */
+	size_t		 hc_maplen;
+	int		 hc_writer;	/* We hold the write lock */
+	size_t		 hc_hits;
+	size_t		 hc_misses;
+};
+
+#define XBF_HCACHE_WRITE	(1 << 0)	/* Create and fill it */
+int xbf_hcache_open(struct xbf_hcache *hc, const char *path, uint32_t cap,
+    int flags);
+int xbf_hcache_probe(struct xbf_hcache *hc, struct xbf *xbf,
+    const char *fname);
+void xbf_hcache_close(struct xbf_hcache *hc);
+
+/*
+ * Device families, as far as the configuration logic is concerned
+ */
+#define XBF_FAM_UNKNOWN	0
+#define XBF_FAM_V2	1	/* Virtex, Virtex-II (Pro), Spartan-II/3 */
+#define XBF_FAM_S6	2	/* Spartan-6 */
+#define XBF_FAM_V5	3	/* Virtex-4, Virtex-5 */
+#define XBF_FAM_V6	4	/* Virtex-6 */
+#define XBF_FAM_7	5	/* 7 Series */
+#define XBF_FAM_US	6	/* UltraScale */
+#define XBF_FAM_USP	7	/* UltraScale+ */
+
+int xbf_get_family(struct xbf *xbf);
+
+/*
+ * Marker words searched for in the payload, see xbf_sync.c
+ */
+#define XBF_SYNC_WORD		0xaa995566
+#define XBF_DUMMY_WORD		0xffffffff
+#define XBF_BUSWIDTH_WORD0	0x000000bb
+#define XBF_BUSWIDTH_WORD1	0x11220044
+
+/* SIMD kernels; _xbf_cpu_has() tells which ones the CPU can run */
+#define XBF_KERN_SCALAR	0
+#define XBF_KERN_SSE2	1
+#define XBF_KERN_SSSE3	2
+#define XBF_KERN_SSE42	3
+#define XBF_KERN_AVX2	4
+
+int _xbf_cpu_has(int kern);
+size_t _xbf_sync_find_kern(int kern, const void *buf, size_t len,
+    uint32_t word, size_t *offs, size_t max);
+size_t xbf_sync_find(const void *buf, size_t len, uint32_t word,
+    size_t *offs, size_t max);
+size_t _xbf_dummy_skip_kern(int kern, const void *buf, size_t len);
+size_t xbf_dummy_skip(const void *buf, size_t len);
+size_t xbf_get_syncs(struct xbf *xbf, size_t *offs, size_t max);
+ssize_t xbf_get_buswidth_off(struct xbf *xbf);
+
+/*
+ * Raw .bin images, see xbf_export.c
+ */
+#define XBF_EXPORT_ASIS		0	/* Payload as it is */
+#define XBF_EXPORT_SWAP32	1	/* Bytes of every 32-bit word swapped */
+#define XBF_EXPORT_BITREV	2	/* Bits of every byte reversed */
+
+void _xbf_export_conv_kern(int kern, int mode, void *dst, const void *src,
+    size_t len);
+void xbf_export_conv(int mode, void *dst, const void *src, size_t len);
+int xbf_export_bin(struct xbf *xbf, int fd, int mode);
+int xbf_export_mcs(struct xbf *xbf, int fd, uint32_t addr, int mode);
+
+/*
+ * Sending the payload to a configuration device, see xbf_program.c
+ */
+struct xbf_program_opts {
+	int		 xp_mode;	/* XBF_EXPORT_*, what the device wants */
+	int		 xp_flags;	/* XBF_PROG_* */
+	size_t		 xp_chunk;	/* Bytes per transfer, 0 for default */
+	/* Filled in by xbf_program_fd() */
+	int		 xp_method;	/* XBF_PROG_M_* */
+	uint64_t	 xp_bytes;
+	double		 xp_secs;
+};
+#define XBF_PROG_CHUNK		(1024 * 1024)
+#define XBF_PROG_NOZEROCOPY	(1 << 0)	/* Don't use sendfile/splice */
+#define XBF_PROG_DONTNEED	(1 << 1)	/* Drop the pages once sent */
+#define XBF_PROG_M_SENDFILE	1	/* Straight from the file */
+#define XBF_PROG_M_SPLICE	2	/* Same, into a pipe */
+#define XBF_PROG_M_WRITE	3	/* write() from memory */
+#define XBF_PROG_M_CONV		4	/* Converted, written behind */
+
+int xbf_program_fd(struct xbf *xbf, int fd, struct xbf_program_opts *xp);
+
+/*
+ * Writing .bit files, see xbf_build.c
+ */
+struct xbf_build {
+	const char	*xb_ncdname;
+	const char	*xb_partname;
+	const char	*xb_date;	/* "YYYY/MM/DD", now if NULL */
+	const char	*xb_time;	/* "HH:MM:SS", now if NULL */
+	const void	*xb_data;	/* Payload in memory, */
+	int		 xb_srcfd;	/* or at xb_srcoff in this file */
+	uint64_t	 xb_srcoff;
+	uint32_t	 xb_len;
+	int		 _xb_ownfd;	/* xb_srcfd is closed by xbf_build_free() */
+	struct xbf	*_xb_xbz;	/* xb_srcfd is this probed container */
+	char		 _xb_date[11];
+	char		 _xb_time[9];
+	struct xbf	 xb_xbf;	/* Errors are reported in here */
+};
+
+void xbf_build_init(struct xbf_build *xb, const char *ncdname,
+    const char *partname);
+void xbf_build_data(struct xbf_build *xb, const void *data, uint32_t len);
+void xbf_build_source(struct xbf_build *xb, int fd, uint64_t off,
+    uint32_t len);
+int xbf_build_from(struct xbf_build *xb, struct xbf *xbf);
+int xbf_build_write(struct xbf_build *xb, int fd);
+void xbf_build_free(struct xbf_build *xb);
+
+/*
+ * Payload checksums, see xbf_hash.c
+ */
+uint32_t _xbf_crc32c_kern(int kern, uint32_t crc, const void *buf,
+    size_t len);
+uint32_t xbf_crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t xbf_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+uint32_t _xbf_crc32c_shift(uint32_t crc, uint64_t nbits);
+int xbf_hash(struct xbf *xbf, int nthreads, uint32_t *digest);
+
+/*
+ * Configuration packets, see xbf_pkt.c.  Offsets are relative to
+ * xbf_data and point at the packet header; data words follow it.
+ */
+struct xbf_pkt {
+	uint32_t	xp_off;
+	uint32_t	xp_wcnt;	/* Number of data words */
+	uint16_t	xp_reg;		/* Register address */
+	uint8_t		xp_type;	/* 1, 2 or XBF_PKT_SYNC */
+	uint8_t		xp_op;		/* XBF_PKT_OP_* */
+};
+#define XBF_PKT_SYNC		0	/* Sync word, not a packet */
+#define XBF_PKT_OP_NOOP		0
+#define XBF_PKT_OP_READ		1
+#define XBF_PKT_OP_WRITE	2
+
+struct xbf_pkts {
+	struct xbf_pkt	*xp_pkts;
+	size_t		 xp_npkts;
+	size_t		 xp_cap;
+};
+
+/* Registers common to all supported families */
+#define XBF_REG_CRC	0
+#define XBF_REG_FAR	1
+#define XBF_REG_FDRI	2
+#define XBF_REG_FDRO	3
+#define XBF_REG_CMD	4
+#define XBF_REG_MFWR	10
+#define XBF_REG_IDCODE	12	/* Virtex-4 and later */
+#define XBF_REG_WBSTAR	16
+
+/* Commands written to XBF_REG_CMD */
+#define XBF_CMD_NULL	0
+#define XBF_CMD_WCFG	1
+#define XBF_CMD_MFW	2
+#define XBF_CMD_LFRM	3
+#define XBF_CMD_RCFG	4
+#define XBF_CMD_START	5
+#define XBF_CMD_RCRC	7
+#define XBF_CMD_GRESTORE 10
+#define XBF_CMD_DESYNC	13
+#define XBF_CMD_IPROG	15
+
+int xbf_pkt_decode(struct xbf *xbf, struct xbf_pkts *pk);
+void xbf_pkt_free(struct xbf_pkts *pk);
+uint32_t xbf_pkt_word(struct xbf *xbf, const struct xbf_pkt *p, size_t i);
+const char *xbf_pkt_regname(struct xbf *xbf, unsigned reg);
+const char *xbf_pkt_cmdname(uint32_t cmd);
+void xbf_pkt_print_fp(FILE *fp, struct xbf *xbf, struct xbf_pkts *pk);
+
+/*
+ * FDRI bursts, see xbf_frame.c.  Frames of a burst follow the frame
+ * ``xb_first'' frames after the FAR written last.
+ */
+struct xbf_burst {
+	uint32_t	xb_far;		/* FAR written last */
+	uint32_t	xb_first;	/* Frames after it */
+	uint32_t	xb_off;		/* Payload offset of the frame data */
+	uint32_t	xb_nframes;
+	int		xb_farok;	/* Was FAR written after the sync? */
+};
+
+struct xbf_bursts {
+	struct xbf_burst *xb_bursts;
+	size_t		 xb_nbursts;
+	size_t		 xb_cap;
+	unsigned	 xb_flen;	/* Words per frame */
+};
+
+unsigned xbf_get_frame_words(struct xbf *xbf);
+int _xbf_frame_bursts(struct xbf *xbf, struct xbf_pkts *pk,
+    struct xbf_bursts *xb);
+void _xbf_frame_bursts_free(struct xbf_bursts *xb);
+
+/*
+ * Frame address index: bursts sorted by (FAR, first frame), one array
+ * per field, plus a directory of where every range of FARs starts.
+ */
+struct xbf_faridx {
+	size_t		 fi_n;
+	uint32_t	*fi_far;
+	uint32_t	*fi_first;
+	uint32_t	*fi_off;
+	uint32_t	*fi_nframes;
+	uint32_t	*fi_dir;	/* fi_ndir + 1 entries */
+	size_t		 fi_ndir;
+	unsigned	 fi_shift;	/* FAR >> fi_shift is the bucket */
+	unsigned	 fi_flen;
+};
+
+int xbf_far_index(struct xbf *xbf);
+ssize_t xbf_far_lookup(struct xbf *xbf, uint32_t far, uint32_t idx);
+void _xbf_far_index_free(struct xbf *xbf);
+
+/*
+ * Frame differences, see xbf_diff.c
+ */
+struct xbf_diff_range {
+	uint32_t	xdr_far;	/* FAR of the burst */
+	uint32_t	xdr_first;	/* First changed frame after it */
+	uint32_t	xdr_nframes;
+	uint32_t	xdr_off;	/* Offset of the first one in the payload */
+	uint32_t	xdr_burst;
+	int		xdr_farok;
+};
+
+struct xbf_diff {
+	struct xbf_diff_range *xd_ranges;
+	size_t		 xd_nranges;
+	size_t		 xd_cap;
+	size_t		 xd_nframes;	/* Frames compared */
+	size_t		 xd_nchanged;
+	unsigned	 xd_flen;
+	struct xbf_bursts xd_bursts;	/* Of the new bit stream */
+};
+
+int _xbf_diff_kern(int kern, struct xbf *old, struct xbf *new,
+    struct xbf_diff *xd);
+int xbf_diff(struct xbf *old, struct xbf *new, struct xbf_diff *xd);
+int xbf_diff_write(struct xbf *new, struct xbf_diff *xd, int fd);
+void xbf_diff_print_fp(FILE *fp, struct xbf_diff *xd);
+void xbf_diff_free(struct xbf_diff *xd);
+
+/*
+ * gzip and zstd compressed input, see xbf_zin.c
+ */
+int _xbf_zin_is(const void *mem, size_t len);
+int _xbf_zin_open(struct xbf *xbf, const char *fname, void *mem,
+    size_t size);
+int _xbf_zin_probe(struct xbf *xbf, const char *fname, void *mem,
+    size_t len, size_t size);
+int xbf_feed_file(struct xbf_feed *xf, const char *fname);
+
+/*
+ * Seekable compressed containers, see xbf_xbz.c
+ */
+#define XBF_XBZ_BLOCK	(64 * 1024)
+
+int _xbf_xbz_is(const void *mem, size_t len);
+int _xbf_xbz_open(struct xbf *xbf, const char *fname, void *mem,
+    size_t size);
+int _xbf_xbz_probe(struct xbf *xbf, const char *fname, void *mem,
+    size_t len, size_t size);
+int _xbf_xbz_source(struct xbf *xbf);
+ssize_t _xbf_xbz_pread(struct xbf *xbf, int fd, void *buf, size_t len,
+    size_t off);
+void _xbf_xbz_free(struct xbf *xbf);
+int xbf_xbz_write(struct xbf *xbf, int fd, size_t blksize);
+
+/*
+ * Readback verification, see xbf_verify.c
+ */
+struct xbf_verify_bad {
+	uint32_t	xvb_frame;	/* Frame number in the readback */
+	uint32_t	xvb_off;	/* Payload offset of the expected frame */
+	uint32_t	xvb_far;	/* FAR of its burst */
+	uint32_t	xvb_first;	/* Frames after it */
+	int		xvb_farok;
+};
+
+struct xbf_verify {
+	struct xbf	*xv_xbf;	/* Expected frames */
+	struct xbf	*xv_msk;	/* Mask, or NULL */
+	struct xbf_bursts xv_exp;
+	struct xbf_bursts xv_mask;
+	size_t		 xv_burst;	/* Where the readback is */
+	size_t		 xv_frame;
+	size_t		 xv_fpos;	/* Bytes of the frame compared */
+	size_t		 xv_mburst;	/* Same frame in the mask */
+	size_t		 xv_mframe;
+	size_t		 xv_skip;	/* Readback bytes still to drop */
+	size_t		 xv_nframes;	/* Frames compared */
+	size_t		 xv_total;	/* Frames expected */
+	struct xbf_verify_bad *xv_bad;
+	size_t		 xv_nbad;
+	size_t		 xv_cap;
+	int		 xv_curbad;	/* Current frame is in xv_bad already */
+	int		 xv_kern;
+};
+#define XBF_VERIFY_PAD	(1 << 0)	/* Readback starts with a pad frame */
+
+int _xbf_verify_init_kern(int kern, struct xbf_verify *xv, struct xbf *xbf,
+    struct xbf *msk, int flags);
+int xbf_verify_init(struct xbf_verify *xv, struct xbf *xbf, struct xbf *msk,
+    int flags);
+int xbf_verify_update(struct xbf_verify *xv, const void *buf, size_t len);
+int xbf_verify_end(struct xbf_verify *xv);
+void xbf_verify_print_fp(FILE *fp, struct xbf_verify *xv);
+void xbf_verify_free(struct xbf_verify *xv);
+
+/*
+ * Compression with multiple frame writes, see xbf_compress.c
+ */
+struct xbf_compress {
+	size_t		 xc_nframes;	/* Frames at known addresses */
+	size_t		 xc_nunique;	/* Different ones among them */
+	size_t		 xc_ncopied;	/* Written with MFWR */
+	size_t		 xc_oldlen;	/* Payload lengths */
+	size_t		 xc_newlen;
+};
+
+int xbf_compress(struct xbf *xbf, int fd, struct xbf_compress *xc);
+void xbf_compress_print_fp(FILE *fp, struct xbf_compress *xc);
+
+/*
+ * Configuration CRC, see xbf_crc.c
+ */
+int _xbf_crc_verify_kern(int kern, struct xbf *xbf, size_t *nchecked);
+int xbf_crc_verify(struct xbf *xbf, size_t *nchecked);
+uint32_t _xbf_crc_update(int fam, uint32_t crc, unsigned reg,
+    const void *words, size_t n);
+
+/*
+ * Flash images made of several bit streams, see xbf_flash.c
+ */
+struct xbf_flash_img {
+	struct xbf	*xfi_xbf;
+	uint32_t	 xfi_off;	/* Where the payload goes */
+	uint32_t	 xfi_len;
+	int		 xfi_flags;
+};
+#define XBF_FLASH_UPDATE	(1 << 0)	/* MultiBoot jumps here */
+
+struct xbf_flash {
+	struct xbf	 xfl_xbf;	/* Error messages end up here */
+	struct xbf_flash_img *xfl_imgs;
+	size_t		 xfl_nimgs;
+	uint32_t	 xfl_size;	/* Pad up to that, if not 0 */
+	int		 xfl_flags;
+	size_t		 xfl_ncopied;	/* Images copied in the kernel */
+	size_t		 xfl_hdrlen;
+	uint32_t	 xfl_hdr[16];	/* MultiBoot header */
+};
+#define XBF_FLASH_MULTIBOOT	(1 << 0)
+
+void xbf_flash_init(struct xbf_flash *xfl, uint32_t size, int flags);
+int xbf_flash_add(struct xbf_flash *xfl, struct xbf *xbf, uint32_t off,
+    int flags);
+int xbf_flash_write(struct xbf_flash *xfl, int fd);
+void xbf_flash_print_fp(FILE *fp, struct xbf_flash *xfl);
+void xbf_flash_free(struct xbf_flash *xfl);
+
+/*
+ * Compact catalog of parsed headers, see xbf_catalog.c
+ */
+struct xbf_catalog {
+	struct xbf	 xct_xbf;	/* Errors */
+	size_t		 xct_n;
+	size_t		 xct_cap;
+	/* One entry per header; strings are offsets into xct_arena */
+	uint32_t	*xct_path;
+	uint32_t	*xct_ncdname;
+	uint32_t	*xct_partname;
+	int64_t		*xct_time;	/* Seconds since the epoch */
+	uint32_t	*xct_len;
+	uint8_t		*xct_family;
+	char		*xct_arena;
+	size_t		 xct_arenalen;
+	size_t		 xct_arenacap;
+	uint32_t	*xct_htab;	/* Interned strings, offset + 1 */
+	size_t		 xct_hsize;
+	size_t		 xct_nstr;
+};
+
+#define XBF_CATALOG_NOTIME	INT64_MIN	/* Date or time unreadable */
+#define XBF_CATALOG_ANY		UINT32_MAX	/* Any part */
+
+int xbf_catalog_init(struct xbf_catalog *cat);
+ssize_t xbf_catalog_add(struct xbf_catalog *cat, struct xbf *xbf);
+const char *xbf_catalog_str(struct xbf_catalog *cat, uint32_t off);
+ssize_t xbf_catalog_find_str(struct xbf_catalog *cat, const char *s);
+size_t xbf_catalog_filter(struct xbf_catalog *cat, uint32_t part,
+    int64_t from, int64_t to, uint32_t *idx);
+int xbf_catalog_sort_time(struct xbf_catalog *cat, uint32_t *idx, size_t n);
+size_t xbf_catalog_memsize(struct xbf_catalog *cat);
+void xbf_catalog_free(struct xbf_catalog *cat);
+int64_t _xbf_catalog_time(const char *date, const char *time);
+
+/*
+ * Parallel scanning of directory trees, see xbf_scan.c
+ */
+typedef void xbf_scan_cb_t(void *arg, const char *path, struct xbf *xbf,
+    int error);
+int xbf_scan(const char *path, const char *suffix, int nthreads,
+    xbf_scan_cb_t *cb, void *arg);
+
 #define xbf_err(xbf, fmt, ...)						\
 	(_xbf_err((__func__), (__LINE__), (xbf), (fmt), ##__VA_ARGS__))
 #define xbf_erri(xbf, fmt, ...)						\
 	(_xbf_erri((__func__), (__LINE__), (xbf), (fmt), ##__VA_ARGS__))
+#define xbf_errc(xbf, code, field, val, off)				\
+	(_xbf_errc((__func__), (__LINE__), (xbf), (code), (field),	\
+	    (val), (off)))
 
 #ifndef strlcat
 size_t strlcat(char * __restrict dst, const char * __restrict src, size_t siz);
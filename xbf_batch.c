@@ -0,0 +1,643 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Opening many bit stream headers at once.
+ *
+ * On Linux the open, statx, read and close of every file go through an
+ * io_uring, so a single thread keeps up to BATCH_INFLIGHT files moving
+ * through the pipeline with one system call per round.  The ring is
+ * driven with raw system calls, so there is no liburing dependency.
+ * When io_uring isn't there (old kernel, seccomp, other OS) or
+ * XBF_BATCH_NOURING is passed, a pool of threads does xbf_probe() on
+ * each file instead.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* struct statx */
+#endif
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+#define BATCH_MAXTHREADS	32
+
+struct batch_pool {
+	struct xbf	*bp_arr;
+	const char	**bp_paths;
+	size_t		 bp_n;
+	size_t		 bp_next;
+	size_t		 bp_nerr;
+};
+
+static void *
+batch_pool_main(void *arg)
+{
+	struct batch_pool *bp = arg;
+	size_t i;
+
+	for (;;) {
+		i = __atomic_fetch_add(&bp->bp_next, 1, __ATOMIC_RELAXED);
+		if (i >= bp->bp_n)
+			break;
+		if (xbf_probe(&bp->bp_arr[i], bp->bp_paths[i]) != 0)
+			__atomic_add_fetch(&bp->bp_nerr, 1, __ATOMIC_RELAXED);
+	}
+	return (NULL);
+}
+
+/*
+ * Fallback: the headers are small, so the work is all system call
+ * latency and it pays to have more threads than CPUs.
+ */
+static int
+batch_pool(struct xbf *arr, const char **paths, size_t n)
+{
+	pthread_t thr[BATCH_MAXTHREADS];
+	struct batch_pool bp;
+	long ncpu;
+	int i, nthr;
+
+	memset(&bp, 0, sizeof(bp));
+	bp.bp_arr = arr;
+	bp.bp_paths = paths;
+	bp.bp_n = n;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthr = (ncpu > 0) ? (int)ncpu * 4 : 4;
+	if (nthr > BATCH_MAXTHREADS)
+		nthr = BATCH_MAXTHREADS;
+	if ((size_t)nthr > n)
+		nthr = (int)n;
+	for (i = 0; i < nthr; i++)
+		if (pthread_create(&thr[i], NULL, batch_pool_main, &bp) != 0)
+			break;
+	nthr = i;
+	/* Whatever the threads didn't pick up is done right here */
+	(void)batch_pool_main(&bp);
+	for (i = 0; i < nthr; i++)
+		pthread_join(thr[i], NULL);
+	return ((bp.bp_nerr == 0) ? 0 : -1);
+}
+
+#ifdef __linux__
+#define BATCH_RING	256
+#define BATCH_INFLIGHT	64
+
+/* Room for the open and statx of new files plus a read or close of each */
+#if BATCH_RING < 3 * BATCH_INFLIGHT
+#error "BATCH_RING is too small for BATCH_INFLIGHT files"
+#endif
+
+/* What a completion belongs to, kept in the low bits of user_data */
+#define BOP_OPEN	0
+#define BOP_STATX	1
+#define BOP_READ	2
+#define BOP_CLOSE	3
+#define BOP_SHIFT	2
+#define BOP_MASK	((1 << BOP_SHIFT) - 1)
+
+struct uring {
+	int		 ur_fd;
+	unsigned	*ur_sq_head;
+	unsigned	*ur_sq_tail;
+	unsigned	*ur_sq_mask;
+	unsigned	*ur_sq_array;
+	struct io_uring_sqe *ur_sqes;
+	unsigned	*ur_cq_head;
+	unsigned	*ur_cq_tail;
+	unsigned	*ur_cq_mask;
+	struct io_uring_cqe *ur_cqes;
+	void		*ur_sq_ptr;
+	size_t		 ur_sq_len;
+	void		*ur_cq_ptr;
+	size_t		 ur_cq_len;
+	size_t		 ur_sqe_len;
+	unsigned	 ur_tosubmit;
+	unsigned	 ur_pending;	/* Submitted, not completed yet */
+};
+
+struct batch_ent {
+	struct statx	 be_stx;
+	void		*be_buf;
+	int		 be_fd;
+	int		 be_left;	/* open and statx still to come */
+	enum xbf_error	 be_err;	/* Failed in the pipeline */
+	int		 be_errno;
+};
+
+static int
+uring_setup(struct uring *ur, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ur, 0, sizeof(*ur));
+	memset(&p, 0, sizeof(p));
+	ur->ur_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ur->ur_fd < 0)
+		return (-1);
+
+	ur->ur_sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->ur_cq_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_cq_len > ur->ur_sq_len)
+			ur->ur_sq_len = ur->ur_cq_len;
+		ur->ur_cq_len = 0;
+	}
+	ur->ur_sq_ptr = mmap(NULL, ur->ur_sq_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING);
+	if (ur->ur_sq_ptr == MAP_FAILED)
+		goto fail;
+	if (ur->ur_cq_len == 0)
+		ur->ur_cq_ptr = ur->ur_sq_ptr;
+	else {
+		ur->ur_cq_ptr = mmap(NULL, ur->ur_cq_len, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, ur->ur_fd, IORING_OFF_CQ_RING);
+		if (ur->ur_cq_ptr == MAP_FAILED)
+			goto fail_sq;
+	}
+	ur->ur_sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->ur_sqes = mmap(NULL, ur->ur_sqe_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = ur->ur_sq_ptr;
+	cq = ur->ur_cq_ptr;
+	ur->ur_sq_head = (unsigned *)(sq + p.sq_off.head);
+	ur->ur_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ur->ur_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur->ur_sq_array = (unsigned *)(sq + p.sq_off.array);
+	ur->ur_cq_head = (unsigned *)(cq + p.cq_off.head);
+	ur->ur_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ur->ur_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return (0);
+
+fail_cq:
+	if (ur->ur_cq_len != 0)
+		(void)munmap(ur->ur_cq_ptr, ur->ur_cq_len);
+fail_sq:
+	(void)munmap(ur->ur_sq_ptr, ur->ur_sq_len);
+fail:
+	(void)close(ur->ur_fd);
+	return (-1);
+}
+
+static void
+uring_free(struct uring *ur)
+{
+
+	(void)munmap(ur->ur_sqes, ur->ur_sqe_len);
+	if (ur->ur_cq_len != 0)
+		(void)munmap(ur->ur_cq_ptr, ur->ur_cq_len);
+	(void)munmap(ur->ur_sq_ptr, ur->ur_sq_len);
+	(void)close(ur->ur_fd);
+}
+
+/*
+ * Does the kernel know all the opcodes we need?  OPENAT and STATX
+ * showed up in 5.6.
+ */
+static int
+uring_supported(struct uring *ur)
+{
+	static const int ops[] = {
+		IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+		IORING_OP_CLOSE
+	};
+	struct io_uring_probe *pr;
+	size_t len;
+	int ok, i;
+
+	len = sizeof(*pr) + 256 * sizeof(struct io_uring_probe_op);
+	pr = calloc(1, len);
+	if (pr == NULL)
+		return (0);
+	ok = (syscall(__NR_io_uring_register, ur->ur_fd,
+	    IORING_REGISTER_PROBE, pr, 256) == 0);
+	for (i = 0; ok && i < (int)(sizeof(ops) / sizeof(ops[0])); i++)
+		if (ops[i] > pr->last_op ||
+		    (pr->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+			ok = 0;
+	free(pr);
+	return (ok);
+}
+
+/*
+ * Free SQEs, counting the ones the kernel hasn't consumed yet.
+ */
+static unsigned
+uring_room(struct uring *ur)
+{
+	unsigned head, tail;
+
+	head = __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE);
+	tail = *ur->ur_sq_tail + ur->ur_tosubmit;
+	return (*ur->ur_sq_mask + 1 - (tail - head));
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (uring_room(ur) == 0)
+		return (NULL);
+	idx = (*ur->ur_sq_tail + ur->ur_tosubmit) & *ur->ur_sq_mask;
+	sqe = &ur->ur_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->ur_sq_array[idx] = idx;
+	ur->ur_tosubmit++;
+	return (sqe);
+}
+
+/*
+ * Publish what was queued with uring_sqe() and wait for at least
+ * ``wait'' completions.  SQEs an earlier call didn't get the kernel to
+ * take are submitted again.
+ */
+static int
+uring_enter(struct uring *ur, unsigned wait)
+{
+	unsigned n;
+	int ret;
+
+	__atomic_store_n(ur->ur_sq_tail, *ur->ur_sq_tail + ur->ur_tosubmit,
+	    __ATOMIC_RELEASE);
+	ur->ur_pending += ur->ur_tosubmit;
+	ur->ur_tosubmit = 0;
+	n = *ur->ur_sq_tail - __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE);
+	do {
+		ret = (int)syscall(__NR_io_uring_enter, ur->ur_fd, n, wait,
+		    (wait > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+	return ((ret < 0) ? -1 : 0);
+}
+
+/*
+ * uring_sqe(), submitting what's queued first if the ring is full.  It
+ * isn't with BATCH_RING sized as it is, unless the kernel took fewer
+ * SQEs than it was given.
+ */
+static struct io_uring_sqe *
+batch_sqe(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(ur);
+	if (sqe == NULL && uring_enter(ur, 0) == 0)
+		sqe = uring_sqe(ur);
+	return (sqe);
+}
+
+static int
+batch_submit_read(struct uring *ur, struct batch_ent *be, size_t i)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = batch_sqe(ur);
+	if (sqe == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = be->be_fd;
+	sqe->addr = (uintptr_t)be->be_buf;
+	sqe->len = XBF_PROBE_SIZE;
+	sqe->off = 0;
+	sqe->user_data = (i << BOP_SHIFT) | BOP_READ;
+	return (0);
+}
+
+/*
+ * Close ``fd'' through the ring.  If there's no room, it's closed right
+ * here and -1 says there's no completion to wait for.
+ */
+static int
+batch_submit_close(struct uring *ur, int fd, size_t i)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = batch_sqe(ur);
+	if (sqe == NULL) {
+		(void)close(fd);
+		return (-1);
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = (i << BOP_SHIFT) | BOP_CLOSE;
+	return (0);
+}
+
+/*
+ * File ``i'' is done: either it failed somewhere in the pipeline, or
+ * its header prefix is in be_buf.
+ */
+static int
+batch_finish(struct xbf *xbf, const char *path, struct batch_ent *be,
+    ssize_t rlen)
+{
+	int error;
+
+	xbf->xbf_fname = path;
+	if (be->be_err != XBF_OK) {
+		free(be->be_buf);
+		be->be_buf = NULL;
+		return (xbf_errc(xbf, be->be_err, be->be_errno, 0, 0));
+	}
+	if (be->be_stx.stx_size < XBF_HDR_SIZE || rlen < XBF_HDR_SIZE) {
+		free(be->be_buf);
+		be->be_buf = NULL;
+		return (xbf_errc(xbf, XBF_E_SHORT, 0, 0, be->be_stx.stx_size));
+	}
+	if (_xbf_xbz_is(be->be_buf, rlen))
+		error = _xbf_xbz_probe(xbf, path, be->be_buf, rlen,
+		    be->be_stx.stx_size);
+	else if (_xbf_zin_is(be->be_buf, rlen))
+		error = _xbf_zin_probe(xbf, path, be->be_buf, rlen,
+		    be->be_stx.stx_size);
+	else
+		error = _xbf_open_hdr(xbf, path, be->be_buf, rlen,
+		    be->be_stx.stx_size);
+	be->be_buf = NULL;
+	return (error);
+}
+
+/*
+ * Wait for everything submitted to complete, so the kernel is done with
+ * be_stx and be_buf, and keep the descriptors opened meanwhile for the
+ * caller to close.  Returns -1 if the ring stops delivering.
+ */
+static int
+batch_drain(struct uring *ur, struct batch_ent *ents)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int error;
+
+	while (ur->ur_pending > 0 || ur->ur_tosubmit > 0) {
+		error = uring_enter(ur, 1);
+		head = *ur->ur_cq_head;
+		tail = __atomic_load_n(ur->ur_cq_tail, __ATOMIC_ACQUIRE);
+		if (error != 0 && head == tail)
+			return (-1);
+		for (; head != tail; head++) {
+			cqe = &ur->ur_cqes[head & *ur->ur_cq_mask];
+			if ((cqe->user_data & BOP_MASK) == BOP_OPEN &&
+			    cqe->res >= 0)
+				ents[cqe->user_data >> BOP_SHIFT].be_fd =
+				    cqe->res;
+			ur->ur_pending--;
+		}
+		__atomic_store_n(ur->ur_cq_head, head, __ATOMIC_RELEASE);
+	}
+	return (0);
+}
+
+/*
+ * The ring is dead: do the closes it never took off the SQ ring.  The
+ * kernel only takes them in io_uring_enter(), so they won't run twice.
+ */
+static void
+batch_closes(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head, tail;
+
+	head = __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE);
+	tail = *ur->ur_sq_tail + ur->ur_tosubmit;
+	for (; head != tail; head++) {
+		sqe = &ur->ur_sqes[ur->ur_sq_array[head & *ur->ur_sq_mask]];
+		if (sqe->opcode == IORING_OP_CLOSE)
+			(void)close(sqe->fd);
+	}
+}
+
+static int
+batch_uring(struct uring *ur, struct xbf *arr, const char **paths, size_t n)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct batch_ent *ents, *be;
+	size_t next, done, inflight, nerr, i;
+	unsigned head, tail;
+	int op, res, drained;
+
+	ents = calloc(n, sizeof(*ents));
+	if (ents == NULL)
+		return (-2);
+	next = done = inflight = nerr = 0;
+	while (done < n) {
+		/*
+		 * Keep the pipeline full.  Each new file needs two SQEs,
+		 * and every file in flight may still want a read or a
+		 * close, which BATCH_RING leaves room for.  SQEs the
+		 * kernel didn't take hold new files back a round.
+		 */
+		while (next < n && inflight < BATCH_INFLIGHT &&
+		    uring_room(ur) >= 2) {
+			be = &ents[next];
+			be->be_fd = -1;
+			be->be_left = 2;
+			be->be_buf = malloc(XBF_PROBE_SIZE);
+			if (be->be_buf == NULL) {
+				be->be_err = XBF_E_NOMEM;
+				be->be_errno = ENOMEM;
+				nerr += (batch_finish(&arr[next], paths[next],
+				    be, 0) != 0);
+				next++;
+				done++;
+				continue;
+			}
+			sqe = uring_sqe(ur);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)paths[next];
+			sqe->open_flags = O_RDONLY;
+			sqe->user_data = (next << BOP_SHIFT) | BOP_OPEN;
+			sqe = uring_sqe(ur);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)paths[next];
+			sqe->len = STATX_SIZE;
+			sqe->off = (uintptr_t)&be->be_stx;
+			sqe->user_data = (next << BOP_SHIFT) | BOP_STATX;
+			next++;
+			inflight++;
+		}
+		if (done == n)
+			break;
+		if (uring_enter(ur, 1) != 0) {
+			/*
+			 * Nothing can be freed while the kernel may still
+			 * write to it: if it can't be waited for, the
+			 * memory is leaked.
+			 */
+			drained = (batch_drain(ur, ents) == 0);
+			if (!drained)
+				batch_closes(ur);
+			for (i = 0; i < next; i++) {
+				if (ents[i].be_buf == NULL)
+					continue;
+				if (drained)
+					free(ents[i].be_buf);
+				if (ents[i].be_fd != -1)
+					(void)close(ents[i].be_fd);
+			}
+			if (drained)
+				free(ents);
+			return (-2);
+		}
+
+		head = *ur->ur_cq_head;
+		tail = __atomic_load_n(ur->ur_cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ur->ur_cqes[head & *ur->ur_cq_mask];
+			i = cqe->user_data >> BOP_SHIFT;
+			op = cqe->user_data & BOP_MASK;
+			res = cqe->res;
+			be = &ents[i];
+			ur->ur_pending--;
+			switch (op) {
+			case BOP_OPEN:
+				if (res < 0) {
+					be->be_err = XBF_E_OPEN;
+					be->be_errno = -res;
+				} else
+					be->be_fd = res;
+				/* FALLTHROUGH */
+			case BOP_STATX:
+				if (op == BOP_STATX && res < 0 &&
+				    be->be_err == XBF_OK) {
+					be->be_err = XBF_E_STAT;
+					be->be_errno = -res;
+				}
+				if (--be->be_left > 0)
+					break;
+				if (be->be_err == XBF_OK) {
+					if (batch_submit_read(ur, be, i) == 0)
+						break;
+					be->be_err = XBF_E_READ;
+					be->be_errno = EBUSY;
+				}
+				if (be->be_fd == -1 ||
+				    batch_submit_close(ur, be->be_fd, i) != 0)
+					inflight--;
+				nerr += (batch_finish(&arr[i], paths[i],
+				    be, 0) != 0);
+				done++;
+				break;
+			case BOP_READ:
+				if (res < 0) {
+					be->be_err = XBF_E_READ;
+					be->be_errno = -res;
+				}
+				if (batch_submit_close(ur, be->be_fd, i) != 0)
+					inflight--;
+				nerr += (batch_finish(&arr[i], paths[i],
+				    be, res) != 0);
+				done++;
+				break;
+			case BOP_CLOSE:
+				inflight--;
+				break;
+			}
+		}
+		__atomic_store_n(ur->ur_cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	/* Reap the outstanding closes */
+	if (batch_drain(ur, ents) != 0)
+		batch_closes(ur);
+	free(ents);
+	return ((nerr == 0) ? 0 : -1);
+}
+#endif /* __linux__ */
+
+/*
+ * Read headers of ``n'' files named in ``paths'' into the contexts of
+ * ``arr'', just as if xbf_probe() was called on each of them.  Returns
+ * 0 if all of them were opened, -1 otherwise; use xbf_opened() and
+ * xbf_errmsg() on each context to see which ones failed.
+ */
+int
+xbf_open_batch(struct xbf *arr, const char **paths, size_t n, int flags)
+{
+#ifdef __linux__
+	struct uring ur;
+	int error;
+#endif
+	size_t i;
+
+	ASSERT(arr != NULL);
+	ASSERT(paths != NULL);
+	for (i = 0; i < n; i++)
+		xbf_init(&arr[i]);
+	if (n == 0)
+		return (0);
+#ifdef __linux__
+	if ((flags & XBF_BATCH_NOURING) == 0 &&
+	    uring_setup(&ur, BATCH_RING) == 0) {
+		if (uring_supported(&ur)) {
+			error = batch_uring(&ur, arr, paths, n);
+			uring_free(&ur);
+			/* -2 means the ring itself broke; start over */
+			if (error != -2)
+				return (error);
+			for (i = 0; i < n; i++) {
+				if (xbf_opened(&arr[i]) &&
+				    arr[i]._xbf_mem != NULL)
+					(void)xbf_close(&arr[i]);
+				xbf_init(&arr[i]);
+			}
+		} else
+			uring_free(&ur);
+	}
+#else
+	(void)flags;
+#endif
+	return (batch_pool(arr, paths, n));
+}
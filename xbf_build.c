@@ -0,0 +1,340 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Writing .bit files: a header put together from the names, the date
+ * and the time, followed by a payload that's either in memory or in
+ * another file.
+ *
+ * The header is built on the stack by _xbf_hdr_build() and the payload
+ * is never copied by us.  From memory, header and payload go out in one
+ * writev().  From a file, the header is written and the payload is
+ * copied by the kernel with copy_file_range() (which may share the
+ * blocks on file systems that can), falling back to sendfile() and
+ * only then to read() and write().
+ *
+ * Re-stamping an existing bit stream is xbf_build_from() on the opened
+ * context followed by xbf_build_write(): the names are kept, the date
+ * and time become the current ones unless set.  The payload of a probed
+ * container is decompressed a buffer at a time on its way out.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* copy_file_range() */
+#endif
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+/* Bounce buffer of the last resort copy */
+#define BUILD_BUFSIZE	(64 * 1024)
+
+void
+xbf_build_init(struct xbf_build *xb, const char *ncdname,
+    const char *partname)
+{
+
+	ASSERT(xb != NULL);
+	memset(xb, 0, sizeof(*xb));
+	xbf_init(&xb->xb_xbf);
+	xb->xb_ncdname = ncdname;
+	xb->xb_partname = partname;
+	xb->xb_srcfd = -1;
+}
+
+/*
+ * The payload is the ``len'' bytes at ``data''.  They must stay there
+ * until xbf_build_write() is done.
+ */
+void
+xbf_build_data(struct xbf_build *xb, const void *data, uint32_t len)
+{
+
+	ASSERT(xb != NULL);
+	xb->xb_data = data;
+	xb->xb_len = len;
+	xb->_xb_xbz = NULL;
+}
+
+/*
+ * The payload is the ``len'' bytes at ``off'' in file ``fd''.
+ */
+void
+xbf_build_source(struct xbf_build *xb, int fd, uint64_t off, uint32_t len)
+{
+
+	ASSERT(xb != NULL);
+	xb->xb_data = NULL;
+	xb->xb_srcfd = fd;
+	xb->xb_srcoff = off;
+	xb->xb_len = len;
+	xb->_xb_xbz = NULL;
+}
+
+/*
+ * Take the names and the payload of the opened ``xbf''.  The payload is
+ * read from the file it came from if it's still there, so it works
+ * after xbf_probe() too, of a .bit file or a container.  Probed .gz and
+ * .zst files have it nowhere.  ``xbf'' has to stay open until
+ * xbf_build_write() is done.
+ */
+int
+xbf_build_from(struct xbf_build *xb, struct xbf *xbf)
+{
+	int fd;
+
+	ASSERT(xb != NULL);
+	xbf_assert(xbf);
+	if (!xbf_opened(xbf))
+		return (xbf_erri(&xb->xb_xbf, "No bit stream opened"));
+	xb->xb_ncdname = xbf->xbf_ncdname;
+	xb->xb_partname = xbf->xbf_partname;
+	fd = -1;
+	if (xbf->_xbf_xbz == NULL)
+		fd = _xbf_open_source(xbf);
+	else if (xbf->xbf_data == NULL)
+		fd = _xbf_xbz_source(xbf);
+	if (fd != -1) {
+		xbf_build_free(xb);
+		xbf_build_source(xb, fd, (xbf->_xbf_xbz != NULL) ? 0 :
+		    xbf->xbf_offset, xbf->xbf_len);
+		xb->_xb_ownfd = 1;
+		xb->_xb_xbz = (xbf->_xbf_xbz != NULL) ? xbf : NULL;
+	} else if (xbf->xbf_data != NULL)
+		xbf_build_data(xb, xbf->xbf_data, xbf->xbf_len);
+	else
+		return (xbf_erri(&xb->xb_xbf, "Payload of '%s' is neither in "
+		    "memory nor in the file", xbf->xbf_fname));
+	return (0);
+}
+
+/*
+ * Write the whole iovec, whatever writev() takes at a time.
+ */
+static int
+build_writev(struct xbf_build *xb, int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t w;
+
+	while (iovcnt > 0) {
+		w = writev(fd, iov, iovcnt);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return (xbf_erri(&xb->xb_xbf, "Couldn't write: %s",
+			    (w == 0) ? "short write" : strerror(errno)));
+		for (; iovcnt > 0 && (size_t)w >= iov->iov_len; iov++, iovcnt--)
+			w -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return (0);
+}
+
+#ifdef __linux__
+/*
+ * Let the kernel copy the payload: copy_file_range(), or sendfile() if
+ * that doesn't work between these two files.  Returns the number of
+ * bytes that are still left for read() and write().
+ */
+static ssize_t
+build_copy_kern(struct xbf_build *xb, int fd, off_t *off)
+{
+	size_t left;
+	ssize_t n;
+	int cfr = 1;
+
+	for (left = xb->xb_len; left > 0; left -= n) {
+		if (cfr)
+			n = copy_file_range(xb->xb_srcfd, off, fd, NULL, left,
+			    0);
+		else
+			n = sendfile(fd, xb->xb_srcfd, off, left);
+		if (n == -1 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n == -1 && left == xb->xb_len && (errno == EXDEV ||
+		    errno == EINVAL || errno == ENOSYS ||
+		    errno == EOPNOTSUPP)) {
+			/* Nothing copied yet, try the next way */
+			if (!cfr)
+				break;
+			cfr = 0;
+			n = 0;
+			continue;
+		}
+		if (n == -1)
+			return (xbf_erri(&xb->xb_xbf, "Couldn't copy the "
+			    "payload: %s", strerror(errno)));
+		if (n == 0)
+			return (xbf_erri(&xb->xb_xbf, "Payload source ends %zu "
+			    "bytes early", left));
+	}
+	return (left);
+}
+#endif
+
+/*
+ * Copy the payload from xb_srcfd to ``fd'', at its current offset.  A
+ * container's blocks go through the buffer, decompressed.
+ */
+static int
+build_copy(struct xbf_build *xb, int fd)
+{
+	char *buf;
+	off_t off;
+	ssize_t left, n;
+
+	off = xb->xb_srcoff;
+	left = xb->xb_len;
+#ifdef __linux__
+	if (xb->_xb_xbz == NULL) {
+		left = build_copy_kern(xb, fd, &off);
+		if (left <= 0)
+			return (left);
+	}
+#endif
+	buf = malloc(MIN(left, BUILD_BUFSIZE));
+	if (buf == NULL)
+		return (xbf_erri(&xb->xb_xbf, "Couldn't allocate the copy "
+		    "buffer"));
+	while (left > 0) {
+		if (xb->_xb_xbz != NULL) {
+			n = _xbf_xbz_pread(xb->_xb_xbz, xb->xb_srcfd, buf,
+			    MIN(left, BUILD_BUFSIZE), off);
+			if (n == -1) {
+				free(buf);
+				return (xbf_erri(&xb->xb_xbf, "Couldn't read "
+				    "the payload: %s",
+				    xbf_errmsg(xb->_xb_xbz)));
+			}
+		} else
+			n = pread(xb->xb_srcfd, buf, MIN(left, BUILD_BUFSIZE),
+			    off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			free(buf);
+			return (xbf_erri(&xb->xb_xbf, "Couldn't read the "
+			    "payload: %s", (n == 0) ? "file too short" :
+			    strerror(errno)));
+		}
+		if (_xbf_write(&xb->xb_xbf, fd, buf, n) != 0) {
+			free(buf);
+			return (-1);
+		}
+		off += n;
+		left -= n;
+	}
+	free(buf);
+	return (0);
+}
+
+/*
+ * Write the .bit file to ``fd''.
+ */
+int
+xbf_build_write(struct xbf_build *xb, int fd)
+{
+	struct xbf *xbf;
+	struct iovec iov[2];
+	struct tm tm;
+	time_t now;
+	char hdr[XBF_PROBE_SIZE];
+	ssize_t hlen;
+
+	ASSERT(xb != NULL);
+	xbf = &xb->xb_xbf;
+	if (xb->xb_data == NULL && xb->xb_srcfd == -1 && xb->xb_len != 0)
+		return (xbf_erri(xbf, "No payload given"));
+	if (xb->xb_date == NULL || xb->xb_time == NULL) {
+		now = time(NULL);
+		if (localtime_r(&now, &tm) == NULL)
+			return (xbf_erri(xbf, "Couldn't get the local time"));
+		(void)strftime(xb->_xb_date, sizeof(xb->_xb_date),
+		    "%Y/%m/%d", &tm);
+		(void)strftime(xb->_xb_time, sizeof(xb->_xb_time),
+		    "%H:%M:%S", &tm);
+	}
+	xbf->xbf_ncdname = xb->xb_ncdname;
+	xbf->xbf_partname = xb->xb_partname;
+	xbf->xbf_date = (xb->xb_date != NULL) ? xb->xb_date : xb->_xb_date;
+	xbf->xbf_time = (xb->xb_time != NULL) ? xb->xb_time : xb->_xb_time;
+	/* Readers insist on these lengths */
+	if (strlen(xbf->xbf_date) != 10)
+		return (xbf_erri(xbf, "Date '%s' isn't YYYY/MM/DD",
+		    xbf->xbf_date));
+	if (strlen(xbf->xbf_time) != 8)
+		return (xbf_erri(xbf, "Time '%s' isn't HH:MM:SS",
+		    xbf->xbf_time));
+
+	hlen = _xbf_hdr_build(xbf, xb->xb_len, hdr, sizeof(hdr));
+	if (hlen == -1)
+		return (-1);
+	if (xb->xb_data == NULL)
+		return (_xbf_write(xbf, fd, hdr, hlen) != 0 ? -1 :
+		    build_copy(xb, fd));
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = (void *)(uintptr_t)xb->xb_data;
+	iov[1].iov_len = xb->xb_len;
+	return (build_writev(xb, fd, iov, 2));
+}
+
+/*
+ * Close the payload file xbf_build_from() opened.
+ */
+void
+xbf_build_free(struct xbf_build *xb)
+{
+
+	ASSERT(xb != NULL);
+	if (xb->_xb_ownfd && xb->xb_srcfd != -1)
+		(void)close(xb->xb_srcfd);
+	xb->_xb_ownfd = 0;
+	xb->xb_srcfd = -1;
+	xb->_xb_xbz = NULL;
+}
@@ -0,0 +1,386 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Catalog of many parsed headers.
+ *
+ * A struct xbf is over a kilobyte, mostly error buffers, and points
+ * into memory that has to stay around.  The catalog keeps only what's
+ * needed to find bit streams again, one array per field: strings are
+ * offsets into a single arena, the date and time are decoded into a
+ * timestamp.  NCD and part names are interned, since a handful of them
+ * cover a whole archive, so a filter on the part is a compare of 32-bit
+ * offsets.  Paths are stored as they are.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xbf.h"
+
+#define CAT_MINCAP	1024
+#define CAT_MINARENA	(64 * 1024)
+
+#define CAT_STR(s)	((s) != NULL ? (s) : "")
+
+int
+xbf_catalog_init(struct xbf_catalog *cat)
+{
+
+	ASSERT(cat != NULL);
+	memset(cat, 0, sizeof(*cat));
+	xbf_init(&cat->xct_xbf);
+	cat->xct_xbf.xbf_fname = "(catalog)";
+	return (0);
+}
+
+void
+xbf_catalog_free(struct xbf_catalog *cat)
+{
+
+	free(cat->xct_path);
+	free(cat->xct_ncdname);
+	free(cat->xct_partname);
+	free(cat->xct_time);
+	free(cat->xct_len);
+	free(cat->xct_family);
+	free(cat->xct_arena);
+	free(cat->xct_htab);
+	(void)xbf_catalog_init(cat);
+}
+
+/*
+ * Bytes held by the catalog.
+ */
+size_t
+xbf_catalog_memsize(struct xbf_catalog *cat)
+{
+
+	return (cat->xct_cap * (4 * sizeof(uint32_t) + sizeof(int64_t) +
+	    sizeof(uint8_t)) + cat->xct_arenacap +
+	    cat->xct_hsize * sizeof(uint32_t));
+}
+
+static int
+cat_grow(struct xbf_catalog *cat)
+{
+	size_t cap;
+
+	cap = MAX(cat->xct_cap * 2, CAT_MINCAP);
+#define CAT_REALLOC(a) do {						\
+	void *_p = realloc((a), cap * sizeof(*(a)));			\
+	if (_p == NULL)							\
+		return (xbf_erri(&cat->xct_xbf, "Couldn't grow the "	\
+		    "catalog to %zu headers", cap));			\
+	(a) = _p;							\
+} while (0)
+	CAT_REALLOC(cat->xct_path);
+	CAT_REALLOC(cat->xct_ncdname);
+	CAT_REALLOC(cat->xct_partname);
+	CAT_REALLOC(cat->xct_time);
+	CAT_REALLOC(cat->xct_len);
+	CAT_REALLOC(cat->xct_family);
+#undef CAT_REALLOC
+	cat->xct_cap = cap;
+	return (0);
+}
+
+/*
+ * Append ``s'' to the arena; its offset goes to ``*off''.
+ */
+static int
+cat_put(struct xbf_catalog *cat, const char *s, uint32_t *off)
+{
+	size_t len, cap;
+	char *p;
+
+	len = strlen(s) + 1;
+	if (cat->xct_arenalen + len > UINT32_MAX)
+		return (xbf_erri(&cat->xct_xbf, "Catalog string arena is "
+		    "full"));
+	if (cat->xct_arenalen + len > cat->xct_arenacap) {
+		cap = MAX(cat->xct_arenacap, CAT_MINARENA);
+		while (cap < cat->xct_arenalen + len)
+			cap *= 2;
+		p = realloc(cat->xct_arena, cap);
+		if (p == NULL)
+			return (xbf_erri(&cat->xct_xbf, "Couldn't grow the "
+			    "catalog string arena"));
+		cat->xct_arena = p;
+		cat->xct_arenacap = cap;
+	}
+	memcpy(cat->xct_arena + cat->xct_arenalen, s, len);
+	*off = cat->xct_arenalen;
+	cat->xct_arenalen += len;
+	return (0);
+}
+
+static uint32_t
+cat_hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0')
+		h = (h ^ (uint8_t)*s++) * 16777619U;
+	return (h);
+}
+
+/*
+ * Slot of ``s'' in the interning table: the one holding it, or the
+ * empty one where it would go.
+ */
+static size_t
+cat_slot(struct xbf_catalog *cat, const char *s)
+{
+	size_t i, mask;
+	uint32_t e;
+
+	mask = cat->xct_hsize - 1;
+	for (i = cat_hash(s) & mask;; i = (i + 1) & mask) {
+		e = cat->xct_htab[i];
+		if (e == 0 || strcmp(cat->xct_arena + e - 1, s) == 0)
+			return (i);
+	}
+}
+
+static int
+cat_rehash(struct xbf_catalog *cat)
+{
+	uint32_t *old;
+	size_t i, oldsize;
+
+	old = cat->xct_htab;
+	oldsize = cat->xct_hsize;
+	cat->xct_hsize = MAX(oldsize * 2, 64);
+	cat->xct_htab = calloc(cat->xct_hsize, sizeof(uint32_t));
+	if (cat->xct_htab == NULL) {
+		cat->xct_htab = old;
+		cat->xct_hsize = oldsize;
+		return (xbf_erri(&cat->xct_xbf, "Couldn't grow the catalog "
+		    "string table"));
+	}
+	for (i = 0; i < oldsize; i++)
+		if (old[i] != 0)
+			cat->xct_htab[cat_slot(cat,
+			    cat->xct_arena + old[i] - 1)] = old[i];
+	free(old);
+	return (0);
+}
+
+/*
+ * Same as cat_put(), but equal strings are stored only once.
+ */
+static int
+cat_intern(struct xbf_catalog *cat, const char *s, uint32_t *off)
+{
+	size_t slot;
+
+	if ((cat->xct_nstr + 1) * 2 > cat->xct_hsize &&
+	    cat_rehash(cat) != 0)
+		return (-1);
+	slot = cat_slot(cat, s);
+	if (cat->xct_htab[slot] != 0) {
+		*off = cat->xct_htab[slot] - 1;
+		return (0);
+	}
+	if (cat_put(cat, s, off) != 0)
+		return (-1);
+	cat->xct_htab[slot] = *off + 1;
+	cat->xct_nstr++;
+	return (0);
+}
+
+/*
+ * Offset of the interned NCD or part name ``s'', or -1 if no header
+ * in the catalog has it.
+ */
+ssize_t
+xbf_catalog_find_str(struct xbf_catalog *cat, const char *s)
+{
+	size_t slot;
+
+	if (cat->xct_hsize == 0)
+		return (-1);
+	slot = cat_slot(cat, s);
+	if (cat->xct_htab[slot] == 0)
+		return (-1);
+	return ((ssize_t)cat->xct_htab[slot] - 1);
+}
+
+const char *
+xbf_catalog_str(struct xbf_catalog *cat, uint32_t off)
+{
+
+	ASSERT(off < cat->xct_arenalen);
+	return (cat->xct_arena + off);
+}
+
+/*
+ * Days from 1970-01-01 to the given date of the proleptic Gregorian
+ * calendar.
+ */
+static int64_t
+cat_days(int64_t y, int m, int d)
+{
+	int64_t era;
+	int yoe, doy, doe;
+
+	y -= (m <= 2);
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (int)(y - era * 400);
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (era * 146097 + doe - 719468);
+}
+
+/*
+ * Header date ("2009/ 6/ 1") and time ("12:34:56") as seconds since the
+ * epoch.  The tools write local time without a zone, so it's taken as
+ * UTC.
+ */
+int64_t
+_xbf_catalog_time(const char *date, const char *time)
+{
+	int y, mo, d, h, mi, s;
+
+	if (date == NULL || time == NULL ||
+	    sscanf(date, "%d/%d/%d", &y, &mo, &d) != 3 ||
+	    sscanf(time, "%d:%d:%d", &h, &mi, &s) != 3 ||
+	    mo < 1 || mo > 12 || d < 1 || d > 31 ||
+	    h < 0 || h > 23 || mi < 0 || mi > 59 || s < 0 || s > 60)
+		return (XBF_CATALOG_NOTIME);
+	return (cat_days(y, mo, d) * 86400 + h * 3600 + mi * 60 + s);
+}
+
+/*
+ * Add the header of the opened or probed ``xbf''.  Returns its index,
+ * or -1.
+ */
+ssize_t
+xbf_catalog_add(struct xbf_catalog *cat, struct xbf *xbf)
+{
+	size_t i;
+
+	xbf_assert(xbf);
+	if (cat->xct_n == cat->xct_cap && cat_grow(cat) != 0)
+		return (-1);
+	i = cat->xct_n;
+	if (cat_put(cat, CAT_STR(xbf_get_fname(xbf)), &cat->xct_path[i]) != 0 ||
+	    cat_intern(cat, CAT_STR(xbf_get_ncdname(xbf)),
+	    &cat->xct_ncdname[i]) != 0 ||
+	    cat_intern(cat, CAT_STR(xbf_get_partname(xbf)),
+	    &cat->xct_partname[i]) != 0)
+		return (-1);
+	cat->xct_time[i] = _xbf_catalog_time(xbf_get_date(xbf),
+	    xbf_get_time(xbf));
+	cat->xct_len[i] = xbf_get_len(xbf);
+	cat->xct_family[i] = xbf_get_family(xbf);
+	cat->xct_n++;
+	return ((ssize_t)i);
+}
+
+/*
+ * Indexes of the headers for part ``part'' (an offset from
+ * xbf_catalog_find_str(), or XBF_CATALOG_ANY) made in [from, to].
+ * ``idx'' has room for xct_n entries.  Returns how many matched.
+ */
+size_t
+xbf_catalog_filter(struct xbf_catalog *cat, uint32_t part, int64_t from,
+    int64_t to, uint32_t *idx)
+{
+	const uint32_t *parts;
+	const int64_t *times;
+	size_t i, n;
+
+	parts = cat->xct_partname;
+	times = cat->xct_time;
+	for (i = n = 0; i < cat->xct_n; i++) {
+		idx[n] = i;
+		n += (part == XBF_CATALOG_ANY || parts[i] == part) &&
+		    times[i] >= from && times[i] <= to;
+	}
+	return (n);
+}
+
+/*
+ * Sort ``n'' catalog indexes by time, oldest first; equal times keep
+ * their order.  An LSD radix sort a byte at a time, skipping the bytes
+ * all timestamps share, which are most of them.
+ */
+int
+xbf_catalog_sort_time(struct xbf_catalog *cat, uint32_t *idx, size_t n)
+{
+	size_t cnt[8][256];
+	uint32_t *tmp, *src, *dst, *t;
+	uint64_t k;
+	size_t i, sum, c;
+	int b;
+
+	if (n < 2)
+		return (0);
+	tmp = malloc(n * sizeof(*tmp));
+	if (tmp == NULL)
+		return (xbf_erri(&cat->xct_xbf, "Couldn't allocate sort "
+		    "buffer"));
+	memset(cnt, 0, sizeof(cnt));
+	for (i = 0; i < n; i++) {
+		/* Flip the sign so negative times sort first */
+		k = (uint64_t)cat->xct_time[idx[i]] ^ (1ULL << 63);
+		for (b = 0; b < 8; b++)
+			cnt[b][(k >> (b * 8)) & 0xff]++;
+	}
+	src = idx;
+	dst = tmp;
+	for (b = 0; b < 8; b++) {
+		k = (uint64_t)cat->xct_time[src[0]] ^ (1ULL << 63);
+		if (cnt[b][(k >> (b * 8)) & 0xff] == n)
+			continue;
+		for (i = sum = 0; i < 256; i++) {
+			c = cnt[b][i];
+			cnt[b][i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++) {
+			k = (uint64_t)cat->xct_time[src[i]] ^ (1ULL << 63);
+			dst[cnt[b][(k >> (b * 8)) & 0xff]++] = src[i];
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != idx)
+		memcpy(idx, src, n * sizeof(*idx));
+	free(tmp);
+	return (0);
+}
@@ -0,0 +1,518 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Compression of bit streams with multiple frame writes (MFWR), the way
+ * the vendor tools compress them: a frame that's written to several
+ * addresses goes through FDRI once and is then copied to every address
+ * with a FAR write and an MFWR write.
+ *
+ * The address of a frame is only known when the stream writes FAR right
+ * before it (see xbf_frame.c), so only frames written on their own, as
+ * a FAR write followed by the frame and its pad frame, are compressed;
+ * everything else is copied as it is.  Frames are grouped by content
+ * with a hash table keyed by their CRC32C, and every group is written
+ * where its first frame was.  This assumes that every frame address is
+ * written once, which is what the vendor tools do; FARs written more
+ * than once are left alone.  The configuration CRC is recomputed.
+ */
+
+#include <sys/param.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xbf.h"
+
+#define ARRAY_SIZE(x)	((int)(sizeof(x)/sizeof(x[0])))
+
+#define CMP_T1_WRITE(reg, n)	((1U << 29) | (2U << 27) | ((reg) << 13) | (n))
+#define CMP_MFWR_WORDS		2	/* Their value doesn't matter */
+
+/*
+ * A frame written on its own: the FAR write at packet cu_farpkt, the
+ * frame and a pad frame at cu_datapkt.
+ */
+struct cmp_unit {
+	size_t		 cu_farpkt;
+	size_t		 cu_datapkt;
+	uint32_t	 cu_far;
+	uint32_t	 cu_off;	/* Payload offset of the frame */
+	ssize_t		 cu_next;	/* Next one with the same frame */
+	int		 cu_ok;
+	int		 cu_leader;	/* First one with that frame */
+};
+
+struct cmp_ctx {
+	struct xbf	*cc_xbf;
+	struct xbf_pkts	 cc_pk;
+	struct cmp_unit	*cc_units;
+	size_t		 cc_nunits;
+	ssize_t		*cc_bypkt;	/* Unit of every packet, or -1 */
+	unsigned	 cc_flen;
+};
+
+struct cmp_out {
+	struct xbf	*co_xbf;
+	int		 co_fd;
+	int		 co_fam;
+	uint32_t	 co_crc;
+	size_t		 co_len;
+	size_t		 co_n;
+	uint32_t	 co_buf[128];
+};
+
+static int
+cmp_far_cmp(const void *a, const void *b)
+{
+	uint32_t fa = *(const uint32_t *)a, fb = *(const uint32_t *)b;
+
+	return ((fa < fb) ? -1 : (fa > fb));
+}
+
+/*
+ * Is ``far'' written exactly once?  ``fars'' is sorted.
+ */
+static int
+cmp_far_once(const uint32_t *fars, size_t n, uint32_t far)
+{
+	size_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fars[mid] < far)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo + 1 >= n || fars[lo + 1] != far);
+}
+
+/*
+ * Find the frames written on their own.
+ */
+static int
+cmp_units(struct cmp_ctx *cc)
+{
+	struct xbf *xbf = cc->cc_xbf;
+	const struct xbf_pkt *p;
+	struct cmp_unit *u;
+	uint32_t *fars;
+	size_t i, nfars;
+	ssize_t farpkt, last;
+	int clean;
+
+	cc->cc_units = calloc(cc->cc_pk.xp_npkts + 1, sizeof(*cc->cc_units));
+	fars = calloc(cc->cc_pk.xp_npkts + 1, sizeof(*fars));
+	if (cc->cc_units == NULL || fars == NULL) {
+		free(fars);
+		return (xbf_erri(xbf, "Couldn't allocate memory"));
+	}
+	farpkt = last = -1;
+	clean = 0;
+	for (i = 0, nfars = 0; i < cc->cc_pk.xp_npkts; i++) {
+		p = &cc->cc_pk.xp_pkts[i];
+		if (p->xp_type == XBF_PKT_SYNC) {
+			farpkt = last = -1;
+			continue;
+		}
+		if (p->xp_op == XBF_PKT_OP_NOOP)
+			continue;
+		if (p->xp_op == XBF_PKT_OP_WRITE && p->xp_reg == XBF_REG_FAR &&
+		    p->xp_wcnt == 1) {
+			farpkt = i;
+			clean = 1;
+			fars[nfars++] = xbf_pkt_word(xbf, p, 0);
+			continue;
+		}
+		if (p->xp_op != XBF_PKT_OP_WRITE || p->xp_reg != XBF_REG_FDRI) {
+			clean = 0;
+			continue;
+		}
+		if (p->xp_wcnt == 0)
+			continue;
+		if (farpkt != -1 && clean && p->xp_wcnt == 2 * cc->cc_flen) {
+			u = &cc->cc_units[cc->cc_nunits];
+			u->cu_farpkt = farpkt;
+			u->cu_datapkt = i;
+			u->cu_far = xbf_pkt_word(xbf,
+			    &cc->cc_pk.xp_pkts[farpkt], 0);
+			u->cu_off = p->xp_off + 4;
+			u->cu_ok = 1;
+			last = cc->cc_nunits++;
+		} else if (farpkt == -1 && last != -1)
+			/* More frames follow from the same FAR */
+			cc->cc_units[last].cu_ok = 0;
+		else
+			last = -1;
+		farpkt = -1;
+	}
+	qsort(fars, nfars, sizeof(*fars), cmp_far_cmp);
+	for (i = 0; i < cc->cc_nunits; i++)
+		if (!cmp_far_once(fars, nfars, cc->cc_units[i].cu_far))
+			cc->cc_units[i].cu_ok = 0;
+	free(fars);
+	return (0);
+}
+
+/*
+ * Chain the units with the same frame, in stream order.
+ */
+static int
+cmp_group(struct cmp_ctx *cc)
+{
+	const uint8_t *data = (const uint8_t *)cc->cc_xbf->xbf_data;
+	struct cmp_unit *u, *h;
+	ssize_t *tab, *tail;
+	size_t fbytes, ntab, i, j;
+	uint32_t hash;
+
+	for (ntab = 16; ntab < cc->cc_nunits * 2; ntab *= 2)
+		;
+	tab = malloc(ntab * sizeof(*tab));
+	tail = malloc((cc->cc_nunits + 1) * sizeof(*tail));
+	if (tab == NULL || tail == NULL) {
+		free(tab);
+		free(tail);
+		return (xbf_erri(cc->cc_xbf, "Couldn't allocate memory"));
+	}
+	memset(tab, 0xff, ntab * sizeof(*tab));
+	fbytes = cc->cc_flen * 4;
+	for (i = 0; i < cc->cc_nunits; i++) {
+		u = &cc->cc_units[i];
+		u->cu_next = -1;
+		if (!u->cu_ok)
+			continue;
+		hash = xbf_crc32c(0, data + u->cu_off, fbytes);
+		for (j = hash & (ntab - 1); tab[j] != -1; j = (j + 1) & (ntab - 1)) {
+			h = &cc->cc_units[tab[j]];
+			if (memcmp(data + h->cu_off, data + u->cu_off,
+			    fbytes) == 0)
+				break;
+		}
+		if (tab[j] == -1) {
+			tab[j] = i;
+			tail[i] = i;
+			u->cu_leader = 1;
+		} else {
+			cc->cc_units[tail[tab[j]]].cu_next = i;
+			tail[tab[j]] = i;
+		}
+	}
+	free(tab);
+	free(tail);
+	return (0);
+}
+
+static int
+cmp_out_flush(struct cmp_out *o)
+{
+	int error = 0;
+
+	if (o->co_fd != -1 && o->co_n > 0)
+		error = _xbf_write(o->co_xbf, o->co_fd, o->co_buf,
+		    o->co_n * 4);
+	o->co_n = 0;
+	return (error);
+}
+
+static int
+cmp_out_word(struct cmp_out *o, uint32_t w)
+{
+
+	if (o->co_n == ARRAY_SIZE(o->co_buf) && cmp_out_flush(o) != 0)
+		return (-1);
+	o->co_buf[o->co_n++] = htonl(w);
+	o->co_len += 4;
+	return (0);
+}
+
+/*
+ * Bytes of the original payload, as they are.
+ */
+static int
+cmp_out_raw(struct cmp_out *o, size_t off, size_t len)
+{
+
+	if (len == 0)
+		return (0);
+	o->co_len += len;
+	if (o->co_fd == -1)
+		return (0);
+	if (cmp_out_flush(o) != 0)
+		return (-1);
+	return (_xbf_write(o->co_xbf, o->co_fd,
+	    (const char *)o->co_xbf->xbf_data + off, len));
+}
+
+/*
+ * Type 1 write of ``n'' words to ``reg'' (NULL: zeros), with the CRC
+ * kept up to date.
+ */
+static int
+cmp_out_reg(struct cmp_out *o, unsigned reg, const uint32_t *vals, size_t n)
+{
+	uint32_t be;
+	size_t i;
+
+	if (cmp_out_word(o, CMP_T1_WRITE(reg, n)) != 0)
+		return (-1);
+	for (i = 0; i < n; i++) {
+		if (cmp_out_word(o, (vals != NULL) ? vals[i] : 0) != 0)
+			return (-1);
+		be = htonl((vals != NULL) ? vals[i] : 0);
+		if (o->co_fd != -1)
+			o->co_crc = _xbf_crc_update(o->co_fam, o->co_crc, reg,
+			    &be, 1);
+	}
+	return (0);
+}
+
+/*
+ * A packet of the original stream.  CRC writes get the new CRC.
+ */
+static int
+cmp_out_pkt(struct cmp_out *o, const struct xbf_pkt *p)
+{
+	const uint8_t *data = (const uint8_t *)o->co_xbf->xbf_data;
+
+	if (p->xp_type == XBF_PKT_SYNC)
+		return (cmp_out_raw(o, p->xp_off, 4));
+	if (p->xp_op != XBF_PKT_OP_WRITE || p->xp_wcnt == 0)
+		return (cmp_out_raw(o, p->xp_off, 4 + p->xp_wcnt * 4));
+	if (p->xp_reg == XBF_REG_CRC && p->xp_wcnt == 1) {
+		if (cmp_out_raw(o, p->xp_off, 4) != 0 ||
+		    cmp_out_word(o, o->co_crc) != 0)
+			return (-1);
+		o->co_crc = 0;
+		return (0);
+	}
+	if (p->xp_reg == XBF_REG_CMD && p->xp_wcnt == 1 &&
+	    xbf_pkt_word(o->co_xbf, p, 0) == XBF_CMD_RCRC)
+		o->co_crc = 0;
+	else if (o->co_fd != -1)
+		o->co_crc = _xbf_crc_update(o->co_fam, o->co_crc, p->xp_reg,
+		    data + p->xp_off + 4, p->xp_wcnt);
+	return (cmp_out_raw(o, p->xp_off, 4 + p->xp_wcnt * 4));
+}
+
+/*
+ * The frame of ``u'' once, then copied to the address of every unit of
+ * its group.  The frame stays in the frame buffer since there's no pad
+ * frame after it, so its own address is written with MFWR as well.
+ */
+static int
+cmp_out_group(struct cmp_out *o, struct cmp_ctx *cc, struct cmp_unit *u)
+{
+	const char *data = o->co_xbf->xbf_data;
+	uint32_t v;
+	ssize_t i;
+
+	v = XBF_CMD_WCFG;
+	if (cmp_out_reg(o, XBF_REG_FAR, &u->cu_far, 1) != 0 ||
+	    cmp_out_reg(o, XBF_REG_CMD, &v, 1) != 0 ||
+	    cmp_out_word(o, CMP_T1_WRITE(XBF_REG_FDRI, cc->cc_flen)) != 0 ||
+	    cmp_out_flush(o) != 0)
+		return (-1);
+	o->co_len += cc->cc_flen * 4;
+	if (o->co_fd != -1) {
+		o->co_crc = _xbf_crc_update(o->co_fam, o->co_crc, XBF_REG_FDRI,
+		    data + u->cu_off, cc->cc_flen);
+		if (_xbf_write(o->co_xbf, o->co_fd, data + u->cu_off,
+		    cc->cc_flen * 4) != 0)
+			return (-1);
+	}
+	v = XBF_CMD_MFW;
+	if (cmp_out_reg(o, XBF_REG_CMD, &v, 1) != 0)
+		return (-1);
+	for (i = u - cc->cc_units; i != -1; i = cc->cc_units[i].cu_next) {
+		if (cmp_out_reg(o, XBF_REG_FAR, &cc->cc_units[i].cu_far,
+		    1) != 0 ||
+		    cmp_out_reg(o, XBF_REG_MFWR, NULL, CMP_MFWR_WORDS) != 0)
+			return (-1);
+	}
+	v = XBF_CMD_WCFG;
+	return (cmp_out_reg(o, XBF_REG_CMD, &v, 1));
+}
+
+/*
+ * Packets of frames that are copied with MFWR are in cc_bypkt; all of
+ * them are written with the first one.
+ */
+static int
+cmp_out_all(struct cmp_out *o, struct cmp_ctx *cc)
+{
+	const struct xbf_pkt *p;
+	struct cmp_unit *u;
+	size_t i, done;
+
+	for (i = 0, done = 0; i < cc->cc_pk.xp_npkts; i++) {
+		p = &cc->cc_pk.xp_pkts[i];
+		/* Words the decoder skipped, like the ones after DESYNC */
+		if (cmp_out_raw(o, done, p->xp_off - done) != 0)
+			return (-1);
+		done = p->xp_off + ((p->xp_type == XBF_PKT_SYNC) ? 4 :
+		    4 + p->xp_wcnt * 4);
+		if (cc->cc_bypkt[i] == -1) {
+			if (cmp_out_pkt(o, p) != 0)
+				return (-1);
+			continue;
+		}
+		u = &cc->cc_units[cc->cc_bypkt[i]];
+		if (u->cu_leader && i == u->cu_farpkt &&
+		    cmp_out_group(o, cc, u) != 0)
+			return (-1);
+	}
+	if (cmp_out_raw(o, done, o->co_xbf->xbf_len - done) != 0)
+		return (-1);
+	return (cmp_out_flush(o));
+}
+
+static void
+cmp_free(struct cmp_ctx *cc)
+{
+
+	xbf_pkt_free(&cc->cc_pk);
+	free(cc->cc_units);
+	free(cc->cc_bypkt);
+}
+
+/*
+ * Write ``xbf'' to ``fd'' with frames that are written more than once
+ * replaced with multiple frame writes.  Sizes and counts end up in
+ * ``xc''.
+ */
+int
+xbf_compress(struct xbf *xbf, int fd, struct xbf_compress *xc)
+{
+	struct cmp_ctx cc;
+	struct cmp_out o;
+	struct cmp_unit *u;
+	char hdr[XBF_PROBE_SIZE];
+	ssize_t hlen;
+	size_t i, j;
+
+	xbf_assert(xbf);
+	memset(xc, 0, sizeof(*xc));
+	memset(&cc, 0, sizeof(cc));
+	cc.cc_xbf = xbf;
+	cc.cc_flen = xbf_get_frame_words(xbf);
+	if (cc.cc_flen == 0)
+		return (xbf_erri(xbf, "Frame length of part '%s' isn't known",
+		    xbf->xbf_partname));
+	if (xbf_pkt_decode(xbf, &cc.cc_pk) != 0)
+		return (-1);
+	if (cmp_units(&cc) != 0 || cmp_group(&cc) != 0)
+		goto fail;
+	cc.cc_bypkt = malloc((cc.cc_pk.xp_npkts + 1) * sizeof(*cc.cc_bypkt));
+	if (cc.cc_bypkt == NULL) {
+		xbf_erri(xbf, "Couldn't allocate memory");
+		goto fail;
+	}
+	memset(cc.cc_bypkt, 0xff, (cc.cc_pk.xp_npkts + 1) *
+	    sizeof(*cc.cc_bypkt));
+	for (i = 0; i < cc.cc_nunits; i++) {
+		u = &cc.cc_units[i];
+		if (!u->cu_ok)
+			continue;
+		xc->xc_nframes++;
+		if (u->cu_leader)
+			xc->xc_nunique++;
+		/* Frames written once stay as they are */
+		if (u->cu_leader && u->cu_next == -1)
+			continue;
+		xc->xc_ncopied++;
+		for (j = u->cu_farpkt; j <= u->cu_datapkt; j++)
+			cc.cc_bypkt[j] = i;
+	}
+
+	/* Dry run for the length first */
+	memset(&o, 0, sizeof(o));
+	o.co_xbf = xbf;
+	o.co_fd = -1;
+	o.co_fam = xbf_get_family(xbf);
+	if (cmp_out_all(&o, &cc) != 0)
+		goto fail;
+	if (o.co_len > UINT32_MAX) {
+		xbf_erri(xbf, "Compressed bit stream would be too big");
+		goto fail;
+	}
+	xc->xc_oldlen = xbf->xbf_len;
+	xc->xc_newlen = o.co_len;
+	hlen = _xbf_hdr_build(xbf, o.co_len, hdr, sizeof(hdr));
+	if (hlen == -1 || _xbf_write(xbf, fd, hdr, hlen) != 0)
+		goto fail;
+	o.co_fd = fd;
+	o.co_crc = 0;
+	o.co_len = 0;
+	if (cmp_out_all(&o, &cc) != 0)
+		goto fail;
+	cmp_free(&cc);
+	return (0);
+fail:
+	cmp_free(&cc);
+	return (-1);
+}
+
+/* Configuration interfaces for the time estimates */
+static const struct {
+	const char	*name;
+	double		 bps;
+} cmp_ifaces[] = {
+	{ "JTAG, 30 MHz",		30e6 },
+	{ "SPI x1, 50 MHz",		50e6 },
+	{ "SPI x4, 50 MHz",		200e6 },
+	{ "SelectMAP x32, 100 MHz",	3200e6 },
+};
+
+void
+xbf_compress_print_fp(FILE *fp, struct xbf_compress *xc)
+{
+	double told, tnew;
+	int i;
+
+	fprintf(fp, "%d frames at known addresses, %d different, %d copied "
+	    "with MFWR\n", (int)xc->xc_nframes, (int)xc->xc_nunique,
+	    (int)xc->xc_ncopied);
+	fprintf(fp, "%d -> %d bytes, ratio %.3f\n", (int)xc->xc_oldlen,
+	    (int)xc->xc_newlen, (xc->xc_newlen == 0) ? 0 :
+	    (double)xc->xc_oldlen / xc->xc_newlen);
+	for (i = 0; i < ARRAY_SIZE(cmp_ifaces); i++) {
+		told = xc->xc_oldlen * 8 / cmp_ifaces[i].bps;
+		tnew = xc->xc_newlen * 8 / cmp_ifaces[i].bps;
+		fprintf(fp, "  %-24s %10.3f ms -> %10.3f ms, %.3f ms saved\n",
+		    cmp_ifaces[i].name, told * 1e3, tnew * 1e3,
+		    (told - tnew) * 1e3);
+	}
+}
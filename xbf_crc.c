@@ -0,0 +1,287 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Checking the CRC the configuration logic itself computes.
+ *
+ * Every register write feeds its data words, together with the register
+ * address, into a CRC register; a write to the CRC register compares
+ * and resets it, and so does the RCRC command.  Virtex-4 and later use
+ * CRC32C over 37 bits per word (32 bits of data, then 5 bits of the
+ * address, LSB first, no inversion).  Virtex-II uses CRC-16
+ * (x^16 + x^15 + x^2 + 1) over 32 data and 4 address bits (XAPP151).
+ *
+ * The 32 data bits of the CRC32C step are exactly what the SSE4.2
+ * crc32 instruction does; the 5 address bits are one lookup in a small
+ * table.  Long FDRI bursts are split into three parts worked on at
+ * the same time, to hide the latency of the instruction, and glued
+ * back with _xbf_crc32c_shift().
+ */
+
+#include <sys/param.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_X86
+#endif
+
+#include "xbf.h"
+
+#define CRC_POLY32	0x82f63b78	/* CRC32C, reflected */
+#define CRC_POLY16	0xa001		/* x^16 + x^15 + x^2 + 1, reflected */
+#define CRC_ABITS	5		/* Address bits, CRC32C */
+#define CRC_LANES_MIN	96		/* Words worth splitting in 3 */
+
+struct crc_ctx {
+	int		 cc_kern;
+	const uint32_t	*cc_t5;		/* 5 address bits at once */
+	const uint32_t	*cc_t8;		/* A byte at once */
+};
+
+static uint32_t crc_t5[1 << CRC_ABITS];
+static uint32_t crc_t8[256];
+static pthread_once_t crc_tbl_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_tbl_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++) {
+			c = (c >> 1) ^ ((c & 1) ? CRC_POLY32 : 0);
+			if (j == CRC_ABITS - 1 && i < (1 << CRC_ABITS))
+				crc_t5[i] = c;
+		}
+		crc_t8[i] = c;
+	}
+}
+
+/*
+ * The tables are built once; writers update the CRC a word at a time.
+ */
+static void
+crc_ctx_init(struct crc_ctx *cc, int kern)
+{
+
+	(void)pthread_once(&crc_tbl_once, crc_tbl_init);
+	cc->cc_kern = kern;
+	cc->cc_t5 = crc_t5;
+	cc->cc_t8 = crc_t8;
+}
+
+/*
+ * Word counts in bits.
+ */
+#define CRC_NBITS(n)	((uint64_t)(n) * (32 + CRC_ABITS))
+
+static uint32_t
+crc_words_scalar(const struct crc_ctx *cc, uint32_t c, unsigned reg,
+    const uint8_t *p, size_t n)
+{
+	size_t i;
+	int b;
+
+	for (i = 0; i < n; i++, p += 4) {
+		/* The word goes in LSB first: least significant byte first */
+		for (b = 3; b >= 0; b--)
+			c = (c >> 8) ^ cc->cc_t8[(c ^ p[b]) & 0xff];
+		c = (c >> CRC_ABITS) ^ cc->cc_t5[(c ^ reg) & 0x1f];
+	}
+	return (c);
+}
+
+#ifdef CRC_X86
+#define CRC_STEP(cc, c, reg, p) do {					\
+	uint32_t _w;							\
+									\
+	memcpy(&_w, (p), sizeof(_w));					\
+	(c) = _mm_crc32_u32((c), ntohl(_w));				\
+	(c) = ((c) >> CRC_ABITS) ^ (cc)->cc_t5[((c) ^ (reg)) & 0x1f];	\
+} while (0)
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc_words_sse42(const struct crc_ctx *cc, uint32_t c, unsigned reg,
+    const uint8_t *p, size_t n)
+{
+	const uint8_t *p1, *p2;
+	uint32_t c1, c2;
+	size_t i, n3;
+
+	if (n < CRC_LANES_MIN) {
+		for (i = 0; i < n; i++, p += 4)
+			CRC_STEP(cc, c, reg, p);
+		return (c);
+	}
+	n3 = n / 3;
+	p1 = p + 4 * n3;
+	p2 = p1 + 4 * n3;
+	c1 = c2 = 0;
+	for (i = 0; i < n3; i++, p += 4, p1 += 4, p2 += 4) {
+		CRC_STEP(cc, c, reg, p);
+		CRC_STEP(cc, c1, reg, p1);
+		CRC_STEP(cc, c2, reg, p2);
+	}
+	/* What's left over belongs to the third part */
+	for (i = 3 * n3; i < n; i++, p2 += 4)
+		CRC_STEP(cc, c2, reg, p2);
+	return (_xbf_crc32c_shift(c, CRC_NBITS(n - n3)) ^
+	    _xbf_crc32c_shift(c1, CRC_NBITS(n - 2 * n3)) ^ c2);
+}
+#endif /* CRC_X86 */
+
+static uint32_t
+crc_words(const struct crc_ctx *cc, uint32_t c, unsigned reg,
+    const uint8_t *p, size_t n)
+{
+
+#ifdef CRC_X86
+	if (cc->cc_kern == XBF_KERN_SSE42)
+		return (crc_words_sse42(cc, c, reg, p, n));
+#endif
+	return (crc_words_scalar(cc, c, reg, p, n));
+}
+
+/*
+ * Virtex-II: CRC-16, a bit at a time.  The devices are small.
+ */
+static uint32_t
+crc_words16(uint32_t c, unsigned reg, const uint8_t *p, size_t n)
+{
+	uint64_t v;
+	uint32_t w;
+	size_t i;
+	int b;
+
+	for (i = 0; i < n; i++, p += 4) {
+		memcpy(&w, p, sizeof(w));
+		v = ((uint64_t)(reg & 0xf) << 32) | ntohl(w);
+		for (b = 0; b < 36; b++, v >>= 1)
+			c = (c >> 1) ^ (((c ^ v) & 1) ? CRC_POLY16 : 0);
+	}
+	return (c);
+}
+
+/*
+ * Replay the register writes of the payload and compare the CRC with
+ * every CRC register write, using the kernel chosen by the caller.
+ */
+int
+_xbf_crc_verify_kern(int kern, struct xbf *xbf, size_t *nchecked)
+{
+	struct xbf_pkts pk;
+	struct crc_ctx cc;
+	const struct xbf_pkt *p;
+	const uint8_t *data;
+	uint32_t crc, w;
+	size_t i, n;
+	int fam, error;
+
+	xbf_assert(xbf);
+	fam = xbf_get_family(xbf);
+	if (fam == XBF_FAM_UNKNOWN || fam == XBF_FAM_S6)
+		return (xbf_erri(xbf, "Configuration CRC of part '%s' isn't "
+		    "supported", xbf->xbf_partname));
+	if (xbf_pkt_decode(xbf, &pk) != 0)
+		return (-1);
+	crc_ctx_init(&cc, kern);
+	data = (const uint8_t *)xbf->xbf_data;
+	crc = 0;
+	error = 0;
+	for (i = 0, n = 0; i < pk.xp_npkts && error == 0; i++) {
+		p = &pk.xp_pkts[i];
+		if (p->xp_type == XBF_PKT_SYNC || p->xp_op != XBF_PKT_OP_WRITE ||
+		    p->xp_wcnt == 0)
+			continue;
+		if (p->xp_reg == XBF_REG_CRC) {
+			w = xbf_pkt_word(xbf, p, 0);
+			if (fam == XBF_FAM_V2)
+				w &= 0xffff;
+			if (w != crc)
+				error = xbf_erri(xbf, "Configuration CRC "
+				    "mismatch at offset %d: stream has 0x%08x, "
+				    "computed 0x%08x", (int)p->xp_off, w, crc);
+			crc = 0;
+			n++;
+		} else if (p->xp_reg == XBF_REG_CMD && p->xp_wcnt == 1 &&
+		    xbf_pkt_word(xbf, p, 0) == XBF_CMD_RCRC)
+			crc = 0;
+		else if (fam == XBF_FAM_V2)
+			crc = crc_words16(crc, p->xp_reg,
+			    data + p->xp_off + 4, p->xp_wcnt);
+		else
+			crc = crc_words(&cc, crc, p->xp_reg,
+			    data + p->xp_off + 4, p->xp_wcnt);
+	}
+	xbf_pkt_free(&pk);
+	if (nchecked != NULL)
+		*nchecked = n;
+	return (error);
+}
+
+/*
+ * Same, with the fastest kernel.  ``nchecked'' gets the number of CRC
+ * writes checked; bit streams made with CRC disabled have none.
+ */
+int
+xbf_crc_verify(struct xbf *xbf, size_t *nchecked)
+{
+
+	return (_xbf_crc_verify_kern(_xbf_cpu_has(XBF_KERN_SSE42) ?
+	    XBF_KERN_SSE42 : XBF_KERN_SCALAR, xbf, nchecked));
+}
+
+/*
+ * Feed ``n'' big endian words written to ``reg'' into the configuration
+ * CRC of family ``fam''.  For writers of bit streams.
+ */
+uint32_t
+_xbf_crc_update(int fam, uint32_t crc, unsigned reg, const void *words,
+    size_t n)
+{
+	struct crc_ctx cc;
+
+	if (fam == XBF_FAM_V2)
+		return (crc_words16(crc, reg, words, n));
+	crc_ctx_init(&cc, _xbf_cpu_has(XBF_KERN_SSE42) ? XBF_KERN_SSE42 :
+	    XBF_KERN_SCALAR);
+	return (crc_words(&cc, crc, reg, words, n));
+}
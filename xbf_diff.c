@@ -0,0 +1,503 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Frame by frame comparison of two bit streams of the same design
+ * layout, and partial bit streams rewriting only what changed.
+ *
+ * Frames are compared with an AVX2 kernel that ORs the XOR of both
+ * frames 32 bytes at a time and tests the result once per frame.  A
+ * frame can only be addressed relative to the FAR written before its
+ * burst (see xbf_frame.c), so the partial bit stream rewrites every
+ * frame from that FAR up to the last changed one, followed by a pad
+ * frame to flush the frame buffer.  Streams written with a FAR per
+ * frame or per row get the finest granularity.
+ */
+
+#include <sys/param.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIFF_X86
+#endif
+
+#include "xbf.h"
+
+#define ARRAY_SIZE(x)	((int)(sizeof(x)/sizeof(x[0])))
+
+#define DIFF_T1_WRITE(reg, n)	((1U << 29) | (2U << 27) | ((reg) << 13) | (n))
+#define DIFF_T2_WRITE(n)	((2U << 29) | (2U << 27) | (n))
+#define DIFF_NOOP		0x20000000
+#define DIFF_FLUSH_NOOPS	100	/* After LFRM */
+
+static int
+diff_frame_eq_scalar(const uint8_t *a, const uint8_t *b, size_t n)
+{
+
+	return (memcmp(a, b, n) == 0);
+}
+
+#ifdef DIFF_X86
+/* ``n'' is at least 32 */
+__attribute__((target("avx2")))
+static int
+diff_frame_eq_avx2(const uint8_t *a, const uint8_t *b, size_t n)
+{
+	__m256i acc;
+	size_t i;
+
+	acc = _mm256_setzero_si256();
+	for (i = 0; i + 32 <= n; i += 32)
+		acc = _mm256_or_si256(acc, _mm256_xor_si256(
+		    _mm256_loadu_si256((const void *)(a + i)),
+		    _mm256_loadu_si256((const void *)(b + i))));
+	/* The tail overlaps with what's been compared already */
+	if (i < n)
+		acc = _mm256_or_si256(acc, _mm256_xor_si256(
+		    _mm256_loadu_si256((const void *)(a + n - 32)),
+		    _mm256_loadu_si256((const void *)(b + n - 32))));
+	return (_mm256_testz_si256(acc, acc));
+}
+#endif
+
+static int
+diff_range_add(struct xbf *xbf, struct xbf_diff *xd,
+    const struct xbf_diff_range *r)
+{
+	struct xbf_diff_range *nr;
+	size_t ncap;
+
+	if (xd->xd_nranges == xd->xd_cap) {
+		ncap = (xd->xd_cap == 0) ? 16 : xd->xd_cap * 2;
+		nr = realloc(xd->xd_ranges, ncap * sizeof(*nr));
+		if (nr == NULL)
+			return (xbf_erri(xbf, "Couldn't allocate memory"));
+		xd->xd_ranges = nr;
+		xd->xd_cap = ncap;
+	}
+	xd->xd_ranges[xd->xd_nranges++] = *r;
+	return (0);
+}
+
+static int
+diff_bursts(struct xbf *xbf, struct xbf_bursts *xb)
+{
+	struct xbf_pkts pk;
+	int error;
+
+	if (xbf_pkt_decode(xbf, &pk) != 0)
+		return (-1);
+	error = _xbf_frame_bursts(xbf, &pk, xb);
+	xbf_pkt_free(&pk);
+	return (error);
+}
+
+/*
+ * Compare the frames of ``old'' and ``new'' with the kernel chosen by
+ * the caller.  Errors are reported in ``new''.
+ */
+int
+_xbf_diff_kern(int kern, struct xbf *old, struct xbf *new,
+    struct xbf_diff *xd)
+{
+	struct xbf_bursts ob;
+	const struct xbf_burst *bo, *bn;
+	struct xbf_diff_range r;
+	const uint8_t *po, *pn;
+	size_t i, f, fbytes;
+	int eq, inrange;
+
+	xbf_assert(old);
+	xbf_assert(new);
+	memset(xd, 0, sizeof(*xd));
+	if (xbf_get_family(old) != xbf_get_family(new))
+		return (xbf_erri(new, "Parts '%s' and '%s' differ",
+		    old->xbf_partname, new->xbf_partname));
+	if (diff_bursts(new, &xd->xd_bursts) != 0)
+		return (-1);
+	if (diff_bursts(old, &ob) != 0) {
+		xbf_erri(new, "Old bit stream: %s", xbf_errmsg(old));
+		xbf_diff_free(xd);
+		return (-1);
+	}
+	for (i = 0; i < ob.xb_nbursts || i < xd->xd_bursts.xb_nbursts; i++) {
+		if (i == ob.xb_nbursts || i == xd->xd_bursts.xb_nbursts)
+			break;
+		bo = &ob.xb_bursts[i];
+		bn = &xd->xd_bursts.xb_bursts[i];
+		if (bo->xb_far != bn->xb_far || bo->xb_first != bn->xb_first ||
+		    bo->xb_nframes != bn->xb_nframes ||
+		    bo->xb_farok != bn->xb_farok)
+			break;
+	}
+	if (i != ob.xb_nbursts || i != xd->xd_bursts.xb_nbursts) {
+		_xbf_frame_bursts_free(&ob);
+		xbf_diff_free(xd);
+		return (xbf_erri(new, "Frame layouts differ from FDRI burst "
+		    "%d on", (int)i));
+	}
+
+	fbytes = ob.xb_flen * 4;
+	xd->xd_flen = ob.xb_flen;
+	for (i = 0; i < ob.xb_nbursts; i++) {
+		bo = &ob.xb_bursts[i];
+		bn = &xd->xd_bursts.xb_bursts[i];
+		po = (const uint8_t *)old->xbf_data + bo->xb_off;
+		pn = (const uint8_t *)new->xbf_data + bn->xb_off;
+		inrange = 0;
+		for (f = 0; f < bn->xb_nframes; f++) {
+#ifdef DIFF_X86
+			if (kern == XBF_KERN_AVX2)
+				eq = diff_frame_eq_avx2(po + f * fbytes,
+				    pn + f * fbytes, fbytes);
+			else
+#endif
+				eq = diff_frame_eq_scalar(po + f * fbytes,
+				    pn + f * fbytes, fbytes);
+			if (!eq && !inrange) {
+				r.xdr_far = bn->xb_far;
+				r.xdr_first = bn->xb_first + f;
+				r.xdr_nframes = 0;
+				r.xdr_off = bn->xb_off + f * fbytes;
+				r.xdr_burst = i;
+				r.xdr_farok = bn->xb_farok;
+				inrange = 1;
+			}
+			if (!eq)
+				r.xdr_nframes++;
+			if ((eq || f + 1 == bn->xb_nframes) && inrange) {
+				if (diff_range_add(new, xd, &r) != 0) {
+					_xbf_frame_bursts_free(&ob);
+					xbf_diff_free(xd);
+					return (-1);
+				}
+				xd->xd_nchanged += r.xdr_nframes;
+				inrange = 0;
+			}
+		}
+		xd->xd_nframes += bn->xb_nframes;
+	}
+	_xbf_frame_bursts_free(&ob);
+	return (0);
+}
+
+/*
+ * Which frames of ``new'' differ from ``old''?  Both have to come from
+ * the same kind of bit stream: the same FDRI bursts after the same FAR
+ * writes.  Errors are reported in ``new''.
+ */
+int
+xbf_diff(struct xbf *old, struct xbf *new, struct xbf_diff *xd)
+{
+
+	return (_xbf_diff_kern(_xbf_cpu_has(XBF_KERN_AVX2) ? XBF_KERN_AVX2 :
+	    XBF_KERN_SCALAR, old, new, xd));
+}
+
+void
+xbf_diff_free(struct xbf_diff *xd)
+{
+
+	_xbf_frame_bursts_free(&xd->xd_bursts);
+	free(xd->xd_ranges);
+	memset(xd, 0, sizeof(*xd));
+}
+
+void
+xbf_diff_print_fp(FILE *fp, struct xbf_diff *xd)
+{
+	const struct xbf_diff_range *r;
+	size_t i;
+
+	fprintf(fp, "%d of %d frames changed, in %d ranges\n",
+	    (int)xd->xd_nchanged, (int)xd->xd_nframes, (int)xd->xd_nranges);
+	for (i = 0; i < xd->xd_nranges; i++) {
+		r = &xd->xd_ranges[i];
+		if (r->xdr_farok)
+			fprintf(fp, "  FAR 0x%08x", r->xdr_far);
+		else
+			fprintf(fp, "  FAR unknown ");
+		fprintf(fp, " +%-6u %6u frames at offset %u\n", r->xdr_first,
+		    r->xdr_nframes, r->xdr_off);
+	}
+}
+
+/*
+ * Partial bit stream writer.  With ``do_fd'' == -1 it only counts the
+ * bytes, which is needed for the header.
+ */
+struct diff_out {
+	struct xbf	*do_xbf;
+	int		 do_fd;
+	int		 do_fam;
+	uint32_t	 do_crc;
+	size_t		 do_len;
+	size_t		 do_n;
+	uint32_t	 do_buf[128];
+};
+
+static int
+diff_out_flush(struct diff_out *o)
+{
+	int error = 0;
+
+	if (o->do_fd != -1 && o->do_n > 0)
+		error = _xbf_write(o->do_xbf, o->do_fd, o->do_buf,
+		    o->do_n * 4);
+	o->do_n = 0;
+	return (error);
+}
+
+static int
+diff_out_word(struct diff_out *o, uint32_t w)
+{
+
+	if (o->do_n == ARRAY_SIZE(o->do_buf) && diff_out_flush(o) != 0)
+		return (-1);
+	o->do_buf[o->do_n++] = htonl(w);
+	o->do_len += 4;
+	return (0);
+}
+
+/*
+ * Type 1 write of one word to ``reg'', with the CRC kept up to date.
+ */
+static int
+diff_out_reg(struct diff_out *o, unsigned reg, uint32_t val)
+{
+	uint32_t be;
+
+	if (diff_out_word(o, DIFF_T1_WRITE(reg, 1)) != 0 ||
+	    diff_out_word(o, val) != 0)
+		return (-1);
+	if (reg == XBF_REG_CRC || (reg == XBF_REG_CMD &&
+	    val == XBF_CMD_RCRC))
+		o->do_crc = 0;
+	else if (o->do_fd != -1) {
+		be = htonl(val);
+		o->do_crc = _xbf_crc_update(o->do_fam, o->do_crc, reg, &be, 1);
+	}
+	return (0);
+}
+
+/*
+ * FDRI data, written as it is.  NULL stands for zeros.
+ */
+static int
+diff_out_data(struct diff_out *o, const void *data, size_t nwords)
+{
+	static const uint32_t zero[128];
+	size_t n;
+
+	if (o->do_fd == -1) {
+		o->do_len += nwords * 4;
+		return (0);
+	}
+	if (diff_out_flush(o) != 0)
+		return (-1);
+	if (data != NULL) {
+		o->do_crc = _xbf_crc_update(o->do_fam, o->do_crc,
+		    XBF_REG_FDRI, data, nwords);
+		o->do_len += nwords * 4;
+		return (_xbf_write(o->do_xbf, o->do_fd, data, nwords * 4));
+	}
+	for (; nwords > 0; nwords -= n) {
+		n = MIN(nwords, ARRAY_SIZE(zero));
+		o->do_crc = _xbf_crc_update(o->do_fam, o->do_crc,
+		    XBF_REG_FDRI, zero, n);
+		o->do_len += n * 4;
+		if (_xbf_write(o->do_xbf, o->do_fd, zero, n * 4) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Rewrite frames 0 .. ``last'' after the FAR of burst ``b0'', taking
+ * them from the bursts that continue from it.
+ */
+static int
+diff_out_frames(struct diff_out *o, struct xbf_diff *xd, size_t b0,
+    uint32_t last)
+{
+	const struct xbf_bursts *xb = &xd->xd_bursts;
+	const struct xbf_burst *b;
+	const char *data;
+	uint32_t n;
+	size_t i;
+
+	b = &xb->xb_bursts[b0];
+	if (diff_out_reg(o, XBF_REG_FAR, b->xb_far) != 0 ||
+	    diff_out_reg(o, XBF_REG_CMD, XBF_CMD_WCFG) != 0 ||
+	    diff_out_word(o, DIFF_NOOP) != 0 ||
+	    diff_out_word(o, DIFF_T1_WRITE(XBF_REG_FDRI, 0)) != 0 ||
+	    diff_out_word(o, DIFF_T2_WRITE((last + 2) * xb->xb_flen)) != 0)
+		return (-1);
+	data = o->do_xbf->xbf_data;
+	for (i = b0; i < xb->xb_nbursts; i++) {
+		b = &xb->xb_bursts[i];
+		if (i > b0 && b->xb_first == 0)
+			break;
+		if (b->xb_first > last)
+			break;
+		n = MIN(b->xb_nframes, last + 1 - b->xb_first);
+		if (diff_out_data(o, data + b->xb_off,
+		    (size_t)n * xb->xb_flen) != 0)
+			return (-1);
+	}
+	/* Pad frame */
+	return (diff_out_data(o, NULL, xb->xb_flen));
+}
+
+/*
+ * First burst of the run ``b'' belongs to, the one right after a FAR.
+ */
+static size_t
+diff_run_start(struct xbf_diff *xd, size_t b)
+{
+
+	while (b > 0 && xd->xd_bursts.xb_bursts[b].xb_first != 0)
+		b--;
+	return (b);
+}
+
+static int
+diff_out_all(struct diff_out *o, struct xbf_diff *xd, uint32_t idcode,
+    int has_idcode)
+{
+	const struct xbf_diff_range *r;
+	size_t i, j, b0;
+	uint32_t last;
+	int k;
+
+	for (k = 0; k < 8; k++)
+		if (diff_out_word(o, XBF_DUMMY_WORD) != 0)
+			return (-1);
+	if (diff_out_word(o, XBF_BUSWIDTH_WORD0) != 0 ||
+	    diff_out_word(o, XBF_BUSWIDTH_WORD1) != 0 ||
+	    diff_out_word(o, XBF_DUMMY_WORD) != 0 ||
+	    diff_out_word(o, XBF_DUMMY_WORD) != 0 ||
+	    diff_out_word(o, XBF_SYNC_WORD) != 0 ||
+	    diff_out_word(o, DIFF_NOOP) != 0 ||
+	    diff_out_reg(o, XBF_REG_CMD, XBF_CMD_RCRC) != 0 ||
+	    diff_out_word(o, DIFF_NOOP) != 0 ||
+	    diff_out_word(o, DIFF_NOOP) != 0)
+		return (-1);
+	if (has_idcode && diff_out_reg(o, XBF_REG_IDCODE, idcode) != 0)
+		return (-1);
+
+	/* One FAR write per run of bursts that continue from it */
+	for (i = 0; i < xd->xd_nranges; i = j) {
+		b0 = diff_run_start(xd, xd->xd_ranges[i].xdr_burst);
+		last = 0;
+		for (j = i; j < xd->xd_nranges; j++) {
+			r = &xd->xd_ranges[j];
+			if (diff_run_start(xd, r->xdr_burst) != b0)
+				break;
+			last = r->xdr_first + r->xdr_nframes - 1;
+		}
+		if (diff_out_frames(o, xd, b0, last) != 0)
+			return (-1);
+	}
+
+	if (diff_out_reg(o, XBF_REG_CRC, o->do_crc) != 0 ||
+	    diff_out_word(o, DIFF_NOOP) != 0 ||
+	    diff_out_word(o, DIFF_NOOP) != 0 ||
+	    diff_out_reg(o, XBF_REG_CMD, XBF_CMD_LFRM) != 0)
+		return (-1);
+	for (k = 0; k < DIFF_FLUSH_NOOPS; k++)
+		if (diff_out_word(o, DIFF_NOOP) != 0)
+			return (-1);
+	if (diff_out_reg(o, XBF_REG_CMD, XBF_CMD_DESYNC) != 0)
+		return (-1);
+	for (k = 0; k < 16; k++)
+		if (diff_out_word(o, DIFF_NOOP) != 0)
+			return (-1);
+	return (diff_out_flush(o));
+}
+
+/*
+ * Write a partial bit stream to ``fd'' that turns a device configured
+ * with the old bit stream into one configured with ``new''.  ``xd''
+ * has to come from xbf_diff() with the same ``new''.
+ */
+int
+xbf_diff_write(struct xbf *new, struct xbf_diff *xd, int fd)
+{
+	struct xbf_pkts pk;
+	struct diff_out o;
+	char hdr[XBF_PROBE_SIZE];
+	uint32_t idcode = 0;
+	ssize_t hlen;
+	size_t i;
+	int has_idcode = 0;
+
+	xbf_assert(new);
+	for (i = 0; i < xd->xd_nranges; i++)
+		if (!xd->xd_ranges[i].xdr_farok)
+			return (xbf_erri(new, "Changed frames at offset %u "
+			    "have no FAR written before them",
+			    xd->xd_ranges[i].xdr_off));
+	if (xbf_pkt_decode(new, &pk) != 0)
+		return (-1);
+	for (i = 0; i < pk.xp_npkts; i++)
+		if (pk.xp_pkts[i].xp_type != XBF_PKT_SYNC &&
+		    pk.xp_pkts[i].xp_op == XBF_PKT_OP_WRITE &&
+		    pk.xp_pkts[i].xp_reg == XBF_REG_IDCODE &&
+		    pk.xp_pkts[i].xp_wcnt == 1) {
+			idcode = xbf_pkt_word(new, &pk.xp_pkts[i], 0);
+			has_idcode = 1;
+		}
+	xbf_pkt_free(&pk);
+
+	/* Dry run for the length first */
+	memset(&o, 0, sizeof(o));
+	o.do_xbf = new;
+	o.do_fd = -1;
+	o.do_fam = xbf_get_family(new);
+	if (diff_out_all(&o, xd, idcode, has_idcode) != 0)
+		return (-1);
+	if (o.do_len > UINT32_MAX)
+		return (xbf_erri(new, "Partial bit stream would be too big"));
+	hlen = _xbf_hdr_build(new, o.do_len, hdr, sizeof(hdr));
+	if (hlen == -1 || _xbf_write(new, fd, hdr, hlen) != 0)
+		return (-1);
+	o.do_fd = fd;
+	o.do_crc = 0;
+	o.do_len = 0;
+	return (diff_out_all(&o, xd, idcode, has_idcode));
+}
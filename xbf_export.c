@@ -0,0 +1,381 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Writing the payload out as a raw .bin image, the way programming
+ * tools want it.  SelectMAP x8 in most setups expects every byte with
+ * its bits reversed, some flash programmers want 32-bit words in the
+ * other byte order.
+ *
+ * The payload is converted in chunks into an aligned buffer, which is
+ * then written out, so memory use doesn't depend on the image size.
+ * The SSSE3 and AVX2 kernels do both conversions with PSHUFB: directly
+ * for the byte swap, and as two nibble lookups for the bit reversal.
+ *
+ * The same payload can also go out as an Intel HEX (.mcs) PROM file.
+ * That one is encoded in small chunks too: the text image of a large
+ * device is almost 3 times the size of the payload.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EXPORT_X86
+#endif
+
+#include "xbf.h"
+
+/* Size of the conversion buffer */
+#define EXPORT_BUFSIZE	(1024 * 1024)
+#define EXPORT_ALIGN	64
+
+/* Payload bytes per MCS data record, and per conversion chunk */
+#define MCS_RECLEN	16
+#define MCS_CHUNK	(64 * 1024)
+/* ':', length, address, type, 255 bytes of data, checksum, newline */
+#define MCS_RECMAX	(1 + 2 + 4 + 2 + 255 * 2 + 2 + 1)
+#define MCS_OUTSIZE	(64 * 1024)
+
+#define MCS_DATA	0x00
+#define MCS_EOF		0x01
+#define MCS_ELA		0x04	/* Extended linear address */
+
+/* Every byte value in upper case hex */
+static const char export_hex[256][2] = {
+#define HX(v)	((v) < 10 ? '0' + (v) : 'A' - 10 + (v))
+#define H1(n)	{ HX((n) >> 4), HX((n) & 15) }
+#define H4(n)	H1(n), H1((n) + 1), H1((n) + 2), H1((n) + 3)
+#define H16(n)	H4(n), H4((n) + 4), H4((n) + 8), H4((n) + 12)
+#define H64(n)	H16(n), H16((n) + 16), H16((n) + 32), H16((n) + 48)
+	H64(0), H64(64), H64(128), H64(192)
+#undef H64
+#undef H16
+#undef H4
+#undef H1
+#undef HX
+};
+
+/* Bits of every byte reversed */
+static const uint8_t export_bitrev_tbl[256] = {
+#define R2(n)	(n), (n) + 2 * 64, (n) + 1 * 64, (n) + 3 * 64
+#define R4(n)	R2(n), R2((n) + 2 * 16), R2((n) + 1 * 16), R2((n) + 3 * 16)
+#define R6(n)	R4(n), R4((n) + 2 * 4), R4((n) + 1 * 4), R4((n) + 3 * 4)
+	R6(0), R6(2), R6(1), R6(3)
+#undef R6
+#undef R4
+#undef R2
+};
+
+static void
+export_conv_scalar(int mode, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	uint32_t w;
+	size_t i;
+
+	switch (mode) {
+	case XBF_EXPORT_SWAP32:
+		for (i = 0; i + 4 <= len; i += 4) {
+			memcpy(&w, src + i, sizeof(w));
+			w = __builtin_bswap32(w);
+			memcpy(dst + i, &w, sizeof(w));
+		}
+		/* Odd tail is copied as it is */
+		memcpy(dst + i, src + i, len - i);
+		break;
+	case XBF_EXPORT_BITREV:
+		for (i = 0; i < len; i++)
+			dst[i] = export_bitrev_tbl[src[i]];
+		break;
+	default:
+		memcpy(dst, src, len);
+		break;
+	}
+}
+
+#ifdef EXPORT_X86
+/* Bit reversed nibbles, shifted to the high and low half of a byte */
+#define EXPORT_NIB_HI							\
+	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,			\
+	0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0
+#define EXPORT_NIB_LO							\
+	0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,				\
+	0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+#define EXPORT_BSWAP							\
+	3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+
+__attribute__((target("ssse3")))
+static void
+export_conv_ssse3(int mode, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m128i bswap = _mm_setr_epi8(EXPORT_BSWAP);
+	const __m128i nhi = _mm_setr_epi8(EXPORT_NIB_HI);
+	const __m128i nlo = _mm_setr_epi8(EXPORT_NIB_LO);
+	const __m128i m4 = _mm_set1_epi8(0x0f);
+	__m128i v, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const void *)(src + i));
+		if (mode == XBF_EXPORT_SWAP32)
+			v = _mm_shuffle_epi8(v, bswap);
+		else {
+			lo = _mm_and_si128(v, m4);
+			hi = _mm_and_si128(_mm_srli_epi16(v, 4), m4);
+			v = _mm_or_si128(_mm_shuffle_epi8(nhi, lo),
+			    _mm_shuffle_epi8(nlo, hi));
+		}
+		_mm_storeu_si128((void *)(dst + i), v);
+	}
+	export_conv_scalar(mode, dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void
+export_conv_avx2(int mode, uint8_t *dst, const uint8_t *src, size_t len)
+{
+	const __m256i bswap = _mm256_setr_epi8(EXPORT_BSWAP, EXPORT_BSWAP);
+	const __m256i nhi = _mm256_setr_epi8(EXPORT_NIB_HI, EXPORT_NIB_HI);
+	const __m256i nlo = _mm256_setr_epi8(EXPORT_NIB_LO, EXPORT_NIB_LO);
+	const __m256i m4 = _mm256_set1_epi8(0x0f);
+	__m256i v, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const void *)(src + i));
+		if (mode == XBF_EXPORT_SWAP32)
+			v = _mm256_shuffle_epi8(v, bswap);
+		else {
+			lo = _mm256_and_si256(v, m4);
+			hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), m4);
+			v = _mm256_or_si256(_mm256_shuffle_epi8(nhi, lo),
+			    _mm256_shuffle_epi8(nlo, hi));
+		}
+		_mm256_store_si256((void *)(dst + i), v);
+	}
+	export_conv_scalar(mode, dst + i, src + i, len - i);
+}
+#endif /* EXPORT_X86 */
+
+/*
+ * Convert ``len'' bytes from ``src'' to ``dst'' with the kernel chosen
+ * by the caller.  The AVX2 kernel wants ``dst'' 32 byte aligned.
+ */
+void
+_xbf_export_conv_kern(int kern, int mode, void *dst, const void *src,
+    size_t len)
+{
+
+	if (mode == XBF_EXPORT_ASIS) {
+		memcpy(dst, src, len);
+		return;
+	}
+	switch (kern) {
+#ifdef EXPORT_X86
+	case XBF_KERN_AVX2:
+		ASSERT(((uintptr_t)dst & 31) == 0);
+		export_conv_avx2(mode, dst, src, len);
+		break;
+	case XBF_KERN_SSSE3:
+		export_conv_ssse3(mode, dst, src, len);
+		break;
+#endif
+	default:
+		export_conv_scalar(mode, dst, src, len);
+		break;
+	}
+}
+
+/*
+ * Convert ``len'' bytes of a payload for the XBF_EXPORT_* ``mode'' with
+ * the fastest kernel the CPU has.
+ */
+void
+xbf_export_conv(int mode, void *dst, const void *src, size_t len)
+{
+	static int kern = -1;
+	int k;
+
+	k = __atomic_load_n(&kern, __ATOMIC_RELAXED);
+	if (k == -1) {
+		if (_xbf_cpu_has(XBF_KERN_AVX2))
+			k = XBF_KERN_AVX2;
+		else if (_xbf_cpu_has(XBF_KERN_SSSE3))
+			k = XBF_KERN_SSSE3;
+		else
+			k = XBF_KERN_SCALAR;
+		__atomic_store_n(&kern, k, __ATOMIC_RELAXED);
+	}
+	if (k == XBF_KERN_AVX2 && ((uintptr_t)dst & 31) != 0)
+		k = XBF_KERN_SSSE3;
+	_xbf_export_conv_kern(k, mode, dst, src, len);
+}
+
+/*
+ * Write the payload of ``xbf'' to ``fd'' as a raw .bin image.
+ */
+int
+xbf_export_bin(struct xbf *xbf, int fd, int mode)
+{
+	const uint8_t *src;
+	uint8_t *buf;
+	size_t len, n;
+	int error = 0;
+
+	xbf_assert(xbf);
+	if (mode != XBF_EXPORT_ASIS && mode != XBF_EXPORT_SWAP32 &&
+	    mode != XBF_EXPORT_BITREV)
+		return (xbf_erri(xbf, "Unknown export mode %d", mode));
+	src = (const uint8_t *)xbf->xbf_data;
+	len = xbf->xbf_len;
+	if (src == NULL)
+		return (xbf_erri(xbf, "Payload isn't in memory"));
+
+	/* Nothing to convert, write straight from the mapping */
+	if (mode == XBF_EXPORT_ASIS)
+		return (_xbf_write(xbf, fd, src, len));
+
+	if (posix_memalign((void **)&buf, EXPORT_ALIGN,
+	    MIN(len, EXPORT_BUFSIZE)) != 0)
+		return (xbf_erri(xbf, "Couldn't allocate export buffer"));
+	while (len > 0 && error == 0) {
+		n = MIN(len, EXPORT_BUFSIZE);
+		xbf_export_conv(mode, buf, src, n);
+		error = _xbf_write(xbf, fd, buf, n);
+		src += n;
+		len -= n;
+	}
+	free(buf);
+	return (error);
+}
+
+/*
+ * Encode one record at ``p'' and return where it ends.
+ */
+static char *
+mcs_record(char *p, uint8_t type, uint16_t addr, const uint8_t *data,
+    size_t n)
+{
+	uint8_t sum;
+	size_t i;
+
+	ASSERT(n <= 255);
+	sum = n + (addr >> 8) + addr + type;
+	*p++ = ':';
+	memcpy(p, export_hex[n], 2);
+	memcpy(p + 2, export_hex[addr >> 8], 2);
+	memcpy(p + 4, export_hex[addr & 0xff], 2);
+	memcpy(p + 6, export_hex[type], 2);
+	p += 8;
+	for (i = 0; i < n; i++) {
+		memcpy(p, export_hex[data[i]], 2);
+		p += 2;
+		sum += data[i];
+	}
+	memcpy(p, export_hex[(uint8_t)-sum], 2);
+	p[2] = '\n';
+	return (p + 3);
+}
+
+/*
+ * Write the payload of ``xbf'' to ``fd'' as an Intel HEX (.mcs) file
+ * placed at ``addr'' in the PROM, converted for ``mode'' first.
+ * Memory use is bounded by the conversion and output buffers.
+ */
+int
+xbf_export_mcs(struct xbf *xbf, int fd, uint32_t addr, int mode)
+{
+	const uint8_t *src;
+	uint8_t *chunk, ela[2];
+	char *out, *p;
+	size_t len, n, i, rec;
+	uint32_t hi = UINT32_MAX;
+	int error = 0;
+
+	xbf_assert(xbf);
+	if (mode != XBF_EXPORT_ASIS && mode != XBF_EXPORT_SWAP32 &&
+	    mode != XBF_EXPORT_BITREV)
+		return (xbf_erri(xbf, "Unknown export mode %d", mode));
+	src = (const uint8_t *)xbf->xbf_data;
+	len = xbf->xbf_len;
+	if (src == NULL)
+		return (xbf_erri(xbf, "Payload isn't in memory"));
+	if ((uint64_t)addr + len > ((uint64_t)1 << 32))
+		return (xbf_erri(xbf, "Image at %#x doesn't fit in 4GB", addr));
+
+	chunk = NULL;
+	out = malloc(MCS_OUTSIZE);
+	if (out == NULL || (mode != XBF_EXPORT_ASIS &&
+	    posix_memalign((void **)&chunk, EXPORT_ALIGN, MCS_CHUNK) != 0)) {
+		free(out);
+		return (xbf_erri(xbf, "Couldn't allocate export buffers"));
+	}
+	p = out;
+	while (len > 0 && error == 0) {
+		n = MIN(len, MCS_CHUNK);
+		if (chunk != NULL)
+			xbf_export_conv(mode, chunk, src, n);
+		for (i = 0; i < n; i += rec) {
+			/* Records can't cross a 64kB boundary */
+			rec = MIN(n - i, MCS_RECLEN);
+			rec = MIN(rec, 0x10000 - (addr & 0xffff));
+			if (p - out > MCS_OUTSIZE - 2 * MCS_RECMAX) {
+				error = _xbf_write(xbf, fd, out, p - out);
+				if (error != 0)
+					break;
+				p = out;
+			}
+			if ((addr >> 16) != hi) {
+				hi = addr >> 16;
+				ela[0] = hi >> 8;
+				ela[1] = hi;
+				p = mcs_record(p, MCS_ELA, 0, ela, 2);
+			}
+			p = mcs_record(p, MCS_DATA, addr & 0xffff,
+			    (chunk != NULL ? chunk : src) + i, rec);
+			addr += rec;
+		}
+		src += n;
+		len -= n;
+	}
+	if (error == 0) {
+		p = mcs_record(p, MCS_EOF, 0, NULL, 0);
+		error = _xbf_write(xbf, fd, out, p - out);
+	}
+	free(chunk);
+	free(out);
+	return (error);
+}
@@ -0,0 +1,327 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Push parser for bit streams that arrive in pieces (pipes, sockets).
+ *
+ * The header is collected field by field into a small buffer inside
+ * the context, and every field is checked as soon as it's complete, so
+ * garbage is rejected after a couple of bytes.  Once the 'e' length is
+ * in, the whole header goes through _xbf_setup() (the same checks as
+ * xbf_open()) and the header callback runs; from then on the payload is
+ * handed to the data callback straight from the caller's buffers.
+ */
+
+#include <sys/param.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xbf.h"
+
+/*
+ * Parser states, in the order the header is laid out.  Each one waits
+ * for xf_need bytes.
+ */
+enum {
+	FS_LEN1, FS_HDR1,
+	FS_LEN2, FS_KEYA,
+	FS_LEN3, FS_NCD,
+	FS_KEYB, FS_LEN4, FS_PART,
+	FS_KEYC, FS_LEN5, FS_DATE,
+	FS_KEYD, FS_LEN6, FS_TIME,
+	FS_KEYE, FS_LEN7,
+	FS_DATA,
+	FS_DONE,
+	FS_ERROR
+};
+
+/* Bytes of the header from 'c' to the end of the 'e' length */
+#define FEED_TAIL	(3 + 11 + 3 + 9 + 1 + 4)
+
+/* Header errors are recorded like _xbf_setup() does */
+#define FERR(xf, code, field, val)					\
+	xbf_errc(&(xf)->xf_xbf, (code), (field), (val), (xf)->xf_fstart)
+
+void
+xbf_feed_init(struct xbf_feed *xf, xbf_feed_hdr_cb_t *hdr_cb,
+    xbf_feed_data_cb_t *data_cb, void *arg)
+{
+
+	ASSERT(xf != NULL);
+	memset(xf, 0, sizeof(*xf));
+	xbf_init(&xf->xf_xbf);
+	xf->xf_xbf.xbf_fname = "(stream)";
+	xf->xf_hdr_cb = hdr_cb;
+	xf->xf_data_cb = data_cb;
+	xf->xf_arg = arg;
+	xf->xf_state = FS_LEN1;
+	xf->xf_need = 2;
+}
+
+static int
+feed_error(struct xbf_feed *xf)
+{
+
+	xf->xf_state = FS_ERROR;
+	return (-1);
+}
+
+/*
+ * Expect a single key byte of header field ``field'', then a 2 byte
+ * length.
+ */
+static int
+feed_key(struct xbf_feed *xf, uint8_t u8, char key, int field)
+{
+
+	if (u8 != key) {
+		FERR(xf, XBF_E_MAGIC, field, u8);
+		return (feed_error(xf));
+	}
+	xf->xf_state++;
+	xf->xf_need = 2;
+	return (0);
+}
+
+/*
+ * Length of a string field has arrived; make sure it fits.
+ */
+static int
+feed_strlen(struct xbf_feed *xf, uint16_t u16, size_t tail, int field)
+{
+
+	if (u16 == 0 || xf->xf_hdrlen + u16 + tail > sizeof(xf->xf_hdr)) {
+		FERR(xf, XBF_E_STRLEN, field, u16);
+		return (feed_error(xf));
+	}
+	xf->xf_state++;
+	xf->xf_need = u16;
+	return (0);
+}
+
+/*
+ * A string field has arrived; it must be terminated with 0.
+ */
+static int
+feed_str(struct xbf_feed *xf, int field)
+{
+
+	if (xf->xf_hdr[xf->xf_hdrlen - 1] != '\0') {
+		FERR(xf, XBF_E_STRTERM, field, 0);
+		return (feed_error(xf));
+	}
+	xf->xf_state++;
+	xf->xf_need = 1;
+	return (0);
+}
+
+/*
+ * Whole header is in xf_hdr: fill the context and tell the caller.
+ */
+static int
+feed_header(struct xbf_feed *xf)
+{
+	struct xbf *xbf = &xf->xf_xbf;
+
+	xbf->_xbf_flags |= XBF_FLAG_HDRONLY;
+	xbf->_xbf_mem = xf->xf_hdr;
+	xbf->_xbf_memsize = xf->xf_hdrlen;
+	/* The stream has no known size */
+	xbf->_xbf_filesize = SIZE_MAX;
+	if (_xbf_setup(xbf) != 0)
+		return (feed_error(xf));
+	xf->xf_left = xbf->xbf_len;
+	xf->xf_state = (xf->xf_left == 0) ? FS_DONE : FS_DATA;
+	if (xf->xf_hdr_cb != NULL && xf->xf_hdr_cb(xf->xf_arg, xbf) != 0) {
+		xbf_erri(xbf, "Stream rejected by the header callback");
+		return (feed_error(xf));
+	}
+	return (0);
+}
+
+/*
+ * Advance the header state machine once the field that started at
+ * xf_fstart is complete.
+ */
+static int
+feed_step(struct xbf_feed *xf)
+{
+	const char *p;
+	uint16_t u16;
+	uint8_t u8;
+
+	p = xf->xf_hdr + xf->xf_fstart;
+	u8 = *(const uint8_t *)p;
+	u16 = (xf->xf_hdrlen - xf->xf_fstart == 2) ?
+	    ntohs(*(const uint16_t *)p) : 0;
+
+	switch (xf->xf_state) {
+	case FS_LEN1:
+		if (u16 != 9) {
+			FERR(xf, XBF_E_FIELDLEN, 1, u16);
+			return (feed_error(xf));
+		}
+		xf->xf_state = FS_HDR1;
+		xf->xf_need = 9;
+		return (0);
+	case FS_HDR1:
+		xf->xf_state = FS_LEN2;
+		xf->xf_need = 2;
+		return (0);
+	case FS_LEN2:
+		if (u16 != 1) {
+			FERR(xf, XBF_E_FIELDLEN, 2, u16);
+			return (feed_error(xf));
+		}
+		xf->xf_state = FS_KEYA;
+		xf->xf_need = 1;
+		return (0);
+	case FS_KEYA:
+		return (feed_key(xf, u8, 'a', 2));
+	case FS_LEN3:
+		return (feed_strlen(xf, u16, 3 + 1 + FEED_TAIL, 3));
+	case FS_NCD:
+		return (feed_str(xf, 3));
+	case FS_KEYB:
+		return (feed_key(xf, u8, 'b', 4));
+	case FS_LEN4:
+		return (feed_strlen(xf, u16, FEED_TAIL, 4));
+	case FS_PART:
+		return (feed_str(xf, 4));
+	case FS_KEYC:
+		return (feed_key(xf, u8, 'c', 5));
+	case FS_LEN5:
+		if (u16 != 11) {
+			FERR(xf, XBF_E_FIELDLEN, 5, u16);
+			return (feed_error(xf));
+		}
+		xf->xf_state = FS_DATE;
+		xf->xf_need = 11;
+		return (0);
+	case FS_DATE:
+		return (feed_str(xf, 5));
+	case FS_KEYD:
+		return (feed_key(xf, u8, 'd', 6));
+	case FS_LEN6:
+		if (u16 != 9) {
+			FERR(xf, XBF_E_FIELDLEN, 6, u16);
+			return (feed_error(xf));
+		}
+		xf->xf_state = FS_TIME;
+		xf->xf_need = 9;
+		return (0);
+	case FS_TIME:
+		return (feed_str(xf, 6));
+	case FS_KEYE:
+		if (feed_key(xf, u8, 'e', 7) != 0)
+			return (-1);
+		xf->xf_need = 4;
+		return (0);
+	case FS_LEN7:
+		return (feed_header(xf));
+	}
+	ASSERT(0 && "unknown xbf_feed state");
+	return (feed_error(xf));
+}
+
+/*
+ * Push ``len'' bytes of the stream into the parser.  Returns -1 once
+ * the stream is known to be bad; the reason is in xf->xf_xbf.
+ */
+int
+xbf_feed(struct xbf_feed *xf, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t n;
+
+	ASSERT(xf != NULL);
+	if (xf->xf_state == FS_ERROR)
+		return (-1);
+
+	while (len > 0 && xf->xf_state < FS_DATA) {
+		n = MIN(len, xf->xf_need);
+		memcpy(xf->xf_hdr + xf->xf_hdrlen, p, n);
+		xf->xf_hdrlen += n;
+		xf->xf_need -= n;
+		p += n;
+		len -= n;
+		if (xf->xf_need > 0)
+			break;
+		if (feed_step(xf) != 0)
+			return (-1);
+		xf->xf_fstart = xf->xf_hdrlen;
+	}
+
+	if (len > 0 && xf->xf_state == FS_DATA) {
+		n = MIN(len, xf->xf_left);
+		if (xf->xf_data_cb != NULL &&
+		    xf->xf_data_cb(xf->xf_arg, p, n) != 0) {
+			xbf_erri(&xf->xf_xbf, "Stream rejected by the data "
+			    "callback");
+			return (feed_error(xf));
+		}
+		xf->xf_left -= n;
+		p += n;
+		len -= n;
+		if (xf->xf_left == 0)
+			xf->xf_state = FS_DONE;
+	}
+
+	/* Anything past the payload is ignored, just like xbf_open() does */
+	xf->xf_trailer += len;
+	return (0);
+}
+
+/*
+ * The stream is over.  Was it a complete bit stream?
+ */
+int
+xbf_feed_end(struct xbf_feed *xf)
+{
+
+	ASSERT(xf != NULL);
+	switch (xf->xf_state) {
+	case FS_ERROR:
+		return (-1);
+	case FS_DONE:
+		return (0);
+	case FS_DATA:
+		xbf_erri(&xf->xf_xbf, "Stream truncated, %u bytes of payload "
+		    "missing", (unsigned)xf->xf_left);
+		return (feed_error(xf));
+	default:
+		xbf_erri(&xf->xf_xbf, "Stream ended within the header");
+		return (feed_error(xf));
+	}
+}
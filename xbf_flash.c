@@ -0,0 +1,376 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Putting several bit streams into one flash image, e.g. a golden image
+ * and an update image for MultiBoot.
+ *
+ * Payloads are copied with copy_file_range(2) or sendfile(2) straight
+ * from the files they were opened from, so they don't have to be in
+ * memory at all (xbf_probe() contexts work), and are written from
+ * memory otherwise.  Gaps are filled with 0xFF, the erased state of the
+ * flash.  Nothing about the output depends on time or on the machine,
+ * so the same inputs always give the same image.
+ *
+ * With XBF_FLASH_MULTIBOOT a small header is put at offset 0.  It sets
+ * WBSTAR to the image added with XBF_FLASH_UPDATE and issues IPROG, so
+ * the device boots the update image.  If that fails, fallback makes the
+ * configuration logic ignore the IPROG and carry on to the golden image
+ * placed after the header (UG470, ``MultiBoot'').
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* copy_file_range() */
+#endif
+
+#include <sys/param.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+/* Type 1 packets of the MultiBoot header */
+#define FLASH_T1_WRITE(reg, n)	((1U << 29) | (2U << 27) | ((reg) << 13) | (n))
+#define FLASH_NOOP		0x20000000
+
+#define FLASH_PADSIZE		(64 * 1024)
+
+void
+xbf_flash_init(struct xbf_flash *xfl, uint32_t size, int flags)
+{
+
+	ASSERT(xfl != NULL);
+	memset(xfl, 0, sizeof(*xfl));
+	xbf_init(&xfl->xfl_xbf);
+	xfl->xfl_xbf.xbf_fname = "(flash)";
+	xfl->xfl_size = size;
+	xfl->xfl_flags = flags;
+}
+
+void
+xbf_flash_free(struct xbf_flash *xfl)
+{
+
+	ASSERT(xfl != NULL);
+	free(xfl->xfl_imgs);
+	xfl->xfl_imgs = NULL;
+	xfl->xfl_nimgs = 0;
+}
+
+/*
+ * Place the payload of ``xbf'' at ``off'' in the flash.  ``xbf'' has to
+ * stay open until the image is written.
+ */
+int
+xbf_flash_add(struct xbf_flash *xfl, struct xbf *xbf, uint32_t off,
+    int flags)
+{
+	struct xbf_flash_img *img;
+
+	ASSERT(xfl != NULL);
+	xbf_assert(xbf);
+	if (xbf_get_len(xbf) == 0)
+		return (xbf_erri(&xfl->xfl_xbf, "'%s' has no payload",
+		    xbf_get_fname(xbf)));
+	if ((uint64_t)off + xbf_get_len(xbf) > ((uint64_t)1 << 32))
+		return (xbf_erri(&xfl->xfl_xbf, "'%s' at %#x doesn't fit in "
+		    "4GB", xbf_get_fname(xbf), off));
+	img = realloc(xfl->xfl_imgs, (xfl->xfl_nimgs + 1) * sizeof(*img));
+	if (img == NULL)
+		return (xbf_erri(&xfl->xfl_xbf, "Couldn't allocate memory"));
+	xfl->xfl_imgs = img;
+	img += xfl->xfl_nimgs++;
+	img->xfi_xbf = xbf;
+	img->xfi_off = off;
+	img->xfi_len = xbf_get_len(xbf);
+	img->xfi_flags = flags;
+	return (0);
+}
+
+static int
+flash_img_cmp(const void *a, const void *b)
+{
+	const struct xbf_flash_img *ia = a, *ib = b;
+
+	if (ia->xfi_off != ib->xfi_off)
+		return ((ia->xfi_off < ib->xfi_off) ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Build the MultiBoot header that jumps to ``addr''.  Returns the
+ * number of words.
+ */
+static size_t
+flash_mb_header(uint32_t *w, uint32_t addr)
+{
+	size_t i, n = 0;
+
+	w[n++] = XBF_DUMMY_WORD;
+	w[n++] = XBF_BUSWIDTH_WORD0;
+	w[n++] = XBF_BUSWIDTH_WORD1;
+	w[n++] = XBF_DUMMY_WORD;
+	w[n++] = XBF_SYNC_WORD;
+	w[n++] = FLASH_NOOP;
+	w[n++] = FLASH_T1_WRITE(XBF_REG_WBSTAR, 1);
+	w[n++] = addr;
+	w[n++] = FLASH_NOOP;
+	w[n++] = FLASH_T1_WRITE(XBF_REG_CMD, 1);
+	w[n++] = XBF_CMD_IPROG;
+	w[n++] = FLASH_NOOP;
+	w[n++] = FLASH_NOOP;
+	w[n++] = FLASH_NOOP;
+	for (i = 0; i < n; i++)
+		w[i] = htonl(w[i]);
+	return (n);
+}
+
+/*
+ * Sort the images, check they don't overlap and fill the MultiBoot
+ * header if asked for.
+ */
+static int
+flash_layout(struct xbf_flash *xfl)
+{
+	struct xbf_flash_img *img, *upd;
+	uint64_t end;
+	size_t i;
+	int fam;
+
+	if (xfl->xfl_nimgs == 0)
+		return (xbf_erri(&xfl->xfl_xbf, "No images to write"));
+	qsort(xfl->xfl_imgs, xfl->xfl_nimgs, sizeof(*xfl->xfl_imgs),
+	    flash_img_cmp);
+
+	xfl->xfl_hdrlen = 0;
+	if (xfl->xfl_flags & XBF_FLASH_MULTIBOOT) {
+		for (i = 0, upd = NULL; i < xfl->xfl_nimgs; i++)
+			if (xfl->xfl_imgs[i].xfi_flags & XBF_FLASH_UPDATE)
+				upd = &xfl->xfl_imgs[i];
+		if (upd == NULL)
+			return (xbf_erri(&xfl->xfl_xbf, "MultiBoot needs an "
+			    "image marked with XBF_FLASH_UPDATE"));
+		fam = xbf_get_family(upd->xfi_xbf);
+		if (fam != XBF_FAM_V5 && fam != XBF_FAM_V6 &&
+		    fam != XBF_FAM_7 && fam != XBF_FAM_US &&
+		    fam != XBF_FAM_USP)
+			return (xbf_erri(&xfl->xfl_xbf, "MultiBoot header "
+			    "isn't supported for part '%s'",
+			    xbf_get_partname(upd->xfi_xbf)));
+		xfl->xfl_hdrlen = flash_mb_header(xfl->xfl_hdr,
+		    upd->xfi_off) * sizeof(uint32_t);
+	}
+
+	for (i = 0, end = xfl->xfl_hdrlen; i < xfl->xfl_nimgs; i++) {
+		img = &xfl->xfl_imgs[i];
+		if (img->xfi_off < end)
+			return (xbf_erri(&xfl->xfl_xbf, "'%s' at %#x overlaps "
+			    "with what's before it (ending at %#jx)",
+			    xbf_get_fname(img->xfi_xbf), img->xfi_off,
+			    (uintmax_t)end));
+		end = (uint64_t)img->xfi_off + img->xfi_len;
+	}
+	if (xfl->xfl_size != 0 && end > xfl->xfl_size)
+		return (xbf_erri(&xfl->xfl_xbf, "Images end at %#jx, past "
+		    "the end of the flash (%#x)", (uintmax_t)end,
+		    xfl->xfl_size));
+	return (0);
+}
+
+static int
+flash_pad(struct xbf_flash *xfl, int fd, uint64_t len)
+{
+	static uint8_t ff[FLASH_PADSIZE];
+	size_t n;
+
+	if (len > 0 && ff[0] != 0xff)
+		memset(ff, 0xff, sizeof(ff));
+	while (len > 0) {
+		n = MIN(len, sizeof(ff));
+		if (_xbf_write(&xfl->xfl_xbf, fd, ff, n) != 0)
+			return (-1);
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Copy the payload in the kernel, from the file ``xbf'' was opened
+ * from.  Returns 1 if that can't be done and the caller has to write
+ * it out by hand; nothing has been written then.
+ */
+static int
+flash_copy(struct xbf_flash *xfl, int fd, struct xbf_flash_img *img)
+{
+#ifdef __linux__
+	struct xbf *xbf = img->xfi_xbf;
+	size_t left;
+	off_t off;
+	ssize_t n;
+	int sfd, use_cfr = 1;
+
+	if ((_xbf_owner(xbf)->_xbf_flags &
+	    (XBF_FLAG_MMAPED | XBF_FLAG_HDRONLY)) == 0)
+		return (1);
+	/* Only if it's still the file we parsed */
+	sfd = _xbf_open_source(xbf);
+	if (sfd == -1)
+		return (1);
+	off = xbf->xbf_offset;
+	left = img->xfi_len;
+	while (left > 0) {
+		if (use_cfr) {
+			n = copy_file_range(sfd, &off, fd, NULL, left, 0);
+			if (n == -1 && left == img->xfi_len &&
+			    (errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP ||
+			    errno == EBADF)) {
+				use_cfr = 0;
+				continue;
+			}
+		} else {
+			n = sendfile(fd, sfd, &off, left);
+			if (n == -1 && left == img->xfi_len &&
+			    (errno == EINVAL || errno == ENOSYS)) {
+				(void)close(sfd);
+				return (1);
+			}
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			(void)close(sfd);
+			return (xbf_erri(&xfl->xfl_xbf, "Couldn't copy '%s': "
+			    "%s", xbf->xbf_fname, (n == 0) ? "file shrunk" :
+			    strerror(errno)));
+		}
+		left -= n;
+	}
+	(void)close(sfd);
+	xfl->xfl_ncopied++;
+	return (0);
+#else
+	(void)xfl;
+	(void)fd;
+	(void)img;
+	return (1);
+#endif
+}
+
+/*
+ * Write the whole flash image to ``fd'', sequentially, so pipes work.
+ */
+int
+xbf_flash_write(struct xbf_flash *xfl, int fd)
+{
+	struct xbf_flash_img *img;
+	uint64_t pos;
+	size_t i;
+	int error;
+
+	ASSERT(xfl != NULL);
+	if (flash_layout(xfl) != 0)
+		return (-1);
+	xfl->xfl_ncopied = 0;
+	if (_xbf_write(&xfl->xfl_xbf, fd, xfl->xfl_hdr,
+	    xfl->xfl_hdrlen) != 0)
+		return (-1);
+	pos = xfl->xfl_hdrlen;
+	for (i = 0; i < xfl->xfl_nimgs; i++) {
+		img = &xfl->xfl_imgs[i];
+		if (flash_pad(xfl, fd, img->xfi_off - pos) != 0)
+			return (-1);
+		error = flash_copy(xfl, fd, img);
+		if (error == 1) {
+			if (img->xfi_xbf->xbf_data == NULL)
+				return (xbf_erri(&xfl->xfl_xbf, "Payload of "
+				    "'%s' is neither in memory nor in a file",
+				    xbf_get_fname(img->xfi_xbf)));
+			error = _xbf_write(&xfl->xfl_xbf, fd,
+			    img->xfi_xbf->xbf_data, img->xfi_len);
+		}
+		if (error != 0)
+			return (-1);
+		pos = (uint64_t)img->xfi_off + img->xfi_len;
+	}
+	if (xfl->xfl_size > pos)
+		return (flash_pad(xfl, fd, xfl->xfl_size - pos));
+	return (0);
+}
+
+/*
+ * Print where everything went.  Call after xbf_flash_write().
+ */
+void
+xbf_flash_print_fp(FILE *fp, struct xbf_flash *xfl)
+{
+	struct xbf_flash_img *img;
+	uint64_t pos, end;
+	size_t i;
+
+	ASSERT(xfl != NULL);
+	pos = 0;
+	if (xfl->xfl_hdrlen > 0) {
+		fprintf(fp, "0x%08x 0x%08x %10u MultiBoot header\n", 0,
+		    (unsigned)xfl->xfl_hdrlen, (unsigned)xfl->xfl_hdrlen);
+		pos = xfl->xfl_hdrlen;
+	}
+	for (i = 0; i < xfl->xfl_nimgs; i++) {
+		img = &xfl->xfl_imgs[i];
+		if (img->xfi_off > pos)
+			fprintf(fp, "0x%08jx 0x%08x %10ju (pad)\n",
+			    (uintmax_t)pos, img->xfi_off,
+			    (uintmax_t)(img->xfi_off - pos));
+		end = (uint64_t)img->xfi_off + img->xfi_len;
+		fprintf(fp, "0x%08x 0x%08jx %10u %s %s%s\n", img->xfi_off,
+		    (uintmax_t)end, img->xfi_len,
+		    xbf_get_partname(img->xfi_xbf),
+		    xbf_get_fname(img->xfi_xbf),
+		    (img->xfi_flags & XBF_FLASH_UPDATE) ? " (update)" : "");
+		pos = end;
+	}
+	if (xfl->xfl_size > pos)
+		fprintf(fp, "0x%08jx 0x%08x %10ju (pad)\n", (uintmax_t)pos,
+		    xfl->xfl_size, (uintmax_t)(xfl->xfl_size - pos));
+	fprintf(fp, "%ju bytes, %u of %u images copied in the kernel\n",
+	    (uintmax_t)MAX(pos, xfl->xfl_size), (unsigned)xfl->xfl_ncopied,
+	    (unsigned)xfl->xfl_nimgs);
+}
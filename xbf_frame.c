@@ -0,0 +1,342 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Configuration frames.
+ *
+ * Frame data goes to FDRI in bursts.  The frame address of a burst is
+ * only known when the stream writes FAR before it; after that the
+ * device increments FAR on its own, in an order that depends on the
+ * device geometry (column types, rows), which isn't in the bit stream.
+ * So frames are located here by the FAR written last (the anchor) and
+ * their index after it.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xbf.h"
+
+/*
+ * Words per frame.  0 if unknown: Virtex-II frame lengths depend on the
+ * device and come from the FLR register, and Spartan-6 isn't supported.
+ */
+unsigned
+xbf_get_frame_words(struct xbf *xbf)
+{
+
+	switch (xbf_get_family(xbf)) {
+	case XBF_FAM_V5:
+		return (41);
+	case XBF_FAM_V6:
+		return (81);
+	case XBF_FAM_7:
+		return (101);
+	case XBF_FAM_US:
+		return (123);
+	case XBF_FAM_USP:
+		return (93);
+	}
+	return (0);
+}
+
+static int
+frame_add(struct xbf *xbf, struct xbf_bursts *xb, const struct xbf_burst *b)
+{
+	struct xbf_burst *nb;
+	size_t ncap;
+
+	if (xb->xb_nbursts == xb->xb_cap) {
+		ncap = (xb->xb_cap == 0) ? 16 : xb->xb_cap * 2;
+		nb = realloc(xb->xb_bursts, ncap * sizeof(*nb));
+		if (nb == NULL)
+			return (xbf_erri(xbf, "Couldn't allocate memory"));
+		xb->xb_bursts = nb;
+		xb->xb_cap = ncap;
+	}
+	xb->xb_bursts[xb->xb_nbursts++] = *b;
+	return (0);
+}
+
+/*
+ * Find every FDRI burst in ``pk'' (from xbf_pkt_decode()).  Words that
+ * don't make a whole frame are left out.
+ */
+int
+_xbf_frame_bursts(struct xbf *xbf, struct xbf_pkts *pk, struct xbf_bursts *xb)
+{
+	const struct xbf_pkt *p;
+	struct xbf_burst b;
+	uint32_t far, next;
+	unsigned flen;
+	size_t i;
+	int farok;
+
+	xbf_assert(xbf);
+	memset(xb, 0, sizeof(*xb));
+	flen = xbf_get_frame_words(xbf);
+	if (flen == 0)
+		return (xbf_erri(xbf, "Frame length of part '%s' isn't known",
+		    xbf->xbf_partname));
+	xb->xb_flen = flen;
+	far = next = 0;
+	farok = 0;
+	for (i = 0; i < pk->xp_npkts; i++) {
+		p = &pk->xp_pkts[i];
+		if (p->xp_type == XBF_PKT_SYNC) {
+			farok = 0;
+			continue;
+		}
+		if (p->xp_op != XBF_PKT_OP_WRITE || p->xp_wcnt == 0)
+			continue;
+		if (p->xp_reg == XBF_REG_FAR) {
+			far = xbf_pkt_word(xbf, p, 0);
+			next = 0;
+			farok = 1;
+		} else if (p->xp_reg == XBF_REG_FDRI &&
+		    p->xp_wcnt >= flen) {
+			b.xb_far = far;
+			b.xb_first = next;
+			b.xb_off = p->xp_off + 4;
+			b.xb_nframes = p->xp_wcnt / flen;
+			b.xb_farok = farok;
+			if (frame_add(xbf, xb, &b) != 0) {
+				_xbf_frame_bursts_free(xb);
+				return (-1);
+			}
+			next += b.xb_nframes;
+		}
+	}
+	return (0);
+}
+
+void
+_xbf_frame_bursts_free(struct xbf_bursts *xb)
+{
+
+	free(xb->xb_bursts);
+	memset(xb, 0, sizeof(*xb));
+}
+
+/* Entries per directory bucket, on average */
+#define FARIDX_BUCKET	4
+#define FARIDX_MAXDIR	(1 << 16)
+
+struct faridx_ent {
+	uint32_t	fe_far;
+	uint32_t	fe_first;
+	uint32_t	fe_off;
+	uint32_t	fe_nframes;
+};
+
+static int
+faridx_cmp(const void *a, const void *b)
+{
+	const struct faridx_ent *ea = a, *eb = b;
+
+	if (ea->fe_far != eb->fe_far)
+		return ((ea->fe_far < eb->fe_far) ? -1 : 1);
+	if (ea->fe_first != eb->fe_first)
+		return ((ea->fe_first < eb->fe_first) ? -1 : 1);
+	/* Bursts of one anchor in the order they were written */
+	return ((ea->fe_off < eb->fe_off) ? -1 : (ea->fe_off > eb->fe_off));
+}
+
+static void
+faridx_free(struct xbf_faridx *fi)
+{
+
+	if (fi == NULL)
+		return;
+	free(fi->fi_far);
+	free(fi->fi_first);
+	free(fi->fi_off);
+	free(fi->fi_nframes);
+	free(fi->fi_dir);
+	free(fi);
+}
+
+void
+_xbf_far_index_free(struct xbf *xbf)
+{
+
+	faridx_free(xbf->_xbf_faridx);
+	xbf->_xbf_faridx = NULL;
+}
+
+/*
+ * Fill the bucket directory: fi_dir[b] is the first entry whose FAR
+ * falls into bucket b or a later one.
+ */
+static void
+faridx_dir(struct xbf_faridx *fi)
+{
+	uint32_t maxfar;
+	size_t b, i;
+
+	maxfar = (fi->fi_n > 0) ? fi->fi_far[fi->fi_n - 1] : 0;
+	for (fi->fi_shift = 0; fi->fi_shift < 32 &&
+	    ((uint64_t)maxfar >> fi->fi_shift) >= fi->fi_ndir; fi->fi_shift++)
+		;
+	for (i = 0, b = 0; i < fi->fi_n; i++)
+		for (; b <= (fi->fi_far[i] >> fi->fi_shift); b++)
+			fi->fi_dir[b] = i;
+	for (; b <= fi->fi_ndir; b++)
+		fi->fi_dir[b] = fi->fi_n;
+}
+
+/*
+ * Build the frame address index of ``xbf'', unless it's there already.
+ * Only bursts with a FAR written before them are indexed.
+ */
+int
+xbf_far_index(struct xbf *xbf)
+{
+	struct xbf_pkts pk;
+	struct xbf_bursts xb;
+	struct faridx_ent *ents;
+	struct xbf_faridx *fi, *old, **slot;
+	size_t i, n;
+	int error;
+
+	xbf_assert(xbf);
+	slot = &_xbf_owner(xbf)->_xbf_faridx;
+	if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != NULL)
+		return (0);
+	if (xbf_pkt_decode(xbf, &pk) != 0)
+		return (-1);
+	error = _xbf_frame_bursts(xbf, &pk, &xb);
+	xbf_pkt_free(&pk);
+	if (error != 0)
+		return (-1);
+
+	ents = calloc(xb.xb_nbursts + 1, sizeof(*ents));
+	fi = calloc(1, sizeof(*fi));
+	if (ents == NULL || fi == NULL)
+		goto nomem;
+	for (i = 0, n = 0; i < xb.xb_nbursts; i++) {
+		if (!xb.xb_bursts[i].xb_farok)
+			continue;
+		ents[n].fe_far = xb.xb_bursts[i].xb_far;
+		ents[n].fe_first = xb.xb_bursts[i].xb_first;
+		ents[n].fe_off = xb.xb_bursts[i].xb_off;
+		ents[n].fe_nframes = xb.xb_bursts[i].xb_nframes;
+		n++;
+	}
+	qsort(ents, n, sizeof(*ents), faridx_cmp);
+
+	fi->fi_n = n;
+	fi->fi_flen = xb.xb_flen;
+	for (fi->fi_ndir = 1; fi->fi_ndir * FARIDX_BUCKET < n &&
+	    fi->fi_ndir < FARIDX_MAXDIR; fi->fi_ndir *= 2)
+		;
+	fi->fi_far = malloc((n + 1) * sizeof(uint32_t));
+	fi->fi_first = malloc((n + 1) * sizeof(uint32_t));
+	fi->fi_off = malloc((n + 1) * sizeof(uint32_t));
+	fi->fi_nframes = malloc((n + 1) * sizeof(uint32_t));
+	fi->fi_dir = malloc((fi->fi_ndir + 1) * sizeof(uint32_t));
+	if (fi->fi_far == NULL || fi->fi_first == NULL || fi->fi_off == NULL ||
+	    fi->fi_nframes == NULL || fi->fi_dir == NULL)
+		goto nomem;
+	for (i = 0; i < n; i++) {
+		fi->fi_far[i] = ents[i].fe_far;
+		fi->fi_first[i] = ents[i].fe_first;
+		fi->fi_off[i] = ents[i].fe_off;
+		fi->fi_nframes[i] = ents[i].fe_nframes;
+	}
+	faridx_dir(fi);
+	free(ents);
+	_xbf_frame_bursts_free(&xb);
+	/* Another thread sharing the stream may have been faster */
+	old = NULL;
+	if (!__atomic_compare_exchange_n(slot, &old, fi, 0, __ATOMIC_ACQ_REL,
+	    __ATOMIC_ACQUIRE))
+		faridx_free(fi);
+	return (0);
+nomem:
+	free(ents);
+	faridx_free(fi);
+	_xbf_frame_bursts_free(&xb);
+	return (xbf_erri(xbf, "Couldn't allocate memory"));
+}
+
+/*
+ * Payload offset of frame ``idx'' after the write of ``far'' to FAR,
+ * or -1 if there's no such frame.  A frame written more than once is
+ * found where it was written last.  The index is built on first use.
+ */
+ssize_t
+xbf_far_lookup(struct xbf *xbf, uint32_t far, uint32_t idx)
+{
+	struct xbf_faridx *fi;
+	size_t lo, hi, mid, b, i, found;
+
+	xbf_assert(xbf);
+	fi = __atomic_load_n(&_xbf_owner(xbf)->_xbf_faridx, __ATOMIC_ACQUIRE);
+	if (fi == NULL) {
+		if (xbf_far_index(xbf) != 0)
+			return (-1);
+		fi = __atomic_load_n(&_xbf_owner(xbf)->_xbf_faridx,
+		    __ATOMIC_ACQUIRE);
+	}
+	b = far >> fi->fi_shift;
+	if (b >= fi->fi_ndir)
+		return (-1);
+
+	/* Last entry in the bucket with (FAR, first) <= (far, idx) */
+	lo = fi->fi_dir[b];
+	hi = fi->fi_dir[b + 1];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fi->fi_far[mid] < far || (fi->fi_far[mid] == far &&
+		    fi->fi_first[mid] <= idx))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/*
+	 * Every burst of ``far'' before that starts at or before ``idx''.
+	 * A FAR written more than once has a few; the one holding ``idx''
+	 * that was written last wins, as it does in the device.
+	 */
+	found = SIZE_MAX;
+	for (i = lo; i > fi->fi_dir[b] && fi->fi_far[i - 1] == far; i--)
+		if (idx - fi->fi_first[i - 1] < fi->fi_nframes[i - 1] &&
+		    (found == SIZE_MAX || fi->fi_off[i - 1] > fi->fi_off[found]))
+			found = i - 1;
+	if (found == SIZE_MAX)
+		return (-1);
+	return ((ssize_t)fi->fi_off[found] +
+	    (ssize_t)(idx - fi->fi_first[found]) * fi->fi_flen * 4);
+}
@@ -0,0 +1,311 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Payload checksums.
+ *
+ * The digest is CRC32C (Castagnoli), which the SSE4.2 CRC32 instruction
+ * computes 8 bytes at a time; without it a slice-by-8 table does the
+ * work.  Large payloads are cut into HASH_CHUNK pieces which are
+ * checksummed by several threads, and the chunk CRCs are then combined
+ * in GF(2) (the zlib crc32_combine() method), so the result is the same
+ * as the CRC of the whole payload, whatever the number of threads.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HASH_X86
+#endif
+
+#include "xbf.h"
+
+#define HASH_POLY	0x82f63b78	/* CRC32C, reflected */
+#define HASH_CHUNK	(1024 * 1024)
+#define HASH_MAXTHREADS	64
+
+static uint32_t hash_tbl[8][256];
+static pthread_once_t hash_tbl_once = PTHREAD_ONCE_INIT;
+
+static void
+hash_tbl_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ ((c & 1) ? HASH_POLY : 0);
+		hash_tbl[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			hash_tbl[j][i] = (hash_tbl[j - 1][i] >> 8) ^
+			    hash_tbl[0][hash_tbl[j - 1][i] & 0xff];
+}
+
+/*
+ * CRC update without the pre and post inversion.
+ */
+static uint32_t
+hash_crc_scalar(uint32_t c, const uint8_t *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	(void)pthread_once(&hash_tbl_once, hash_tbl_init);
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		c = (c >> 8) ^ hash_tbl[0][(c ^ *p++) & 0xff];
+	for (; len >= 8; len -= 8, p += 8) {
+		/* Little endian order of the bytes is what's wanted here */
+		lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		c = hash_tbl[7][lo & 0xff] ^ hash_tbl[6][(lo >> 8) & 0xff] ^
+		    hash_tbl[5][(lo >> 16) & 0xff] ^ hash_tbl[4][lo >> 24] ^
+		    hash_tbl[3][hi & 0xff] ^ hash_tbl[2][(hi >> 8) & 0xff] ^
+		    hash_tbl[1][(hi >> 16) & 0xff] ^ hash_tbl[0][hi >> 24];
+	}
+	for (; len > 0; len--)
+		c = (c >> 8) ^ hash_tbl[0][(c ^ *p++) & 0xff];
+	return (c);
+}
+
+#ifdef HASH_X86
+__attribute__((target("sse4.2")))
+static uint32_t
+hash_crc_sse42(uint32_t c, const uint8_t *p, size_t len)
+{
+#ifdef __x86_64__
+	uint64_t c64;
+	uint64_t w;
+#endif
+	uint32_t w32;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+		c = _mm_crc32_u8(c, *p++);
+#ifdef __x86_64__
+	c64 = c;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, sizeof(w));
+		c64 = _mm_crc32_u64(c64, w);
+	}
+	c = (uint32_t)c64;
+#endif
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(&w32, p, sizeof(w32));
+		c = _mm_crc32_u32(c, w32);
+	}
+	for (; len > 0; len--)
+		c = _mm_crc32_u8(c, *p++);
+	return (c);
+}
+#endif /* HASH_X86 */
+
+/*
+ * CRC32C of ``buf'', continuing from ``crc'' (0 to start), with the
+ * kernel chosen by the caller.
+ */
+uint32_t
+_xbf_crc32c_kern(int kern, uint32_t crc, const void *buf, size_t len)
+{
+
+	crc = ~crc;
+#ifdef HASH_X86
+	if (kern == XBF_KERN_SSE42)
+		crc = hash_crc_sse42(crc, buf, len);
+	else
+#endif
+		crc = hash_crc_scalar(crc, buf, len);
+	return (~crc);
+}
+
+/*
+ * CRC32C of ``buf'', continuing from ``crc'' (0 to start).
+ */
+uint32_t
+xbf_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	static int kern = -1;
+	int k;
+
+	k = __atomic_load_n(&kern, __ATOMIC_RELAXED);
+	if (k == -1) {
+		k = _xbf_cpu_has(XBF_KERN_SSE42) ? XBF_KERN_SSE42 :
+		    XBF_KERN_SCALAR;
+		__atomic_store_n(&kern, k, __ATOMIC_RELAXED);
+	}
+	return (_xbf_crc32c_kern(k, crc, buf, len));
+}
+
+/*
+ * a * b modulo the polynomial, both reflected.
+ */
+static uint32_t
+hash_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m, p;
+
+	m = (uint32_t)1 << 31;
+	p = 0;
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ HASH_POLY : b >> 1;
+	}
+	return (p);
+}
+
+/*
+ * x^nbits modulo the polynomial.
+ */
+static uint32_t
+hash_xnmodp(uint64_t nbits)
+{
+	uint32_t p, x2k;
+
+	p = (uint32_t)1 << 31;		/* x^0 */
+	x2k = (uint32_t)1 << 30;	/* x^1 */
+	while (nbits != 0) {
+		if (nbits & 1)
+			p = hash_multmodp(x2k, p);
+		nbits >>= 1;
+		x2k = hash_multmodp(x2k, x2k);
+	}
+	return (p);
+}
+
+/*
+ * Raw CRC register ``crc'' (no inversion) after ``nbits'' zero bits.
+ */
+uint32_t
+_xbf_crc32c_shift(uint32_t crc, uint64_t nbits)
+{
+
+	return (hash_multmodp(hash_xnmodp(nbits), crc));
+}
+
+/*
+ * CRC of A followed by B, from the CRC of A, the CRC of B and the length
+ * of B.
+ */
+uint32_t
+xbf_crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+
+	return (_xbf_crc32c_shift(crc1, (uint64_t)len2 * 8) ^ crc2);
+}
+
+struct hash_job {
+	const uint8_t	*hj_data;
+	size_t		 hj_len;
+	size_t		 hj_nchunks;
+	size_t		 hj_next;
+	uint32_t	*hj_crcs;
+};
+
+static void *
+hash_main(void *arg)
+{
+	struct hash_job *hj = arg;
+	size_t i, off;
+
+	for (;;) {
+		i = __atomic_fetch_add(&hj->hj_next, 1, __ATOMIC_RELAXED);
+		if (i >= hj->hj_nchunks)
+			break;
+		off = i * HASH_CHUNK;
+		hj->hj_crcs[i] = xbf_crc32c(0, hj->hj_data + off,
+		    MIN(HASH_CHUNK, hj->hj_len - off));
+	}
+	return (NULL);
+}
+
+/*
+ * CRC32C of the payload, on ``nthreads'' threads (0 means one per CPU).
+ */
+int
+xbf_hash(struct xbf *xbf, int nthreads, uint32_t *digest)
+{
+	pthread_t thr[HASH_MAXTHREADS];
+	struct hash_job hj;
+	uint32_t crc;
+	size_t i;
+	int nthr;
+
+	xbf_assert(xbf);
+	ASSERT(digest != NULL);
+	if (xbf->xbf_data == NULL)
+		return (xbf_erri(xbf, "Payload isn't in memory"));
+	memset(&hj, 0, sizeof(hj));
+	hj.hj_data = (const uint8_t *)xbf->xbf_data;
+	hj.hj_len = xbf->xbf_len;
+	hj.hj_nchunks = howmany(hj.hj_len, HASH_CHUNK);
+	if (nthreads <= 0)
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	nthr = MIN(nthreads, HASH_MAXTHREADS);
+	if ((size_t)nthr > hj.hj_nchunks)
+		nthr = (int)hj.hj_nchunks;
+	if (nthr <= 1) {
+		*digest = xbf_crc32c(0, hj.hj_data, hj.hj_len);
+		return (0);
+	}
+
+	hj.hj_crcs = calloc(hj.hj_nchunks, sizeof(*hj.hj_crcs));
+	if (hj.hj_crcs == NULL)
+		return (xbf_erri(xbf, "Couldn't allocate memory"));
+	/* This thread is one of the workers */
+	for (i = 0; i < (size_t)nthr - 1; i++)
+		if (pthread_create(&thr[i], NULL, hash_main, &hj) != 0)
+			break;
+	nthr = (int)i;
+	(void)hash_main(&hj);
+	for (i = 0; i < (size_t)nthr; i++)
+		pthread_join(thr[i], NULL);
+
+	crc = hj.hj_crcs[0];
+	for (i = 1; i < hj.hj_nchunks; i++)
+		crc = xbf_crc32c_combine(crc, hj.hj_crcs[i],
+		    MIN(HASH_CHUNK, hj.hj_len - i * HASH_CHUNK));
+	free(hj.hj_crcs);
+	*digest = crc;
+	return (0);
+}
@@ -0,0 +1,388 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Persistent cache of parsed headers.
+ *
+ * The cache is a file that's mapped shared by every process using it:
+ * a small header, a hash table of 32-bit slots and a table of fixed
+ * size records, each with the key of a bit stream file (device, inode,
+ * size and modification time in ns) and its parsed header.  A lookup
+ * is a stat of the file and a walk over a few slots, so a hit never
+ * opens the file; the header is then rebuilt from the record.
+ *
+ * There's one writer at a time, the process holding an exclusive
+ * flock() on the cache; everybody else only reads.  The writer only
+ * appends: it fills a record past the published ones, publishes it by
+ * bumping the record count and then stores its number in a free slot,
+ * both with release stores that readers pair with acquire loads.  So a
+ * reader sees either nothing or a whole record, without locking.
+ * Records of files that changed stay behind, since their key doesn't
+ * match any more; delete the cache file to start over.  The file is
+ * made at its full size but sparse, so only written records take up
+ * disk space.  Numbers are in host byte order: the cache is local.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* statx() */
+#endif
+
+#include <sys/param.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+#define HC_MAGIC	"xbfhc01"
+#define HC_DEFCAP	(64 * 1024)	/* Records */
+
+struct hc_hdr {
+	char		hh_magic[8];
+	uint32_t	hh_recsize;
+	uint32_t	hh_nslots;	/* A power of 2, twice hh_cap */
+	uint32_t	hh_cap;
+	uint32_t	hh_nrecs;	/* Published */
+	char		hh_pad[40];
+};
+
+struct hc_rec {
+	uint64_t	hr_dev;
+	uint64_t	hr_ino;
+	uint64_t	hr_size;
+	int64_t		hr_mtime;	/* ns */
+	uint32_t	hr_len;		/* Payload length */
+	uint32_t	hr_offset;	/* Header length */
+	char		hr_ncdname[144];
+	char		hr_partname[48];
+	char		hr_date[12];
+	char		hr_time[12];
+};
+
+static size_t
+hc_size(uint32_t nslots, uint32_t cap)
+{
+
+	return (sizeof(struct hc_hdr) + (size_t)nslots * sizeof(uint32_t) +
+	    (size_t)cap * sizeof(struct hc_rec));
+}
+
+static uint32_t *
+hc_slots(struct xbf_hcache *hc)
+{
+
+	return ((uint32_t *)((struct hc_hdr *)hc->hc_map + 1));
+}
+
+static struct hc_rec *
+hc_recs(struct xbf_hcache *hc)
+{
+	struct hc_hdr *h = hc->hc_map;
+
+	return ((struct hc_rec *)(hc_slots(hc) + h->hh_nslots));
+}
+
+static uint64_t
+hc_hash(const struct hc_rec *k)
+{
+	uint64_t h;
+
+	h = k->hr_dev * 0x9e3779b97f4a7c15ULL ^ k->hr_ino;
+	h = (h ^ k->hr_size) * 0xff51afd7ed558ccdULL;
+	h = (h ^ (uint64_t)k->hr_mtime) * 0xc4ceb9fe1a85ec53ULL;
+	return (h ^ (h >> 33));
+}
+
+/*
+ * Key of ``fname'': one stat, no open.
+ */
+static int
+hc_key(struct xbf_hcache *hc, const char *fname, struct hc_rec *k)
+{
+#ifdef STATX_BASIC_STATS
+	struct statx stx;
+
+	if (statx(AT_FDCWD, fname, 0, STATX_INO | STATX_SIZE | STATX_MTIME,
+	    &stx) == -1)
+		return (xbf_erri(&hc->hc_xbf, "Couldn't check file '%s' "
+		    "information", fname));
+	k->hr_dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+	k->hr_ino = stx.stx_ino;
+	k->hr_size = stx.stx_size;
+	k->hr_mtime = stx.stx_mtime.tv_sec * 1000000000LL +
+	    stx.stx_mtime.tv_nsec;
+#else
+	struct stat st;
+
+	if (stat(fname, &st) == -1)
+		return (xbf_erri(&hc->hc_xbf, "Couldn't check file '%s' "
+		    "information", fname));
+	k->hr_dev = st.st_dev;
+	k->hr_ino = st.st_ino;
+	k->hr_size = st.st_size;
+	k->hr_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+	return (0);
+}
+
+/*
+ * Lay out an empty cache in the new file.  Called by the writer only.
+ */
+static int
+hc_create(struct xbf_hcache *hc, uint32_t cap)
+{
+	struct hc_hdr h;
+	uint32_t nslots;
+
+	if (cap == 0)
+		cap = HC_DEFCAP;
+	for (nslots = 64; nslots < cap * 2ULL; nslots *= 2)
+		;
+	memset(&h, 0, sizeof(h));
+	h.hh_recsize = sizeof(struct hc_rec);
+	h.hh_nslots = nslots;
+	h.hh_cap = cap;
+	if (ftruncate(hc->hc_fd, hc_size(nslots, cap)) == -1)
+		return (xbf_erri(&hc->hc_xbf, "Couldn't grow the cache"));
+	/* The magic goes last: readers take the cache as empty until then */
+	if (pwrite(hc->hc_fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    pwrite(hc->hc_fd, HC_MAGIC, sizeof(HC_MAGIC), 0) !=
+	    sizeof(HC_MAGIC))
+		return (xbf_erri(&hc->hc_xbf, "Couldn't write the cache"));
+	return (0);
+}
+
+/*
+ * Open the cache in ``path''.  With XBF_HCACHE_WRITE the file is made
+ * if needed (room for ``cap'' records, 0 for the default), and the
+ * cache is written to if no other process is writing it already;
+ * hc_writer tells.
+ */
+int
+xbf_hcache_open(struct xbf_hcache *hc, const char *path, uint32_t cap,
+    int flags)
+{
+	struct stat st;
+	struct hc_hdr *h;
+
+	memset(hc, 0, sizeof(*hc));
+	xbf_init(&hc->hc_xbf);
+	hc->hc_xbf.xbf_fname = path;
+	hc->hc_fd = open(path, (flags & XBF_HCACHE_WRITE) ?
+	    O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (hc->hc_fd == -1)
+		return (xbf_erri(&hc->hc_xbf, "Couldn't open cache '%s'",
+		    path));
+	if ((flags & XBF_HCACHE_WRITE) &&
+	    flock(hc->hc_fd, LOCK_EX | LOCK_NB) == 0)
+		hc->hc_writer = 1;
+	if (fstat(hc->hc_fd, &st) == -1) {
+		xbf_hcache_close(hc);
+		return (xbf_erri(&hc->hc_xbf, "Couldn't check cache '%s'",
+		    path));
+	}
+	if (st.st_size == 0 && hc->hc_writer) {
+		if (hc_create(hc, cap) != 0) {
+			xbf_hcache_close(hc);
+			return (-1);
+		}
+		if (fstat(hc->hc_fd, &st) == -1)
+			st.st_size = 0;
+	}
+	/* Still being made by somebody else: nothing in it yet */
+	if ((size_t)st.st_size < sizeof(struct hc_hdr))
+		return (0);
+	hc->hc_map = mmap(NULL, st.st_size, hc->hc_writer ?
+	    PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, hc->hc_fd, 0);
+	if (hc->hc_map == MAP_FAILED) {
+		hc->hc_map = NULL;
+		xbf_hcache_close(hc);
+		return (xbf_erri(&hc->hc_xbf, "Couldn't map cache '%s'",
+		    path));
+	}
+	hc->hc_maplen = st.st_size;
+	h = hc->hc_map;
+	if (h->hh_magic[0] == '\0') {
+		(void)munmap(hc->hc_map, hc->hc_maplen);
+		hc->hc_map = NULL;
+		return (0);
+	}
+	if (memcmp(h->hh_magic, HC_MAGIC, sizeof(HC_MAGIC)) != 0 ||
+	    h->hh_recsize != sizeof(struct hc_rec) ||
+	    h->hh_cap > h->hh_nslots / 2 ||
+	    (h->hh_nslots & (h->hh_nslots - 1)) != 0 ||
+	    hc_size(h->hh_nslots, h->hh_cap) > hc->hc_maplen) {
+		xbf_hcache_close(hc);
+		return (xbf_erri(&hc->hc_xbf, "'%s' isn't a header cache",
+		    path));
+	}
+	return (0);
+}
+
+void
+xbf_hcache_close(struct xbf_hcache *hc)
+{
+
+	if (hc->hc_map != NULL)
+		(void)munmap(hc->hc_map, hc->hc_maplen);
+	if (hc->hc_fd != -1)
+		(void)close(hc->hc_fd);
+	hc->hc_map = NULL;
+	hc->hc_fd = -1;
+	hc->hc_writer = 0;
+}
+
+static int
+hc_key_eq(const struct hc_rec *a, const struct hc_rec *b)
+{
+
+	return (a->hr_dev == b->hr_dev && a->hr_ino == b->hr_ino &&
+	    a->hr_size == b->hr_size && a->hr_mtime == b->hr_mtime);
+}
+
+/*
+ * Record with the key ``k'', or NULL.  Slot ``*free'' is where it would
+ * go.
+ */
+static const struct hc_rec *
+hc_find(struct xbf_hcache *hc, const struct hc_rec *k, uint32_t *free)
+{
+	struct hc_hdr *h = hc->hc_map;
+	const struct hc_rec *r;
+	uint32_t *slots, s, i, mask;
+
+	slots = hc_slots(hc);
+	mask = h->hh_nslots - 1;
+	for (i = hc_hash(k) & mask;; i = (i + 1) & mask) {
+		s = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE);
+		if (s == 0 || s > h->hh_cap) {
+			*free = i;
+			return (NULL);
+		}
+		r = &hc_recs(hc)[s - 1];
+		if (hc_key_eq(r, k))
+			return (r);
+	}
+}
+
+/* Lengths are checked by the caller */
+#define hc_strcpy(dst, src)	memcpy((dst), (src), strlen(src) + 1)
+
+/*
+ * Append the header of ``xbf'' with the key ``k''.  Headers that
+ * don't fit in a record, or that _xbf_hdr_build() wouldn't make the
+ * same, aren't cached.  Neither are compressed files and containers: a
+ * hit is rebuilt as a plain .bit file.
+ */
+static void
+hc_insert(struct xbf_hcache *hc, struct xbf *xbf, struct hc_rec *k,
+    uint32_t slot)
+{
+	struct hc_hdr *h = hc->hc_map;
+	struct hc_rec *r;
+	char buf[XBF_PROBE_SIZE];
+	uint32_t n;
+
+	n = h->hh_nrecs;
+	if (n == h->hh_cap ||
+	    (xbf->_xbf_flags & XBF_FLAG_ZIN) != 0 || xbf->_xbf_xbz != NULL ||
+	    strlen(xbf->xbf_ncdname) >= sizeof(r->hr_ncdname) ||
+	    strlen(xbf->xbf_partname) >= sizeof(r->hr_partname) ||
+	    strlen(xbf->xbf_date) >= sizeof(r->hr_date) ||
+	    strlen(xbf->xbf_time) >= sizeof(r->hr_time) ||
+	    _xbf_hdr_build(xbf, xbf->xbf_len, buf, sizeof(buf)) !=
+	    (ssize_t)xbf->xbf_offset)
+		return;
+	r = &hc_recs(hc)[n];
+	*r = *k;
+	r->hr_len = xbf->xbf_len;
+	r->hr_offset = xbf->xbf_offset;
+	hc_strcpy(r->hr_ncdname, xbf->xbf_ncdname);
+	hc_strcpy(r->hr_partname, xbf->xbf_partname);
+	hc_strcpy(r->hr_date, xbf->xbf_date);
+	hc_strcpy(r->hr_time, xbf->xbf_time);
+	__atomic_store_n(&h->hh_nrecs, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&hc_slots(hc)[slot], n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Like xbf_probe(), but through the cache: on a hit the header comes
+ * from the cache and ``fname'' isn't opened.  A miss is probed, and
+ * cached if this is the writer.  Errors are reported in ``xbf''.
+ */
+int
+xbf_hcache_probe(struct xbf_hcache *hc, struct xbf *xbf, const char *fname)
+{
+	const struct hc_rec *r;
+	struct hc_rec k;
+	struct xbf tmp;
+	uint32_t slot;
+	ssize_t hlen;
+	char *buf;
+
+	xbf_assert(xbf);
+	if (hc->hc_map == NULL)
+		return (xbf_probe(xbf, fname));
+	memset(&k, 0, sizeof(k));
+	if (hc_key(hc, fname, &k) != 0)
+		return (xbf_probe(xbf, fname));
+	r = hc_find(hc, &k, &slot);
+	if (r == NULL) {
+		hc->hc_misses++;
+		if (xbf_probe(xbf, fname) != 0)
+			return (-1);
+		if (hc->hc_writer)
+			hc_insert(hc, xbf, &k, slot);
+		return (0);
+	}
+
+	hc->hc_hits++;
+	xbf_init(&tmp);
+	tmp.xbf_ncdname = r->hr_ncdname;
+	tmp.xbf_partname = r->hr_partname;
+	tmp.xbf_date = r->hr_date;
+	tmp.xbf_time = r->hr_time;
+	buf = malloc(XBF_PROBE_SIZE);
+	if (buf == NULL)
+		return (xbf_erri(xbf, "Couldn't allocate header buffer"));
+	hlen = _xbf_hdr_build(&tmp, r->hr_len, buf, XBF_PROBE_SIZE);
+	if (hlen != (ssize_t)r->hr_offset) {
+		free(buf);
+		return (xbf_probe(xbf, fname));
+	}
+	return (_xbf_open_hdr(xbf, fname, buf, hlen, r->hr_size));
+}
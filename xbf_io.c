@@ -0,0 +1,309 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Opening bit streams with a choice of I/O.
+ *
+ * xbf_open() maps the file and lets the payload fault in as it's used,
+ * which is the cheapest way to get at a header and a little data.  A
+ * programmer that streams the whole payload once does better with the
+ * pages read in up front, in big sequential chunks.  Tools going
+ * through archives of cold images don't want them in the page cache at
+ * all.  xbf_open_opts() lets the caller pick:
+ *
+ * XBF_IO_MMAP		what xbf_open() does.
+ * XBF_IO_POPULATE	the mapping is advised sequential (and huge pages,
+ *			where the file system has them) and faulted in
+ *			before returning.
+ * XBF_IO_PREAD		pread() into a buffer: the caller's xo_buf, which
+ *			lets it recycle buffers between opens, or a
+ *			malloc()ed one.
+ * XBF_IO_DIRECT	aligned O_DIRECT reads that leave the page cache
+ *			alone.  File systems without O_DIRECT get plain
+ *			reads, and the pages are dropped afterwards.
+ *
+ * Compressed files always go through xbf_open(): the payload ends up
+ * in anonymous memory anyway.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* O_DIRECT */
+#endif
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+/* O_DIRECT wants the buffer, the offset and the length aligned to this */
+#define IO_ALIGN	4096
+
+/* Bytes asked for per read() */
+#define IO_CHUNK	(1024 * 1024)
+
+/*
+ * Open ``fname'' and check it's long enough to be a bit stream.  If
+ * ``direct'' is set, O_DIRECT is tried first; it's cleared if the file
+ * system doesn't take it.
+ */
+static enum xbf_error
+io_open(struct xbf *xbf, const char *fname, int *direct, int *fdp,
+    size_t *sizep)
+{
+	struct stat st;
+	int fd, error;
+
+	fd = -1;
+#ifdef O_DIRECT
+	if (direct != NULL && *direct)
+		fd = open(fname, O_RDONLY | O_DIRECT);
+#endif
+	if (fd == -1) {
+		if (direct != NULL)
+			*direct = 0;
+		fd = open(fname, O_RDONLY);
+	}
+	if (fd == -1)
+		return (xbf_errc(xbf, XBF_E_OPEN, errno, 0, 0));
+	if (fstat(fd, &st) == -1) {
+		error = errno;
+		(void)close(fd);
+		return (xbf_errc(xbf, XBF_E_STAT, error, 0, 0));
+	}
+	if (st.st_size < XBF_HDR_SIZE) {
+		(void)close(fd);
+		return (xbf_errc(xbf, XBF_E_SHORT, 0, 0, st.st_size));
+	}
+	*fdp = fd;
+	*sizep = st.st_size;
+	return (XBF_OK);
+}
+
+/*
+ * The file was opened with O_DIRECT, but the file system won't do it
+ * after all.  Go on without.
+ */
+static int
+io_nodirect(int fd)
+{
+#ifdef O_DIRECT
+	int fl;
+
+	fl = fcntl(fd, F_GETFL);
+	if (fl == -1 || fcntl(fd, F_SETFL, fl & ~O_DIRECT) == -1)
+		return (-1);
+#endif
+	return (0);
+}
+
+/*
+ * Read the ``size'' bytes of the file into ``buf''.  With O_DIRECT the
+ * reads are whole IO_ALIGN blocks, so ``buf'' must have room for
+ * ``size'' rounded up to one.
+ */
+static int
+io_read(int fd, char *buf, size_t size, int *direct)
+{
+	size_t off, n;
+	ssize_t rsize;
+
+	for (off = 0; off < size; off += rsize) {
+		n = MIN(size - off, IO_CHUNK);
+		if (*direct)
+			n = roundup(n, IO_ALIGN);
+		rsize = pread(fd, buf + off, n, off);
+		if (rsize == -1 && errno == EINVAL && *direct) {
+			if (io_nodirect(fd) != 0)
+				return (-1);
+			*direct = 0;
+			rsize = 0;
+			continue;
+		}
+		if (rsize == -1 && errno == EINTR) {
+			rsize = 0;
+			continue;
+		}
+		if (rsize == -1)
+			return (-1);
+		if (rsize == 0) {
+			/* The file got shorter */
+			errno = 0;
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Map the file, advise the kernel it'll be read front to back, and
+ * fault it all in now.
+ */
+static enum xbf_error
+io_populate(struct xbf *xbf, const char *fname)
+{
+	volatile const char *p;
+	enum xbf_error code;
+	size_t size, i, pgsz;
+	void *mem;
+	int fd, error;
+
+	code = io_open(xbf, fname, NULL, &fd, &size);
+	if (code != XBF_OK)
+		return (code);
+	mem = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	error = errno;
+	(void)close(fd);
+	if (mem == MAP_FAILED)
+		return (xbf_errc(xbf, XBF_E_MAP, error, 0, 0));
+	(void)madvise(mem, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	(void)madvise(mem, size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_READ
+	if (madvise(mem, size, MADV_POPULATE_READ) != 0)
+#endif
+	{
+		pgsz = sysconf(_SC_PAGESIZE);
+		p = mem;
+		for (i = 0; i < size; i += pgsz)
+			(void)p[i];
+	}
+	if (_xbf_xbz_is(mem, size))
+		return (_xbf_xbz_open(xbf, fname, mem, size) == 0 ?
+		    XBF_OK : xbf_errcode(xbf, NULL, NULL));
+	if (_xbf_zin_is(mem, size))
+		return (_xbf_zin_open(xbf, fname, mem, size) == 0 ?
+		    XBF_OK : xbf_errcode(xbf, NULL, NULL));
+	xbf->_xbf_flags |= XBF_FLAG_MMAPED;
+	return (xbf_open_mem(xbf, mem, size));
+}
+
+/*
+ * Read the whole file into memory, with O_DIRECT if ``direct'' is set.
+ */
+static enum xbf_error
+io_pread(struct xbf *xbf, const char *fname, const struct xbf_open_opts *xo,
+    int direct)
+{
+	enum xbf_error code;
+	size_t size, need;
+	char *mem;
+	int fd, error, own;
+
+	code = io_open(xbf, fname, &direct, &fd, &size);
+	if (code != XBF_OK)
+		return (code);
+	/* Room for the last O_DIRECT block, even if we end up without it */
+	need = direct ? roundup(size, IO_ALIGN) : size;
+	own = 0;
+	if (xo->xo_buf != NULL) {
+		mem = xo->xo_buf;
+		if (xo->xo_bufsize < need ||
+		    (direct && ((uintptr_t)mem % IO_ALIGN) != 0)) {
+			(void)close(fd);
+			xbf_erri(xbf, "Buffer at %p (%zu bytes) doesn't fit "
+			    "'%s' (%zu bytes)", mem, xo->xo_bufsize, fname, need);
+			return (XBF_E_OTHER);
+		}
+	} else {
+		mem = NULL;
+		if (direct)
+			error = posix_memalign((void **)&mem, IO_ALIGN, need);
+		else
+			error = (mem = malloc(need)) == NULL ? ENOMEM : 0;
+		if (error != 0) {
+			(void)close(fd);
+			return (xbf_errc(xbf, XBF_E_NOMEM, error, 0, 0));
+		}
+		own = 1;
+	}
+	if (io_read(fd, mem, size, &direct) != 0) {
+		error = errno;
+		(void)close(fd);
+		if (own)
+			free(mem);
+		return (xbf_errc(xbf, XBF_E_READ, error, 0, 0));
+	}
+	if (xo->xo_io == XBF_IO_DIRECT && !direct)
+		(void)posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+	(void)close(fd);
+	if (_xbf_xbz_is(mem, size) || _xbf_zin_is(mem, size)) {
+		if (own)
+			free(mem);
+		return (xbf_open(xbf, fname));
+	}
+	if (own)
+		xbf->_xbf_flags |= XBF_FLAG_ALLOCED;
+	code = xbf_open_mem(xbf, mem, size);
+	if (code != XBF_OK && own) {
+		free(mem);
+		xbf->_xbf_mem = NULL;
+		xbf->_xbf_flags &= ~XBF_FLAG_ALLOCED;
+	}
+	return (code);
+}
+
+/*
+ * Open bit stream ``fname'' like xbf_open(), with the I/O chosen in
+ * ``xo''.  NULL is the same as XBF_IO_MMAP.  A buffer passed in ``xo''
+ * must outlive the context.
+ */
+enum xbf_error
+xbf_open_opts(struct xbf *xbf, const char *fname,
+    const struct xbf_open_opts *xo)
+{
+
+	xbf_assert(xbf);
+	if (!xbf_initialized(xbf))
+		return (xbf_errc(xbf, XBF_E_INIT, 0, 0, 0));
+	if (xo == NULL)
+		return (xbf_open(xbf, fname));
+	xbf->xbf_fname = fname;
+	switch (xo->xo_io) {
+	case XBF_IO_MMAP:
+		return (xbf_open(xbf, fname));
+	case XBF_IO_POPULATE:
+		return (io_populate(xbf, fname));
+	case XBF_IO_PREAD:
+		return (io_pread(xbf, fname, xo, 0));
+	case XBF_IO_DIRECT:
+		return (io_pread(xbf, fname, xo, 1));
+	}
+	xbf_erri(xbf, "Unknown I/O strategy %d", xo->xo_io);
+	return (XBF_E_OTHER);
+}
@@ -0,0 +1,318 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Process wide cache of opened bit streams.
+ *
+ * Programming the same images over and over shouldn't map, fault in
+ * and unmap the same file every time.  The cache keeps each file it
+ * opened as a shared handle (see xbf_share()), keyed by device, inode,
+ * size and modification time, with its pages already faulted in, and
+ * hands out views of it.  A file that changed gets a new key; its old
+ * entry is dropped as soon as the change is seen.  Entries are kept in
+ * LRU order and the oldest ones go when the mapped bytes exceed the
+ * budget.  Evicting an entry only drops the cache's reference, so views
+ * in use stay valid.
+ *
+ * A handful of images is the expected load, so the entries are a
+ * plain list under one mutex.  stat() and the open of a miss are done
+ * without holding it.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+struct mc_ent {
+	struct mc_ent		*me_prev;	/* Towards more recent */
+	struct mc_ent		*me_next;
+	uint64_t		 me_dev;
+	uint64_t		 me_ino;
+	uint64_t		 me_size;
+	int64_t			 me_mtime;	/* ns */
+	size_t			 me_bytes;	/* Mapped */
+	struct xbf_shared	*me_xs;
+};
+
+struct xbf_mcache_priv {
+	pthread_mutex_t		 mp_lock;
+	struct mc_ent		*mp_head;	/* Most recently used */
+	struct mc_ent		*mp_tail;
+};
+
+/*
+ * Set up an empty cache that keeps up to ``budget'' bytes mapped.
+ */
+int
+xbf_mcache_init(struct xbf_mcache *mc, size_t budget)
+{
+
+	ASSERT(mc != NULL);
+	memset(mc, 0, sizeof(*mc));
+	mc->mc_stats.ms_budget = budget;
+	mc->_mc_priv = calloc(1, sizeof(*mc->_mc_priv));
+	if (mc->_mc_priv == NULL)
+		return (-1);
+	if (pthread_mutex_init(&mc->_mc_priv->mp_lock, NULL) != 0) {
+		free(mc->_mc_priv);
+		mc->_mc_priv = NULL;
+		return (-1);
+	}
+	return (0);
+}
+
+static void
+mc_unlink(struct xbf_mcache *mc, struct mc_ent *me)
+{
+	struct xbf_mcache_stats *ms = &mc->mc_stats;
+	struct xbf_mcache_priv *mp = mc->_mc_priv;
+
+	if (me->me_prev != NULL)
+		me->me_prev->me_next = me->me_next;
+	else
+		mp->mp_head = me->me_next;
+	if (me->me_next != NULL)
+		me->me_next->me_prev = me->me_prev;
+	else
+		mp->mp_tail = me->me_prev;
+	ms->ms_bytes -= me->me_bytes;
+	ms->ms_nentries--;
+}
+
+static void
+mc_push(struct xbf_mcache *mc, struct mc_ent *me)
+{
+	struct xbf_mcache_stats *ms = &mc->mc_stats;
+	struct xbf_mcache_priv *mp = mc->_mc_priv;
+
+	me->me_prev = NULL;
+	me->me_next = mp->mp_head;
+	if (mp->mp_head != NULL)
+		mp->mp_head->me_prev = me;
+	else
+		mp->mp_tail = me;
+	mp->mp_head = me;
+	ms->ms_bytes += me->me_bytes;
+	ms->ms_nentries++;
+}
+
+/*
+ * Entries whose references are to be dropped once the lock is let go
+ * are chained through me_next.
+ */
+static void
+mc_drop(struct mc_ent *me)
+{
+	struct mc_ent *next;
+
+	for (; me != NULL; me = next) {
+		next = me->me_next;
+		xbf_shared_put(me->me_xs);
+		free(me);
+	}
+}
+
+/*
+ * Fault the whole payload in now, rather than on the first programming.
+ */
+static void
+mc_prefault(struct xbf *xbf)
+{
+	volatile const char *p;
+	size_t i, pgsz;
+
+	if (xbf->xbf_data == NULL || xbf->xbf_len == 0)
+		return;
+#ifdef MADV_POPULATE_READ
+	if ((xbf->_xbf_flags & XBF_FLAG_MMAPED) != 0 &&
+	    madvise(xbf->_xbf_mem, xbf->_xbf_memsize,
+	    MADV_POPULATE_READ) == 0)
+		return;
+#endif
+	pgsz = sysconf(_SC_PAGESIZE);
+	p = xbf->xbf_data;
+	for (i = 0; i < xbf->xbf_len; i += pgsz)
+		(void)p[i];
+	(void)p[xbf->xbf_len - 1];
+}
+
+/*
+ * Set up ``view'' for bit stream ``fname'' like xbf_open() would, but
+ * from the cache if the file is in it.  Close the view with
+ * xbf_close().  Errors are reported in ``view''.
+ */
+enum xbf_error
+xbf_mcache_open(struct xbf_mcache *mc, struct xbf *view, const char *fname)
+{
+	struct xbf_mcache_stats *ms = &mc->mc_stats;
+	struct xbf_mcache_priv *mp = mc->_mc_priv;
+	struct mc_ent *me, *stale, *evict;
+	struct xbf_shared *xs;
+	struct xbf xbf;
+	struct stat st;
+	enum xbf_error error;
+
+	xbf_assert(view);
+	view->xbf_fname = fname;
+	if (stat(fname, &st) == -1)
+		return (xbf_errc(view, XBF_E_STAT, errno, 0, 0));
+
+	pthread_mutex_lock(&mp->mp_lock);
+	stale = NULL;
+	for (me = mp->mp_head; me != NULL; me = me->me_next) {
+		if (me->me_dev != (uint64_t)st.st_dev ||
+		    me->me_ino != (uint64_t)st.st_ino)
+			continue;
+		if (me->me_size == (uint64_t)st.st_size &&
+		    me->me_mtime == st.st_mtim.tv_sec * 1000000000LL +
+		    st.st_mtim.tv_nsec)
+			break;
+		/* The file changed under us */
+		mc_unlink(mc, me);
+		ms->ms_stale++;
+		stale = me;
+		stale->me_next = NULL;
+		me = NULL;
+		break;
+	}
+	if (me != NULL) {
+		if (me != mp->mp_head) {
+			mc_unlink(mc, me);
+			mc_push(mc, me);
+		}
+		xbf_shared_get(me->me_xs, view);
+		ms->ms_hits++;
+		pthread_mutex_unlock(&mp->mp_lock);
+		return (XBF_OK);
+	}
+	ms->ms_misses++;
+	pthread_mutex_unlock(&mp->mp_lock);
+	mc_drop(stale);
+
+	/*
+	 * Two threads missing on the same file both open it; one entry
+	 * then ages out.  Cheaper than holding the lock over the open.
+	 */
+	xbf_init(&xbf);
+	error = xbf_open(&xbf, fname);
+	if (error != XBF_OK) {
+		view->_xbf_err = xbf._xbf_err;
+		return (error);
+	}
+	mc_prefault(&xbf);
+	me = calloc(1, sizeof(*me));
+	if (me == NULL || (xs = xbf_share(&xbf)) == NULL) {
+		free(me);
+		if (xbf_opened(&xbf))
+			(void)xbf_close(&xbf);
+		return (xbf_errc(view, XBF_E_NOMEM, ENOMEM, 0, 0));
+	}
+	/* The path has to live as long as the views */
+	xs->xs_fname = strdup(fname);
+	if (xs->xs_fname != NULL)
+		xs->xs_xbf.xbf_fname = xs->xs_fname;
+	me->me_dev = st.st_dev;
+	me->me_ino = st.st_ino;
+	me->me_size = st.st_size;
+	me->me_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	me->me_bytes = xs->xs_xbf._xbf_memsize;
+	me->me_xs = xs;
+	xbf_shared_get(xs, view);
+
+	pthread_mutex_lock(&mp->mp_lock);
+	mc_push(mc, me);
+	evict = NULL;
+	while (ms->ms_bytes > ms->ms_budget && mp->mp_tail != me) {
+		stale = mp->mp_tail;
+		mc_unlink(mc, stale);
+		stale->me_next = evict;
+		evict = stale;
+		ms->ms_evictions++;
+	}
+	pthread_mutex_unlock(&mp->mp_lock);
+	mc_drop(evict);
+	return (XBF_OK);
+}
+
+/*
+ * Drop every entry.  Views still open stay valid.
+ */
+void
+xbf_mcache_free(struct xbf_mcache *mc)
+{
+	struct xbf_mcache_stats *ms = &mc->mc_stats;
+	struct xbf_mcache_priv *mp = mc->_mc_priv;
+	struct mc_ent *all;
+
+	pthread_mutex_lock(&mp->mp_lock);
+	all = mp->mp_head;
+	mp->mp_head = mp->mp_tail = NULL;
+	ms->ms_bytes = 0;
+	ms->ms_nentries = 0;
+	pthread_mutex_unlock(&mp->mp_lock);
+	mc_drop(all);
+	pthread_mutex_destroy(&mp->mp_lock);
+	free(mp);
+	mc->_mc_priv = NULL;
+}
+
+/*
+ * Consistent copy of the counters.
+ */
+void
+xbf_mcache_stats(struct xbf_mcache *mc, struct xbf_mcache_stats *ms)
+{
+
+	pthread_mutex_lock(&mc->_mc_priv->mp_lock);
+	*ms = mc->mc_stats;
+	pthread_mutex_unlock(&mc->_mc_priv->mp_lock);
+}
+
+void
+xbf_mcache_print_fp(FILE *fp, struct xbf_mcache *mc)
+{
+	struct xbf_mcache_stats ms;
+
+	xbf_mcache_stats(mc, &ms);
+	fprintf(fp, "%zu entries, %zu of %zu bytes mapped\n",
+	    ms.ms_nentries, ms.ms_bytes, ms.ms_budget);
+	fprintf(fp, "%zu hits, %zu misses, %zu evictions, %zu changed\n",
+	    ms.ms_hits, ms.ms_misses, ms.ms_evictions, ms.ms_stale);
+}
@@ -0,0 +1,329 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Configuration packet decoder.
+ *
+ * The payload of a .bit file is a stream of 32-bit big endian words fed
+ * to the configuration logic.  Everything up to the sync word
+ * (0xAA995566) is padding and bus width detection; after it come Type 1
+ * packets (header with register address and a short word count) and
+ * Type 2 packets (long word count, register taken from the Type 1
+ * packet before).  A DESYNC command ends the synchronized part; partial
+ * and MultiBoot images may sync again later on.
+ *
+ * The decoder doesn't copy anything: it only records where every packet
+ * is within xbf_data.  Layout follows the Virtex-II (UG002) and 7 Series
+ * (UG470) configuration guides.  Spartan-6 uses 16-bit packets and
+ * isn't supported.
+ */
+
+#include <sys/param.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "xbf.h"
+
+#define ARRAY_SIZE(x)	((int)(sizeof(x)/sizeof(x[0])))
+
+#define PKT_TYPE(h)	((h) >> 29)
+#define PKT_OP(h)	(((h) >> 27) & 0x3)
+#define PKT_T1_REG(h)	(((h) >> 13) & 0x3fff)
+#define PKT_T1_WCNT(h)	((h) & 0x7ff)
+#define PKT_T2_WCNT(h)	((h) & 0x7ffffff)
+
+static const char *pkt_regs_v2[] = {
+	"CRC", "FAR", "FDRI", "FDRO", "CMD", "CTL", "MASK", "STAT",
+	"LOUT", "COR", "MFWR", "FLR", "KEY", "CBC", "IDCODE",
+};
+
+static const char *pkt_regs_v4[] = {
+	"CRC", "FAR", "FDRI", "FDRO", "CMD", "CTL0", "MASK", "STAT",
+	"LOUT", "COR0", "MFWR", "CBC", "IDCODE", "AXSS", "COR1", NULL,
+	"WBSTAR", "TIMER", NULL, "RBCRC_SW", NULL, NULL, "BOOTSTS", NULL,
+	"CTL1", NULL, NULL, NULL, NULL, NULL, NULL, "BSPI",
+};
+
+static const char *pkt_cmds[] = {
+	"NULL", "WCFG", "MFW", "LFRM", "RCFG", "START", "RCAP", "RCRC",
+	"AGHIGH", "SWITCH", "GRESTORE", "SHUTDOWN", "GCAPTURE", "DESYNC",
+	NULL, "IPROG", "CRCC", "LTIMER", "BSPI_READ", "FALL_EDGE",
+};
+
+/*
+ * Guess the device family from the part name, e.g. "2vp50ff1152",
+ * "xc7k325tffg900" or "xcku040-ffva1156-2-e".
+ */
+int
+xbf_get_family(struct xbf *xbf)
+{
+	const char *p;
+
+	xbf_assert(xbf);
+	p = xbf->xbf_partname;
+	if (p == NULL)
+		return (XBF_FAM_UNKNOWN);
+	if (strncasecmp(p, "xc", 2) == 0)
+		p += 2;
+	if (strncasecmp(p, "6s", 2) == 0)
+		return (XBF_FAM_S6);
+	if (p[0] == '2' || strncasecmp(p, "3s", 2) == 0 ||
+	    (tolower((unsigned char)p[0]) == 'v' &&
+	    isdigit((unsigned char)p[1])))
+		return (XBF_FAM_V2);
+	if (strncasecmp(p, "4v", 2) == 0 || strncasecmp(p, "5v", 2) == 0)
+		return (XBF_FAM_V5);
+	if (strncasecmp(p, "6v", 2) == 0)
+		return (XBF_FAM_V6);
+	if (p[0] == '7')
+		return (XBF_FAM_7);
+	if (strncasecmp(p, "zu", 2) == 0)
+		return (XBF_FAM_USP);
+	if (strncasecmp(p, "ku", 2) == 0 || strncasecmp(p, "vu", 2) == 0) {
+		/* UltraScale+ parts end their number with 'p': xcku5p */
+		for (p += 2; isdigit((unsigned char)*p); p++)
+			;
+		return ((tolower((unsigned char)*p) == 'p') ?
+		    XBF_FAM_USP : XBF_FAM_US);
+	}
+	return (XBF_FAM_UNKNOWN);
+}
+
+const char *
+xbf_pkt_regname(struct xbf *xbf, unsigned reg)
+{
+	const char *name = NULL;
+
+	if (xbf_get_family(xbf) == XBF_FAM_V2) {
+		if (reg < (unsigned)ARRAY_SIZE(pkt_regs_v2))
+			name = pkt_regs_v2[reg];
+	} else {
+		if (reg < (unsigned)ARRAY_SIZE(pkt_regs_v4))
+			name = pkt_regs_v4[reg];
+	}
+	return (name);
+}
+
+const char *
+xbf_pkt_cmdname(uint32_t cmd)
+{
+
+	if (cmd < (unsigned)ARRAY_SIZE(pkt_cmds))
+		return (pkt_cmds[cmd]);
+	return (NULL);
+}
+
+/*
+ * Data word ``i'' of packet ``p'', in host order.
+ */
+uint32_t
+xbf_pkt_word(struct xbf *xbf, const struct xbf_pkt *p, size_t i)
+{
+	uint32_t w;
+
+	ASSERT(i < p->xp_wcnt);
+	memcpy(&w, xbf->xbf_data + p->xp_off + 4 * (i + 1), sizeof(w));
+	return (ntohl(w));
+}
+
+static int
+pkt_add(struct xbf *xbf, struct xbf_pkts *pk, uint32_t off, int type,
+    int op, unsigned reg, uint32_t wcnt)
+{
+	struct xbf_pkt *np;
+	size_t ncap;
+
+	if (pk->xp_npkts == pk->xp_cap) {
+		ncap = (pk->xp_cap == 0) ? 256 : pk->xp_cap * 2;
+		np = realloc(pk->xp_pkts, ncap * sizeof(*np));
+		if (np == NULL)
+			return (xbf_erri(xbf, "Couldn't allocate %d packet "
+			    "descriptors", (int)ncap));
+		pk->xp_pkts = np;
+		pk->xp_cap = ncap;
+	}
+	np = &pk->xp_pkts[pk->xp_npkts++];
+	np->xp_off = off;
+	np->xp_wcnt = wcnt;
+	np->xp_reg = reg;
+	np->xp_type = type;
+	np->xp_op = op;
+	return (0);
+}
+
+/*
+ * Find the next sync word at or after ``off''.  Returns the offset
+ * right after it or 0 if there's none.
+ */
+static size_t
+pkt_find_sync(const uint8_t *data, size_t len, size_t off)
+{
+	size_t i;
+
+	if (off >= len ||
+	    xbf_sync_find(data + off, len - off, XBF_SYNC_WORD, &i, 1) == 0)
+		return (0);
+	return (off + i + 4);
+}
+
+/*
+ * Walk all packets of the payload and record them in ``pk''.  Every sync
+ * word gets an XBF_PKT_SYNC descriptor of its own.
+ */
+int
+xbf_pkt_decode(struct xbf *xbf, struct xbf_pkts *pk)
+{
+	const uint8_t *data;
+	uint32_t h, w, wcnt;
+	size_t len, off, sync;
+	unsigned reg;
+	int type, op;
+
+	xbf_assert(xbf);
+	ASSERT(pk != NULL);
+	memset(pk, 0, sizeof(*pk));
+	if (xbf->xbf_data == NULL)
+		return (xbf_erri(xbf, "Payload of '%s' isn't loaded",
+		    xbf->xbf_fname));
+	if (xbf_get_family(xbf) == XBF_FAM_S6)
+		return (xbf_erri(xbf, "Spartan-6 packets aren't supported"));
+
+	data = (const uint8_t *)xbf->xbf_data;
+	len = xbf->xbf_len;
+	off = 0;
+	while ((sync = pkt_find_sync(data, len, off)) != 0) {
+		if (pkt_add(xbf, pk, sync - 4, XBF_PKT_SYNC, 0, 0, 0) != 0) {
+			xbf_pkt_free(pk);
+			return (-1);
+		}
+		reg = 0;
+		for (off = sync; off + 4 <= len; ) {
+			memcpy(&h, data + off, sizeof(h));
+			h = ntohl(h);
+			type = PKT_TYPE(h);
+			op = PKT_OP(h);
+			if (type == 1) {
+				reg = PKT_T1_REG(h);
+				wcnt = PKT_T1_WCNT(h);
+			} else if (type == 2)
+				wcnt = PKT_T2_WCNT(h);
+			else {
+				xbf_erri(xbf, "Unknown packet %#08x at offset %d",
+				    h, (int)off);
+				xbf_pkt_free(pk);
+				return (-1);
+			}
+			if (wcnt > (len - off - 4) / 4) {
+				xbf_erri(xbf, "Packet at offset %d runs past the "
+				    "end of payload", (int)off);
+				xbf_pkt_free(pk);
+				return (-1);
+			}
+			if (pkt_add(xbf, pk, off, type, op, reg, wcnt) != 0) {
+				xbf_pkt_free(pk);
+				return (-1);
+			}
+			off += 4 * (1 + wcnt);
+
+			/* DESYNC: whatever follows needs a new sync word */
+			if (op == XBF_PKT_OP_WRITE && reg == XBF_REG_CMD &&
+			    wcnt > 0) {
+				memcpy(&w, data + off - 4, sizeof(w));
+				if (ntohl(w) == XBF_CMD_DESYNC)
+					break;
+			}
+		}
+	}
+	return (0);
+}
+
+void
+xbf_pkt_free(struct xbf_pkts *pk)
+{
+
+	ASSERT(pk != NULL);
+	free(pk->xp_pkts);
+	memset(pk, 0, sizeof(*pk));
+}
+
+/*
+ * Human readable dump of the packet stream.
+ */
+void
+xbf_pkt_print_fp(FILE *fp, struct xbf *xbf, struct xbf_pkts *pk)
+{
+	static const char *ops[] = { "NOOP", "READ", "WRITE", "RSVD" };
+	const struct xbf_pkt *p;
+	const char *name;
+	char regbuf[16];
+	uint32_t w;
+	size_t i;
+
+	ASSERT(fp != NULL);
+	xbf_assert(xbf);
+	ASSERT(pk != NULL);
+
+	(void)fprintf(fp, "%10s %-4s %-5s %-8s %9s\n", "Offset", "Type", "Op",
+	    "Register", "Words");
+	for (i = 0; i < pk->xp_npkts; i++) {
+		p = &pk->xp_pkts[i];
+		if (p->xp_type == XBF_PKT_SYNC) {
+			(void)fprintf(fp, "%10u SYNC\n", p->xp_off);
+			continue;
+		}
+		if (p->xp_op == XBF_PKT_OP_NOOP) {
+			(void)fprintf(fp, "%10u T%u   NOOP\n", p->xp_off,
+			    p->xp_type);
+			continue;
+		}
+		name = xbf_pkt_regname(xbf, p->xp_reg);
+		if (name == NULL) {
+			(void)snprintf(regbuf, sizeof(regbuf), "R%u",
+			    p->xp_reg);
+			name = regbuf;
+		}
+		(void)fprintf(fp, "%10u T%u   %-5s %-8s %9u", p->xp_off,
+		    p->xp_type, ops[p->xp_op], name, p->xp_wcnt);
+		if (p->xp_op == XBF_PKT_OP_WRITE && p->xp_wcnt == 1) {
+			w = xbf_pkt_word(xbf, p, 0);
+			(void)fprintf(fp, "  0x%08x", w);
+			if (p->xp_reg == XBF_REG_CMD &&
+			    (name = xbf_pkt_cmdname(w)) != NULL)
+				(void)fprintf(fp, " %s", name);
+		}
+		(void)fprintf(fp, "\n");
+	}
+}
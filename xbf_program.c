@@ -0,0 +1,385 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Sending the payload to a configuration device: /dev/xdevcfg, the
+ * fpga_manager firmware path, or anything else that takes write()s.
+ *
+ * Copying the mapped payload into a buffer and writing that out reads
+ * and writes every byte twice more than needed, which shows on small
+ * controllers.  When the device takes the payload as it is and the file
+ * the context came from still holds it (same size, same header bytes),
+ * the kernel moves it straight from the page cache with sendfile(), or
+ * with splice() where sendfile() won't take the descriptor but it's a
+ * pipe.  Otherwise the payload is written from the mapping.
+ *
+ * A device that wants it converted (XBF_EXPORT_SWAP32, _BITREV) gets it
+ * through two buffers: a writer thread writes one out while the other
+ * is converted.  The same path reads the payload in when it isn't in
+ * memory, after xbf_probe().
+ *
+ * With XBF_PROG_DONTNEED the pages of the payload are given back as soon
+ * as they're sent.  That's only done for payloads backed by the file;
+ * a decompressed payload has no other copy.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* splice() */
+#endif
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+#ifndef rounddown
+#define rounddown(x, y)	(((x) / (y)) * (y))
+#endif
+
+/* Write-behind buffers for converted payloads */
+#define PROG_ALIGN	64
+
+struct prog_wb {
+	pthread_mutex_t	 wb_lock;
+	pthread_cond_t	 wb_cv;
+	char		*wb_buf[2];
+	size_t		 wb_len[2];	/* Queued for writing, 0 when free */
+	int		 wb_fd;
+	int		 wb_done;	/* Nothing more will be queued */
+	int		 wb_errno;	/* The writer gave up */
+};
+
+static double
+prog_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Payload bytes [off, off + n) have been sent; let the kernel have
+ * their pages back.  ``src'' is the file they came from, -1 if they
+ * aren't backed by one.
+ */
+static void
+prog_release(struct xbf *xbf, int src, size_t off, size_t n)
+{
+	uintptr_t pgsz, start, end;
+
+	/* A container's blocks aren't where the payload would be */
+	if (src == -1 || xbf->_xbf_xbz != NULL)
+		return;
+	if (xbf->xbf_data != NULL &&
+	    (_xbf_owner(xbf)->_xbf_flags & XBF_FLAG_MMAPED) != 0) {
+		/* Whole pages only; a partly sent one goes with the next */
+		pgsz = sysconf(_SC_PAGESIZE);
+		start = rounddown((uintptr_t)xbf->xbf_data + off, pgsz);
+		end = (uintptr_t)xbf->xbf_data + off + n;
+		if (off + n == xbf->xbf_len)
+			end = roundup(end, pgsz);
+		else
+			end = rounddown(end, pgsz);
+		if (end > start)
+			(void)madvise((void *)start, end - start,
+			    MADV_DONTNEED);
+	}
+	(void)posix_fadvise(src, xbf->xbf_offset + off, n,
+	    POSIX_FADV_DONTNEED);
+}
+
+#ifdef __linux__
+/*
+ * Let the kernel move the payload from ``src'' to ``fd''.  Returns 1 if
+ * it can't for these descriptors; nothing was sent then.
+ */
+static int
+prog_zerocopy(struct xbf *xbf, int src, int fd, struct xbf_program_opts *xp,
+    size_t chunk)
+{
+	struct stat st;
+	loff_t off, start, end;
+	ssize_t n;
+
+	start = off = xbf->xbf_offset;
+	end = start + xbf->xbf_len;
+	xp->xp_method = XBF_PROG_M_SENDFILE;
+	while (off < end) {
+		if (xp->xp_method == XBF_PROG_M_SENDFILE)
+			n = sendfile(fd, src, &off, MIN(end - off, chunk));
+		else
+			n = splice(src, &off, fd, NULL, MIN(end - off, chunk),
+			    SPLICE_F_MORE);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && off == start &&
+		    (errno == EINVAL || errno == ENOSYS)) {
+			if (xp->xp_method == XBF_PROG_M_SENDFILE &&
+			    fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+				xp->xp_method = XBF_PROG_M_SPLICE;
+				continue;
+			}
+			return (1);
+		}
+		if (n <= 0)
+			return (xbf_erri(xbf, "Couldn't send: %s", (n == 0) ?
+			    "short write" : strerror(errno)));
+		xp->xp_bytes += n;
+		if ((xp->xp_flags & XBF_PROG_DONTNEED) != 0)
+			prog_release(xbf, src, off - n - start, n);
+	}
+	return (0);
+}
+#endif
+
+/*
+ * The payload is in memory and the device takes it as it is: write it
+ * straight from there.
+ */
+static int
+prog_write(struct xbf *xbf, int src, int fd, struct xbf_program_opts *xp,
+    size_t chunk)
+{
+	size_t off, n;
+
+	xp->xp_method = XBF_PROG_M_WRITE;
+	for (off = 0; off < xbf->xbf_len; off += n) {
+		n = MIN(xbf->xbf_len - off, chunk);
+		if (_xbf_write(xbf, fd, xbf->xbf_data + off, n) != 0)
+			return (-1);
+		xp->xp_bytes += n;
+		if ((xp->xp_flags & XBF_PROG_DONTNEED) != 0)
+			prog_release(xbf, src, off, n);
+	}
+	return (0);
+}
+
+static void *
+prog_writer(void *arg)
+{
+	struct prog_wb *wb = arg;
+	const char *p;
+	size_t len;
+	ssize_t w;
+	int i, error;
+
+	for (i = 0;; i ^= 1) {
+		pthread_mutex_lock(&wb->wb_lock);
+		while (wb->wb_len[i] == 0 && !wb->wb_done)
+			pthread_cond_wait(&wb->wb_cv, &wb->wb_lock);
+		len = wb->wb_len[i];
+		pthread_mutex_unlock(&wb->wb_lock);
+		/* Buffers are queued in turn, so this one was the last */
+		if (len == 0)
+			break;
+		error = 0;
+		for (p = wb->wb_buf[i]; len > 0; p += w, len -= w) {
+			w = write(wb->wb_fd, p, len);
+			if (w == -1 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			if (w <= 0) {
+				error = (w == 0) ? EIO : errno;
+				break;
+			}
+		}
+		pthread_mutex_lock(&wb->wb_lock);
+		wb->wb_len[i] = 0;
+		if (error != 0)
+			wb->wb_errno = error;
+		pthread_cond_broadcast(&wb->wb_cv);
+		pthread_mutex_unlock(&wb->wb_lock);
+		if (error != 0)
+			break;
+	}
+	return (NULL);
+}
+
+/*
+ * Put the ``n'' payload bytes at ``off'' into ``buf'', in the device's
+ * format.
+ */
+static int
+prog_fill(struct xbf *xbf, int src, int mode, char *buf, size_t off,
+    size_t n)
+{
+	ssize_t r;
+
+	if (xbf->xbf_data != NULL) {
+		xbf_export_conv(mode, buf, xbf->xbf_data + off, n);
+		return (0);
+	}
+	if (src == -1)
+		return (xbf_erri(xbf, "Payload of '%s' is neither in memory "
+		    "nor in the file", xbf->xbf_fname));
+	if (xbf->_xbf_xbz != NULL)
+		r = _xbf_xbz_pread(xbf, src, buf, n, off);
+	else
+		r = pread(src, buf, n, xbf->xbf_offset + off);
+	if (r != (ssize_t)n)
+		return (xbf_erri(xbf, "Couldn't read the payload of '%s' at "
+		    "%zu", xbf->xbf_fname, off));
+	if (mode != XBF_EXPORT_ASIS)
+		xbf_export_conv(mode, buf, buf, n);
+	return (0);
+}
+
+/*
+ * Convert (or read) the payload into one buffer while a writer thread
+ * writes the other one out.
+ */
+static int
+prog_conv(struct xbf *xbf, int src, int fd, struct xbf_program_opts *xp,
+    size_t chunk)
+{
+	struct prog_wb wb;
+	pthread_t td;
+	size_t off, n;
+	int i, werr, error = 0;
+
+	xp->xp_method = XBF_PROG_M_CONV;
+	memset(&wb, 0, sizeof(wb));
+	wb.wb_fd = fd;
+	chunk = MIN(chunk, xbf->xbf_len);
+	if (posix_memalign((void **)&wb.wb_buf[0], PROG_ALIGN, chunk) != 0)
+		return (xbf_erri(xbf, "Couldn't allocate write buffers"));
+	if (posix_memalign((void **)&wb.wb_buf[1], PROG_ALIGN, chunk) != 0) {
+		free(wb.wb_buf[0]);
+		return (xbf_erri(xbf, "Couldn't allocate write buffers"));
+	}
+	pthread_mutex_init(&wb.wb_lock, NULL);
+	pthread_cond_init(&wb.wb_cv, NULL);
+	if (pthread_create(&td, NULL, prog_writer, &wb) != 0) {
+		error = xbf_erri(xbf, "Couldn't start the writer");
+		goto out;
+	}
+	for (off = 0, i = 0; off < xbf->xbf_len; off += n, i ^= 1) {
+		pthread_mutex_lock(&wb.wb_lock);
+		while (wb.wb_len[i] != 0 && wb.wb_errno == 0)
+			pthread_cond_wait(&wb.wb_cv, &wb.wb_lock);
+		werr = wb.wb_errno;
+		pthread_mutex_unlock(&wb.wb_lock);
+		if (werr != 0)
+			break;
+		n = MIN(xbf->xbf_len - off, chunk);
+		error = prog_fill(xbf, src, xp->xp_mode, wb.wb_buf[i], off, n);
+		if (error != 0)
+			break;
+		if ((xp->xp_flags & XBF_PROG_DONTNEED) != 0)
+			prog_release(xbf, src, off, n);
+		pthread_mutex_lock(&wb.wb_lock);
+		wb.wb_len[i] = n;
+		pthread_cond_broadcast(&wb.wb_cv);
+		pthread_mutex_unlock(&wb.wb_lock);
+		xp->xp_bytes += n;
+	}
+	pthread_mutex_lock(&wb.wb_lock);
+	wb.wb_done = 1;
+	pthread_cond_broadcast(&wb.wb_cv);
+	pthread_mutex_unlock(&wb.wb_lock);
+	pthread_join(td, NULL);
+	if (error == 0 && wb.wb_errno != 0)
+		error = xbf_erri(xbf, "Couldn't write: %s",
+		    strerror(wb.wb_errno));
+out:
+	pthread_cond_destroy(&wb.wb_cv);
+	pthread_mutex_destroy(&wb.wb_lock);
+	free(wb.wb_buf[0]);
+	free(wb.wb_buf[1]);
+	return (error);
+}
+
+/*
+ * Send the payload of ``xbf'' to ``fd'', converted for the device as
+ * ``xp'' says, and record how it went in ``xp''.  NULL sends it as it
+ * is.  Works after xbf_probe() too.
+ */
+int
+xbf_program_fd(struct xbf *xbf, int fd, struct xbf_program_opts *xp)
+{
+	struct xbf_program_opts def;
+	size_t chunk;
+	double t;
+	int src, error;
+
+	xbf_assert(xbf);
+	if (xp == NULL) {
+		memset(&def, 0, sizeof(def));
+		xp = &def;
+	}
+	if (xp->xp_mode != XBF_EXPORT_ASIS &&
+	    xp->xp_mode != XBF_EXPORT_SWAP32 &&
+	    xp->xp_mode != XBF_EXPORT_BITREV)
+		return (xbf_erri(xbf, "Unknown export mode %d", xp->xp_mode));
+	if (!xbf_opened(xbf))
+		return (xbf_erri(xbf, "Nothing to program, no bit stream "
+		    "opened"));
+	/* Whole words, so no word is split between two conversions */
+	chunk = (xp->xp_chunk != 0) ? roundup(xp->xp_chunk, 4) :
+	    XBF_PROG_CHUNK;
+	xp->xp_method = 0;
+	xp->xp_bytes = 0;
+	t = prog_now();
+	if (xbf->_xbf_xbz != NULL)
+		src = _xbf_xbz_source(xbf);
+	else
+		src = _xbf_open_source(xbf);
+	error = 1;
+#ifdef __linux__
+	if (src != -1 && xbf->_xbf_xbz == NULL &&
+	    xp->xp_mode == XBF_EXPORT_ASIS &&
+	    (xp->xp_flags & XBF_PROG_NOZEROCOPY) == 0)
+		error = prog_zerocopy(xbf, src, fd, xp, chunk);
+#endif
+	if (error == 1 && xp->xp_mode == XBF_EXPORT_ASIS &&
+	    xbf->xbf_data != NULL)
+		error = prog_write(xbf, src, fd, xp, chunk);
+	else if (error == 1)
+		error = prog_conv(xbf, src, fd, xp, chunk);
+	if (src != -1)
+		(void)close(src);
+	xp->xp_secs = prog_now() - t;
+	return (error);
+}
@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Recursive, parallel scanning of directory trees full of .bit files.
+ *
+ * Every worker thread owns a deque of tasks.  A task is either a
+ * directory to read or a file to probe.  The owner pushes and pops at
+ * the tail, so it walks the tree depth-first, while idle workers steal
+ * from the head, where the oldest (and usually the biggest) directories
+ * are.  Headers are read with xbf_probe(), so the payload is never
+ * touched and the scan is bound by the metadata I/O.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+struct scan_task {
+	char		*st_path;
+	int		 st_isdir;
+};
+
+struct scan_deque {
+	pthread_mutex_t	 sd_lock;
+	struct scan_task *sd_tasks;
+	size_t		 sd_head;
+	size_t		 sd_tail;
+	size_t		 sd_cap;
+};
+
+struct scan_ctx;
+
+struct scan_worker {
+	struct scan_deque sw_dq;
+	struct scan_ctx	*sw_ctx;
+	pthread_t	 sw_thr;
+	int		 sw_id;
+};
+
+struct scan_ctx {
+	struct scan_worker *sc_workers;
+	int		 sc_nworkers;
+	const char	*sc_suffix;
+	xbf_scan_cb_t	*sc_cb;
+	void		*sc_arg;
+
+	/* Tasks queued or running; the scan is over when it drops to 0 */
+	long		 sc_pending;
+
+	/* Bumped on every push, so sleepers can't miss new work */
+	unsigned long	 sc_gen;
+	int		 sc_nidle;
+	pthread_mutex_t	 sc_idle_lock;
+	pthread_cond_t	 sc_idle_cv;
+};
+
+static int
+scan_push(struct scan_worker *sw, char *path, int isdir)
+{
+	struct scan_ctx *sc = sw->sw_ctx;
+	struct scan_deque *dq = &sw->sw_dq;
+	struct scan_task *nt;
+	size_t ncap;
+
+	__atomic_add_fetch(&sc->sc_pending, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&dq->sd_lock);
+	if (dq->sd_head == dq->sd_tail)
+		dq->sd_head = dq->sd_tail = 0;
+	if (dq->sd_tail == dq->sd_cap) {
+		if (dq->sd_head > dq->sd_cap / 2) {
+			memmove(dq->sd_tasks, dq->sd_tasks + dq->sd_head,
+			    (dq->sd_tail - dq->sd_head) * sizeof(*nt));
+			dq->sd_tail -= dq->sd_head;
+			dq->sd_head = 0;
+		} else {
+			ncap = (dq->sd_cap == 0) ? 64 : dq->sd_cap * 2;
+			nt = realloc(dq->sd_tasks, ncap * sizeof(*nt));
+			if (nt == NULL) {
+				pthread_mutex_unlock(&dq->sd_lock);
+				__atomic_sub_fetch(&sc->sc_pending, 1,
+				    __ATOMIC_SEQ_CST);
+				return (-1);
+			}
+			dq->sd_tasks = nt;
+			dq->sd_cap = ncap;
+		}
+	}
+	dq->sd_tasks[dq->sd_tail].st_path = path;
+	dq->sd_tasks[dq->sd_tail].st_isdir = isdir;
+	dq->sd_tail++;
+	pthread_mutex_unlock(&dq->sd_lock);
+
+	__atomic_add_fetch(&sc->sc_gen, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sc->sc_nidle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&sc->sc_idle_lock);
+		pthread_cond_signal(&sc->sc_idle_cv);
+		pthread_mutex_unlock(&sc->sc_idle_lock);
+	}
+	return (0);
+}
+
+/*
+ * Owner side: newest task first.
+ */
+static int
+scan_pop(struct scan_worker *sw, struct scan_task *t)
+{
+	struct scan_deque *dq = &sw->sw_dq;
+	int found = 0;
+
+	pthread_mutex_lock(&dq->sd_lock);
+	if (dq->sd_head != dq->sd_tail) {
+		*t = dq->sd_tasks[--dq->sd_tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->sd_lock);
+	return (found);
+}
+
+/*
+ * Thief side: oldest task first.
+ */
+static int
+scan_steal(struct scan_worker *victim, struct scan_task *t)
+{
+	struct scan_deque *dq = &victim->sw_dq;
+	int found = 0;
+
+	pthread_mutex_lock(&dq->sd_lock);
+	if (dq->sd_head != dq->sd_tail) {
+		*t = dq->sd_tasks[dq->sd_head++];
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->sd_lock);
+	return (found);
+}
+
+static int
+scan_suffix_ok(const char *path, const char *suffix)
+{
+	size_t plen, slen;
+
+	if (suffix == NULL)
+		return (1);
+	plen = strlen(path);
+	slen = strlen(suffix);
+	if (plen < slen)
+		return (0);
+	return (strcasecmp(path + plen - slen, suffix) == 0);
+}
+
+static void
+scan_file(struct scan_ctx *sc, const char *path)
+{
+	struct xbf xbf;
+	int error;
+
+	xbf_init(&xbf);
+	error = xbf_probe(&xbf, path);
+	sc->sc_cb(sc->sc_arg, path, &xbf, error);
+	if (error == 0)
+		(void)xbf_close(&xbf);
+}
+
+static void
+scan_dir(struct scan_worker *sw, const char *path)
+{
+	struct scan_ctx *sc = sw->sw_ctx;
+	struct dirent *de;
+	struct stat st;
+	struct xbf xbf;
+	char *cpath;
+	size_t plen;
+	int isdir, error;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		error = errno;
+		xbf_init(&xbf);
+		xbf.xbf_fname = path;
+		sc->sc_cb(sc->sc_arg, path, &xbf, xbf_errc(&xbf, XBF_E_OPEN,
+		    error, 0, 0));
+		return;
+	}
+	plen = strlen(path);
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		cpath = malloc(plen + 1 + strlen(de->d_name) + 1);
+		if (cpath == NULL) {
+			/* The rest of the directory is lost: say so */
+			xbf_init(&xbf);
+			(void)xbf_erri(&xbf, "Couldn't read all of directory "
+			    "'%s': %s", path, strerror(ENOMEM));
+			sc->sc_cb(sc->sc_arg, path, &xbf, XBF_E_OTHER);
+			break;
+		}
+		(void)sprintf(cpath, "%s/%s", path, de->d_name);
+		switch (de->d_type) {
+		case DT_DIR:
+			isdir = 1;
+			break;
+		case DT_REG:
+			isdir = 0;
+			break;
+		case DT_UNKNOWN:
+			if (lstat(cpath, &st) == 0 &&
+			    (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+				isdir = S_ISDIR(st.st_mode);
+				break;
+			}
+			/* FALLTHROUGH */
+		default:
+			/* Symbolic links and specials aren't followed */
+			free(cpath);
+			continue;
+		}
+		if ((!isdir && !scan_suffix_ok(cpath, sc->sc_suffix)) ||
+		    scan_push(sw, cpath, isdir) != 0)
+			free(cpath);
+	}
+	(void)closedir(dir);
+}
+
+static int
+scan_next(struct scan_worker *sw, struct scan_task *t)
+{
+	struct scan_ctx *sc = sw->sw_ctx;
+	unsigned long gen;
+	int i, v;
+
+	for (;;) {
+		gen = __atomic_load_n(&sc->sc_gen, __ATOMIC_SEQ_CST);
+		if (scan_pop(sw, t))
+			return (1);
+		for (i = 1; i < sc->sc_nworkers; i++) {
+			v = (sw->sw_id + i) % sc->sc_nworkers;
+			if (scan_steal(&sc->sc_workers[v], t))
+				return (1);
+		}
+
+		pthread_mutex_lock(&sc->sc_idle_lock);
+		__atomic_add_fetch(&sc->sc_nidle, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&sc->sc_pending, __ATOMIC_SEQ_CST) == 0) {
+			__atomic_sub_fetch(&sc->sc_nidle, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&sc->sc_idle_lock);
+			return (0);
+		}
+		if (__atomic_load_n(&sc->sc_gen, __ATOMIC_SEQ_CST) == gen)
+			pthread_cond_wait(&sc->sc_idle_cv, &sc->sc_idle_lock);
+		__atomic_sub_fetch(&sc->sc_nidle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&sc->sc_idle_lock);
+	}
+}
+
+static void *
+scan_worker_main(void *arg)
+{
+	struct scan_worker *sw = arg;
+	struct scan_ctx *sc = sw->sw_ctx;
+	struct scan_task t;
+
+	while (scan_next(sw, &t)) {
+		if (t.st_isdir)
+			scan_dir(sw, t.st_path);
+		else
+			scan_file(sc, t.st_path);
+		free(t.st_path);
+		if (__atomic_sub_fetch(&sc->sc_pending, 1,
+		    __ATOMIC_SEQ_CST) == 0) {
+			pthread_mutex_lock(&sc->sc_idle_lock);
+			pthread_cond_broadcast(&sc->sc_idle_cv);
+			pthread_mutex_unlock(&sc->sc_idle_lock);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Walk the tree under ``path'' with ``nthreads'' workers (0 means one per
+ * online CPU) and call ``cb'' once for every regular file whose name ends
+ * with ``suffix'' (all files if NULL).  ``cb'' is called concurrently
+ * from the workers and gets the probed context along with the result of
+ * xbf_probe(); the context is only valid during the call.  Directories
+ * that can't be read are reported through ``cb'' as errors too.
+ */
+int
+xbf_scan(const char *path, const char *suffix, int nthreads,
+    xbf_scan_cb_t *cb, void *arg)
+{
+	struct scan_ctx sc;
+	struct scan_task t;
+	struct stat st;
+	char *rpath;
+	int error = 0;
+	int i, n, nstart;
+
+	ASSERT(path != NULL);
+	ASSERT(cb != NULL);
+
+	if (stat(path, &st) == -1)
+		return (-1);
+	if (nthreads <= 0)
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.sc_suffix = suffix;
+	sc.sc_cb = cb;
+	sc.sc_arg = arg;
+	sc.sc_nworkers = nthreads;
+	pthread_mutex_init(&sc.sc_idle_lock, NULL);
+	pthread_cond_init(&sc.sc_idle_cv, NULL);
+	sc.sc_workers = calloc(nthreads, sizeof(*sc.sc_workers));
+	if (sc.sc_workers == NULL)
+		return (-1);
+	for (i = 0; i < nthreads; i++) {
+		sc.sc_workers[i].sw_ctx = &sc;
+		sc.sc_workers[i].sw_id = i;
+		pthread_mutex_init(&sc.sc_workers[i].sw_dq.sd_lock, NULL);
+	}
+
+	nstart = nthreads;
+	rpath = strdup(path);
+	if (rpath == NULL || scan_push(&sc.sc_workers[0], rpath,
+	    S_ISDIR(st.st_mode)) != 0) {
+		free(rpath);
+		error = -1;
+		nstart = 0;
+	}
+
+	for (n = 0; n < nstart; n++)
+		if (pthread_create(&sc.sc_workers[n].sw_thr, NULL,
+		    scan_worker_main, &sc.sc_workers[n]) != 0)
+			break;
+	if (n == 0 && nstart > 0) {
+		/* No threads at all; do the work ourselves */
+		sc.sc_nworkers = 1;
+		while (scan_pop(&sc.sc_workers[0], &t)) {
+			if (t.st_isdir)
+				scan_dir(&sc.sc_workers[0], t.st_path);
+			else
+				scan_file(&sc, t.st_path);
+			free(t.st_path);
+			sc.sc_pending--;
+		}
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(sc.sc_workers[i].sw_thr, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_destroy(&sc.sc_workers[i].sw_dq.sd_lock);
+		free(sc.sc_workers[i].sw_dq.sd_tasks);
+	}
+	free(sc.sc_workers);
+	pthread_cond_destroy(&sc.sc_idle_cv);
+	pthread_mutex_destroy(&sc.sc_idle_lock);
+	return (error);
+}
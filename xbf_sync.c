@@ -0,0 +1,365 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ * Searching the payload for 32-bit marker words: the sync word, the bus
+ * width detection pattern and so on.  They don't have to be aligned.
+ *
+ * The SIMD kernels compare 16 (SSE2) or 32 (AVX2) starting positions at
+ * once: four unaligned loads shifted by one byte each are compared
+ * against the four bytes of the word and the results ANDed, so every
+ * set bit of the final mask is a match.  The dummy pad in front of the
+ * sync word is skipped the same way, a whole vector of 0xFF bytes at a
+ * time.  The kernel is picked at run time from what the CPU supports.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SYNC_X86
+#endif
+
+#include "xbf.h"
+
+/*
+ * What the CPU can do.  __builtin_cpu_supports() does its own caching.
+ */
+int
+_xbf_cpu_has(int kern)
+{
+
+	switch (kern) {
+	case XBF_KERN_SCALAR:
+		return (1);
+#ifdef SYNC_X86
+	case XBF_KERN_SSE2:
+		return (__builtin_cpu_supports("sse2"));
+	case XBF_KERN_SSSE3:
+		return (__builtin_cpu_supports("ssse3"));
+	case XBF_KERN_SSE42:
+		return (__builtin_cpu_supports("sse4.2"));
+	case XBF_KERN_AVX2:
+		return (__builtin_cpu_supports("avx2"));
+#endif
+	}
+	return (0);
+}
+
+static size_t
+sync_find_scalar(const uint8_t *p, size_t len, uint32_t word, size_t *offs,
+    size_t max, size_t start)
+{
+	uint8_t b0, b1, b2, b3;
+	size_t i, n = 0;
+
+	b0 = word >> 24;
+	b1 = word >> 16;
+	b2 = word >> 8;
+	b3 = word;
+	for (i = start; i + 4 <= len && n < max; i++)
+		if (p[i] == b0 && p[i + 1] == b1 && p[i + 2] == b2 &&
+		    p[i + 3] == b3)
+			offs[n++] = i;
+	return (n);
+}
+
+static size_t
+dummy_skip_scalar(const uint8_t *p, size_t len, size_t start)
+{
+	size_t i;
+
+	for (i = start; i < len && p[i] == 0xff; i++)
+		;
+	return (i);
+}
+
+#ifdef SYNC_X86
+__attribute__((target("sse2")))
+static size_t
+sync_find_sse2(const uint8_t *p, size_t len, uint32_t word, size_t *offs,
+    size_t max)
+{
+	__m128i b0, b1, b2, b3, m;
+	unsigned mask;
+	size_t i, n = 0;
+
+	b0 = _mm_set1_epi8((char)(word >> 24));
+	b1 = _mm_set1_epi8((char)(word >> 16));
+	b2 = _mm_set1_epi8((char)(word >> 8));
+	b3 = _mm_set1_epi8((char)word);
+	for (i = 0; i + 16 + 3 <= len; i += 16) {
+		m = _mm_cmpeq_epi8(_mm_loadu_si128((const void *)(p + i)), b0);
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(
+		    _mm_loadu_si128((const void *)(p + i + 1)), b1));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(
+		    _mm_loadu_si128((const void *)(p + i + 2)), b2));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(
+		    _mm_loadu_si128((const void *)(p + i + 3)), b3));
+		mask = (unsigned)_mm_movemask_epi8(m);
+		while (mask != 0) {
+			offs[n++] = i + __builtin_ctz(mask);
+			if (n == max)
+				return (n);
+			mask &= mask - 1;
+		}
+	}
+	return (n + sync_find_scalar(p, len, word, offs + n, max - n, i));
+}
+
+__attribute__((target("avx2")))
+static size_t
+sync_find_avx2(const uint8_t *p, size_t len, uint32_t word, size_t *offs,
+    size_t max)
+{
+	__m256i b0, b1, b2, b3, m;
+	unsigned mask;
+	size_t i, n = 0;
+
+	b0 = _mm256_set1_epi8((char)(word >> 24));
+	b1 = _mm256_set1_epi8((char)(word >> 16));
+	b2 = _mm256_set1_epi8((char)(word >> 8));
+	b3 = _mm256_set1_epi8((char)word);
+	for (i = 0; i + 32 + 3 <= len; i += 32) {
+		m = _mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const void *)(p + i)), b0);
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const void *)(p + i + 1)), b1));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const void *)(p + i + 2)), b2));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const void *)(p + i + 3)), b3));
+		mask = (unsigned)_mm256_movemask_epi8(m);
+		while (mask != 0) {
+			offs[n++] = i + __builtin_ctz(mask);
+			if (n == max)
+				return (n);
+			mask &= mask - 1;
+		}
+	}
+	return (n + sync_find_scalar(p, len, word, offs + n, max - n, i));
+}
+
+__attribute__((target("sse2")))
+static size_t
+dummy_skip_sse2(const uint8_t *p, size_t len)
+{
+	__m128i ff;
+	unsigned mask;
+	size_t i;
+
+	ff = _mm_set1_epi8((char)0xff);
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const void *)(p + i)), ff));
+		if (mask != 0xffff)
+			return (i + __builtin_ctz(~mask));
+	}
+	return (dummy_skip_scalar(p, len, i));
+}
+
+__attribute__((target("avx2")))
+static size_t
+dummy_skip_avx2(const uint8_t *p, size_t len)
+{
+	__m256i ff;
+	unsigned mask;
+	size_t i;
+
+	ff = _mm256_set1_epi8((char)0xff);
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		    _mm256_loadu_si256((const void *)(p + i)), ff));
+		if (mask != 0xffffffffU)
+			return (i + __builtin_ctz(~mask));
+	}
+	return (dummy_skip_scalar(p, len, i));
+}
+#endif /* SYNC_X86 */
+
+/*
+ * Best kernel the CPU has, looked up once.
+ */
+static int
+sync_kern(void)
+{
+	static int kern = -1;
+	int k;
+
+	k = __atomic_load_n(&kern, __ATOMIC_RELAXED);
+	if (k == -1) {
+		if (_xbf_cpu_has(XBF_KERN_AVX2))
+			k = XBF_KERN_AVX2;
+		else if (_xbf_cpu_has(XBF_KERN_SSE2))
+			k = XBF_KERN_SSE2;
+		else
+			k = XBF_KERN_SCALAR;
+		__atomic_store_n(&kern, k, __ATOMIC_RELAXED);
+	}
+	return (k);
+}
+
+/*
+ * Same as xbf_sync_find(), but with the kernel chosen by the caller.
+ * Used by the benchmarks.
+ */
+size_t
+_xbf_sync_find_kern(int kern, const void *buf, size_t len, uint32_t word,
+    size_t *offs, size_t max)
+{
+
+	if (max == 0)
+		return (0);
+	switch (kern) {
+#ifdef SYNC_X86
+	case XBF_KERN_AVX2:
+		return (sync_find_avx2(buf, len, word, offs, max));
+	case XBF_KERN_SSE2:
+		return (sync_find_sse2(buf, len, word, offs, max));
+#endif
+	default:
+		return (sync_find_scalar(buf, len, word, offs, max, 0));
+	}
+}
+
+/*
+ * Find the big endian 32-bit ``word'' at any byte offset of ``buf''.
+ * Up to ``max'' offsets are stored in ``offs'', in increasing order,
+ * and their number is returned.
+ */
+size_t
+xbf_sync_find(const void *buf, size_t len, uint32_t word, size_t *offs,
+    size_t max)
+{
+
+	return (_xbf_sync_find_kern(sync_kern(), buf, len, word, offs, max));
+}
+
+/*
+ * Same as xbf_dummy_skip(), but with the kernel chosen by the caller.
+ */
+size_t
+_xbf_dummy_skip_kern(int kern, const void *buf, size_t len)
+{
+	size_t n;
+
+	switch (kern) {
+#ifdef SYNC_X86
+	case XBF_KERN_AVX2:
+		n = dummy_skip_avx2(buf, len);
+		break;
+	case XBF_KERN_SSE2:
+		n = dummy_skip_sse2(buf, len);
+		break;
+#endif
+	default:
+		n = dummy_skip_scalar(buf, len, 0);
+		break;
+	}
+	/* Only whole dummy words count */
+	return (n & ~(size_t)3);
+}
+
+/*
+ * Length in bytes of the run of dummy words (XBF_DUMMY_WORD) the
+ * ``len'' bytes at ``buf'' start with.
+ */
+size_t
+xbf_dummy_skip(const void *buf, size_t len)
+{
+
+	return (_xbf_dummy_skip_kern(sync_kern(), buf, len));
+}
+
+/*
+ * Offsets of all sync words within the payload.  Partial and MultiBoot
+ * images have more than one.  Returns how many there are, even if only
+ * ``max'' fit in ``offs''.
+ */
+size_t
+xbf_get_syncs(struct xbf *xbf, size_t *offs, size_t max)
+{
+	const char *data;
+	size_t off, n, total, len, tmp;
+
+	xbf_assert(xbf);
+	data = xbf->xbf_data;
+	len = xbf->xbf_len;
+	if (data == NULL)
+		return (0);
+	off = xbf_dummy_skip(data, len);
+	for (total = 0; off < len; total++) {
+		n = xbf_sync_find(data + off, len - off, XBF_SYNC_WORD, &tmp, 1);
+		if (n == 0)
+			break;
+		if (total < max)
+			offs[total] = off + tmp;
+		off += tmp + 4;
+	}
+	return (total);
+}
+
+/*
+ * Where is the bus width detection pattern (0x000000BB 0x11220044)?
+ * Returns -1 if there's none before the first sync word.
+ */
+ssize_t
+xbf_get_buswidth_off(struct xbf *xbf)
+{
+	const uint8_t *data;
+	size_t offs[4], len, n, i;
+	size_t sync, pad;
+
+	xbf_assert(xbf);
+	data = (const uint8_t *)xbf->xbf_data;
+	if (data == NULL)
+		return (-1);
+	len = xbf->xbf_len;
+	/* The pattern follows the dummy pad */
+	pad = xbf_dummy_skip(data, len);
+	data += pad;
+	len -= pad;
+	if (xbf_sync_find(data, len, XBF_SYNC_WORD, &sync, 1) == 1)
+		len = sync;
+	n = xbf_sync_find(data, len, XBF_BUSWIDTH_WORD0, offs,
+	    sizeof(offs) / sizeof(offs[0]));
+	for (i = 0; i < n; i++)
+		if (offs[i] + 8 <= len && data[offs[i] + 4] ==
+		    (uint8_t)(XBF_BUSWIDTH_WORD1 >> 24) &&
+		    data[offs[i] + 5] == (uint8_t)(XBF_BUSWIDTH_WORD1 >> 16) &&
+		    data[offs[i] + 6] == (uint8_t)(XBF_BUSWIDTH_WORD1 >> 8) &&
+		    data[offs[i] + 7] == (uint8_t)XBF_BUSWIDTH_WORD1)
+			return ((ssize_t)(pad + offs[i]));
+	return (-1);
+}
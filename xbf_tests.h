@@ -4,3 +4,27 @@
 	TEST_UNIT(f1_ncdnull)
 	TEST_UNIT(f1_neglen)
 	TEST_UNIT(f1_lentoobig)
+	TEST_UNIT(hdr_ok)
+	TEST_UNIT(hdr_payload)
+	TEST_UNIT(hdr_short)
+	TEST_UNIT(f1_trunc)
+	TEST_UNIT(f2_noa)
+	TEST_UNIT(f3_trunc)
+	TEST_UNIT(f3_pastend)
+	TEST_UNIT(f4_trunc)
+	TEST_UNIT(f4_pastend)
+	TEST_UNIT(f5_len)
+	TEST_UNIT(f6_nonull)
+	TEST_UNIT(f7_noe)
+	TEST_UNIT(f7_pastend)
+	TEST_UNIT(f7_huge)
+	TEST_UNIT(hdr_feed)
+	TEST_UNIT(u_hcache)
+	TEST_UNIT(u_far)
+	TEST_UNIT(u_crc)
+	TEST_UNIT(u_compress)
+	TEST_UNIT(u_diff)
+	TEST_UNIT(u_xbz)
+	TEST_UNIT(u_build)
+	TEST_UNIT(u_program)
+	TEST_UNIT(u_mcs)
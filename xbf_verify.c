@@ -0,0 +1,358 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Readback verification.
+ *
+ * The readback is compared with the frames the bit stream writes to
+ * FDRI, in the order it writes them; bits set in the mask (the FDRI
+ * frames of a .msk file, which has the same layout) are left out.  It's
+ * streamed: every piece of readback is compared straight from the
+ * caller's buffer against the mapped bit stream and mask, so nothing
+ * is copied and only the current position is kept.  The SIMD kernels
+ * OR together (readback ^ expected) & ~mask 32 (AVX2) or 16 (SSE2)
+ * bytes at a time and test the result once per piece of frame.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VERIFY_X86
+#endif
+
+#include "xbf.h"
+
+/* Longest frame, in bytes; see xbf_get_frame_words() */
+#define VERIFY_MAXFRAME	(128 * 4)
+
+/* Mask of a bit stream without a .msk file */
+static const uint8_t verify_nomask[VERIFY_MAXFRAME];
+
+static int
+verify_eq_scalar(const uint8_t *rb, const uint8_t *exp, const uint8_t *msk,
+    size_t n)
+{
+	uint64_t a, b, m, acc;
+	size_t i;
+
+	acc = 0;
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&a, rb + i, 8);
+		memcpy(&b, exp + i, 8);
+		memcpy(&m, msk + i, 8);
+		acc |= (a ^ b) & ~m;
+	}
+	for (; i < n; i++)
+		acc |= (rb[i] ^ exp[i]) & ~msk[i] & 0xff;
+	return (acc == 0);
+}
+
+#ifdef VERIFY_X86
+__attribute__((target("sse2")))
+static int
+verify_eq_sse2(const uint8_t *rb, const uint8_t *exp, const uint8_t *msk,
+    size_t n)
+{
+	__m128i acc;
+	size_t i;
+
+	acc = _mm_setzero_si128();
+	for (i = 0; i + 16 <= n; i += 16)
+		acc = _mm_or_si128(acc, _mm_andnot_si128(
+		    _mm_loadu_si128((const void *)(msk + i)),
+		    _mm_xor_si128(_mm_loadu_si128((const void *)(rb + i)),
+		    _mm_loadu_si128((const void *)(exp + i)))));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+	    0xffff)
+		return (0);
+	return (verify_eq_scalar(rb + i, exp + i, msk + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static int
+verify_eq_avx2(const uint8_t *rb, const uint8_t *exp, const uint8_t *msk,
+    size_t n)
+{
+	__m256i acc;
+	size_t i;
+
+	acc = _mm256_setzero_si256();
+	for (i = 0; i + 32 <= n; i += 32)
+		acc = _mm256_or_si256(acc, _mm256_andnot_si256(
+		    _mm256_loadu_si256((const void *)(msk + i)),
+		    _mm256_xor_si256(_mm256_loadu_si256((const void *)(rb + i)),
+		    _mm256_loadu_si256((const void *)(exp + i)))));
+	if (!_mm256_testz_si256(acc, acc))
+		return (0);
+	return (verify_eq_scalar(rb + i, exp + i, msk + i, n - i));
+}
+#endif
+
+static int
+verify_eq(int kern, const uint8_t *rb, const uint8_t *exp, const uint8_t *msk,
+    size_t n)
+{
+
+	switch (kern) {
+#ifdef VERIFY_X86
+	case XBF_KERN_AVX2:
+		return (verify_eq_avx2(rb, exp, msk, n));
+	case XBF_KERN_SSE2:
+		return (verify_eq_sse2(rb, exp, msk, n));
+#endif
+	default:
+		return (verify_eq_scalar(rb, exp, msk, n));
+	}
+}
+
+static int
+verify_bursts(struct xbf *xbf, struct xbf_bursts *xb, size_t *nframes)
+{
+	struct xbf_pkts pk;
+	size_t i;
+	int error;
+
+	if (xbf_pkt_decode(xbf, &pk) != 0)
+		return (-1);
+	error = _xbf_frame_bursts(xbf, &pk, xb);
+	xbf_pkt_free(&pk);
+	if (error != 0)
+		return (-1);
+	for (i = 0, *nframes = 0; i < xb->xb_nbursts; i++)
+		*nframes += xb->xb_bursts[i].xb_nframes;
+	return (0);
+}
+
+/*
+ * Same as xbf_verify_init(), but with the kernel chosen by the caller.
+ * Used by the benchmarks.
+ */
+int
+_xbf_verify_init_kern(int kern, struct xbf_verify *xv, struct xbf *xbf,
+    struct xbf *msk, int flags)
+{
+	size_t nmask;
+
+	xbf_assert(xbf);
+	memset(xv, 0, sizeof(*xv));
+	xv->xv_xbf = xbf;
+	xv->xv_msk = msk;
+	xv->xv_kern = kern;
+	if (msk != NULL) {
+		xbf_assert(msk);
+		if (xbf_get_family(msk) != xbf_get_family(xbf))
+			return (xbf_erri(xbf, "Parts '%s' and '%s' of the mask "
+			    "differ", xbf->xbf_partname, msk->xbf_partname));
+	}
+	if (verify_bursts(xbf, &xv->xv_exp, &xv->xv_total) != 0)
+		return (-1);
+	ASSERT(xv->xv_exp.xb_flen * 4 <= VERIFY_MAXFRAME);
+	if (msk != NULL) {
+		if (verify_bursts(msk, &xv->xv_mask, &nmask) != 0) {
+			xbf_erri(xbf, "Mask: %s", xbf_errmsg(msk));
+			xbf_verify_free(xv);
+			return (-1);
+		}
+		if (nmask != xv->xv_total) {
+			xbf_verify_free(xv);
+			return (xbf_erri(xbf, "Mask has %d frames, the bit "
+			    "stream %d", (int)nmask, (int)xv->xv_total));
+		}
+	}
+	if (flags & XBF_VERIFY_PAD)
+		xv->xv_skip = xv->xv_exp.xb_flen * 4;
+	return (0);
+}
+
+/*
+ * Get ready to compare the readback of ``xbf'' under the mask ``msk''
+ * (NULL compares every bit).  Errors are reported in ``xbf''.
+ */
+int
+xbf_verify_init(struct xbf_verify *xv, struct xbf *xbf, struct xbf *msk,
+    int flags)
+{
+	static int kern = -1;
+	int k;
+
+	k = __atomic_load_n(&kern, __ATOMIC_RELAXED);
+	if (k == -1) {
+		if (_xbf_cpu_has(XBF_KERN_AVX2))
+			k = XBF_KERN_AVX2;
+		else if (_xbf_cpu_has(XBF_KERN_SSE2))
+			k = XBF_KERN_SSE2;
+		else
+			k = XBF_KERN_SCALAR;
+		__atomic_store_n(&kern, k, __ATOMIC_RELAXED);
+	}
+	return (_xbf_verify_init_kern(k, xv, xbf, msk, flags));
+}
+
+/*
+ * The current frame differs; remember it once.
+ */
+static int
+verify_bad(struct xbf_verify *xv)
+{
+	const struct xbf_burst *b;
+	struct xbf_verify_bad *nb, *vb;
+	size_t ncap;
+
+	if (xv->xv_nbad == xv->xv_cap) {
+		ncap = (xv->xv_cap == 0) ? 16 : xv->xv_cap * 2;
+		nb = realloc(xv->xv_bad, ncap * sizeof(*nb));
+		if (nb == NULL)
+			return (xbf_erri(xv->xv_xbf, "Couldn't allocate memory"));
+		xv->xv_bad = nb;
+		xv->xv_cap = ncap;
+	}
+	b = &xv->xv_exp.xb_bursts[xv->xv_burst];
+	vb = &xv->xv_bad[xv->xv_nbad++];
+	vb->xvb_frame = xv->xv_nframes;
+	vb->xvb_off = b->xb_off + xv->xv_frame * xv->xv_exp.xb_flen * 4;
+	vb->xvb_far = b->xb_far;
+	vb->xvb_first = b->xb_first + xv->xv_frame;
+	vb->xvb_farok = b->xb_farok;
+	xv->xv_curbad = 1;
+	return (0);
+}
+
+static void
+verify_next(struct xbf_verify *xv)
+{
+
+	xv->xv_fpos = 0;
+	xv->xv_curbad = 0;
+	xv->xv_nframes++;
+	if (++xv->xv_frame == xv->xv_exp.xb_bursts[xv->xv_burst].xb_nframes) {
+		xv->xv_frame = 0;
+		xv->xv_burst++;
+	}
+	if (xv->xv_msk != NULL &&
+	    ++xv->xv_mframe == xv->xv_mask.xb_bursts[xv->xv_mburst].xb_nframes) {
+		xv->xv_mframe = 0;
+		xv->xv_mburst++;
+	}
+}
+
+/*
+ * Compare the next ``len'' bytes of readback.  Pieces can be of any
+ * size.  Differing frames are added to xv_bad; -1 is only returned if
+ * the readback can't be compared.
+ */
+int
+xbf_verify_update(struct xbf_verify *xv, const void *buf, size_t len)
+{
+	const struct xbf_burst *b;
+	const uint8_t *p = buf, *exp, *msk;
+	size_t fbytes, n;
+
+	n = MIN(len, xv->xv_skip);
+	xv->xv_skip -= n;
+	p += n;
+	len -= n;
+	fbytes = xv->xv_exp.xb_flen * 4;
+	while (len > 0) {
+		if (xv->xv_nframes == xv->xv_total)
+			return (xbf_erri(xv->xv_xbf, "Readback is longer than "
+			    "the %d frames of the bit stream",
+			    (int)xv->xv_total));
+		n = MIN(len, fbytes - xv->xv_fpos);
+		b = &xv->xv_exp.xb_bursts[xv->xv_burst];
+		exp = (const uint8_t *)xv->xv_xbf->xbf_data + b->xb_off +
+		    xv->xv_frame * fbytes + xv->xv_fpos;
+		if (xv->xv_msk != NULL) {
+			b = &xv->xv_mask.xb_bursts[xv->xv_mburst];
+			msk = (const uint8_t *)xv->xv_msk->xbf_data +
+			    b->xb_off + xv->xv_mframe * fbytes + xv->xv_fpos;
+		} else
+			msk = verify_nomask;
+		if (!xv->xv_curbad && !verify_eq(xv->xv_kern, p, exp, msk, n) &&
+		    verify_bad(xv) != 0)
+			return (-1);
+		p += n;
+		len -= n;
+		xv->xv_fpos += n;
+		if (xv->xv_fpos == fbytes)
+			verify_next(xv);
+	}
+	return (0);
+}
+
+/*
+ * The readback is over.  Returns -1 if it was short; whether the
+ * frames matched is in xv_nbad.
+ */
+int
+xbf_verify_end(struct xbf_verify *xv)
+{
+
+	if (xv->xv_nframes != xv->xv_total)
+		return (xbf_erri(xv->xv_xbf, "Readback is short, %d of %d "
+		    "frames", (int)xv->xv_nframes, (int)xv->xv_total));
+	return (0);
+}
+
+void
+xbf_verify_print_fp(FILE *fp, struct xbf_verify *xv)
+{
+	const struct xbf_verify_bad *vb;
+	size_t i;
+
+	fprintf(fp, "%d of %d frames differ\n", (int)xv->xv_nbad,
+	    (int)xv->xv_nframes);
+	for (i = 0; i < xv->xv_nbad; i++) {
+		vb = &xv->xv_bad[i];
+		fprintf(fp, "  frame %-6u", vb->xvb_frame);
+		if (vb->xvb_farok)
+			fprintf(fp, " FAR 0x%08x", vb->xvb_far);
+		else
+			fprintf(fp, " FAR unknown ");
+		fprintf(fp, " +%-6u at offset %u\n", vb->xvb_first,
+		    vb->xvb_off);
+	}
+}
+
+void
+xbf_verify_free(struct xbf_verify *xv)
+{
+
+	_xbf_frame_bursts_free(&xv->xv_exp);
+	_xbf_frame_bursts_free(&xv->xv_mask);
+	free(xv->xv_bad);
+	xv->xv_bad = NULL;
+	xv->xv_nbad = xv->xv_cap = 0;
+}
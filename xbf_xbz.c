@@ -0,0 +1,610 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * Seekable compressed container for archived bit streams.
+ *
+ * The .bit header is kept as it is, so xbf_probe() gets everything it
+ * needs from its usual single read.  The payload is cut into blocks
+ * that are compressed on their own, and an index of where every block
+ * starts lets xbf_pread() decompress only the blocks a range needs.
+ * xbf_open() decompresses the whole payload.  All numbers are big
+ * endian, like in the .bit header:
+ *
+ *	0	"xbz1"
+ *	4	header length
+ *	8	block size (bytes of payload, a multiple of 4)
+ *	12	payload length
+ *	16	number of blocks, n
+ *	20	codec, then 3 reserved bytes
+ *	24	the .bit header, up to the payload
+ *	...	n + 1 block offsets, 64 bits each, from the start of the file
+ *	...	the blocks
+ *
+ * Blocks are compressed with a run length code over 32-bit words, which
+ * needs no library and suits the long runs of equal words that frame
+ * data is made of: a control word with the top bit set is followed by
+ * a word repeated (control & 0x7fffffff) times, one without it by that
+ * many literal words.  The bytes of a block that don't make a whole
+ * word follow as they are.  Blocks that don't get smaller are stored.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xbf.h"
+
+#define XBZ_MAGIC	"xbz1"
+#define XBZ_PREFIX	24
+#define XBZ_RUN		0x80000000U
+#define XBZ_MINRUN	3		/* Shorter runs stay literal */
+#define XBZ_MAXBLOCK	(64 * 1024 * 1024)
+
+#define XBZ_CODEC_STORE	0
+#define XBZ_CODEC_RLE	1
+
+struct xbf_xbz {
+	uint32_t	 xz_hdrlen;
+	uint32_t	 xz_blksize;
+	uint32_t	 xz_nblocks;
+	uint8_t		 xz_codec;
+	uint8_t		 xz_prefix[XBZ_PREFIX];
+	uint64_t	 xz_size;	/* Of the container, when probed */
+	uint64_t	*xz_idx;	/* Loaded on first use */
+};
+
+static uint32_t
+xbz_get32(const void *p)
+{
+	uint32_t u32;
+
+	memcpy(&u32, p, 4);
+	return (ntohl(u32));
+}
+
+static void
+xbz_put32(void *p, uint32_t v)
+{
+
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static uint64_t
+xbz_get64(const uint8_t *p)
+{
+
+	return (((uint64_t)xbz_get32(p) << 32) | xbz_get32(p + 4));
+}
+
+static void
+xbz_put64(uint8_t *p, uint64_t v)
+{
+
+	xbz_put32(p, v >> 32);
+	xbz_put32(p + 4, v);
+}
+
+/*
+ * Does ``mem'' start with a container?
+ */
+int
+_xbf_xbz_is(const void *mem, size_t len)
+{
+
+	return (len >= XBZ_PREFIX && memcmp(mem, XBZ_MAGIC, 4) == 0);
+}
+
+/*
+ * Check the prefix and keep what's needed for later reads.
+ */
+static int
+xbz_prefix(struct xbf *xbf, const char *fname, const uint8_t *mem,
+    uint32_t *paylen)
+{
+	struct xbf_xbz *xz;
+	uint64_t n;
+
+	*paylen = xbz_get32(mem + 12);
+	xz = calloc(1, sizeof(*xz));
+	if (xz == NULL)
+		return (xbf_erri(xbf, "Couldn't allocate memory"));
+	xz->xz_hdrlen = xbz_get32(mem + 4);
+	xz->xz_blksize = xbz_get32(mem + 8);
+	xz->xz_nblocks = xbz_get32(mem + 16);
+	xz->xz_codec = mem[20];
+	memcpy(xz->xz_prefix, mem, XBZ_PREFIX);
+	n = (xz->xz_blksize == 0) ? 0 :
+	    ((uint64_t)*paylen + xz->xz_blksize - 1) / xz->xz_blksize;
+	if (xz->xz_blksize == 0 || xz->xz_blksize % 4 != 0 ||
+	    xz->xz_blksize > XBZ_MAXBLOCK || n != xz->xz_nblocks ||
+	    xz->xz_hdrlen == 0 ||
+	    xz->xz_hdrlen > XBF_PROBE_SIZE - XBZ_PREFIX ||
+	    xz->xz_codec > XBZ_CODEC_RLE) {
+		free(xz);
+		return (xbf_erri(xbf, "Container '%s' is corrupted", fname));
+	}
+	xbf->_xbf_xbz = xz;
+	return (0);
+}
+
+void
+_xbf_xbz_free(struct xbf *xbf)
+{
+
+	if (xbf->_xbf_xbz == NULL)
+		return;
+	free(xbf->_xbf_xbz->xz_idx);
+	free(xbf->_xbf_xbz);
+	xbf->_xbf_xbz = NULL;
+}
+
+/*
+ * Decompress ``clen'' bytes of block into ``len'' bytes at ``dst''.
+ */
+static int
+xbz_decode(const uint8_t *src, size_t clen, uint8_t *dst, size_t len,
+    int codec)
+{
+	const uint8_t *end = src + clen;
+	uint32_t ctl, n, w;
+	size_t nw, i;
+
+	if (codec == XBZ_CODEC_STORE) {
+		if (clen != len)
+			return (-1);
+		memcpy(dst, src, len);
+		return (0);
+	}
+	for (nw = len / 4; nw > 0; nw -= n) {
+		if (end - src < 4)
+			return (-1);
+		ctl = xbz_get32(src);
+		src += 4;
+		n = ctl & ~XBZ_RUN;
+		if (n == 0 || n > nw)
+			return (-1);
+		if (ctl & XBZ_RUN) {
+			if (end - src < 4)
+				return (-1);
+			memcpy(&w, src, 4);
+			src += 4;
+			for (i = 0; i < n; i++, dst += 4)
+				memcpy(dst, &w, 4);
+		} else {
+			if ((size_t)(end - src) < (size_t)n * 4)
+				return (-1);
+			memcpy(dst, src, (size_t)n * 4);
+			src += (size_t)n * 4;
+			dst += (size_t)n * 4;
+		}
+	}
+	if ((size_t)(end - src) != len % 4)
+		return (-1);
+	memcpy(dst, src, len % 4);
+	return (0);
+}
+
+/*
+ * Compress ``len'' bytes into ``dst'', which has room for len + 8.
+ * Returns the compressed length, or 0 if it isn't worth it.
+ */
+static size_t
+xbz_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	uint32_t a, b;
+	size_t nw, i, j, lit, out;
+
+	nw = len / 4;
+	out = 0;
+	for (i = 0, lit = 0; i < nw; i = j) {
+		memcpy(&a, src + i * 4, 4);
+		for (j = i + 1; j < nw; j++) {
+			memcpy(&b, src + j * 4, 4);
+			if (a != b)
+				break;
+		}
+		if (j - i < XBZ_MINRUN)
+			continue;
+		if (lit < i) {
+			if (out + 4 + (i - lit) * 4 + 8 > len)
+				return (0);
+			xbz_put32(dst + out, i - lit);
+			memcpy(dst + out + 4, src + lit * 4, (i - lit) * 4);
+			out += 4 + (i - lit) * 4;
+		}
+		if (out + 8 > len)
+			return (0);
+		xbz_put32(dst + out, XBZ_RUN | (j - i));
+		memcpy(dst + out + 4, &a, 4);
+		out += 8;
+		lit = j;
+	}
+	if (lit < nw) {
+		if (out + 4 + (nw - lit) * 4 >= len)
+			return (0);
+		xbz_put32(dst + out, nw - lit);
+		memcpy(dst + out + 4, src + lit * 4, (nw - lit) * 4);
+		out += 4 + (nw - lit) * 4;
+	}
+	if (out + len % 4 >= len)
+		return (0);
+	memcpy(dst + out, src + nw * 4, len % 4);
+	return (out + len % 4);
+}
+
+/*
+ * Write the opened ``xbf'' to ``fd'' as a container with ``blksize''
+ * byte blocks (0 picks XBF_XBZ_BLOCK).  The index comes before the
+ * blocks, so they are all compressed first, one after another into a
+ * buffer that's never bigger than the payload: a block that doesn't
+ * get smaller is written from the payload itself.
+ */
+int
+xbf_xbz_write(struct xbf *xbf, int fd, size_t blksize)
+{
+	uint8_t prefix[XBZ_PREFIX], be[8], *cbuf;
+	uint64_t *idx, off;
+	size_t nblocks, i, len, clen, cpos, *clens;
+	const uint8_t *p;
+	int error;
+
+	xbf_assert(xbf);
+	if (xbf->xbf_data == NULL)
+		return (xbf_erri(xbf, "Payload of '%s' isn't loaded",
+		    xbf->xbf_fname));
+	if (blksize == 0)
+		blksize = XBF_XBZ_BLOCK;
+	if (blksize % 4 != 0 || blksize > XBZ_MAXBLOCK)
+		return (xbf_erri(xbf, "Block size %d isn't a multiple of 4 "
+		    "up to %d", (int)blksize, XBZ_MAXBLOCK));
+	if (xbf->xbf_offset > XBF_PROBE_SIZE - XBZ_PREFIX)
+		return (xbf_erri(xbf, "Header of '%s' is too long",
+		    xbf->xbf_fname));
+	nblocks = (xbf->xbf_len + blksize - 1) / blksize;
+	idx = calloc(nblocks + 1, sizeof(*idx));
+	clens = calloc(nblocks + 1, sizeof(*clens));
+	/* A block is only kept if it got smaller, and needs len + 8 */
+	cbuf = malloc((size_t)xbf->xbf_len + 8);
+	if (idx == NULL || clens == NULL || cbuf == NULL) {
+		free(idx);
+		free(clens);
+		free(cbuf);
+		return (xbf_erri(xbf, "Couldn't allocate memory"));
+	}
+
+	off = XBZ_PREFIX + xbf->xbf_offset + (nblocks + 1) * 8;
+	p = (const uint8_t *)xbf->xbf_data;
+	for (i = 0, cpos = 0; i < nblocks; i++) {
+		len = MIN(blksize, xbf->xbf_len - i * blksize);
+		clen = xbz_encode(p + i * blksize, len, cbuf + cpos);
+		clens[i] = clen;
+		cpos += clen;
+		idx[i] = off;
+		off += (clen == 0) ? len : clen;
+	}
+	idx[nblocks] = off;
+
+	memset(prefix, 0, sizeof(prefix));
+	memcpy(prefix, XBZ_MAGIC, 4);
+	xbz_put32(prefix + 4, xbf->xbf_offset);
+	xbz_put32(prefix + 8, blksize);
+	xbz_put32(prefix + 12, xbf->xbf_len);
+	xbz_put32(prefix + 16, nblocks);
+	prefix[20] = XBZ_CODEC_RLE;
+	error = _xbf_write(xbf, fd, prefix, sizeof(prefix));
+	if (error == 0)
+		error = _xbf_write(xbf, fd, xbf->_xbf_mem, xbf->xbf_offset);
+	for (i = 0; i <= nblocks && error == 0; i++) {
+		xbz_put64(be, idx[i]);
+		error = _xbf_write(xbf, fd, be, 8);
+	}
+	for (i = 0, cpos = 0; i < nblocks && error == 0; i++) {
+		len = MIN(blksize, xbf->xbf_len - i * blksize);
+		if (clens[i] == 0)
+			error = _xbf_write(xbf, fd, p + i * blksize, len);
+		else
+			error = _xbf_write(xbf, fd, cbuf + cpos, clens[i]);
+		cpos += clens[i];
+	}
+	free(idx);
+	free(clens);
+	free(cbuf);
+	return (error);
+}
+
+/*
+ * Decompress all blocks of the container in ``mem'' (the whole file)
+ * into ``dst''.
+ */
+static int
+xbz_blocks(struct xbf *xbf, const uint8_t *mem, size_t size, uint32_t paylen,
+    uint8_t *dst)
+{
+	struct xbf_xbz *xz = xbf->_xbf_xbz;
+	const uint8_t *ip;
+	uint64_t start, end;
+	size_t i, len;
+
+	ip = mem + XBZ_PREFIX + xz->xz_hdrlen;
+	if ((size_t)(ip - mem) + ((size_t)xz->xz_nblocks + 1) * 8 > size)
+		return (xbf_erri(xbf, "Container '%s' is truncated",
+		    xbf->xbf_fname));
+	for (i = 0; i < xz->xz_nblocks; i++) {
+		start = xbz_get64(ip + i * 8);
+		end = xbz_get64(ip + i * 8 + 8);
+		len = MIN(xz->xz_blksize, paylen - i * xz->xz_blksize);
+		if (start > end || end > size ||
+		    xbz_decode(mem + start, end - start,
+		    dst + i * xz->xz_blksize, len,
+		    (end - start == len) ? XBZ_CODEC_STORE : xz->xz_codec) != 0)
+			return (xbf_erri(xbf, "Block %d of '%s' is corrupted",
+			    (int)i, xbf->xbf_fname));
+	}
+	return (0);
+}
+
+/*
+ * xbf_open() of a container mapped at ``mem'': the header and the whole
+ * payload are decompressed into memory of their own, and the mapping
+ * goes away.
+ */
+int
+_xbf_xbz_open(struct xbf *xbf, const char *fname, void *mem, size_t size)
+{
+	uint32_t paylen;
+	uint8_t *buf;
+	int error;
+
+	if (xbz_prefix(xbf, fname, mem, &paylen) != 0) {
+		(void)munmap(mem, size);
+		return (-1);
+	}
+	xbf->xbf_fname = fname;
+	buf = malloc((size_t)xbf->_xbf_xbz->xz_hdrlen + paylen);
+	if (buf == NULL) {
+		(void)munmap(mem, size);
+		_xbf_xbz_free(xbf);
+		return (xbf_erri(xbf, "Couldn't allocate memory"));
+	}
+	error = 0;
+	if ((size_t)XBZ_PREFIX + xbf->_xbf_xbz->xz_hdrlen > size)
+		error = xbf_erri(xbf, "Container '%s' is truncated", fname);
+	else {
+		memcpy(buf, (uint8_t *)mem + XBZ_PREFIX,
+		    xbf->_xbf_xbz->xz_hdrlen);
+		error = xbz_blocks(xbf, mem, size, paylen,
+		    buf + xbf->_xbf_xbz->xz_hdrlen);
+	}
+	(void)munmap(mem, size);
+	if (error != 0) {
+		free(buf);
+		_xbf_xbz_free(xbf);
+		return (-1);
+	}
+	xbf->_xbf_flags |= XBF_FLAG_ALLOCED;
+	xbf->_xbf_mem = buf;
+	xbf->_xbf_memsize = (size_t)xbf->_xbf_xbz->xz_hdrlen + paylen;
+	xbf->_xbf_filesize = xbf->_xbf_memsize;
+	error = _xbf_setup(xbf);
+	if (error == 0 && xbf->xbf_offset + xbf->xbf_len != xbf->_xbf_memsize)
+		error = xbf_erri(xbf, "Header of '%s' doesn't match the "
+		    "container", fname);
+	if (error != 0) {
+		free(buf);
+		_xbf_xbz_free(xbf);
+		xbf->_xbf_mem = NULL;
+		xbf->xbf_data = NULL;
+		xbf->_xbf_flags &= ~(XBF_FLAG_ALLOCED | XBF_FLAG_OPENED);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * xbf_probe() of a ``size'' byte container: ``mem'' has the first
+ * ``len'' bytes of the file.  Takes ``mem'' like _xbf_open_hdr() does.
+ */
+int
+_xbf_xbz_probe(struct xbf *xbf, const char *fname, void *mem, size_t len,
+    size_t size)
+{
+	uint32_t paylen, hdrlen;
+
+	if (xbz_prefix(xbf, fname, mem, &paylen) != 0) {
+		free(mem);
+		return (-1);
+	}
+	hdrlen = xbf->_xbf_xbz->xz_hdrlen;
+	memmove(mem, (uint8_t *)mem + XBZ_PREFIX, len - XBZ_PREFIX);
+	if (_xbf_open_hdr(xbf, fname, mem, MIN(hdrlen, len - XBZ_PREFIX),
+	    (size_t)hdrlen + paylen) != 0) {
+		_xbf_xbz_free(xbf);
+		return (-1);
+	}
+	xbf->_xbf_xbz->xz_size = size;
+	return (0);
+}
+
+/*
+ * Open the container a probed ``xbf'' came from, if it still is that
+ * container: the same size, prefix and header.  Returns the descriptor,
+ * or -1.
+ */
+int
+_xbf_xbz_source(struct xbf *xbf)
+{
+	struct xbf_xbz *xz = xbf->_xbf_xbz;
+	struct xbf *own;
+	struct stat st;
+	uint8_t hdr[XBF_PROBE_SIZE];
+	size_t n;
+	int fd;
+
+	own = _xbf_owner(xbf);
+	n = XBZ_PREFIX + xbf->xbf_offset;
+	if (xz == NULL || own->_xbf_mem == NULL || xbf->xbf_fname == NULL ||
+	    n > sizeof(hdr) || xbf->xbf_offset > own->_xbf_memsize)
+		return (-1);
+	fd = open(xbf->xbf_fname, O_RDONLY);
+	if (fd == -1)
+		return (-1);
+	if (fstat(fd, &st) == -1 || (uint64_t)st.st_size != xz->xz_size ||
+	    pread(fd, hdr, n, 0) != (ssize_t)n ||
+	    memcmp(hdr, xz->xz_prefix, XBZ_PREFIX) != 0 ||
+	    memcmp(hdr + XBZ_PREFIX, own->_xbf_mem, xbf->xbf_offset) != 0) {
+		(void)close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Read ``len'' bytes of the container index and blocks.
+ */
+static int
+xbz_pread(struct xbf *xbf, int fd, void *buf, size_t len, uint64_t off)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = pread(fd, buf, len, off);
+		if (r <= 0)
+			return (xbf_erri(xbf, "Container '%s' is truncated",
+			    xbf->xbf_fname));
+		buf = (char *)buf + r;
+		len -= r;
+		off += r;
+	}
+	return (0);
+}
+
+/*
+ * Read the block index on first use.  Threads sharing the context may
+ * race here: each one reads its own copy, and the first to publish it
+ * wins.
+ */
+static uint64_t *
+xbz_load_index(struct xbf *xbf, int fd)
+{
+	struct xbf_xbz *xz = xbf->_xbf_xbz;
+	uint64_t *idx, *old;
+	uint8_t *raw;
+	size_t i, n;
+
+	n = (size_t)xz->xz_nblocks + 1;
+	raw = malloc(n * 8);
+	idx = malloc(n * sizeof(*idx));
+	if (raw == NULL || idx == NULL) {
+		free(raw);
+		free(idx);
+		xbf_erri(xbf, "Couldn't allocate memory");
+		return (NULL);
+	}
+	if (xbz_pread(xbf, fd, raw, n * 8, XBZ_PREFIX + xz->xz_hdrlen) != 0) {
+		free(raw);
+		free(idx);
+		return (NULL);
+	}
+	for (i = 0; i < n; i++)
+		idx[i] = xbz_get64(raw + i * 8);
+	free(raw);
+	for (i = 0; i + 1 < n; i++)
+		if (idx[i] > idx[i + 1] ||
+		    idx[i + 1] - idx[i] > xz->xz_blksize) {
+			free(idx);
+			xbf_erri(xbf, "Index of '%s' is corrupted",
+			    xbf->xbf_fname);
+			return (NULL);
+		}
+	old = NULL;
+	if (!__atomic_compare_exchange_n(&xz->xz_idx, &old, idx, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(idx);
+		idx = old;
+	}
+	return (idx);
+}
+
+/*
+ * xbf_pread() of a probed container: only the blocks that ``len'' bytes
+ * at ``off'' fall into are read and decompressed.
+ */
+ssize_t
+_xbf_xbz_pread(struct xbf *xbf, int fd, void *buf, size_t len, size_t off)
+{
+	struct xbf_xbz *xz = xbf->_xbf_xbz;
+	uint8_t *cbuf, *dbuf, *dst;
+	size_t b, boff, blen, n, done;
+	uint64_t clen, *idx;
+
+	idx = __atomic_load_n(&xz->xz_idx, __ATOMIC_ACQUIRE);
+	if (idx == NULL && (idx = xbz_load_index(xbf, fd)) == NULL)
+		return (-1);
+	cbuf = malloc(xz->xz_blksize);
+	dbuf = malloc(xz->xz_blksize);
+	if (cbuf == NULL || dbuf == NULL) {
+		free(cbuf);
+		free(dbuf);
+		return (xbf_erri(xbf, "Couldn't allocate memory"));
+	}
+	for (done = 0; done < len; done += n) {
+		b = (off + done) / xz->xz_blksize;
+		boff = (off + done) % xz->xz_blksize;
+		blen = MIN(xz->xz_blksize, xbf->xbf_len - b * xz->xz_blksize);
+		n = MIN(len - done, blen - boff);
+		clen = idx[b + 1] - idx[b];
+		/* Whole blocks go straight to the caller */
+		dst = (n == blen) ? (uint8_t *)buf + done : dbuf;
+		if (xbz_pread(xbf, fd, cbuf, clen, idx[b]) != 0)
+			break;
+		if (xbz_decode(cbuf, clen, dst, blen, (clen == blen) ?
+		    XBZ_CODEC_STORE : xz->xz_codec) != 0) {
+			xbf_erri(xbf, "Block %d of '%s' is corrupted", (int)b,
+			    xbf->xbf_fname);
+			break;
+		}
+		if (dst == dbuf)
+			memcpy((uint8_t *)buf + done, dbuf + boff, n);
+	}
+	free(cbuf);
+	free(dbuf);
+	return ((done == len) ? (ssize_t)len : -1);
+}
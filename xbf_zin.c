@@ -0,0 +1,445 @@
+/*-
+ * Copyright (c) 2009 HIIT <http://www.hiit.fi/>
+ * All rights reserved.
+ *
+ * Author: Wojciech A. Koszek <wkoszek@FreeBSD.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $Id$
+ *
+ *
+ * gzip and zstd compressed bit streams.
+ *
+ * Both are optional, so the library needs nothing else by default:
+ * build with -DXBF_ZLIB (and -lz) and/or -DXBF_ZSTD (and -lzstd).
+ * Compressed files are told apart by their magic number.  xbf_open()
+ * decompresses the first XBF_PROBE_SIZE bytes, which is enough for the
+ * header, then maps anonymous memory of the size the header asks for
+ * and streams the rest of the payload right into it; there's no
+ * temporary file and no buffer that grows.  xbf_probe() decompresses
+ * just the header, from what it has read anyway when that's enough,
+ * and marks the context so the payload isn't read from the compressed
+ * file by mistake.  xbf_feed_file() hands the decompressed stream to a
+ * push parser piece by piece.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef XBF_ZLIB
+#include <zlib.h>
+#endif
+#ifdef XBF_ZSTD
+#include <zstd.h>
+#endif
+
+#include "xbf.h"
+
+#define ZIN_GZIP	1
+#define ZIN_ZSTD	2
+
+/* Largest piece zlib is given at once; its counters are 32 bits */
+#define ZIN_MAXCHUNK	(1U << 30)
+
+/* Pieces xbf_feed_file() feeds */
+#define ZIN_FEEDCHUNK	(64 * 1024)
+
+struct zin {
+	int		 z_type;
+	const uint8_t	*z_in;
+	size_t		 z_inlen;
+	size_t		 z_inpos;
+	int		 z_end;
+#ifdef XBF_ZLIB
+	z_stream	 z_gz;
+#endif
+#ifdef XBF_ZSTD
+	ZSTD_DStream	*z_zs;
+#endif
+};
+
+/*
+ * Is ``mem'' the beginning of a compressed file?  Returns its type, or
+ * 0 for anything else.
+ */
+int
+_xbf_zin_is(const void *mem, size_t len)
+{
+	const uint8_t *p = mem;
+
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+		return (ZIN_GZIP);
+	if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f &&
+	    p[3] == 0xfd)
+		return (ZIN_ZSTD);
+	return (0);
+}
+
+static int
+zin_init(struct xbf *xbf, struct zin *z, int type, const void *in,
+    size_t len)
+{
+
+	memset(z, 0, sizeof(*z));
+	z->z_type = type;
+	z->z_in = in;
+	z->z_inlen = len;
+	switch (type) {
+#ifdef XBF_ZLIB
+	case ZIN_GZIP:
+		/* 16: gzip wrapper, not zlib */
+		if (inflateInit2(&z->z_gz, 15 + 16) != Z_OK)
+			return (xbf_erri(xbf, "Couldn't set up zlib"));
+		return (0);
+#endif
+#ifdef XBF_ZSTD
+	case ZIN_ZSTD:
+		z->z_zs = ZSTD_createDStream();
+		if (z->z_zs == NULL || ZSTD_isError(ZSTD_initDStream(z->z_zs))) {
+			ZSTD_freeDStream(z->z_zs);
+			z->z_zs = NULL;
+			return (xbf_erri(xbf, "Couldn't set up zstd"));
+		}
+		return (0);
+#endif
+	}
+	return (xbf_erri(xbf, "'%s' is %s compressed, which this build of "
+	    "the library doesn't support", xbf->xbf_fname,
+	    (type == ZIN_GZIP) ? "gzip" : "zstd"));
+}
+
+static void
+zin_free(struct zin *z)
+{
+
+	switch (z->z_type) {
+#ifdef XBF_ZLIB
+	case ZIN_GZIP:
+		(void)inflateEnd(&z->z_gz);
+		break;
+#endif
+#ifdef XBF_ZSTD
+	case ZIN_ZSTD:
+		ZSTD_freeDStream(z->z_zs);
+		break;
+#endif
+	}
+}
+
+/*
+ * Decompress up to ``len'' bytes into ``out''.  Returns how many there
+ * are, which is less than ``len'' only at the end of the input; input
+ * that ends early is treated as the end.
+ */
+static ssize_t
+zin_read(struct xbf *xbf, struct zin *z, void *out, size_t len)
+{
+	size_t done = 0;
+#ifdef XBF_ZLIB
+	unsigned nin, nout;
+	int r;
+#endif
+#ifdef XBF_ZSTD
+	ZSTD_inBuffer zi;
+	ZSTD_outBuffer zo;
+	size_t zr;
+#endif
+
+	/* Both are unused without zlib and zstd */
+	(void)xbf;
+	(void)out;
+	while (done < len && !z->z_end) {
+		switch (z->z_type) {
+#ifdef XBF_ZLIB
+		case ZIN_GZIP:
+			nin = MIN(z->z_inlen - z->z_inpos, ZIN_MAXCHUNK);
+			nout = MIN(len - done, ZIN_MAXCHUNK);
+			z->z_gz.next_in = (Bytef *)(uintptr_t)(z->z_in +
+			    z->z_inpos);
+			z->z_gz.avail_in = nin;
+			z->z_gz.next_out = (Bytef *)out + done;
+			z->z_gz.avail_out = nout;
+			r = inflate(&z->z_gz, Z_NO_FLUSH);
+			z->z_inpos += nin - z->z_gz.avail_in;
+			done += nout - z->z_gz.avail_out;
+			if (r == Z_STREAM_END) {
+				/* gzip members can be concatenated */
+				if (z->z_inpos == z->z_inlen ||
+				    inflateReset(&z->z_gz) != Z_OK)
+					z->z_end = 1;
+			} else if (r == Z_BUF_ERROR && z->z_inpos == z->z_inlen)
+				z->z_end = 1;
+			else if (r != Z_OK)
+				return (xbf_erri(xbf, "Couldn't decompress "
+				    "'%s': %s", xbf->xbf_fname,
+				    (z->z_gz.msg != NULL) ? z->z_gz.msg :
+				    "zlib error"));
+			break;
+#endif
+#ifdef XBF_ZSTD
+		case ZIN_ZSTD:
+			zi.src = z->z_in;
+			zi.size = z->z_inlen;
+			zi.pos = z->z_inpos;
+			zo.dst = (uint8_t *)out + done;
+			zo.size = len - done;
+			zo.pos = 0;
+			zr = ZSTD_decompressStream(z->z_zs, &zo, &zi);
+			if (ZSTD_isError(zr))
+				return (xbf_erri(xbf, "Couldn't decompress "
+				    "'%s': %s", xbf->xbf_fname,
+				    ZSTD_getErrorName(zr)));
+			z->z_inpos = zi.pos;
+			done += zo.pos;
+			/* Output to spare and nothing left to give */
+			if (zi.pos == zi.size && zo.pos < zo.size)
+				z->z_end = 1;
+			break;
+#endif
+		default:
+			z->z_end = 1;
+			break;
+		}
+	}
+	return ((ssize_t)done);
+}
+
+/*
+ * xbf_open() of the compressed file mapped at ``mem''.  The mapping goes
+ * away either way.
+ */
+int
+_xbf_zin_open(struct xbf *xbf, const char *fname, void *mem, size_t size)
+{
+	struct xbf hdr;
+	struct zin z;
+	char buf[XBF_PROBE_SIZE];
+	size_t total = 0;
+	ssize_t n, m;
+	void *map;
+
+	xbf->xbf_fname = fname;
+	if (zin_init(xbf, &z, _xbf_zin_is(mem, size), mem, size) != 0) {
+		(void)munmap(mem, size);
+		return (-1);
+	}
+	map = MAP_FAILED;
+	n = zin_read(xbf, &z, buf, sizeof(buf));
+	if (n == -1)
+		goto fail;
+
+	/* The header says how much memory the payload needs */
+	xbf_init(&hdr);
+	hdr.xbf_fname = fname;
+	hdr._xbf_flags |= XBF_FLAG_HDRONLY;
+	hdr._xbf_mem = buf;
+	hdr._xbf_memsize = n;
+	hdr._xbf_filesize = SIZE_MAX;
+	if (n < XBF_HDR_SIZE || _xbf_setup(&hdr) != 0) {
+		if (n < XBF_HDR_SIZE)
+			xbf_erri(xbf, "File '%s' doesn't contain valid data",
+			    fname);
+		else
+			memcpy(&xbf->_xbf_err, &hdr._xbf_err,
+			    sizeof(xbf->_xbf_err));
+		goto fail;
+	}
+	total = hdr.xbf_offset + hdr.xbf_len;
+	map = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON,
+	    -1, 0);
+	if (map == MAP_FAILED) {
+		xbf_erri(xbf, "Couldn't map %d bytes for '%s'", (int)total,
+		    fname);
+		goto fail;
+	}
+	memcpy(map, buf, MIN((size_t)n, total));
+	if ((size_t)n < total) {
+		m = zin_read(xbf, &z, (char *)map + n, total - n);
+		if (m == -1)
+			goto fail;
+		if ((size_t)m != total - n) {
+			xbf_erri(xbf, "Payload of '%s' is truncated, %d bytes "
+			    "missing", fname, (int)(total - n - m));
+			goto fail;
+		}
+	}
+	zin_free(&z);
+	(void)munmap(mem, size);
+	xbf->_xbf_flags |= XBF_FLAG_MMAPED;
+	return (xbf_open_mem(xbf, map, total));
+fail:
+	zin_free(&z);
+	(void)munmap(mem, size);
+	if (map != MAP_FAILED)
+		(void)munmap(map, total);
+	return (-1);
+}
+
+/*
+ * Decompress the first XBF_PROBE_SIZE bytes of the ``len'' bytes at
+ * ``in'' into ``hdr''.  Returns how many there are, or -1.
+ */
+static ssize_t
+zin_hdr(struct xbf *xbf, const void *in, size_t len, void *hdr)
+{
+	struct zin z;
+	ssize_t n;
+
+	if (zin_init(xbf, &z, _xbf_zin_is(in, len), in, len) != 0)
+		return (-1);
+	n = zin_read(xbf, &z, hdr, XBF_PROBE_SIZE);
+	zin_free(&z);
+	return (n);
+}
+
+/*
+ * xbf_probe() of a ``size'' byte compressed file: ``mem'' has the first
+ * ``len'' bytes of it, from which the header is decompressed.  Takes
+ * ``mem'' like _xbf_open_hdr() does.
+ */
+int
+_xbf_zin_probe(struct xbf *xbf, const char *fname, void *mem, size_t len,
+    size_t size)
+{
+	struct stat st;
+	ssize_t n;
+	void *hdr, *map;
+	int fd;
+
+	xbf->xbf_fname = fname;
+	hdr = malloc(XBF_PROBE_SIZE);
+	if (hdr == NULL) {
+		free(mem);
+		return (xbf_erri(xbf, "Couldn't allocate header buffer"));
+	}
+	n = zin_hdr(xbf, mem, len, hdr);
+	free(mem);
+	/*
+	 * zstd decodes whole blocks only, and the first one rarely fits in
+	 * what was read: decompress from a mapping of the file then.
+	 */
+	if (n != -1 && n < XBF_PROBE_SIZE && len < size) {
+		fd = open(fname, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0 ||
+		    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+		    0)) == MAP_FAILED) {
+			if (fd != -1)
+				(void)close(fd);
+			free(hdr);
+			return (xbf_erri(xbf, "Couldn't map file '%s' to "
+			    "memory", fname));
+		}
+		(void)close(fd);
+		n = zin_hdr(xbf, map, st.st_size, hdr);
+		(void)munmap(map, st.st_size);
+	}
+	if (n < XBF_HDR_SIZE) {
+		free(hdr);
+		if (n == -1)
+			return (-1);
+		return (xbf_erri(xbf, "Couldn't read header of '%s'", fname));
+	}
+	/*
+	 * The uncompressed size isn't known, and the payload can't be read
+	 * at xbf_offset of ``fname'': only xbf_open() gets to it.
+	 */
+	if (_xbf_open_hdr(xbf, fname, hdr, n, SIZE_MAX) != XBF_OK)
+		return (-1);
+	xbf->_xbf_flags |= XBF_FLAG_ZIN;
+	return (0);
+}
+
+/*
+ * Push the bit stream in ``fname'', compressed or not, through ``xf''
+ * (see xbf_feed.c) in pieces of ZIN_FEEDCHUNK bytes.  The file is
+ * mapped, so only one piece of decompressed data is in memory at a
+ * time.  Errors are in xf->xf_xbf.
+ */
+int
+xbf_feed_file(struct xbf_feed *xf, const char *fname)
+{
+	struct xbf *xbf = &xf->xf_xbf;
+	struct stat st;
+	struct zin z;
+	char *buf;
+	void *mem;
+	size_t off;
+	ssize_t n;
+	int fd, type, error;
+
+	xbf->xbf_fname = fname;
+	fd = open(fname, O_RDONLY);
+	if (fd == -1)
+		return (xbf_erri(xbf, "Couldn't open file '%s'", fname));
+	if (fstat(fd, &st) == -1) {
+		(void)close(fd);
+		return (xbf_erri(xbf, "Couldn't check file '%s' information",
+		    fname));
+	}
+	if (st.st_size == 0) {
+		(void)close(fd);
+		return (xbf_feed_end(xf));
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (mem == MAP_FAILED)
+		return (xbf_erri(xbf, "Couldn't map file '%s' to memory",
+		    fname));
+	type = _xbf_zin_is(mem, st.st_size);
+	error = 0;
+	if (type == 0) {
+		for (off = 0; off < (size_t)st.st_size && error == 0;
+		    off += n) {
+			n = MIN((size_t)st.st_size - off, ZIN_FEEDCHUNK);
+			error = xbf_feed(xf, (char *)mem + off, n);
+		}
+	} else if ((buf = malloc(ZIN_FEEDCHUNK)) == NULL)
+		error = xbf_erri(xbf, "Couldn't allocate memory");
+	else {
+		error = zin_init(xbf, &z, type, mem, st.st_size);
+		while (error == 0) {
+			n = zin_read(xbf, &z, buf, ZIN_FEEDCHUNK);
+			if (n <= 0) {
+				error = (int)n;
+				break;
+			}
+			error = xbf_feed(xf, buf, n);
+		}
+		zin_free(&z);
+		free(buf);
+	}
+	(void)munmap(mem, st.st_size);
+	if (error != 0)
+		return (-1);
+	return (xbf_feed_end(xf));
+}